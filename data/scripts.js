@@ -18,49 +18,76 @@ function getCurrentUser() {
     return userJson ? JSON.parse(userJson) : null;
 }
 
+// Headers that carry the session token to the endpoints that change things
+function authHeaders() {
+    const token = sessionStorage.getItem('sessionToken');
+    return token ? {'Authorization': 'Bearer ' + token} : {};
+}
+
+// fetch() for the kiosk's API. Right after a power cut the kiosk serves
+// the pages before it has loaded the catalog, and its catalog requests
+// answer 503 with Retry-After until then: wait as long as that says and
+// ask again, for up to half a minute. Nothing ran, so a POST is safe to
+// send again. Any other 503 (too many uploads at once) comes straight back.
+function apiFetch(resource, options, attempt = 0) {
+    return fetch(resource, options).then(response => {
+        const retryAfter = response.headers.get('Retry-After');
+        if (response.status !== 503 || retryAfter === null || attempt >= 30) return response;
+        const seconds = parseInt(retryAfter, 10) || 1;
+        return new Promise(resolve => setTimeout(resolve, seconds * 1000))
+            .then(() => apiFetch(resource, options, attempt + 1));
+    });
+}
+
+// Make this browser the kiosk's own screen (staff only): card reads log
+// in and return books from its index page
+function pairKioskScreen() {
+    postTransaction('/api/kiosk/pair', {})
+        .then(result => {
+            if (!result.ok) {
+                alert(result.error);
+                return;
+            }
+            localStorage.setItem('kioskKey', result.key);
+            alert('This browser is now the kiosk screen. Any screen paired before it no longer is.');
+        })
+        .catch(error => console.error('Error pairing the kiosk screen:', error));
+}
+
 // Logout user
 function logout() {
+    apiFetch('/api/logout', {method: 'POST', headers: authHeaders()}).catch(() => {});
     sessionStorage.removeItem('currentUser');
+    sessionStorage.removeItem('sessionToken');
     sessionStorage.removeItem('currentBook');
     window.location.href = 'index.html';
 }
 
+// Log in on the kiosk with {user, password, type} or {card} and open the
+// user's dashboard. The kiosk checks the password against its salted hash
+// and answers with the account and a session token. Resolves to the
+// kiosk's reply when the login is refused.
+function startSession(params) {
+    return apiFetch('/api/login', {
+        method: 'POST',
+        headers: {'Content-Type': 'application/x-www-form-urlencoded'},
+        body: new URLSearchParams(params).toString(),
+    })
+        .then(response => response.json())
+        .then(result => {
+            if (!result.ok) return result;
+            sessionStorage.setItem('sessionToken', result.token);
+            sessionStorage.setItem('currentUser', JSON.stringify(result.user));
+            window.location.href = result.user.type === 'staff' ? 'admin.html' : 'student.html';
+            return result;
+        });
+}
+
 // Login user
 function loginUser(username, password, userType) {
-    fetch('/api/users')
-        .then(response => response.json())
-        .then(data => {
-            const users = data.users || [];
-            let foundUser = null;
-            
-            // Find user based on type
-            if (userType === 'staff') {
-                foundUser = users.find(user => 
-                    user.type === 'staff' && 
-                    user.username === username && 
-                    user.password === password
-                );
-            } else {
-                foundUser = users.find(user => 
-                    user.type === 'student' && 
-                    user.studentId === username && 
-                    user.password === password
-                );
-            }
-            
-            if (foundUser) {
-                // Store user info in sessionStorage
-                sessionStorage.setItem('currentUser', JSON.stringify(foundUser));
-                
-                // Redirect based on user type
-                if (foundUser.type === 'staff') {
-                    window.location.href = 'admin.html';
-                } else {
-                    window.location.href = 'student.html';
-                }
-            } else {
-                alert('Invalid username, password, or user type');
-            }
+    startSession({user: username, password: password, type: userType})
+        .then(result => {
+            if (!result.ok) alert(result.error);
         })
         .catch(error => {
             console.error('Error during login:', error);
@@ -93,84 +120,90 @@ function setupTabs() {
 // Flag to indicate when we're in book return mode
 let inReturnMode = false;
 
-// Poll for card scan - this needs to check less frequently to match the ESP32's temporary UID storage
-function pollForCardScan() {
+// Live card scans pushed by the ESP32 over Server-Sent Events. One stream is
+// shared by everything on the page; listeners get {seq, uid, mode, time, at},
+// and the kiosk screen a one-time nonce as well. The UID only comes with a
+// session or the kiosk key, and only the nonce logs a card in.
+let scanSource = null;
+const scanListeners = [];
+
+// Call listener for every new scan; returns a function that stops listening
+function onCardScan(listener) {
+    scanListeners.push(listener);
+    if (!scanSource) {
+        // Resume after the last scan this tab saw so one made while the next
+        // page was loading isn't lost (the ESP32 drops stale ones)
+        const params = new URLSearchParams();
+        const since = sessionStorage.getItem('lastScanSeq');
+        if (since) params.set('since', since);
+        const token = sessionStorage.getItem('sessionToken');
+        const kioskKey = localStorage.getItem('kioskKey');
+        if (token) params.set('token', token);
+        else if (kioskKey) params.set('kiosk', kioskKey);
+        scanSource = new EventSource('/api/events' + (params.toString() ? '?' + params : ''));
+        scanSource.addEventListener('scan', event => {
+            const scan = JSON.parse(event.data);
+            sessionStorage.setItem('lastScanSeq', scan.seq);
+            scanListeners.slice().forEach(callback => callback(scan));
+        });
+        scanSource.onerror = () => console.log('Scan event stream interrupted, reconnecting...');
+    }
+    return () => {
+        const index = scanListeners.indexOf(listener);
+        if (index >= 0) scanListeners.splice(index, 1);
+    };
+}
+
+// Show each scanned card and log in with it (index page)
+function watchForCardScan() {
     const cardStatus = document.getElementById('card-status');
-    let lastTimestamp = 0;
     
-    setInterval(function() {
-        fetch('/api/scan')
-            .then(response => response.json())
-            .then(data => {
-                // Only process if the card UID exists and is new (by timestamp)
-                if (data && data.uid && data.uid !== "" && data.timestamp > lastTimestamp) {
-                    const uidDisplay = document.getElementById('last-uid-display');
-                    if (uidDisplay) {
-                        uidDisplay.textContent = data.uid;
-                    }
-                    
-                    if (cardStatus) {
-                        cardStatus.innerHTML = `Card detected: <strong>${data.uid}</strong>`;
-                    }
-                    
-                    // Update last timestamp
-                    lastTimestamp = data.timestamp;
-                    
-                    // Process card scan only if we're not in return mode
-                    if (!inReturnMode) {
-                        processCardScan(data.uid);
-                    }
-                }
-            })
-            .catch(error => {
-                console.log('Error checking for card scan:', error);
-            });
-    }, 2000); // Check every 2 seconds
+    onCardScan(scan => {
+        if (!scan.uid) {
+            // Not the kiosk's own screen: staff pair it from the admin page
+            if (cardStatus) cardStatus.textContent = 'Card read - use the kiosk screen to log in with it';
+            return;
+        }
+        const uidDisplay = document.getElementById('last-uid-display');
+        if (uidDisplay) {
+            uidDisplay.textContent = scan.uid;
+        }
+        
+        if (cardStatus) {
+            cardStatus.innerHTML = `Card detected: <strong>${scan.uid}</strong>`;
+        }
+        
+        // Cards read for registration belong to the admin page, and
+        // return mode handles its own scans
+        if (scan.mode === 'normal' && !inReturnMode) {
+            processCardScan(scan);
+        }
+    });
 }
 
 // Process card scan
-function processCardScan(uid) {
+function processCardScan(scan) {
+    const uid = scan.uid;
     console.log("Processing card with UID:", uid);
-    // Check if it's a user card
-    fetch('/api/users')
+    // One indexed lookup on the ESP32 instead of downloading users and books
+    apiFetch('/api/lookup?uid=' + encodeURIComponent(uid))
         .then(response => response.json())
         .then(data => {
-            const users = data.users || [];
-            const user = users.find(u => u.cardUid === uid);
-            
-            if (user) {
-                console.log("Found user:", user);
-                // User card found
-                sessionStorage.setItem('currentUser', JSON.stringify(user));
-                
-                if (user.type === 'staff') {
-                    window.location.href = 'admin.html';
-                } else {
-                    window.location.href = 'student.html';
-                }
-                return true;
-            }
-            return false;
-        })
-        .then(userFound => {
-            if (!userFound) {
-                // Check if it's a book card
-                return fetch('/api/books')
-                    .then(response => response.json())
-                    .then(data => {
-                        const books = data.books || [];
-                        const book = books.find(b => b.cardUid === uid);
-                        
-                        if (book) {
-                            console.log("Found book:", book);
-                            // Book card found
-                            sessionStorage.setItem('currentBook', JSON.stringify(book));
-                            window.location.href = 'books.html';
-                        } else {
-                            console.log('Unregistered card');
-                            alert('Unregistered card: ' + uid);
-                        }
-                    });
+            if (data.found && data.kind === 'user') {
+                console.log("Found user:", data.user);
+                // User card found - the read's nonce logs in whoever is on the reader
+                startSession({nonce: scan.nonce || ''}).then(result => {
+                    if (!result.ok) alert(result.error);
+                });
+            } else if (data.found && data.kind === 'book') {
+                const book = data.book;
+                console.log("Found book:", book);
+                // Book card found
+                sessionStorage.setItem('currentBook', JSON.stringify(book));
+                window.location.href = 'books.html';
+            } else {
+                console.log('Unregistered card');
+                alert('Unregistered card: ' + uid);
             }
         })
         .catch(error => {
@@ -186,7 +219,7 @@ function startCardScan(elementId) {
     }
     
     // Set mode on the ESP32
-    fetch('/api/mode?mode=user')
+    apiFetch('/api/mode?mode=user')
         .then(response => response.text())
         .then(result => {
             console.log('Card scan mode set:', result);
@@ -207,7 +240,7 @@ function startBookCardScan(elementId) {
     }
     
     // Set mode on the ESP32
-    fetch('/api/mode?mode=book')
+    apiFetch('/api/mode?mode=book')
         .then(response => response.text())
         .then(result => {
             console.log('Book card scan mode set:', result);
@@ -222,82 +255,55 @@ function startBookCardScan(elementId) {
 
 // New function to validate card UIDs
 function validateCardUid(uid, elementId) {
-    // First check against users
-    return fetch('/api/users')
-        .then(response => response.json())
-        .then(userData => {
-            const users = userData.users || [];
-            
-            // Check if card is already assigned to a user
-            if (users.some(u => u.cardUid === uid)) {
-                const element = document.getElementById(elementId);
-                if (element) {
-                    element.textContent = 'Card already registered to a user';
-                }
-                alert('This card is already registered to another user');
-                return Promise.reject('Card already in use');
-            }
-            
-            // Then check against books
-            return fetch('/api/books');
-        })
+    // A single lookup covers both user and book cards
+    return apiFetch('/api/lookup?uid=' + encodeURIComponent(uid))
         .then(response => response.json())
-        .then(bookData => {
-            const books = bookData.books || [];
+        .then(data => {
+            const element = document.getElementById(elementId);
             
-            // Check if card is already assigned to a book
-            if (books.some(b => b.cardUid === uid)) {
-                const element = document.getElementById(elementId);
+            // Check if card is already assigned to a user or a book
+            if (data.found) {
+                const owner = data.kind === 'user' ? 'a user' : 'a book';
                 if (element) {
-                    element.textContent = 'Card already registered to a book';
+                    element.textContent = 'Card already registered to ' + owner;
                 }
-                alert('This card is already registered to a book');
+                alert(data.kind === 'user'
+                    ? 'This card is already registered to another user'
+                    : 'This card is already registered to a book');
                 return Promise.reject('Card already in use');
             }
             
             // If we get here, card is valid
-            const element = document.getElementById(elementId);
             if (element) {
                 element.textContent = uid;
             }
             // Clear the card UID after a successful read for registration
-            fetch('/api/clear-card');
+            apiFetch('/api/clear-card');
         })
         .catch(error => {
             if (error !== 'Card already in use') {
                 console.error('Error validating card:', error);
-                setTimeout(() => checkForNewCard(elementId, 0, 0), 1000);
+                setTimeout(() => checkForNewCard(elementId), 1000);
             }
         });
 }
 
-// Modified checkForNewCard function to validate scanned cards
-function checkForNewCard(elementId, attempts = 0, lastTimestamp = 0) {
-    if (attempts > 15) {
+// Wait for the next card scan and validate it for registration
+function checkForNewCard(elementId) {
+    const stopListening = onCardScan(scan => {
+        stopListening();
+        clearTimeout(timeout);
+        validateCardUid(scan.uid, elementId);
+    });
+    
+    // Same window the ESP32 gives for a scan after motion, with some slack
+    const timeout = setTimeout(() => {
+        stopListening();
         const element = document.getElementById(elementId);
         if (element) {
             element.textContent = 'Scan timeout. Try again.';
         }
-        return;
-    }
-    
-    fetch('/api/scan')
-        .then(response => response.json())
-        .then(data => {
-            if (data && data.uid && data.uid !== "" && data.timestamp > lastTimestamp) {
-                const scannedUid = data.uid;
-                
-                // Validate the card isn't already in use
-                validateCardUid(scannedUid, elementId);
-            } else {
-                // Try again after a short delay
-                setTimeout(() => checkForNewCard(elementId, attempts + 1, lastTimestamp), 1000);
-            }
-        })
-        .catch(error => {
-            console.error('Error checking for new card:', error);
-            setTimeout(() => checkForNewCard(elementId, attempts + 1, lastTimestamp), 1000);
-        });
+    }, 15000);
 }
 
 // Check student login
@@ -332,21 +338,69 @@ function checkAdminLogin() {
     return true;
 }
 
+// Local Mirror Functions
+// -----------------------------
+
+// Bring the local copy of /api/books or /api/users up to date and resolve
+// with its records. The copy remembers the collection version it was taken
+// at, so only records changed since then come back (?since=), and when
+// nothing has changed the browser revalidates its cached reply and the
+// kiosk answers 304 with no body. `fields` projects books; each projection
+// keeps its own copy.
+function syncCollection(name, fields) {
+    const key = 'mirror:' + name + (fields ? ':' + fields : '');
+    let mirror = null;
+    try {
+        mirror = JSON.parse(sessionStorage.getItem(key));
+    } catch (e) {
+        mirror = null;
+    }
+
+    const params = new URLSearchParams();
+    if (fields) params.set('fields', fields);
+    if (mirror) params.set('since', mirror.version);
+    return apiFetch('/api/' + name + '?' + params)
+        .then(response => response.json())
+        .then(data => {
+            const idOf = record => record.id || record.studentId || record.username;
+            let records = data[name] || [];
+
+            if (mirror && data.full === false) {
+                // Patch in place so the catalog order is kept; new records go last
+                const changed = new Map(records.map(record => [idOf(record), record]));
+                const deleted = new Set(data.deleted || []);
+                records = mirror.records
+                    .filter(record => !deleted.has(idOf(record)))
+                    .map(record => {
+                        const update = changed.get(idOf(record));
+                        changed.delete(idOf(record));
+                        return update || record;
+                    });
+                changed.forEach(record => records.push(record));
+            }
+
+            try {
+                sessionStorage.setItem(key, JSON.stringify({version: data.version, records: records}));
+            } catch (e) {
+                sessionStorage.removeItem(key);  // Over quota - fetch in full next time
+            }
+            return records;
+        });
+}
+
 // Admin Functions
 // -----------------------------
 
 // Load accounts
 function loadAccounts() {
-    fetch('/api/users')
-        .then(response => response.json())
-        .then(data => {
+    syncCollection('users')
+        .then(users => {
             const usersList = document.getElementById('accounts-list');
             if (!usersList) return;
             
             usersList.innerHTML = '';
-            const users = data.users || [];
             
-            users.forEach((user, index) => {
+            users.forEach(user => {
                 const row = document.createElement('tr');
                 row.innerHTML = `
                     <td>${user.username || user.studentId}</td>
@@ -354,7 +408,7 @@ function loadAccounts() {
                     <td>${user.name || '-'}</td>
                     <td>${user.cardUid || 'Not assigned'}</td>
                     <td>
-                        <button class="btn-small delete-account-btn" data-index="${index}">Delete</button>
+                        <button class="btn-small delete-account-btn" data-user="${user.studentId || user.username}">Delete</button>
                     </td>
                 `;
                 usersList.appendChild(row);
@@ -363,8 +417,7 @@ function loadAccounts() {
             // Add delete functionality
             document.querySelectorAll('.delete-account-btn').forEach(btn => {
                 btn.addEventListener('click', function() {
-                    const index = parseInt(this.getAttribute('data-index'));
-                    deleteAccount(index);
+                    deleteAccount(this.getAttribute('data-user'));
                 });
             });
         })
@@ -374,30 +427,15 @@ function loadAccounts() {
 }
 
 // Delete account
-function deleteAccount(index) {
+function deleteAccount(userId) {
     if (!confirm('Are you sure you want to delete this account?')) {
         return;
     }
     
-    fetch('/api/users')
-        .then(response => response.json())
-        .then(data => {
-            const users = data.users || [];
-            
-            // Remove the user at index
-            users.splice(index, 1);
-            
-            // Save updated users
-            return fetch('/api/users', {
-                method: 'POST',
-                headers: {
-                    'Content-Type': 'application/x-www-form-urlencoded',
-                },
-                body: `data=${encodeURIComponent(JSON.stringify({users: users}))}`,
-            });
-        })
-        .then(response => {
-            if (response.ok) {
+    // Only the account ID goes over the wire; the server journals the removal
+    postTransaction('/api/users/remove', {user: userId})
+        .then(result => {
+            if (result.ok) {
                 alert('Account deleted successfully');
                 loadAccounts();
                 
@@ -479,70 +517,25 @@ function createAccount() {
     // 4. Log the data we're about to send (for debugging)
     console.log("New account data:", userData);
     
-    // 5. Fetch existing users to check for duplicates
-    fetch('/api/users')
-        .then(response => {
-            if (!response.ok) {
-                throw new Error('Network response was not ok');
-            }
-            return response.json();
-        })
-        .then(data => {
-            // Ensure users array exists
-            const users = data.users || [];
-            console.log("Retrieved existing users:", users.length);
-            
-            // Check for duplicates based on account type
-            if (accountType === 'student') {
-                const duplicateStudent = users.find(u => u.studentId === userData.studentId);
-                if (duplicateStudent) {
-                    alert('A student with this ID already exists');
-                    return Promise.reject('Duplicate student ID');
-                }
-            } else { // staff
-                const duplicateStaff = users.find(u => u.username === userData.username);
-                if (duplicateStaff) {
-                    alert('A staff member with this username already exists');
-                    return Promise.reject('Duplicate username');
-                }
-            }
-            
-            // Check for duplicate card if one was provided
-            if (userData.cardUid && userData.cardUid !== '') {
-                const duplicateCard = users.find(u => u.cardUid === userData.cardUid);
-                if (duplicateCard) {
-                    alert('This card is already registered to another user');
-                    return Promise.reject('Duplicate card');
+    // 5. Send just the new account - the server checks for duplicate IDs and
+    // cards against its indexes and appends the record to its journal
+    postTransaction('/api/users/add', {data: JSON.stringify(userData)})
+        .then(result => {
+            if (!result.ok) {
+                // 409 covers duplicate IDs and cards; the server says which
+                if (result.status === 409) {
+                    alert(result.error);
+                    return Promise.reject('Duplicate');
                 }
+                throw new Error('Failed to save user data: ' + result.error);
             }
-            
-            // 6. If we get here, we can add the new user
-            users.push(userData);
-            
-            // 7. Format data for the API
-            const updatedData = JSON.stringify({users: users});
-            console.log("Sending updated users data...");
-            
-            // 8. Send the updated users data
-            return fetch('/api/users', {
-                method: 'POST',
-                headers: {
-                    'Content-Type': 'application/x-www-form-urlencoded',
-                },
-                body: `data=${encodeURIComponent(updatedData)}`,
-            });
-        })
-        .then(response => {
-            if (!response.ok) {
-                throw new Error('Failed to save user data: ' + response.status);
-            }
-            return response.text();
+            return result;
         })
         .then(result => {
             console.log("Account creation success:", result);
             alert('Account created successfully');
             
-            // 9. Clear the form
+            // 6. Clear the form
             if (accountType === 'student') {
                 document.getElementById('student-id').value = '';
                 document.getElementById('student-name').value = '';
@@ -554,7 +547,7 @@ function createAccount() {
             }
             document.getElementById('card-uid-display').textContent = 'No card scanned';
             
-            // 10. Return to accounts tab and refresh the list
+            // 7. Return to accounts tab and refresh the list
             const accountsTab = document.querySelector('[data-tab="accounts"]');
             if (accountsTab) {
                 accountsTab.click();
@@ -562,29 +555,37 @@ function createAccount() {
             loadAccounts();
         })
         .catch(error => {
-            // 11. Handle expected rejection cases
-            if (error === 'Duplicate student ID' || error === 'Duplicate username' || error === 'Duplicate card') {
+            // 8. Handle expected rejection cases
+            if (error === 'Duplicate') {
                 console.log("Validation error:", error);
                 return; // Already showed an alert
             }
             
-            // 12. Handle unexpected errors
+            // 9. Handle unexpected errors
             console.error("Account creation error:", error);
             alert('Error creating account: ' + error.message);
         });
 }
 // Load books
 function loadBooks() {
-    fetch('/api/books')
-        .then(response => response.json())
-        .then(data => {
+    // Only the columns the table shows. With a search term the ESP32 ranks
+    // the matches itself, so only the hits come back.
+    const fields = 'id,title,author,borrowed,shelf,floor,borrowedBy,returnDate';
+    const searchBox = document.getElementById('book-search');
+    const term = searchBox ? searchBox.value.trim() : '';
+    const request = term
+        ? apiFetch('/api/search?limit=100&fields=' + fields + '&q=' + encodeURIComponent(term))
+            .then(response => response.json())
+            .then(data => data.books || [])
+        : syncCollection('books', fields);
+    request
+        .then(books => {
             const booksList = document.getElementById('books-list');
             if (!booksList) return;
             
             booksList.innerHTML = '';
-            const books = data.books || [];
             
-            books.forEach((book, index) => {
+            books.forEach(book => {
                 const row = document.createElement('tr');
                 row.innerHTML = `
                     <td>${book.id}</td>
@@ -595,7 +596,7 @@ function loadBooks() {
                     <td>${book.borrowedBy || '-'}</td>
                     <td>${book.returnDate ? new Date(book.returnDate).toLocaleDateString() : '-'}</td>
                     <td>
-                        <button class="btn-small delete-book-btn" data-index="${index}">Delete</button>
+                        <button class="btn-small delete-book-btn" data-id="${book.id}" data-borrowed="${book.borrowed}">Delete</button>
                     </td>
                 `;
                 booksList.appendChild(row);
@@ -604,8 +605,7 @@ function loadBooks() {
             // Add delete functionality
             document.querySelectorAll('.delete-book-btn').forEach(btn => {
                 btn.addEventListener('click', function() {
-                    const index = parseInt(this.getAttribute('data-index'));
-                    deleteBook(index);
+                    deleteBook(this.getAttribute('data-id'), this.getAttribute('data-borrowed') === 'true');
                 });
             });
         })
@@ -615,38 +615,22 @@ function loadBooks() {
 }
 
 // Delete book function - updated to prevent deletion of borrowed books
-function deleteBook(index) {
-    fetch('/api/books')
-        .then(response => response.json())
-        .then(data => {
-            const books = data.books || [];
-            const book = books[index];
-            
-            // Check if book is borrowed
-            if (book && book.borrowed) {
-                alert('This book cannot be deleted because it is currently borrowed.');
-                return Promise.reject('Book is borrowed');
-            }
-            
-            // Confirm deletion if the book is not borrowed
-            if (!confirm('Are you sure you want to delete this book?')) {
-                return Promise.reject('Deletion cancelled');
-            }
-            
-            // Remove the book at index
-            books.splice(index, 1);
-            
-            // Save updated books
-            return fetch('/api/books', {
-                method: 'POST',
-                headers: {
-                    'Content-Type': 'application/x-www-form-urlencoded',
-                },
-                body: `data=${encodeURIComponent(JSON.stringify({books: books}))}`,
-            });
-        })
-        .then(response => {
-            if (response && response.ok) {
+function deleteBook(bookId, borrowed) {
+    // Check if book is borrowed
+    if (borrowed) {
+        alert('This book cannot be deleted because it is currently borrowed.');
+        return;
+    }
+    
+    // Confirm deletion if the book is not borrowed
+    if (!confirm('Are you sure you want to delete this book?')) {
+        return;
+    }
+    
+    // The server re-checks the borrowed flag before removing the record
+    postTransaction('/api/books/remove', {id: bookId})
+        .then(result => {
+            if (result.ok) {
                 alert('Book deleted successfully');
                 
                 // Return to books tab
@@ -655,15 +639,15 @@ function deleteBook(index) {
                     booksTab.click();
                 }
                 loadBooks();
+            } else if (result.status === 409) {
+                alert(result.error);
             } else {
                 alert('Failed to delete book');
             }
         })
         .catch(error => {
-            if (error !== 'Book is borrowed' && error !== 'Deletion cancelled') {
-                console.error('Error deleting book:', error);
-                alert('Error deleting book');
-            }
+            console.error('Error deleting book:', error);
+            alert('Error deleting book');
         });
 }
 
@@ -677,8 +661,7 @@ function addBook() {
         shelf: document.getElementById('book-shelf').value,
         floor: document.getElementById('book-floor').value,
         borrowed: false,
-        cardUid: document.getElementById('book-card-uid').textContent,
-        history: []
+        cardUid: document.getElementById('book-card-uid').textContent
     };
     
     if (!bookData.id || !bookData.title || !bookData.author || !bookData.shelf || !bookData.floor) {
@@ -693,68 +676,18 @@ function addBook() {
         bookData.cardUid = '';
     }
     
-    // First check user database to ensure the card isn't already assigned to a user
-    fetch('/api/users')
-        .then(response => {
-            if (!response.ok) {
-                throw new Error('Failed to fetch user data');
-            }
-            return response.json();
-        })
-        .then(userData => {
-            const users = userData.users || [];
-            
-            // Check if card is already assigned to a user
-            if (bookData.cardUid && bookData.cardUid !== '') {
-                if (users.some(u => u.cardUid === bookData.cardUid)) {
-                    alert('This card is already registered to a user');
-                    return Promise.reject('Card already registered to user');
-                }
-            }
-            
-            // Now check book database
-            return fetch('/api/books');
-        })
-        .then(response => {
-            if (!response.ok) {
-                throw new Error('Failed to fetch book data');
-            }
-            return response.json();
-        })
-        .then(data => {
-            const books = data.books || [];
-            
-            // Check for duplicate book ID
-            if (books.some(b => b.id === bookData.id)) {
-                alert('A book with this ID already exists');
-                return Promise.reject('Duplicate ID');
-            }
-            
-            // Check for duplicate card UID if one was provided
-            if (bookData.cardUid && bookData.cardUid !== '') {
-                if (books.some(b => b.cardUid === bookData.cardUid)) {
-                    alert('This card is already registered to another book');
-                    return Promise.reject('Duplicate card');
+    // Send just the new book - the server rejects duplicate IDs and cards
+    // already assigned to a user or another book
+    postTransaction('/api/books/add', {data: JSON.stringify(bookData)})
+        .then(result => {
+            if (!result.ok) {
+                if (result.status === 409) {
+                    alert(result.error);
+                    return Promise.reject('Duplicate');
                 }
+                throw new Error(result.error);
             }
-            
-            // Add the new book
-            books.push(bookData);
-            
-            // Save updated books
-            return fetch('/api/books', {
-                method: 'POST',
-                headers: {
-                    'Content-Type': 'application/x-www-form-urlencoded',
-                },
-                body: `data=${encodeURIComponent(JSON.stringify({books: books}))}`,
-            });
-        })
-        .then(response => {
-            if (!response.ok) {
-                throw new Error('Failed to save book data');
-            }
-            return response.text();
+            return result;
         })
         .then(result => {
             alert('Book added successfully');
@@ -775,13 +708,93 @@ function addBook() {
             loadBooks();
         })
         .catch(error => {
-            if (error !== 'Duplicate ID' && error !== 'Duplicate card' && error !== 'Card already registered to user') {
+            if (error !== 'Duplicate') {
                 console.error('Error adding book:', error);
                 alert('Error adding book: ' + error.message);
             }
         });
 }
 
+// Import a file of books or accounts (CSV or NDJSON). The kiosk reads it
+// as it arrives and commits it a few records at a time; records it
+// already has are skipped, so a file can simply be sent again.
+function importRecords() {
+    const kind = document.getElementById('bulk-kind').value;
+    const file = document.getElementById('import-file').files[0];
+    const status = document.getElementById('import-status');
+    if (!file) {
+        alert('Choose a file to import');
+        return;
+    }
+    const format = /\.(ndjson|jsonl)$/i.test(file.name) ? 'ndjson' : 'csv';
+    
+    // XMLHttpRequest rather than fetch, for the upload progress
+    const request = new XMLHttpRequest();
+    request.open('POST', '/api/import?kind=' + kind + '&format=' + format);
+    const headers = authHeaders();
+    Object.keys(headers).forEach(name => request.setRequestHeader(name, headers[name]));
+    request.setRequestHeader('Content-Type', format === 'csv' ? 'text/csv' : 'application/x-ndjson');
+    request.upload.onprogress = function(e) {
+        if (e.lengthComputable) {
+            status.textContent = 'Importing... ' + Math.round(100 * e.loaded / e.total) + '%';
+        }
+    };
+    request.onload = function() {
+        let report = {};
+        try {
+            report = JSON.parse(request.responseText);
+        } catch (e) {
+            report.error = request.responseText;
+        }
+        if (request.status === 401) {
+            alert(report.error);
+            logout();
+            return;
+        }
+        if (!report.ok) {
+            status.textContent = 'Import failed: ' + (report.error || request.status);
+            return;
+        }
+        let text = report.imported + ' added, ' + report.skipped + ' skipped (' +
+            Math.round(report.recordsPerSecond) + ' records/s)';
+        (report.skippedLines || []).forEach(skipped => {
+            text += '\nLine ' + skipped.line + ': ' + skipped.error;
+        });
+        status.textContent = text;
+        if (kind === 'books') {
+            loadBooks();
+        } else {
+            loadAccounts();
+        }
+    };
+    request.onerror = function() {
+        status.textContent = 'Import cut off - send the file again to add the rest';
+    };
+    status.textContent = 'Importing...';
+    request.send(file);
+}
+
+// Download every book or account as a file
+function exportRecords(format) {
+    const kind = document.getElementById('bulk-kind').value;
+    apiFetch('/api/export?kind=' + kind + '&format=' + format, {headers: authHeaders()})
+        .then(response => {
+            if (!response.ok) throw new Error('HTTP ' + response.status);
+            return response.blob();
+        })
+        .then(blob => {
+            const link = document.createElement('a');
+            link.href = URL.createObjectURL(blob);
+            link.download = kind + '.' + format;
+            link.click();
+            URL.revokeObjectURL(link.href);
+        })
+        .catch(error => {
+            console.error('Error exporting:', error);
+            alert('Error exporting: ' + error.message);
+        });
+}
+
 // Student Functions
 // -----------------------------
 
@@ -790,15 +803,26 @@ function loadBorrowedBooks() {
     const currentUser = getCurrentUser();
     if (!currentUser) return;
     
-    fetch('/api/books')
-        .then(response => response.json())
-        .then(data => {
+    const userId = currentUser.studentId || currentUser.username;
+    const query = new URLSearchParams({
+        borrowedBy: userId,
+        fields: 'id,title,borrowed,borrowedBy,borrowDate,returnDate'
+    });
+    
+    // Penalties come from the kiosk, which tracks what is overdue
+    const overdueQuery = new URLSearchParams({user: userId, ts: Math.floor(Date.now() / 1000)});
+    
+    Promise.all([
+        apiFetch('/api/books?' + query).then(response => response.json()),
+        apiFetch('/api/overdue?' + overdueQuery).then(response => response.ok ? response.json() : {overdue: []})
+    ])
+        .then(([data, overdue]) => {
             const borrowedList = document.getElementById('borrowed-books-list');
             if (!borrowedList) return;
             
             borrowedList.innerHTML = '';
             const books = data.books || [];
-            const userId = currentUser.studentId || currentUser.username;
+            const penalties = new Map((overdue.overdue || []).map(loan => [loan.book, loan.penalty]));
             
             const now = new Date();
             
@@ -806,12 +830,7 @@ function loadBorrowedBooks() {
                 if (book.borrowed && book.borrowedBy === userId) {
                     const returnDate = new Date(book.returnDate);
                     const daysLeft = Math.ceil((returnDate - now) / (1000 * 60 * 60 * 24));
-                    
-                    // Calculate penalty
-                    let penalty = 0;
-                    if (daysLeft < 0) {
-                        penalty = Math.abs(daysLeft);
-                    }
+                    const penalty = penalties.get(book.id) || 0;
                     
                     const row = document.createElement('tr');
                     row.innerHTML = `
@@ -851,48 +870,60 @@ function loadStudentProfile() {
 function loadBorrowingHistory() {
     const currentUser = getCurrentUser();
     if (!currentUser) return;
+    const userId = currentUser.studentId || currentUser.username;
+    
+    // Get 6 months ago date
+    const sixMonthsAgo = new Date();
+    sixMonthsAgo.setMonth(sixMonthsAgo.getMonth() - 6);
+    
+    // Returned loans come from the history log newest first, a page at a
+    // time - stop at the first page reaching back past six months
+    const history = [];
+    const loadPage = offset =>
+        apiFetch('/api/history?user=' + encodeURIComponent(userId) + '&limit=50&offset=' + offset)
+            .then(response => response.json())
+            .then(data => {
+                const loans = data.history || [];
+                loans.forEach(entry => history.push(entry));
+                const last = loans[loans.length - 1];
+                const more = last && offset + loans.length < data.total &&
+                             new Date(last.returnDate) >= sixMonthsAgo;
+                return more ? loadPage(offset + loans.length) : history;
+            });
     
-    fetch('/api/books')
+    // Books still out are on the books themselves
+    const current = apiFetch('/api/books?fields=id,title,borrowDate&borrowedBy=' + encodeURIComponent(userId))
         .then(response => response.json())
-        .then(data => {
+        .then(data => data.books || []);
+    
+    Promise.all([loadPage(0), current])
+        .then(([returned, borrowed]) => {
             const historyList = document.getElementById('history-list');
             if (!historyList) return;
             
             historyList.innerHTML = '';
-            const books = data.books || [];
-            const userId = currentUser.studentId || currentUser.username;
-            
-            // Get 6 months ago date
-            const sixMonthsAgo = new Date();
-            sixMonthsAgo.setMonth(sixMonthsAgo.getMonth() - 6);
-            
-            // Collect history
-            const history = [];
-            
-            books.forEach(book => {
-                if (book.history && book.history.length > 0) {
-                    book.history.forEach(entry => {
-                        if (entry.username === userId) {
-                            const borrowDate = new Date(entry.borrowDate);
-                            if (borrowDate >= sixMonthsAgo) {
-                                history.push({
-                                    id: book.id,
-                                    title: book.title,
-                                    borrowDate: borrowDate,
-                                    returnDate: entry.returnDate ? new Date(entry.returnDate) : null,
-                                    status: entry.returnDate ? 'Returned' : 'Borrowed'
-                                });
-                            }
-                        }
-                    });
-                }
-            });
+            const rows = [];
+            borrowed.forEach(book => rows.push({
+                id: book.id,
+                title: book.title,
+                borrowDate: new Date(book.borrowDate),
+                returnDate: null,
+                status: 'Borrowed'
+            }));
+            returned.forEach(entry => rows.push({
+                id: entry.book,
+                title: entry.title || '(removed)',
+                borrowDate: new Date(entry.borrowDate),
+                returnDate: new Date(entry.returnDate),
+                status: 'Returned'
+            }));
             
             // Sort by borrow date (newest first)
-            history.sort((a, b) => b.borrowDate - a.borrowDate);
+            const recent = rows.filter(item => item.borrowDate >= sixMonthsAgo);
+            recent.sort((a, b) => b.borrowDate - a.borrowDate);
             
             // Display history
-            history.forEach(item => {
+            recent.forEach(item => {
                 const row = document.createElement('tr');
                 row.innerHTML = `
                     <td>${item.id}</td>
@@ -1015,6 +1046,33 @@ function loadBookDetails() {
     }
 }
 
+// Post a borrow/return transaction to the ESP32. Only the book and user
+// travel over the network, with the session token; the server checks who
+// is asking, validates and updates the record. Resolves to {ok, status,
+// error, book}.
+function postTransaction(endpoint, params) {
+    const body = new URLSearchParams(params);
+    // The kiosk has no internet time source, so send ours along
+    body.set('ts', Math.floor(Date.now() / 1000));
+    
+    return apiFetch(endpoint, {
+        method: 'POST',
+        headers: Object.assign({
+            'Content-Type': 'application/x-www-form-urlencoded',
+        }, authHeaders()),
+        body: body.toString(),
+    })
+        .then(response => response.json().then(data => {
+            data.status = response.status;
+            if (response.status === 401 && getCurrentUser()) {
+                // The session ran out (or the kiosk restarted) - log in again
+                alert(data.error);
+                logout();
+            }
+            return data;
+        }));
+}
+
 // Borrow book
 function borrowBook() {
     const currentUser = getCurrentUser();
@@ -1032,69 +1090,27 @@ function borrowBook() {
         return;
     }
     
-    fetch('/api/books')
-        .then(response => response.json())
-        .then(data => {
-            const books = data.books || [];
-            const bookIndex = books.findIndex(b => b.id === book.id);
-            
-            if (bookIndex === -1) {
-                alert('Book not found');
-                return Promise.reject('Book not found');
-            }
-            
-            // Check again if book is borrowed (it might have been borrowed by someone else)
-            if (books[bookIndex].borrowed) {
-                alert('This book has already been borrowed by someone else');
-                return Promise.reject('Book already borrowed');
-            }
-            
-            // Set borrow values
-            const now = new Date();
-            const returnDate = new Date();
-            returnDate.setDate(now.getDate() + 14); // 14 days loan
-            
-            books[bookIndex].borrowed = true;
-            books[bookIndex].borrowedBy = currentUser.studentId;
-            books[bookIndex].borrowDate = now.toISOString();
-            books[bookIndex].returnDate = returnDate.toISOString();
-            
-            // Add to history
-            if (!books[bookIndex].history) {
-                books[bookIndex].history = [];
+    // The server re-checks availability, so two kiosks can't both win
+    postTransaction('/api/borrow', {id: book.id, user: currentUser.studentId})
+        .then(result => {
+            if (result.book) {
+                // Update sessionStorage
+                sessionStorage.setItem('currentBook', JSON.stringify(result.book));
             }
             
-            books[bookIndex].history.push({
-                username: currentUser.studentId,
-                borrowDate: now.toISOString(),
-                returnDate: null
-            });
-            
-            // Update sessionStorage
-            sessionStorage.setItem('currentBook', JSON.stringify(books[bookIndex]));
-            
-            // Save to server
-            return fetch('/api/books', {
-                method: 'POST',
-                headers: {
-                    'Content-Type': 'application/x-www-form-urlencoded',
-                },
-                body: `data=${encodeURIComponent(JSON.stringify({books: books}))}`,
-            });
-        })
-        .then(response => {
-            if (response && response.ok) {
+            if (result.ok) {
                 alert('Book borrowed successfully. You have 14 days to return it.');
                 loadBookDetails(); // Refresh the page
+            } else if (result.status === 409) {
+                alert('This book has already been borrowed by someone else');
+                loadBookDetails();
             } else {
-                alert('Failed to borrow book');
+                alert('Failed to borrow book: ' + result.error);
             }
         })
         .catch(error => {
-            if (error !== 'Book not found' && error !== 'Book already borrowed') {
-                console.error('Error borrowing book:', error);
-                alert('Error borrowing book');
-            }
+            console.error('Error borrowing book:', error);
+            alert('Error borrowing book');
         });
 }
 
@@ -1116,68 +1132,27 @@ function returnBook() {
         return;
     }
     
-    if (book.borrowedBy !== currentUser.studentId && book.borrowedBy !== currentUser.username) {
+    const userId = currentUser.studentId || currentUser.username;
+    if (book.borrowedBy !== userId) {
         alert('You can only return books that you have borrowed');
         return;
     }
     
-    fetch('/api/books')
-        .then(response => response.json())
-        .then(data => {
-            const books = data.books || [];
-            const bookIndex = books.findIndex(b => b.id === book.id);
-            
-            if (bookIndex === -1) {
-                alert('Book not found');
-                return Promise.reject('Book not found');
-            }
-            
-            // Update book status
-            books[bookIndex].borrowed = false;
-            books[bookIndex].borrowedBy = null;
-            books[bookIndex].borrowDate = null;
-            books[bookIndex].returnDate = null;
-            
-            // Update history
-            const now = new Date();
-            
-            if (books[bookIndex].history && books[bookIndex].history.length > 0) {
-                // Find the latest borrow record for this user
-                for (let i = books[bookIndex].history.length - 1; i >= 0; i--) {
-                    const record = books[bookIndex].history[i];
-                    if ((record.username === currentUser.studentId || record.username === currentUser.username) && !record.returnDate) {
-                        record.returnDate = now.toISOString();
-                        break;
-                    }
-                }
-            }
-            
-            // Update sessionStorage
-            sessionStorage.setItem('currentBook', JSON.stringify(books[bookIndex]));
-            
-            // Save to server
-            return fetch('/api/books', {
-                method: 'POST',
-                headers: {
-                    'Content-Type': 'application/x-www-form-urlencoded',
-                },
-                body: `data=${encodeURIComponent(JSON.stringify({books: books}))}`,
-            });
-        })
-        .then(response => {
-            if (response && response.ok) {
+    postTransaction('/api/return', {id: book.id, user: userId})
+        .then(result => {
+            if (result.ok) {
+                // Update sessionStorage
+                sessionStorage.setItem('currentBook', JSON.stringify(result.book));
                 alert('Book returned successfully');
                 // After returning, redirect to index page
                 window.location.href = 'index.html';
             } else {
-                alert('Failed to return book');
+                alert('Failed to return book: ' + result.error);
             }
         })
         .catch(error => {
-            if (error !== 'Book not found') {
-                console.error('Error returning book:', error);
-                alert('Error returning book');
-            }
+            console.error('Error returning book:', error);
+            alert('Error returning book');
         });
 }
 
@@ -1200,26 +1175,11 @@ function returnBookFromIndex() {
         status.textContent = 'Please scan the book card to return...';
     }
     
-    // Set up a polling interval for card scans
-    const returnBookInterval = setInterval(function() {
-        fetch('/api/scan')
-            .then(response => response.json())
-            .then(data => {
-                if (data && data.uid && data.uid !== "") {
-                    // Clear the interval to stop polling
-                    clearInterval(returnBookInterval);
-                    
-                    // Process the book return with the scanned card
-                    processBookReturn(data.uid);
-                }
-            })
-            .catch(error => {
-                console.error('Error checking for book card:', error);
-                if (status) {
-                    status.textContent = 'Error checking card. Please try again.';
-                }
-            });
-    }, 2000); // Check every 2 seconds
+    // Take the next card scanned as the book to return
+    const stopListening = onCardScan(scan => {
+        stopListening();
+        processBookReturn(scan);
+    });
     
     // Set up cancel button
     const cancelBtn = document.createElement('button');
@@ -1227,7 +1187,7 @@ function returnBookFromIndex() {
     cancelBtn.className = 'btn';
     cancelBtn.style.marginTop = '10px';
     cancelBtn.addEventListener('click', function() {
-        clearInterval(returnBookInterval);
+        stopListening();
         inReturnMode = false;
         if (returnSection) {
             returnSection.classList.add('hidden');
@@ -1241,118 +1201,63 @@ function returnBookFromIndex() {
     }
 }
 
-// Process book return
-function processBookReturn(uid) {
-    console.log("Processing book return for card:", uid);
+// Process book return: the read's nonce stands for the book on the reader
+function processBookReturn(scan) {
+    console.log("Processing book return for card:", scan.uid);
     const status = document.getElementById('return-status');
     
-    // Check if it's a book card
-    fetch('/api/books')
-        .then(response => response.json())
-        .then(data => {
-            const books = data.books || [];
-            const book = books.find(b => b.cardUid === uid);
-            
-            if (book) {
-                if (book.borrowed) {
-                    // Book is borrowed, proceed with return
-                    if (status) {
-                        status.textContent = `Found book: ${book.title}. Processing return...`;
-                    }
-                    
-                    const bookIndex = books.indexOf(book);
-                    
-                    // Update book status
-                    books[bookIndex].borrowed = false;
-                    books[bookIndex].borrowedBy = null;
-                    books[bookIndex].borrowDate = null;
-                    books[bookIndex].returnDate = null;
-                    
-                    // Update history
-                    const now = new Date();
+    if (status) {
+        status.textContent = 'Processing return...';
+    }
+    
+    // Retry the return flow after showing a message for 5 seconds
+    const restartReturn = function() {
+        setTimeout(function() {
+            inReturnMode = false;
+            returnBookFromIndex();
+        }, 5000);
+    };
+    
+    postTransaction('/api/return', {nonce: scan.nonce || ''})
+        .then(result => {
+            if (result.ok) {
+                const book = result.book;
+                if (status) {
+                    status.textContent = `Book "${book.title}" returned successfully.`;
                     
-                    if (books[bookIndex].history && books[bookIndex].history.length > 0) {
-                        // Find the latest borrow record
-                        for (let i = books[bookIndex].history.length - 1; i >= 0; i--) {
-                            const record = books[bookIndex].history[i];
-                            if (!record.returnDate) {
-                                record.returnDate = now.toISOString();
-                                break;
-                            }
-                        }
-                    }
+                    // Add a message about successful return with green background
+                    const successMsg = document.createElement('div');
+                    successMsg.textContent = `Book "${book.title}" returned successfully.`;
+                    successMsg.style.backgroundColor = '#dff0d8';
+                    successMsg.style.color = '#3c763d';
+                    successMsg.style.padding = '10px';
+                    successMsg.style.borderRadius = '4px';
+                    successMsg.style.marginTop = '15px';
                     
-                    // Save to server
-                    return fetch('/api/books', {
-                        method: 'POST',
-                        headers: {
-                            'Content-Type': 'application/x-www-form-urlencoded',
-                        },
-                        body: `data=${encodeURIComponent(JSON.stringify({books: books}))}`,
-                    })
-                    .then(response => {
-                        if (response.ok) {
-                            if (status) {
-                                status.textContent = `Book "${book.title}" returned successfully.`;
-                                
-                                // Add a message about successful return with green background
-                                const successMsg = document.createElement('div');
-                                successMsg.textContent = `Book "${book.title}" returned successfully.`;
-                                successMsg.style.backgroundColor = '#dff0d8';
-                                successMsg.style.color = '#3c763d';
-                                successMsg.style.padding = '10px';
-                                successMsg.style.borderRadius = '4px';
-                                successMsg.style.marginTop = '15px';
-                                
-                                const returnSection = document.getElementById('return-book-section');
-                                if (returnSection) {
-                                    // Remove any existing success messages
-                                    const existingMsg = returnSection.querySelector('.success-msg');
-                                    if (existingMsg) {
-                                        returnSection.removeChild(existingMsg);
-                                    }
-                                    
-                                    successMsg.className = 'success-msg';
-                                    returnSection.appendChild(successMsg);
-                                }
-                            }
-                            
-                            // Reset return mode after successful return
-                            setTimeout(function() {
-                                inReturnMode = false;
-                                // Don't hide the return section so user can see the success message
-                            }, 5000);
-                            
-                            return true;
-                        } else {
-                            throw new Error('Failed to save book data');
+                    const returnSection = document.getElementById('return-book-section');
+                    if (returnSection) {
+                        // Remove any existing success messages
+                        const existingMsg = returnSection.querySelector('.success-msg');
+                        if (existingMsg) {
+                            returnSection.removeChild(existingMsg);
                         }
-                    });
-                } else {
-                    if (status) {
-                        status.textContent = 'This book is not currently borrowed.';
+                        
+                        successMsg.className = 'success-msg';
+                        returnSection.appendChild(successMsg);
                     }
-                    
-                    // Reset after 5 seconds
-                    setTimeout(function() {
-                        inReturnMode = false;
-                        returnBookFromIndex();
-                    }, 5000);
-                    
-                    return false;
-                }
-            } else {
-                if (status) {
-                    status.textContent = 'This card is not registered to any book.';
                 }
                 
-                // Reset after 5 seconds
+                // Reset return mode after successful return
                 setTimeout(function() {
                     inReturnMode = false;
-                    returnBookFromIndex();
+                    // Don't hide the return section so user can see the success message
                 }, 5000);
-                
-                return false;
+            } else {
+                // 404: unknown card, 409: book isn't out
+                if (status) {
+                    status.textContent = result.error;
+                }
+                restartReturn();
             }
         })
         .catch(error => {
@@ -1362,103 +1267,132 @@ function processBookReturn(uid) {
             }
             
             // Reset return mode after error
-            setTimeout(function() {
-                inReturnMode = false;
-                returnBookFromIndex();
-            }, 5000);
+            restartReturn();
+        });
+}
+
+// Batch mode: a stack of books is put on the reader and every tag in it is
+// collected, then one request borrows or returns them all. `op` is 'borrow'
+// or 'return'; `user` is the borrower (required to borrow).
+function startBatchScan(sectionId, op, user) {
+    const section = document.getElementById(sectionId);
+    if (!section) return;
+    section.classList.remove('hidden');
+    const status = section.querySelector('.status-box');
+    const list = section.querySelector('ul');
+    const commitBtn = section.querySelector('.batch-commit');
+    const cancelBtn = section.querySelector('.batch-cancel');
+    
+    inReturnMode = true;  // Keep the index page from logging in with these cards
+    status.textContent = 'Place the stack of books on the scanner...';
+    list.innerHTML = '';
+    commitBtn.disabled = true;
+    
+    // Scan events only say which tag was read; the batch itself resolves the
+    // books and has already dropped repeat reads
+    const refresh = () => apiFetch('/api/batch')
+        .then(response => response.json())
+        .then(batch => {
+            list.innerHTML = '';
+            let books = 0;
+            batch.cards.forEach(card => {
+                const item = document.createElement('li');
+                if (card.book) {
+                    books++;
+                    item.textContent = `${card.book.id} - ${card.book.title}`;
+                } else {
+                    item.textContent = `${card.uid} (not a book card, skipped)`;
+                }
+                list.appendChild(item);
+            });
+            status.textContent = `${books} book(s) scanned` + (batch.open ? '' : ' - scanner stopped');
+            commitBtn.disabled = books === 0;
+        });
+    
+    const stopListening = onCardScan(scan => {
+        if (scan.mode === 'batch') refresh();
+    });
+    const finish = () => {
+        stopListening();
+        inReturnMode = false;
+        commitBtn.onclick = null;
+        cancelBtn.onclick = null;
+    };
+    
+    commitBtn.onclick = () => {
+        commitBtn.disabled = true;
+        postTransaction('/api/batch/commit', user ? {op: op, user: user} : {op: op})
+            .then(result => {
+                if (result.ok) {
+                    finish();
+                    const verb = op === 'borrow' ? 'borrowed' : 'returned';
+                    status.textContent = `${result.count} book(s) ${verb} successfully.`;
+                    if (op === 'borrow') loadBorrowedBooks();
+                } else if (result.conflicts) {
+                    // Nothing was changed - take these off the stack and try again
+                    status.textContent = result.error + ': ' +
+                        result.conflicts.map(book => book.title).join(', ');
+                    commitBtn.disabled = false;
+                } else {
+                    status.textContent = result.error;
+                    commitBtn.disabled = false;
+                }
+            })
+            .catch(error => {
+                console.error('Error committing batch:', error);
+                status.textContent = 'Error saving the batch. Please try again.';
+                commitBtn.disabled = false;
+            });
+    };
+    
+    cancelBtn.onclick = () => {
+        finish();
+        apiFetch('/api/batch/cancel', {method: 'POST'});
+        section.classList.add('hidden');
+    };
+    
+    apiFetch('/api/mode?mode=batch')
+        .then(response => response.text())
+        .then(result => console.log('Batch scan mode set:', result))
+        .catch(error => {
+            console.error('Error setting batch mode:', error);
+            status.textContent = 'Could not start the scanner.';
         });
 }
 
 // Process book card for borrowing
 function processBookCardForBorrow(uid) {
     console.log("Processing book card for borrow:", uid);
-    fetch('/api/books')
-        .then(response => response.json())
-        .then(data => {
-            const books = data.books || [];
-            const book = books.find(b => b.cardUid === uid);
-            
-            const status = document.getElementById('borrow-status');
-            
-            if (book) {
-                console.log("Found book for borrow:", book);
+    const status = document.getElementById('borrow-status');
+    const currentUser = getCurrentUser();
+    if (!currentUser) return;
+    
+    postTransaction('/api/borrow', {card: uid, user: currentUser.studentId})
+        .then(result => {
+            if (result.ok) {
+                const book = result.book;
+                console.log("Borrowed book:", book);
                 if (status) {
-                    status.textContent = `Found book: ${book.title}`;
+                    status.textContent = `Book "${book.title}" borrowed successfully. You have 14 days to return it.`;
                 }
-                
-                if (book.borrowed) {
-                    if (status) {
-                        status.textContent = `Book "${book.title}" is already borrowed and unavailable.`;
-                    }
-                    alert(`Book "${book.title}" is already borrowed and unavailable.`);
-                } else {
-                    // Borrow the book
-                    const currentUser = getCurrentUser();
-                    if (currentUser) {
-                        // Set borrow values
-                        const now = new Date();
-                        const returnDate = new Date();
-                        returnDate.setDate(now.getDate() + 14); // 14 days loan
-                        
-                        const bookIndex = books.indexOf(book);
-                        books[bookIndex].borrowed = true;
-                        books[bookIndex].borrowedBy = currentUser.studentId;
-                        books[bookIndex].borrowDate = now.toISOString();
-                        books[bookIndex].returnDate = returnDate.toISOString();
-                        
-                        // Add to history
-                        if (!books[bookIndex].history) {
-                            books[bookIndex].history = [];
-                        }
-                        
-                        books[bookIndex].history.push({
-                            username: currentUser.studentId,
-                            borrowDate: now.toISOString(),
-                            returnDate: null
-                        });
-                        
-                        // Save to server
-                        fetch('/api/books', {
-                            method: 'POST',
-                            headers: {
-                                'Content-Type': 'application/x-www-form-urlencoded',
-                            },
-                            body: `data=${encodeURIComponent(JSON.stringify({books: books}))}`,
-                        })
-                        .then(response => {
-                            if (response.ok) {
-                                if (status) {
-                                    status.textContent = `Book "${book.title}" borrowed successfully. You have 14 days to return it.`;
-                                }
-                                alert(`Book "${book.title}" borrowed successfully. You have 14 days to return it.`);
-                                loadBorrowedBooks(); // Refresh the borrowed books list
-                            } else {
-                                if (status) {
-                                    status.textContent = 'Failed to borrow book';
-                                }
-                                alert('Failed to borrow book');
-                            }
-                        })
-                        .catch(error => {
-                            console.error('Error saving borrowed book:', error);
-                            if (status) {
-                                status.textContent = 'Error borrowing book';
-                            }
-                            alert('Error borrowing book');
-                        });
-                    }
+                alert(`Book "${book.title}" borrowed successfully. You have 14 days to return it.`);
+                loadBorrowedBooks(); // Refresh the borrowed books list
+            } else if (result.status === 409) {
+                const message = `Book "${result.book.title}" is already borrowed and unavailable.`;
+                if (status) {
+                    status.textContent = message;
                 }
+                alert(message);
             } else {
-                console.log("Book not found for card:", uid);
+                console.log("Borrow failed for card:", uid, result.error);
                 if (status) {
-                    status.textContent = 'This card is not registered to any book.';
+                    status.textContent = result.error;
                 }
-                alert('This card is not registered to any book.');
+                alert(result.error);
             }
         })
         .catch(error => {
             console.error('Error processing book card:', error);
-            const status = document.getElementById('borrow-status');
             if (status) {
                 status.textContent = 'Error processing card';
             }
@@ -1480,6 +1414,8 @@ document.addEventListener('DOMContentLoaded', function() {
         logoutBtn.addEventListener('click', logout);
         console.log("Logout button initialized");
     }
+    const pairKioskBtn = document.getElementById('pair-kiosk-btn');
+    if (pairKioskBtn) pairKioskBtn.addEventListener('click', pairKioskScreen);
     
     // Setup tabs if present
     if (document.querySelector('.tabs')) {
@@ -1524,8 +1460,16 @@ document.addEventListener('DOMContentLoaded', function() {
             console.log("Return book button initialized");
         }
         
+        const returnStackBtn = document.getElementById('return-stack-btn');
+        if (returnStackBtn) {
+            returnStackBtn.addEventListener('click', function() {
+                startBatchScan('return-stack-section', 'return');
+            });
+            console.log("Return stack button initialized");
+        }
+        
         // Start polling for card scans
-        pollForCardScan();
+        watchForCardScan();
         console.log("Card polling started");
     }
     
@@ -1537,6 +1481,17 @@ document.addEventListener('DOMContentLoaded', function() {
             loadAccounts();
             loadBooks();
             
+            // Search as the admin types, once they pause
+            const bookSearch = document.getElementById('book-search');
+            if (bookSearch) {
+                let searchTimer = null;
+                bookSearch.addEventListener('input', function() {
+                    clearTimeout(searchTimer);
+                    searchTimer = setTimeout(loadBooks, 250);
+                });
+                console.log("Book search initialized");
+            }
+            
             // Setup account type toggling
             const accountType = document.getElementById('account-type');
             if (accountType) {
@@ -1580,6 +1535,17 @@ document.addEventListener('DOMContentLoaded', function() {
                 });
                 console.log("Add book form initialized");
             }
+            
+            const importForm = document.getElementById('import-form');
+            if (importForm) {
+                importForm.addEventListener('submit', function(e) {
+                    e.preventDefault();
+                    importRecords();
+                });
+                document.getElementById('export-csv').addEventListener('click', () => exportRecords('csv'));
+                document.getElementById('export-ndjson').addEventListener('click', () => exportRecords('ndjson'));
+                console.log("Import and export initialized");
+            }
         }
     }
     
@@ -1602,7 +1568,7 @@ document.addEventListener('DOMContentLoaded', function() {
                         status.textContent = 'Checking for scanned card...';
                     }
                     
-                    fetch('/api/scan')
+                    apiFetch('/api/scan', {headers: authHeaders()})
                         .then(response => response.json())
                         .then(data => {
                             if (data && data.uid && data.uid !== "") {
@@ -1623,6 +1589,14 @@ document.addEventListener('DOMContentLoaded', function() {
                 });
                 console.log("Borrow card button initialized");
             }
+            
+            const borrowStackBtn = document.getElementById('borrow-stack-btn');
+            if (borrowStackBtn) {
+                borrowStackBtn.addEventListener('click', function() {
+                    startBatchScan('borrow-stack-section', 'borrow', getCurrentUser().studentId);
+                });
+                console.log("Borrow stack button initialized");
+            }
         }
     }
     
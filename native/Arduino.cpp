@@ -0,0 +1,188 @@
+#include <Arduino.h>
+
+#include <chrono>
+#include <map>
+#include <random>
+#include <thread>
+
+HardwareSerial Serial;
+EspClass ESP;
+
+uint32_t esp_random() {
+  static std::random_device device;
+  return device();
+}
+
+// ---------------------------------------------------------------------------
+// Time and GPIO
+
+static const auto startTime = std::chrono::steady_clock::now();
+static uint64_t clockOffsetMicros = 0;
+
+unsigned long micros() {
+  auto elapsed = std::chrono::steady_clock::now() - startTime;
+  return (unsigned long)(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() +
+                         clockOffsetMicros);
+}
+
+unsigned long millis() {
+  auto elapsed = std::chrono::steady_clock::now() - startTime;
+  return (unsigned long)((std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() +
+                          clockOffsetMicros) / 1000);
+}
+
+void delay(unsigned long ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void delayMicroseconds(unsigned int us) {
+  std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+void nativeAdvanceClock(unsigned long ms) {
+  clockOffsetMicros += (uint64_t)ms * 1000;
+}
+
+static std::map<int, int> pinValues;
+static std::map<int, void (*)()> risingInterrupts;
+
+void pinMode(int, int) {}
+
+int digitalRead(int pin) {
+  auto found = pinValues.find(pin);
+  return found == pinValues.end() ? LOW : found->second;
+}
+
+void digitalWrite(int pin, int value) {
+  pinValues[pin] = value;
+}
+
+void attachInterrupt(int pin, void (*isr)(), int mode) {
+  if (mode == RISING) risingInterrupts[pin] = isr;
+}
+
+void nativeSetPin(int pin, int value) {
+  int previous = digitalRead(pin);
+  pinValues[pin] = value;
+  auto isr = risingInterrupts.find(pin);
+  if (previous == LOW && value != LOW && isr != risingInterrupts.end()) isr->second();
+}
+
+// ---------------------------------------------------------------------------
+// String
+
+String::String(long number, unsigned char base) {
+  char buffer[34];
+  if (base == HEX) {
+    snprintf(buffer, sizeof(buffer), "%lx", number);
+  } else {
+    snprintf(buffer, sizeof(buffer), "%ld", number);
+  }
+  value = buffer;
+}
+
+String::String(unsigned long number, unsigned char base) {
+  char buffer[34];
+  snprintf(buffer, sizeof(buffer), base == HEX ? "%lx" : "%lu", number);
+  value = buffer;
+}
+
+String::String(double number, unsigned int decimals) {
+  char buffer[64];
+  snprintf(buffer, sizeof(buffer), "%.*f", (int)decimals, number);
+  value = buffer;
+}
+
+void String::trim() {
+  size_t first = value.find_first_not_of(" \t\r\n");
+  size_t last = value.find_last_not_of(" \t\r\n");
+  value = first == std::string::npos ? std::string() : value.substr(first, last - first + 1);
+}
+
+void String::replace(const String& find, const String& with) {
+  if (find.value.empty()) return;
+  for (size_t at = value.find(find.value); at != std::string::npos;
+       at = value.find(find.value, at + with.value.size())) {
+    value.replace(at, find.value.size(), with.value);
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Print / Stream
+
+size_t Print::printf(const char* format, ...) {
+  char buffer[256];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+  if (length < 0) return 0;
+  return write(buffer, std::min<size_t>(length, sizeof(buffer) - 1));
+}
+
+size_t Stream::readBytes(char* buffer, size_t length) {
+  size_t count = 0;
+  while (count < length) {
+    int c = read();
+    if (c < 0) break;
+    buffer[count++] = (char)c;
+  }
+  return count;
+}
+
+size_t Stream::readBytesUntil(char terminator, char* buffer, size_t length) {
+  size_t count = 0;
+  while (count < length) {
+    int c = read();
+    if (c < 0 || c == terminator) break;
+    buffer[count++] = (char)c;
+  }
+  return count;
+}
+
+String Stream::readString() {
+  String result;
+  for (int c = read(); c >= 0; c = read()) result += (char)c;
+  return result;
+}
+
+String Stream::readStringUntil(char terminator) {
+  String result;
+  for (int c = read(); c >= 0 && c != terminator; c = read()) result += (char)c;
+  return result;
+}
+
+bool Stream::find(const char* target) {
+  return findUntil(target, nullptr);
+}
+
+bool Stream::findUntil(const char* target, const char* terminator) {
+  size_t targetLength = strlen(target);
+  size_t terminatorLength = terminator ? strlen(terminator) : 0;
+  size_t matched = 0;
+  size_t terminatorMatched = 0;
+  for (int c = read(); c >= 0; c = read()) {
+    matched = c == target[matched] ? matched + 1 : (c == target[0] ? 1 : 0);
+    if (matched == targetLength) return true;
+    if (terminatorLength > 0) {
+      terminatorMatched = c == terminator[terminatorMatched] ? terminatorMatched + 1
+                                                              : (c == terminator[0] ? 1 : 0);
+      if (terminatorMatched == terminatorLength) return false;
+    }
+  }
+  return false;
+}
+
+// ---------------------------------------------------------------------------
+// FreeRTOS
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t, const char* name, uint32_t, void*,
+                                   UBaseType_t, TaskHandle_t* handle, BaseType_t core) {
+  Serial.printf("Task %s (core %d) not started on the host\n", name, core);
+  if (handle) *handle = nullptr;
+  return pdPASS;
+}
+
+void vTaskDelay(TickType_t ticks) {
+  delay(ticks * portTICK_PERIOD_MS);
+}
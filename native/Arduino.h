@@ -0,0 +1,259 @@
+#pragma once
+
+// Host stand-in for the parts of the Arduino core and ESP-IDF the firmware
+// uses, so src/ builds as a normal program in [env:native]. Behaviour
+// follows arduino-esp32 where the firmware depends on it; everything else
+// is the simplest thing that compiles.
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <algorithm>
+#include <string>
+
+typedef uint8_t byte;
+
+#define HEX 16
+#define DEC 10
+#define LOW 0
+#define HIGH 1
+#define INPUT 0
+#define OUTPUT 1
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+#define IRAM_ATTR
+#define PROGMEM
+#define PGM_P const char*
+#define F(text) (text)
+
+// ---------------------------------------------------------------------------
+// Time and GPIO
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+inline void yield() {}
+
+void pinMode(int pin, int mode);
+int digitalRead(int pin);
+void digitalWrite(int pin, int value);
+inline int digitalPinToInterrupt(int pin) { return pin; }
+void attachInterrupt(int pin, void (*isr)(), int mode);
+
+// Host-only: move millis()/micros() forward without sleeping, so timed
+// states (scan windows, message holds) can be stepped through instantly
+void nativeAdvanceClock(unsigned long ms);
+
+// Host-only: drive an input pin; a low-to-high edge runs a RISING interrupt
+void nativeSetPin(int pin, int value);
+
+// ---------------------------------------------------------------------------
+// String - the subset of WString the firmware and ArduinoJson use
+
+class String {
+ public:
+  String() {}
+  String(const char* text) : value(text ? text : "") {}
+  String(const char* text, size_t length) : value(text, length) {}
+  String(const std::string& text) : value(text) {}
+  explicit String(char c) : value(1, c) {}
+  String(int number, unsigned char base = DEC) : String((long)number, base) {}
+  String(unsigned int number, unsigned char base = DEC) : String((unsigned long)number, base) {}
+  String(unsigned char number, unsigned char base = DEC) : String((unsigned long)number, base) {}
+  String(long number, unsigned char base = DEC);
+  String(unsigned long number, unsigned char base = DEC);
+  String(long long number, unsigned char base = DEC) : String((long)number, base) {}
+  String(unsigned long long number, unsigned char base = DEC) : String((unsigned long)number, base) {}
+  String(float number, unsigned int decimals = 2) : String((double)number, decimals) {}
+  String(double number, unsigned int decimals = 2);
+
+  const char* c_str() const { return value.c_str(); }
+  unsigned int length() const { return value.size(); }
+  bool isEmpty() const { return value.empty(); }
+  bool reserve(unsigned int size) {
+    value.reserve(size);
+    return true;
+  }
+
+  bool concat(const String& other) { value += other.value; return true; }
+  bool concat(const char* text) { if (text) value += text; return true; }
+  bool concat(const char* text, unsigned int length) { value.append(text, length); return true; }
+  bool concat(char c) { value += c; return true; }
+  bool concat(int number) { return concat(String(number)); }
+  bool concat(unsigned int number) { return concat(String(number)); }
+  bool concat(long number) { return concat(String(number)); }
+  bool concat(unsigned long number) { return concat(String(number)); }
+
+  template <typename T>
+  String& operator+=(const T& other) {
+    concat(other);
+    return *this;
+  }
+
+  friend String operator+(const String& a, const String& b) { return String(a.value + b.value); }
+  friend String operator+(const String& a, const char* b) { return String(a.value + (b ? b : "")); }
+  friend String operator+(const char* a, const String& b) { return String((a ? a : "") + b.value); }
+  friend String operator+(const String& a, char b) { return String(a.value + b); }
+
+  bool operator==(const String& other) const { return value == other.value; }
+  bool operator==(const char* other) const { return value == (other ? other : ""); }
+  bool operator!=(const String& other) const { return value != other.value; }
+  bool operator!=(const char* other) const { return !(*this == other); }
+  bool operator<(const String& other) const { return value < other.value; }
+  bool equals(const String& other) const { return value == other.value; }
+  bool equalsIgnoreCase(const String& other) const { return strcasecmp(c_str(), other.c_str()) == 0; }
+
+  char operator[](unsigned int index) const { return index < value.size() ? value[index] : 0; }
+  char& operator[](unsigned int index) { return value[index]; }
+  char charAt(unsigned int index) const { return (*this)[index]; }
+
+  int indexOf(char c, unsigned int from = 0) const { return position(value.find(c, from)); }
+  int indexOf(const String& text, unsigned int from = 0) const { return position(value.find(text.value, from)); }
+  int lastIndexOf(char c) const { return position(value.rfind(c)); }
+  bool startsWith(const String& prefix) const { return value.compare(0, prefix.value.size(), prefix.value) == 0; }
+  bool endsWith(const String& suffix) const {
+    return value.size() >= suffix.value.size() &&
+           value.compare(value.size() - suffix.value.size(), suffix.value.size(), suffix.value) == 0;
+  }
+
+  String substring(unsigned int from) const { return from < value.size() ? String(value.substr(from)) : String(); }
+  String substring(unsigned int from, unsigned int to) const {
+    if (from > to) std::swap(from, to);
+    return from < value.size() ? String(value.substr(from, to - from)) : String();
+  }
+
+  void toUpperCase() { for (char& c : value) c = toupper((unsigned char)c); }
+  void toLowerCase() { for (char& c : value) c = tolower((unsigned char)c); }
+  void trim();
+  void replace(const String& find, const String& with);
+  void remove(unsigned int index) { if (index < value.size()) value.erase(index); }
+  void remove(unsigned int index, unsigned int count) { if (index < value.size()) value.erase(index, count); }
+  long toInt() const { return atol(c_str()); }
+
+ private:
+  static int position(size_t found) { return found == std::string::npos ? -1 : (int)found; }
+
+  std::string value;
+};
+
+// ---------------------------------------------------------------------------
+// Print / Stream
+
+class Print {
+ public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t* data, size_t length) {
+    size_t n = 0;
+    while (length--) n += write(*data++);
+    return n;
+  }
+  size_t write(const char* text) { return text ? write((const uint8_t*)text, strlen(text)) : 0; }
+  size_t write(const char* data, size_t length) { return write((const uint8_t*)data, length); }
+  virtual void flush() {}
+
+  size_t print(const String& text) { return write(text.c_str(), text.length()); }
+  size_t print(const char* text) { return write(text); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(int number, int base = DEC) { return print(String(number, base)); }
+  size_t print(unsigned int number, int base = DEC) { return print(String(number, base)); }
+  size_t print(long number, int base = DEC) { return print(String(number, base)); }
+  size_t print(unsigned long number, int base = DEC) { return print(String(number, base)); }
+  size_t print(double number, int decimals = 2) { return print(String(number, decimals)); }
+  size_t printf(const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+  size_t println() { return write("\r\n"); }
+  template <typename T>
+  size_t println(const T& value) {
+    size_t n = print(value);
+    return n + println();
+  }
+};
+
+class Stream : public Print {
+ public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+
+  void setTimeout(unsigned long) {}
+  size_t readBytes(char* buffer, size_t length);
+  size_t readBytes(uint8_t* buffer, size_t length) { return readBytes((char*)buffer, length); }
+  size_t readBytesUntil(char terminator, char* buffer, size_t length);
+  String readString();
+  String readStringUntil(char terminator);
+  bool find(const char* target);
+  bool findUntil(const char* target, const char* terminator);
+};
+
+// Serial goes to stderr so benchmark results on stdout stay clean
+class HardwareSerial : public Stream {
+ public:
+  void begin(unsigned long) {}
+  size_t write(uint8_t c) override { return fputc(c, stderr) == EOF ? 0 : 1; }
+  size_t write(const uint8_t* data, size_t length) override { return fwrite(data, 1, length, stderr); }
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+};
+
+extern HardwareSerial Serial;
+
+// ---------------------------------------------------------------------------
+// ESP - heap figures. The host has no fixed heap, so they read as zero.
+
+class EspClass {
+ public:
+  uint32_t getHeapSize() { return 0; }
+  uint32_t getFreeHeap() { return 0; }
+  uint32_t getMinFreeHeap() { return 0; }
+  uint32_t getMaxAllocHeap() { return 0; }
+};
+
+extern EspClass ESP;
+
+// esp_system.h: hardware random number generator
+uint32_t esp_random();
+
+// ---------------------------------------------------------------------------
+// newlib extras missing from older glibc
+
+#if defined(__GLIBC__) && (__GLIBC__ < 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ < 38))
+inline size_t strlcpy(char* dst, const char* src, size_t size) {
+  size_t length = strlen(src);
+  if (size > 0) {
+    size_t n = length < size - 1 ? length : size - 1;
+    memcpy(dst, src, n);
+    dst[n] = '\0';
+  }
+  return length;
+}
+#endif
+
+// ---------------------------------------------------------------------------
+// FreeRTOS. Tasks are recorded but not started: on the host each task's
+// loop is driven one pass at a time by whoever links the firmware in (the
+// benchmarks call readerPass()/httpPass()), which keeps runs deterministic.
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+typedef void* TaskHandle_t;
+typedef void (*TaskFunction_t)(void*);
+
+#define portTICK_PERIOD_MS 1
+#define pdPASS 1
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task, const char* name, uint32_t stackDepth,
+                                   void* parameters, UBaseType_t priority, TaskHandle_t* handle,
+                                   BaseType_t core);
+void vTaskDelay(TickType_t ticks);
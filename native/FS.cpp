@@ -0,0 +1,245 @@
+#include <FS.h>
+#include <LittleFS.h>
+#include <SPIFFS.h>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+static size_t writeBudget = SIZE_MAX;
+
+void nativeCutPowerAfter(size_t bytes) {
+  writeBudget = bytes;
+}
+
+namespace fs {
+
+struct FileImpl {
+  FS* owner = nullptr;
+  FILE* handle = nullptr;
+  std::string path;  // Device path, e.g. "/books.bin"
+  bool directory = false;
+  std::vector<std::string> entries;
+  size_t nextEntry = 0;
+
+  ~FileImpl() {
+    if (handle) fclose(handle);
+  }
+};
+
+std::string FS::hostPath(const char* path) const {
+  std::string device = path ? path : "";
+  if (device.empty() || device[0] != '/') device = "/" + device;
+  return root + device;
+}
+
+File FS::open(const char* path, const char* mode, bool) {
+  opens++;
+  auto impl = std::make_shared<FileImpl>();
+  impl->owner = this;
+  impl->path = path;
+
+  std::string host = hostPath(path);
+  struct stat info;
+  if (stat(host.c_str(), &info) == 0 && S_ISDIR(info.st_mode)) {
+    impl->directory = true;
+    if (DIR* dir = opendir(host.c_str())) {
+      std::string prefix = impl->path == "/" ? "/" : impl->path + "/";
+      while (dirent* entry = readdir(dir)) {
+        if (entry->d_name[0] != '.') impl->entries.push_back(prefix + entry->d_name);
+      }
+      closedir(dir);
+    }
+    return File(impl);
+  }
+
+  std::string hostMode = std::string(mode) + "b";
+  impl->handle = fopen(host.c_str(), hostMode.c_str());
+  return impl->handle ? File(impl) : File();
+}
+
+bool FS::exists(const char* path) {
+  struct stat info;
+  return stat(hostPath(path).c_str(), &info) == 0;
+}
+
+bool FS::remove(const char* path) {
+  return ::remove(hostPath(path).c_str()) == 0;
+}
+
+bool FS::rename(const char* from, const char* to) {
+  if (exists(to) && !renameReplaces) return false;
+  return ::rename(hostPath(from).c_str(), hostPath(to).c_str()) == 0;
+}
+
+File::operator bool() const {
+  return impl && (impl->handle || impl->directory);
+}
+
+size_t File::write(uint8_t c) {
+  return write(&c, 1);
+}
+
+size_t File::write(const uint8_t* data, size_t length) {
+  if (!impl || !impl->handle) return 0;
+  size_t written = fwrite(data, 1, std::min(length, writeBudget), impl->handle);
+  if (writeBudget != SIZE_MAX) writeBudget -= written;
+  impl->owner->bytesWritten += written;
+  return written;
+}
+
+int File::available() {
+  return impl && impl->handle ? (int)(size() - position()) : 0;
+}
+
+int File::read() {
+  uint8_t c;
+  return read(&c, 1) == 1 ? c : -1;
+}
+
+int File::peek() {
+  if (!impl || !impl->handle) return -1;
+  int c = fgetc(impl->handle);
+  if (c == EOF) return -1;
+  ungetc(c, impl->handle);
+  return c;
+}
+
+size_t File::read(uint8_t* buffer, size_t length) {
+  if (!impl || !impl->handle) return 0;
+  size_t count = fread(buffer, 1, length, impl->handle);
+  impl->owner->bytesRead += count;
+  return count;
+}
+
+bool File::seek(uint32_t position) {
+  return impl && impl->handle && fseek(impl->handle, position, SEEK_SET) == 0;
+}
+
+size_t File::position() const {
+  return impl && impl->handle ? (size_t)ftell(impl->handle) : 0;
+}
+
+size_t File::size() const {
+  if (!impl || !impl->handle) return 0;
+  fflush(impl->handle);
+  struct stat info;
+  return fstat(fileno(impl->handle), &info) == 0 ? (size_t)info.st_size : 0;
+}
+
+void File::flush() {
+  if (impl && impl->handle) fflush(impl->handle);
+}
+
+void File::close() {
+  impl.reset();
+}
+
+const char* File::name() const {
+  if (!impl) return "";
+  size_t slash = impl->path.rfind('/');
+  return impl->path.c_str() + (slash == std::string::npos ? 0 : slash + 1);
+}
+
+const char* File::path() const {
+  return impl ? impl->path.c_str() : "";
+}
+
+bool File::isDirectory() const {
+  return impl && impl->directory;
+}
+
+File File::openNextFile() {
+  if (!impl || !impl->directory || impl->nextEntry >= impl->entries.size()) return File();
+  return impl->owner->open(impl->entries[impl->nextEntry++].c_str(), "r");
+}
+
+}  // namespace fs
+
+// ---------------------------------------------------------------------------
+
+static std::string defaultRoot() {
+  const char* root = getenv("SPIFFS_ROOT");
+  return root ? root : "spiffs";
+}
+
+// SPIFFS and LittleFS share the one data partition, as on the board. A
+// hidden file says it is formatted as LittleFS.
+static const char* LITTLEFS_MARKER = "/.littlefs";
+
+static bool mountDirectory(const std::string& root) {
+  mkdir(root.c_str(), 0755);
+  struct stat info;
+  return stat(root.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+}
+
+static void removeFiles(fs::FS& partition) {
+  File directory = partition.open("/");
+  for (File file = directory.openNextFile(); file; file = directory.openNextFile()) {
+    std::string path = file.path();
+    file.close();
+    partition.remove(path.c_str());
+  }
+  partition.remove(LITTLEFS_MARKER);
+}
+
+// Usable size of the stock esp32dev data partition
+static const size_t PARTITION_BYTES = 1378241;
+
+static size_t filesBytes(fs::FS& partition) {
+  size_t used = 0;
+  File directory = partition.open("/");
+  for (File file = directory.openNextFile(); file; file = directory.openNextFile()) {
+    used += file.size();
+  }
+  return used;
+}
+
+SPIFFSFS SPIFFS;
+
+SPIFFSFS::SPIFFSFS() : fs::FS(defaultRoot()) {}
+
+bool SPIFFSFS::begin(bool formatOnFail, const char*, uint8_t, const char*) {
+  if (!mountDirectory(root)) return false;
+  if (!exists(LITTLEFS_MARKER)) return true;
+  return formatOnFail && format();
+}
+
+bool SPIFFSFS::format() {
+  removeFiles(*this);
+  return true;
+}
+
+size_t SPIFFSFS::totalBytes() {
+  return PARTITION_BYTES;
+}
+
+size_t SPIFFSFS::usedBytes() {
+  return filesBytes(*this);
+}
+
+LittleFSFS LittleFS;
+
+LittleFSFS::LittleFSFS() : fs::FS(defaultRoot()) {
+  renameReplaces = true;
+}
+
+bool LittleFSFS::begin(bool formatOnFail, const char*, uint8_t, const char*) {
+  if (!mountDirectory(root)) return false;
+  if (exists(LITTLEFS_MARKER)) return true;
+  return formatOnFail && format();
+}
+
+bool LittleFSFS::format() {
+  if (!mountDirectory(root)) return false;
+  removeFiles(*this);
+  File marker = open(LITTLEFS_MARKER, "w");
+  return (bool)marker;
+}
+
+size_t LittleFSFS::totalBytes() {
+  return PARTITION_BYTES;
+}
+
+size_t LittleFSFS::usedBytes() {
+  return filesBytes(*this);
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+// Host stand-in for the arduino-esp32 fs::FS / fs::File API, backed by a
+// directory on the host (see SPIFFS.h).
+
+#include <Arduino.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace fs {
+
+struct FileImpl;
+
+class File : public Stream {
+ public:
+  File() {}
+  explicit File(std::shared_ptr<FileImpl> impl) : impl(impl) {}
+
+  explicit operator bool() const;
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t* data, size_t length) override;
+  using Print::write;
+  int available() override;
+  int read() override;
+  int peek() override;
+  size_t read(uint8_t* buffer, size_t length);
+  bool seek(uint32_t position);
+  size_t position() const;
+  size_t size() const;
+  void flush() override;
+  void close();
+  const char* name() const;
+  const char* path() const;
+  bool isDirectory() const;
+  File openNextFile();
+
+ private:
+  std::shared_ptr<FileImpl> impl;
+};
+
+class FS {
+ public:
+  explicit FS(const std::string& root) : root(root) {}
+
+  File open(const char* path, const char* mode = "r", bool create = false);
+  File open(const String& path, const char* mode = "r", bool create = false) {
+    return open(path.c_str(), mode, create);
+  }
+  bool exists(const char* path);
+  bool exists(const String& path) { return exists(path.c_str()); }
+  bool remove(const char* path);
+  bool remove(const String& path) { return remove(path.c_str()); }
+  bool rename(const char* from, const char* to);
+  bool rename(const String& from, const String& to) { return rename(from.c_str(), to.c_str()); }
+
+  // Host-only: the directory standing in for the partition
+  void setRoot(const std::string& directory) { root = directory; }
+  const std::string& rootDirectory() const { return root; }
+
+  // Host-only: traffic counters
+  size_t bytesWritten = 0;
+  size_t bytesRead = 0;
+  size_t opens = 0;
+
+ protected:
+  std::string hostPath(const char* path) const;
+
+  std::string root;
+  bool renameReplaces = false;  // LittleFS's does; SPIFFS's refuses
+
+  friend class File;
+};
+
+}  // namespace fs
+
+using fs::File;
+using fs::FS;
+
+// Host-only: file writes stop once `bytes` more have been written, as when
+// the power is cut part way through (SIZE_MAX: never)
+void nativeCutPowerAfter(size_t bytes);
@@ -0,0 +1,24 @@
+#include <LiquidCrystal_I2C.h>
+
+LiquidCrystal_I2C::LiquidCrystal_I2C(uint8_t, uint8_t columns, uint8_t rows)
+    : columns(columns), lines(rows, std::string(columns, ' ')) {}
+
+void LiquidCrystal_I2C::clear() {
+  commands++;
+  for (std::string& line : lines) line.assign(columns, ' ');
+  cursorColumn = cursorRow = 0;
+}
+
+void LiquidCrystal_I2C::setCursor(uint8_t column, uint8_t row) {
+  commands++;
+  cursorColumn = column;
+  cursorRow = row < lines.size() ? row : lines.size() - 1;
+}
+
+size_t LiquidCrystal_I2C::write(uint8_t c) {
+  characters++;
+  // Like the HD44780, text past the end of a line goes to off-screen DDRAM
+  if (cursorColumn < columns) lines[cursorRow][cursorColumn] = (char)c;
+  cursorColumn++;
+  return 1;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+// Host stand-in for the 16x2 I2C LCD. It keeps a framebuffer of what the
+// panel would show and counts the bytes that would have crossed the I2C
+// bus, so display changes can be checked and their cost measured.
+
+#include <Arduino.h>
+
+#include <string>
+#include <vector>
+
+class LiquidCrystal_I2C : public Print {
+ public:
+  LiquidCrystal_I2C(uint8_t address, uint8_t columns, uint8_t rows);
+
+  void init() { clear(); }
+  void begin() { clear(); }
+  void backlight() { backlightOn = true; }
+  void noBacklight() { backlightOn = false; }
+  void clear();
+  void home() { setCursor(0, 0); }
+  void setCursor(uint8_t column, uint8_t row);
+  size_t write(uint8_t c) override;
+  using Print::write;
+
+  // Host-only: the panel contents and bus traffic so far
+  const std::string& line(uint8_t row) const { return lines[row]; }
+  bool isBacklit() const { return backlightOn; }
+  uint32_t commands = 0;     // clear / setCursor
+  uint32_t characters = 0;   // Characters written
+  void resetCounters() { commands = characters = 0; }
+
+ private:
+  uint8_t columns;
+  uint8_t cursorColumn = 0;
+  uint8_t cursorRow = 0;
+  bool backlightOn = false;
+  std::vector<std::string> lines;
+};
@@ -0,0 +1,22 @@
+#pragma once
+
+// Host stand-in for LittleFS: the same directory as SPIFFS.h's, since on
+// the board both use the one data partition. It counts as formatted for
+// LittleFS while a hidden marker file is there (format() puts it there,
+// SPIFFS's removes it), and rename() replaces an existing file.
+
+#include <FS.h>
+
+class LittleFSFS : public fs::FS {
+ public:
+  LittleFSFS();
+
+  bool begin(bool formatOnFail = false, const char* basePath = "/littlefs", uint8_t maxOpenFiles = 10,
+             const char* partitionLabel = "spiffs");
+  bool format();
+  size_t totalBytes();
+  size_t usedBytes();
+  void end() {}
+};
+
+extern LittleFSFS LittleFS;
@@ -0,0 +1,64 @@
+#include <MFRC522.h>
+
+bool MFRC522::PICC_ReadCardSerial() {
+  const std::vector<byte>* card;
+  int awake = awakeCard();
+  if (awake >= 0) {
+    selected = awake;
+    card = &field[awake].bytes;
+  } else if (!cards.empty()) {
+    selected = -1;
+    card = &cards.front();
+  } else {
+    return false;
+  }
+  uid.size = std::min(card->size(), sizeof(uid.uidByte));
+  memcpy(uid.uidByte, card->data(), uid.size);
+  uid.sak = 0x08;
+  if (awake < 0) cards.pop_front();
+  return true;
+}
+
+MFRC522::StatusCode MFRC522::PICC_HaltA() {
+  if (selected >= 0) field[selected].halted = true;
+  selected = -1;
+  return STATUS_OK;
+}
+
+std::vector<byte> MFRC522::parseHex(const char* hex) {
+  std::vector<byte> card;
+  for (size_t i = 0; hex[i] && hex[i + 1]; i += 2) {
+    char pair[3] = {hex[i], hex[i + 1], '\0'};
+    card.push_back((byte)strtoul(pair, nullptr, 16));
+  }
+  return card;
+}
+
+int MFRC522::awakeCard() const {
+  for (size_t i = 0; i < field.size(); i++) {
+    if (!field[i].halted) return (int)i;
+  }
+  return -1;
+}
+
+void MFRC522::nativePresentCard(const char* hex) {
+  cards.push_back(parseHex(hex));
+}
+
+void MFRC522::nativePlaceCard(const char* hex) {
+  nativeRemoveCard(hex);  // Placing a card again wakes it
+  FieldCard card;
+  card.bytes = parseHex(hex);
+  field.push_back(card);
+}
+
+void MFRC522::nativeRemoveCard(const char* hex) {
+  std::vector<byte> bytes = parseHex(hex);
+  for (size_t i = 0; i < field.size(); i++) {
+    if (field[i].bytes == bytes) {
+      field.erase(field.begin() + i);
+      selected = -1;
+      return;
+    }
+  }
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+// Host stand-in for the MFRC522 reader. Cards reach it two ways:
+//
+// - nativePresentCard() queues a tap: each queued card answers one
+//   PICC_IsNewCardPresent() / PICC_ReadCardSerial() pair, like tapping
+//   cards in turn.
+// - nativePlaceCard() leaves a card resting in the field, as in a stack of
+//   books. Like a real tag it answers every REQA until PICC_HaltA() puts it
+//   to sleep, and with several awake cards PICC_ReadCardSerial() selects
+//   one of them the way anticollision would. Taking a card away and putting
+//   it back wakes it again.
+
+#include <Arduino.h>
+
+#include <deque>
+#include <vector>
+
+class MFRC522 {
+ public:
+  struct Uid {
+    byte size;
+    byte uidByte[10];
+    byte sak;
+  };
+
+  enum StatusCode : byte { STATUS_OK, STATUS_ERROR, STATUS_COLLISION, STATUS_TIMEOUT };
+
+  MFRC522(byte, byte) {}
+
+  void PCD_Init() {}
+  bool PICC_IsNewCardPresent() { return !cards.empty() || awakeCard() >= 0; }
+  bool PICC_ReadCardSerial();
+  StatusCode PICC_HaltA();
+  void PCD_StopCrypto1() {}
+
+  // Host-only: queue a card for the next scan. Hex like "53C4734302A380".
+  void nativePresentCard(const char* hex);
+  size_t nativeCardsWaiting() const { return cards.size(); }
+
+  // Host-only: put a card in the field / take one or all of them away
+  void nativePlaceCard(const char* hex);
+  void nativeRemoveCard(const char* hex);
+  void nativeClearField() { field.clear(); selected = -1; }
+
+  Uid uid = {};
+
+ private:
+  struct FieldCard {
+    std::vector<byte> bytes;
+    bool halted = false;
+  };
+
+  static std::vector<byte> parseHex(const char* hex);
+  int awakeCard() const;
+
+  std::deque<std::vector<byte>> cards;
+  std::vector<FieldCard> field;
+  int selected = -1;  // Field card last selected, the one PICC_HaltA() halts
+};
@@ -0,0 +1,22 @@
+#pragma once
+
+// Host stand-in for the SPIFFS partition: a directory, $SPIFFS_ROOT or
+// ./spiffs by default. Like SPIFFS it has no real directories and rename()
+// refuses to replace an existing file. It won't mount a partition
+// formatted for LittleFS (see LittleFS.h) unless told to format it.
+
+#include <FS.h>
+
+class SPIFFSFS : public fs::FS {
+ public:
+  SPIFFSFS();
+
+  bool begin(bool formatOnFail = false, const char* basePath = "/spiffs", uint8_t maxOpenFiles = 10,
+             const char* partitionLabel = nullptr);
+  bool format();
+  size_t totalBytes();
+  size_t usedBytes();
+  void end() {}
+};
+
+extern SPIFFSFS SPIFFS;
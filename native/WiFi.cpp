@@ -0,0 +1,201 @@
+#include <WiFi.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+WiFiClass WiFi;
+
+static uint16_t tcpPort = 0;                 // See WiFiServer::nativeServeTcp()
+static std::vector<WiFiServer*> listening;   // Servers connect() can reach
+
+bool IPAddress::fromString(const char* text) {
+  unsigned parts[4];
+  char end;
+  if (sscanf(text, "%u.%u.%u.%u%c", &parts[0], &parts[1], &parts[2], &parts[3], &end) != 4) return false;
+  for (int i = 0; i < 4; i++) {
+    if (parts[i] > 255) return false;
+    octets[i] = (uint8_t)parts[i];
+  }
+  return true;
+}
+
+String IPAddress::toString() const {
+  char text[16];
+  snprintf(text, sizeof(text), "%u.%u.%u.%u", octets[0], octets[1], octets[2], octets[3]);
+  return String(text);
+}
+
+WiFiClient::Connection::~Connection() {
+  if (socket >= 0) close(socket);
+}
+
+WiFiClient WiFiClient::open(size_t reserve) {
+  WiFiClient client;
+  client.connection = std::make_shared<Connection>();
+  client.connection->sent.reserve(reserve);
+  return client;
+}
+
+const std::string& WiFiClient::sent() const {
+  static const std::string none;
+  return connection ? connection->sent : none;
+}
+
+int WiFiClient::connect(const char*, uint16_t port) {
+  stop();
+  connection.reset();
+  for (WiFiServer* server : listening) {
+    if (server->port != port) continue;
+    WiFiClient accepted;
+    connection = std::make_shared<Connection>();
+    accepted.connection = std::make_shared<Connection>();
+    connection->paired = accepted.connection->paired = true;
+    connection->peer = accepted.connection;
+    accepted.connection->peer = connection;
+    server->waiting.push_back(accepted);
+    return 1;
+  }
+  return 0;
+}
+
+size_t WiFiClient::write(const uint8_t* data, size_t length) {
+  if (!connected()) return 0;
+  if (connection->socket >= 0) {
+    size_t written = 0;
+    while (written < length) {
+      ssize_t n = ::send(connection->socket, data + written, length - written, MSG_NOSIGNAL);
+      if (n <= 0) {
+        stop();
+        break;
+      }
+      written += n;
+    }
+    return written;
+  }
+  if (std::shared_ptr<Connection> peer = connection->peer.lock()) {
+    if (!peer->open) return 0;
+    peer->received.append((const char*)data, length);
+    return length;
+  }
+  connection->sent.append((const char*)data, length);
+  return length;
+}
+
+void WiFiClient::receive() {
+  if (connection->socket < 0) return;
+  char buffer[2048];
+  for (;;) {
+    ssize_t n = recv(connection->socket, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (n > 0) {
+      connection->received.append(buffer, n);
+      continue;
+    }
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+      close(connection->socket);  // The other end is gone; what it sent stays readable
+      connection->socket = -1;
+      connection->open = false;
+    }
+    return;
+  }
+}
+
+int WiFiClient::available() {
+  if (!connection) return 0;
+  receive();
+  return connection->received.size() - connection->readOffset;
+}
+
+int WiFiClient::read(uint8_t* data, size_t length) {
+  length = std::min(length, (size_t)available());
+  if (length == 0) return -1;
+  memcpy(data, connection->received.data() + connection->readOffset, length);
+  connection->readOffset += length;
+  if (connection->readOffset == connection->received.size()) {
+    connection->received.clear();
+    connection->readOffset = 0;
+  }
+  return length;
+}
+
+int WiFiClient::read() {
+  uint8_t c;
+  return read(&c, 1) == 1 ? c : -1;
+}
+
+int WiFiClient::peek() {
+  return available() > 0 ? (uint8_t)connection->received[connection->readOffset] : -1;
+}
+
+uint8_t WiFiClient::connected() {
+  if (!connection) return false;
+  if (available() > 0) return true;
+  if (!connection->open) return false;
+  if (connection->socket >= 0) return true;
+  if (!connection->paired) return true;
+  std::shared_ptr<Connection> peer = connection->peer.lock();
+  return peer && peer->open;
+}
+
+void WiFiClient::stop() {
+  if (!connection) return;
+  connection->open = false;
+  if (connection->socket >= 0) close(connection->socket);
+  connection->socket = -1;
+}
+
+void WiFiServer::nativeServeTcp(uint16_t port) {
+  tcpPort = port;
+}
+
+void WiFiServer::begin() {
+  end();
+  listening.push_back(this);
+  if (tcpPort == 0) return;
+  socket = ::socket(AF_INET, SOCK_STREAM, 0);
+  int yes = 1;
+  setsockopt(socket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(tcpPort);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (socket < 0 || bind(socket, (sockaddr*)&address, sizeof(address)) != 0 || listen(socket, 32) != 0 ||
+      fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) | O_NONBLOCK) != 0) {
+    fprintf(stderr, "WiFiServer: can't listen on TCP port %u\n", tcpPort);
+    if (socket >= 0) close(socket);
+    socket = -1;
+  }
+}
+
+void WiFiServer::end() {
+  listening.erase(std::remove(listening.begin(), listening.end(), this), listening.end());
+  if (socket >= 0) close(socket);
+  socket = -1;
+  waiting.clear();
+}
+
+bool WiFiServer::hasClient() {
+  for (int fd; socket >= 0 && (fd = ::accept(socket, nullptr, nullptr)) >= 0;) {
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    WiFiClient accepted;
+    accepted.connection = std::make_shared<WiFiClient::Connection>();
+    accepted.connection->socket = fd;
+    waiting.push_back(accepted);
+  }
+  return !waiting.empty();
+}
+
+WiFiClient WiFiServer::available() {
+  if (!hasClient()) return WiFiClient();
+  WiFiClient client = waiting.front();
+  waiting.pop_front();
+  return client;
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+// Host stand-in for the WiFi soft-AP, WiFiServer and WiFiClient.
+//
+// A WiFiClient is an in-memory connection. One made by open() keeps
+// whatever the firmware writes to it so a caller can read it back; one
+// made by connect() is joined to a WiFiServer of this process listening on
+// that port, and each end reads what the other writes (see bench/). After
+// WiFiServer::nativeServeTcp() a server also takes real TCP connections on
+// the loopback interface, so tools/bench.py can load the host build.
+//
+// Joining a network as a station always succeeds; WiFiUDP (WiFiUdp.h) is a
+// real socket on the loopback interface.
+
+#include <Arduino.h>
+
+#include <deque>
+#include <memory>
+#include <string>
+
+class IPAddress {
+ public:
+  IPAddress(uint8_t a = 0, uint8_t b = 0, uint8_t c = 0, uint8_t d = 0) : octets{a, b, c, d} {}
+  bool fromString(const char* text);
+  String toString() const;
+  operator String() const { return toString(); }
+  uint8_t operator[](int index) const { return octets[index]; }
+  bool operator==(const IPAddress& other) const { return memcmp(octets, other.octets, 4) == 0; }
+  bool operator!=(const IPAddress& other) const { return !(*this == other); }
+
+ private:
+  uint8_t octets[4];
+};
+
+class WiFiClient : public Stream {
+ public:
+  WiFiClient() {}
+
+  // Host-only: a connected client whose output collects in sent(). Room
+  // for `reserve` bytes is set aside up front so writes up to that size
+  // don't allocate (see the allocation counts in bench/).
+  static WiFiClient open(size_t reserve = 0);
+  const std::string& sent() const;
+
+  // Connect to a WiFiServer of this process; the host is ignored
+  int connect(const char* host, uint16_t port);
+
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t* data, size_t length) override;
+  using Print::write;
+  int available() override;
+  int read() override;
+  int read(uint8_t* data, size_t length);
+  int peek() override;
+
+  uint8_t connected();
+  void stop();
+  void setNoDelay(bool) {}
+  IPAddress remoteIP() { return IPAddress(192, 168, 4, 2); }
+  explicit operator bool() { return connected(); }
+
+ private:
+  friend class WiFiServer;
+
+  struct Connection {
+    bool open = true;
+    int socket = -1;                // A loopback TCP connection, or -1
+    std::string sent;               // Written to an open() client
+    std::string received;           // Not yet read
+    size_t readOffset = 0;
+    bool paired = false;             // Made by connect()
+    std::weak_ptr<Connection> peer;  // ...and the other end
+    ~Connection();
+  };
+  void receive();  // Move what the socket has into `received`
+
+  std::shared_ptr<Connection> connection;
+};
+
+class WiFiServer {
+ public:
+  explicit WiFiServer(uint16_t port = 80) : port(port) {}
+  WiFiServer(const WiFiServer&) = delete;
+  WiFiServer& operator=(const WiFiServer&) = delete;
+  ~WiFiServer() { end(); }
+
+  // Host-only: servers begun from now on also accept TCP connections on
+  // this loopback port (0 = in-memory only)
+  static void nativeServeTcp(uint16_t port);
+
+  void begin();
+  void end();
+  void setNoDelay(bool) {}
+  bool hasClient();
+  WiFiClient available();  // The next waiting connection, or an unconnected client
+  WiFiClient accept() { return available(); }
+
+ private:
+  friend class WiFiClient;
+
+  uint16_t port;
+  int socket = -1;
+  std::deque<WiFiClient> waiting;
+};
+
+enum wifi_mode_t { WIFI_OFF, WIFI_STA, WIFI_AP, WIFI_AP_STA };
+
+class WiFiClass {
+ public:
+  bool mode(wifi_mode_t) { return true; }
+  bool softAP(const char*, const char* = nullptr) { return true; }
+  IPAddress softAPIP() { return IPAddress(192, 168, 4, 1); }
+  int begin(const char*, const char* = nullptr) { return 0; }
+  IPAddress localIP() { return IPAddress(127, 0, 0, 1); }
+};
+
+extern WiFiClass WiFi;
@@ -0,0 +1,83 @@
+#include <WiFiUdp.h>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+static const size_t MAX_DATAGRAM = 1472;  // What fits in one Ethernet frame
+
+uint8_t WiFiUDP::begin(uint16_t port) {
+  stop();
+  socket = ::socket(AF_INET, SOCK_DGRAM, 0);
+  if (socket < 0) return 0;
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(socket, (sockaddr*)&address, sizeof(address)) != 0 ||
+      fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) | O_NONBLOCK) != 0) {
+    stop();
+    return 0;
+  }
+  return 1;
+}
+
+void WiFiUDP::stop() {
+  if (socket >= 0) close(socket);
+  socket = -1;
+}
+
+int WiFiUDP::beginPacket(IPAddress ip, uint16_t port) {
+  to = ip;
+  toPort = port;
+  outgoing.clear();
+  return socket >= 0;
+}
+
+size_t WiFiUDP::write(const uint8_t* data, size_t length) {
+  length = std::min(length, MAX_DATAGRAM - outgoing.size());
+  outgoing.insert(outgoing.end(), data, data + length);
+  return length;
+}
+
+int WiFiUDP::endPacket() {
+  if (socket < 0) return 0;
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(toPort);
+  address.sin_addr.s_addr = htonl((uint32_t)to[0] << 24 | (uint32_t)to[1] << 16 | (uint32_t)to[2] << 8 | to[3]);
+  ssize_t sent = sendto(socket, outgoing.data(), outgoing.size(), 0, (sockaddr*)&address, sizeof(address));
+  return sent == (ssize_t)outgoing.size();
+}
+
+int WiFiUDP::parsePacket() {
+  incoming.resize(MAX_DATAGRAM);
+  readOffset = 0;
+  if (socket < 0) {
+    incoming.clear();
+    return 0;
+  }
+  sockaddr_in address = {};
+  socklen_t addressLength = sizeof(address);
+  ssize_t received = recvfrom(socket, incoming.data(), incoming.size(), 0, (sockaddr*)&address, &addressLength);
+  if (received <= 0) {
+    incoming.clear();
+    return 0;
+  }
+  incoming.resize(received);
+  uint32_t ip = ntohl(address.sin_addr.s_addr);
+  from = IPAddress(ip >> 24, ip >> 16, ip >> 8, ip);
+  fromPort = ntohs(address.sin_port);
+  return received;
+}
+
+int WiFiUDP::read(uint8_t* data, size_t length) {
+  length = std::min(length, incoming.size() - readOffset);
+  memcpy(data, incoming.data() + readOffset, length);
+  readOffset += length;
+  return length;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+// Host stand-in for WiFiUDP: a non-blocking UDP socket bound to the
+// loopback interface, so several native builds on one machine can talk to
+// each other the way kiosks do on a LAN (see bench/).
+
+#include <Arduino.h>
+#include <WiFi.h>
+
+#include <vector>
+
+class WiFiUDP {
+ public:
+  WiFiUDP() {}
+  WiFiUDP(const WiFiUDP&) = delete;
+  WiFiUDP& operator=(const WiFiUDP&) = delete;
+  ~WiFiUDP() { stop(); }
+
+  uint8_t begin(uint16_t port);  // 1 on success
+  void stop();
+
+  int beginPacket(IPAddress ip, uint16_t port);
+  size_t write(const uint8_t* data, size_t length);
+  int endPacket();  // 1 if the datagram was sent
+
+  // Receive the next datagram, if any; returns its size (0 = none)
+  int parsePacket();
+  int read(uint8_t* data, size_t length);
+  int read(char* data, size_t length) { return read((uint8_t*)data, length); }
+  IPAddress remoteIP() const { return from; }
+  uint16_t remotePort() const { return fromPort; }
+
+ private:
+  int socket = -1;
+  IPAddress to;
+  uint16_t toPort = 0;
+  std::vector<uint8_t> outgoing;
+  std::vector<uint8_t> incoming;
+  size_t readOffset = 0;
+  IPAddress from;
+  uint16_t fromPort = 0;
+};
@@ -0,0 +1,12 @@
+#pragma once
+
+// Host stand-in: the LCD stand-in needs no bus
+
+#include <Arduino.h>
+
+class TwoWire {
+ public:
+  bool begin(int = -1, int = -1) { return true; }
+};
+
+extern TwoWire Wire;
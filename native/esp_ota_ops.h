@@ -0,0 +1,8 @@
+#pragma once
+
+// Host stand-in for esp_ota_ops.h (see esp_partition.h)
+
+#include <esp_partition.h>
+
+// The app slot an OTA update would be written to: never the running one
+const esp_partition_t* esp_ota_get_next_update_partition(const esp_partition_t* start_from);
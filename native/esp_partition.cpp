@@ -0,0 +1,65 @@
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <SPIFFS.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+static const esp_partition_t APP1 = {0x150000, 0x140000, "app1"};
+
+// The slot's file, created erased the first time it is used
+static int openSlot() {
+  std::string path = SPIFFS.rootDirectory() + ".app1";
+  int file = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  struct stat info;
+  if (file >= 0 && fstat(file, &info) == 0 && info.st_size == 0) {
+    std::vector<uint8_t> erased(APP1.size, 0xFF);
+    if (pwrite(file, erased.data(), erased.size(), 0) != (ssize_t)erased.size()) {
+      close(file);
+      return -1;
+    }
+  }
+  return file;
+}
+
+const esp_partition_t* esp_ota_get_next_update_partition(const esp_partition_t*) {
+  return &APP1;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t* partition, size_t src_offset, void* dst, size_t size) {
+  if (src_offset + size > partition->size) return ESP_ERR_INVALID_SIZE;
+  int file = openSlot();
+  if (file < 0) return ESP_FAIL;
+  bool read = pread(file, dst, size, src_offset) == (ssize_t)size;
+  close(file);
+  return read ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t* partition, size_t dst_offset, const void* src, size_t size) {
+  if (dst_offset + size > partition->size) return ESP_ERR_INVALID_SIZE;
+  int file = openSlot();
+  if (file < 0) return ESP_FAIL;
+  std::vector<uint8_t> flash(size);
+  bool ok = pread(file, flash.data(), size, dst_offset) == (ssize_t)size;
+  const uint8_t* bytes = (const uint8_t*)src;
+  for (size_t i = 0; i < size; i++) flash[i] &= bytes[i];
+  ok = ok && pwrite(file, flash.data(), size, dst_offset) == (ssize_t)size;
+  close(file);
+  return ok ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t* partition, size_t offset, size_t size) {
+  if (offset % SPI_FLASH_SEC_SIZE || size % SPI_FLASH_SEC_SIZE || offset + size > partition->size) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  int file = openSlot();
+  if (file < 0) return ESP_FAIL;
+  std::vector<uint8_t> erased(size, 0xFF);
+  bool ok = pwrite(file, erased.data(), size, offset) == (ssize_t)size;
+  close(file);
+  return ok ? ESP_OK : ESP_FAIL;
+}
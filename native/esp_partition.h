@@ -0,0 +1,27 @@
+#pragma once
+
+// Host stand-in for the ESP-IDF partition API and the one OTA call the
+// firmware makes. The inactive OTA app slot is a file next to the data
+// partition's directory (SPIFFS.h's root plus ".app1"), as big as the
+// stock esp32dev app1, and follows NOR flash rules: erasing sets bytes to
+// 0xFF and writing only clears bits. A slot never written reads as erased.
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_INVALID_SIZE 0x104
+
+#define SPI_FLASH_SEC_SIZE 4096
+
+typedef struct {
+  uint32_t address;
+  uint32_t size;
+  char label[17];
+} esp_partition_t;
+
+esp_err_t esp_partition_read(const esp_partition_t* partition, size_t src_offset, void* dst, size_t size);
+esp_err_t esp_partition_write(const esp_partition_t* partition, size_t dst_offset, const void* src, size_t size);
+esp_err_t esp_partition_erase_range(const esp_partition_t* partition, size_t offset, size_t size);
@@ -0,0 +1,210 @@
+#include "mbedtls/md.h"
+#include "mbedtls/pkcs5.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+// SHA-256 (FIPS 180-4), small and portable rather than fast
+
+static const uint32_t ROUND_CONSTANTS[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t rotateRight(uint32_t value, int bits) {
+  return (value >> bits) | (value << (32 - bits));
+}
+
+class Sha256 {
+ public:
+  void update(const void* data, size_t length) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    total += length;
+    while (length > 0) {
+      size_t take = std::min(length, sizeof(block) - used);
+      memcpy(block + used, bytes, take);
+      used += take;
+      bytes += take;
+      length -= take;
+      if (used == sizeof(block)) {
+        compress();
+        used = 0;
+      }
+    }
+  }
+
+  void finish(uint8_t (&out)[32]) {
+    uint64_t bits = total * 8;
+    uint8_t pad = 0x80;
+    update(&pad, 1);
+    pad = 0;
+    while (used != 56) update(&pad, 1);
+    uint8_t length[8];
+    for (int i = 0; i < 8; i++) length[i] = (uint8_t)(bits >> (56 - 8 * i));
+    update(length, 8);
+    for (int i = 0; i < 8; i++) {
+      for (int j = 0; j < 4; j++) out[4 * i + j] = (uint8_t)(state[i] >> (24 - 8 * j));
+    }
+  }
+
+ private:
+  void compress() {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+      w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+             (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+      uint32_t s0 = rotateRight(w[i - 15], 7) ^ rotateRight(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = rotateRight(w[i - 2], 17) ^ rotateRight(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+      uint32_t t1 = h + (rotateRight(e, 6) ^ rotateRight(e, 11) ^ rotateRight(e, 25)) +
+                    ((e & f) ^ (~e & g)) + ROUND_CONSTANTS[i] + w[i];
+      uint32_t t2 = (rotateRight(a, 2) ^ rotateRight(a, 13) ^ rotateRight(a, 22)) +
+                    ((a & b) ^ (a & c) ^ (b & c));
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+  }
+
+  uint32_t state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                       0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+  uint8_t block[64];
+  size_t used = 0;
+  uint64_t total = 0;
+};
+
+// There is only the one digest; its info is just a non-null pointer
+struct mbedtls_md_info_t {
+  mbedtls_md_type_t type;
+};
+static const mbedtls_md_info_t SHA256_INFO = {MBEDTLS_MD_SHA256};
+
+const mbedtls_md_info_t* mbedtls_md_info_from_type(mbedtls_md_type_t md_type) {
+  return md_type == MBEDTLS_MD_SHA256 ? &SHA256_INFO : nullptr;
+}
+
+void mbedtls_md_init(mbedtls_md_context_t* ctx) {
+  ctx->md_info = nullptr;
+  ctx->md_ctx = nullptr;
+  ctx->hmac = 0;
+}
+
+void mbedtls_md_free(mbedtls_md_context_t* ctx) {
+  delete (Sha256*)ctx->md_ctx;
+  mbedtls_md_init(ctx);
+}
+
+int mbedtls_md_setup(mbedtls_md_context_t* ctx, const mbedtls_md_info_t* md_info, int hmac) {
+  if (!md_info) return -1;
+  ctx->md_info = md_info;
+  ctx->md_ctx = new Sha256();
+  ctx->hmac = hmac;
+  return 0;
+}
+
+int mbedtls_md_starts(mbedtls_md_context_t* ctx) {
+  *(Sha256*)ctx->md_ctx = Sha256();
+  return 0;
+}
+
+int mbedtls_md_update(mbedtls_md_context_t* ctx, const unsigned char* input, size_t ilen) {
+  ((Sha256*)ctx->md_ctx)->update(input, ilen);
+  return 0;
+}
+
+int mbedtls_md_finish(mbedtls_md_context_t* ctx, unsigned char* output) {
+  ((Sha256*)ctx->md_ctx)->finish(*(uint8_t(*)[32])output);
+  return 0;
+}
+
+// HMAC-SHA256 with the key's inner and outer pads hashed once up front,
+// as mbedtls does, so each PBKDF2 iteration costs two compressions
+class HmacSha256 {
+ public:
+  explicit HmacSha256(const uint8_t* key, size_t length) {
+    uint8_t block[64] = {};
+    if (length > sizeof(block)) {
+      Sha256 keyHash;
+      keyHash.update(key, length);
+      keyHash.finish(*(uint8_t(*)[32])block);
+    } else {
+      memcpy(block, key, length);
+    }
+    uint8_t pad[64];
+    for (size_t i = 0; i < sizeof(pad); i++) pad[i] = block[i] ^ 0x36;
+    inner.update(pad, sizeof(pad));
+    for (size_t i = 0; i < sizeof(pad); i++) pad[i] = block[i] ^ 0x5c;
+    outer.update(pad, sizeof(pad));
+  }
+
+  void mac(const uint8_t* first, size_t firstLength, const uint8_t* second, size_t secondLength,
+           uint8_t (&out)[32]) const {
+    Sha256 sha = inner;
+    sha.update(first, firstLength);
+    sha.update(second, secondLength);
+    sha.finish(out);
+    sha = outer;
+    sha.update(out, sizeof(out));
+    sha.finish(out);
+  }
+
+ private:
+  Sha256 inner;
+  Sha256 outer;
+};
+
+int mbedtls_md_hmac(const mbedtls_md_info_t* md_info, const unsigned char* key, size_t keylen,
+                    const unsigned char* input, size_t ilen, unsigned char* output) {
+  if (!md_info) return -1;
+  HmacSha256(key, keylen).mac(input, ilen, nullptr, 0, *(uint8_t(*)[32])output);
+  return 0;
+}
+
+int mbedtls_pkcs5_pbkdf2_hmac(mbedtls_md_context_t* ctx, const unsigned char* password, size_t plen,
+                              const unsigned char* salt, size_t slen, unsigned int iteration_count,
+                              uint32_t key_length, unsigned char* output) {
+  if (!ctx->md_info || !ctx->hmac || iteration_count == 0) return -1;
+  HmacSha256 hmac(password, plen);
+  for (uint32_t block = 1; key_length > 0; block++) {
+    uint8_t index[4] = {(uint8_t)(block >> 24), (uint8_t)(block >> 16), (uint8_t)(block >> 8), (uint8_t)block};
+    uint8_t u[32];
+    uint8_t t[32];
+    hmac.mac(salt, slen, index, sizeof(index), u);
+    memcpy(t, u, sizeof(t));
+    for (unsigned int i = 1; i < iteration_count; i++) {
+      hmac.mac(u, sizeof(u), nullptr, 0, u);
+      for (size_t j = 0; j < sizeof(t); j++) t[j] ^= u[j];
+    }
+    size_t take = std::min<size_t>(key_length, sizeof(t));
+    memcpy(output, t, take);
+    output += take;
+    key_length -= take;
+  }
+  return 0;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+// Host stand-in for mbedtls's PBKDF2 (RFC 8018), HMAC-SHA256 only
+
+#include <mbedtls/md.h>
+
+int mbedtls_pkcs5_pbkdf2_hmac(mbedtls_md_context_t* ctx, const unsigned char* password, size_t plen,
+                              const unsigned char* salt, size_t slen, unsigned int iteration_count,
+                              uint32_t key_length, unsigned char* output);
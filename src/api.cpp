@@ -0,0 +1,1153 @@
+#include "api.h"
+
+#include <ArduinoJson.h>
+#include <algorithm>
+#include "bulk.h"            // Streamed CSV/NDJSON import and export
+#include "catalog.h"         // In-RAM books/users with hash indexes
+#include "chunked.h"         // Streams large responses in fixed-size chunks
+#include "clock.h"           // Wall clock borrowed from the browsers
+#include "events.h"          // Scan events pushed to the browsers
+#include "history.h"         // Append-only lending history behind /api/history
+#include "metrics.h"         // Per-route latency, scan and resource counters
+#include "replication.h"     // Catalog changes shared with the other kiosks
+#include "session.h"         // Login tokens for the endpoints that change things
+#include "store.h"           // Snapshots + write-ahead journal behind the catalog
+
+const int LOAN_DAYS = 14;  // Standard loan period
+
+HttpServer server(80);  // Web server on standard HTTP port
+
+// Card tracking variables (HTTP side - filled from the reader task's events)
+CardUid currentCard;                  // Most recently scanned card, empty if none
+unsigned long lastCardTime = 0;       // When the card was last scanned
+char cardNonce[SessionCache::TOKEN_LENGTH + 1] = "";  // Sent to the kiosk screen with a normal-mode read
+const unsigned long CARD_RESET_TIME = 10000; // Clear card data after 10 seconds of inactivity
+
+// Batch scanning (HTTP side): the distinct cards reported since
+// /api/mode?mode=batch. They are kept until committed or cancelled, even
+// after the reader stops waiting for more.
+CardBatch batchCards;
+bool batchOpen = false;   // The reader is still adding cards
+
+LoopStats loopStats;    // HTTP loop
+uint32_t cardsDelivered = 0;  // Card reads taken off the ring by the HTTP loop
+
+// The account a session token belongs to, or null
+static User* sessionUser(const char* token) {
+  const char* userId = sessions.check(token, millis());
+  return userId ? catalog.findUserById(userId) : nullptr;
+}
+
+// Event stream of card scans (Server-Sent Events). The cursor comes from
+// Last-Event-ID on reconnect or ?since= when a page first opens. An
+// EventSource can't send headers, so the session goes as ?token= and the
+// kiosk screen's key as ?kiosk=.
+void handleEvents() {
+  String cursor = server.hasHeader("Last-Event-ID") ? server.header("Last-Event-ID") : server.arg("since");
+  ScanEvents::Audience audience = kioskKey.check(server.arg("kiosk").c_str())  ? ScanEvents::KIOSK_SCREEN
+                                  : sessionUser(server.arg("token").c_str()) ? ScanEvents::SIGNED_IN
+                                                                               : ScanEvents::ANYONE;
+  scanEvents.subscribe(server.client(), strtoul(cursor.c_str(), nullptr, 10), audience);
+}
+
+// One-off query for the last scanned card UID (the event stream is the live feed)
+void handleScan() {
+  // Check if card UID has expired - security feature
+  if (millis() - lastCardTime > CARD_RESET_TIME) {
+    currentCard = CardUid();  // Clear old card data after timeout
+  }
+  
+  // Only return card data if we have a recent scan, and the UID only to a
+  // signed-in page. Formatted on the stack like the scan events themselves.
+  String header = server.header("Authorization");
+  bool signedIn = header.startsWith("Bearer ") && sessionUser(header.c_str() + 7);
+  char response[96];
+  int length = snprintf(response, sizeof(response), "{\"uid\":\"%s\", \"timestamp\":%lu, \"seq\":%lu}",
+                        signedIn ? currentCard.hex().text : "", currentCard.empty() ? 0UL : lastCardTime,
+                        (unsigned long)scanEvents.lastSeq());
+  server.send_P(200, "application/json", response, length);
+}
+
+// API endpoint to clear the card UID - useful after processing a transaction
+void handleClearCard() {
+  currentCard = CardUid();
+  server.send(200, "text/plain", "Card cleared");
+}
+
+// API endpoint to set the RFID scan mode from the web interface
+void handleMode() {
+  if (server.hasArg("mode")) {
+    String mode = server.arg("mode");
+    // The reader task applies the mode; registration modes also start a
+    // scan window immediately. Any mode but batch closes an open batch.
+    batchOpen = false;
+    if (mode == "batch") {
+      // Reads every tag in the field until /api/batch/commit or /cancel
+      batchCards.clear();
+      batchOpen = true;
+      readerCommands.push({BATCH, true});
+      server.send(200, "text/plain", "Mode set to batch");
+    } else if (mode == "user") {
+      readerCommands.push({NEW_USER, true});
+      server.send(200, "text/plain", "Mode set to new user");
+    } else if (mode == "book") {
+      readerCommands.push({NEW_BOOK, true});
+      server.send(200, "text/plain", "Mode set to new book");
+    } else {
+      readerCommands.push({NORMAL, false});
+      server.send(200, "text/plain", "Mode set to normal");
+    }
+  } else {
+    server.send(400, "text/plain", "Missing mode parameter");
+  }
+}
+
+// Numeric query parameter, or the fallback when absent or malformed
+size_t sizeArg(const char* name, size_t fallback) {
+  if (!server.hasArg(name)) return fallback;
+  String value = server.arg(name);
+  char* end;
+  unsigned long parsed = strtoul(value.c_str(), &end, 10);
+  return (value.length() > 0 && *end == '\0') ? parsed : fallback;
+}
+
+// Conditional GET for a collection read: the ETag is the collection's
+// version, so the browser revalidates every time (no-cache) and gets a 304
+// without a body while nothing has changed. Returns true if the 304 was sent.
+bool sendNotModified(char collection, uint32_t version) {
+  char etag[16];
+  snprintf(etag, sizeof(etag), "\"%c%lu\"", collection, (unsigned long)version);
+  server.sendHeader("Cache-Control", "no-cache");
+  server.sendHeader("ETag", etag);
+  if (server.header("If-None-Match") != etag) return false;
+  server.send(304);
+  return true;
+}
+
+// ?since=<version>: only what changed after a version the client already has
+void readSince(bool& delta, uint32_t& since) {
+  delta = server.hasArg("since");
+  since = sizeArg("since", 0);
+}
+
+// API endpoint to get the list of registered users
+void handleGetUsers() {
+  // Served from RAM - the users snapshot alone is stale once the journal has entries.
+  // Optional: offset, limit, type=student|staff, since=<version>
+  UserQuery query;
+  query.offset = sizeArg("offset", 0);
+  query.limit = sizeArg("limit", SIZE_MAX);
+  query.type = server.arg("type");
+  readSince(query.delta, query.since);
+  if (sendNotModified('u', catalog.usersVersion())) return;
+
+  ChunkedResponse response(server, 200, "application/json");
+  catalog.writeUsers(response, query);
+  response.end();
+}
+
+// API endpoint to get the list of library books
+void handleGetBooks() {
+  // Served from RAM - the books snapshot alone is stale once the journal has entries.
+  // Optional: offset, limit, borrowed=true|false, floor, borrowedBy,
+  // fields=id,title,... (projection), exclude=cardUid,... and since=<version>
+  BookQuery query;
+  query.offset = sizeArg("offset", 0);
+  query.limit = sizeArg("limit", SIZE_MAX);
+  if (server.hasArg("borrowed")) query.borrowed = server.arg("borrowed") == "true" ? 1 : 0;
+  query.floor = server.arg("floor");
+  query.borrowedBy = server.arg("borrowedBy");
+  if (server.hasArg("fields")) query.fields = parseBookFields(server.arg("fields").c_str());
+  if (server.hasArg("exclude")) query.fields &= ~parseBookFields(server.arg("exclude").c_str());
+  readSince(query.delta, query.since);
+  if (sendNotModified('b', catalog.booksVersion())) return;
+
+  ChunkedResponse response(server, 200, "application/json");
+  catalog.writeBooks(response, query);
+  response.end();
+}
+
+// API endpoint for ranked search: every word of ?q= must start a word of
+// the title, author, isbn, shelf or floor. Paged, filtered and projected
+// like /api/books (offset, limit - 20 by default - borrowed, floor, fields,
+// exclude).
+void handleSearch() {
+  if (!server.hasArg("q")) {
+    server.send(400, "text/plain", "Missing q parameter");
+    return;
+  }
+  BookQuery query;
+  query.offset = sizeArg("offset", 0);
+  query.limit = sizeArg("limit", 20);
+  if (server.hasArg("borrowed")) query.borrowed = server.arg("borrowed") == "true" ? 1 : 0;
+  query.floor = server.arg("floor");
+  if (server.hasArg("fields")) query.fields = parseBookFields(server.arg("fields").c_str());
+  if (server.hasArg("exclude")) query.fields &= ~parseBookFields(server.arg("exclude").c_str());
+  if (sendNotModified('b', catalog.booksVersion())) return;
+
+  ChunkedResponse response(server, 200, "application/json");
+  catalog.writeSearch(response, server.arg("q").c_str(), query);
+  response.end();
+}
+
+// API endpoint to check if a specific book is currently borrowed
+void handleCheckBorrowed() {
+  if (server.hasArg("id")) {
+    // Indexed lookup in the resident catalog - no file read or JSON parse
+    Book* book = catalog.findBookById(server.arg("id").c_str());
+    bool borrowed = book != nullptr && book->borrowed;
+    
+    server.send(200, "application/json", borrowed ? "{\"borrowed\":true}" : "{\"borrowed\":false}");
+  } else {
+    server.send(400, "text/plain", "Missing id parameter");
+  }
+}
+
+// API endpoint to look up a single user or book by one of its keys.
+// ?uid= checks user cards first, then book cards; ?id=, ?isbn=, ?studentId=
+// and ?username= hit the matching index directly.
+void handleLookup() {
+  User* user = nullptr;
+  Book* book = nullptr;
+  
+  if (server.hasArg("uid")) {
+    CardUid uid = CardUid::fromHex(server.arg("uid").c_str());
+    user = catalog.findUserByCard(uid);
+    if (!user) book = catalog.findBookByCard(uid);
+  } else if (server.hasArg("id")) {
+    book = catalog.findBookById(server.arg("id").c_str());
+  } else if (server.hasArg("isbn")) {
+    book = catalog.findBookByIsbn(server.arg("isbn").c_str());
+  } else if (server.hasArg("studentId")) {
+    user = catalog.findUserByStudentId(server.arg("studentId").c_str());
+  } else if (server.hasArg("username")) {
+    user = catalog.findUserByUsername(server.arg("username").c_str());
+  } else {
+    server.send(400, "text/plain", "Missing lookup parameter");
+    return;
+  }
+  
+  if (!user && !book) {
+    server.send(200, "application/json", "{\"found\":false}");
+    return;
+  }
+  // Streamed like /api/books, so the record is never built up in a String
+  ChunkedResponse response(server, 200, "application/json");
+  DynamicJsonDocument doc(4096);
+  if (user) {
+    response.print("{\"found\":true,\"kind\":\"user\",\"user\":");
+    userToJson(*user, doc.to<JsonObject>(), false);  // Never hand out passwords
+  } else {
+    response.print("{\"found\":true,\"kind\":\"book\",\"book\":");
+    bookToJson(*book, doc.to<JsonObject>());
+  }
+  serializeJson(doc, response);
+  response.print('}');
+  response.end();
+}
+
+// HTTP status for a rejected commit
+int txStatusCode(TxResult result) {
+  switch (result) {
+    case TX_OK: return 200;
+    case TX_NOT_FOUND: return 404;
+    case TX_CONFLICT: return 409;
+    case TX_INVALID: return 400;
+    default: return 500;
+  }
+}
+
+// Send a small JSON result for the transaction endpoints
+void sendTxResult(int code, const char* error, const Book* book) {
+  DynamicJsonDocument doc(4096);
+  doc["ok"] = error == nullptr;
+  if (error) doc["error"] = error;
+  if (book) bookToJson(*book, doc.createNestedObject("book"));
+  
+  String response;
+  serializeJson(doc, response);
+  server.send(code, "application/json", response);
+}
+
+// Who may call an endpoint that changes something
+enum Access { SIGNED_IN, STAFF_ONLY };
+
+// The ID an account logs in with
+const char* accountId(const User& user) {
+  return user.studentId.length() > 0 ? user.studentId.c_str() : user.username.c_str();
+}
+
+// The account behind the request's "Authorization: Bearer <token>". The
+// account is looked up again each time, so a removed account or a changed
+// role counts at once. Returns null after answering 401 (no session) or
+// 403 (not staff).
+User* authorize(Access access) {
+  String header = server.header("Authorization");
+  User* user = header.startsWith("Bearer ") ? sessionUser(header.c_str() + 7) : nullptr;
+  if (!user) {
+    server.sendHeader("WWW-Authenticate", "Bearer");
+    sendTxResult(401, "Please log in again", nullptr);
+    return nullptr;
+  }
+  if (access == STAFF_ONLY && user->type != "staff") {
+    sendTxResult(403, "Only staff can do this", nullptr);
+    return nullptr;
+  }
+  return user;
+}
+
+// authorize() for acting on `userId`'s loans: students only for themselves
+User* authorizeFor(const String& userId) {
+  User* caller = authorize(SIGNED_IN);
+  if (caller && caller->type != "staff" && userId != accountId(*caller)) {
+    sendTxResult(403, "You can only borrow and return your own books", nullptr);
+    return nullptr;
+  }
+  return caller;
+}
+
+// A UID is no secret, so only the nonce the kiosk screen got with a read
+// stands for the card on the reader, and only until it is used
+static bool onReader(const String& nonce) {
+  return !currentCard.empty() && cardNonce[0] && tokensMatch(nonce.c_str(), cardNonce) &&
+         millis() - lastCardTime <= CARD_RESET_TIME;
+}
+
+static void forgetCard() {
+  currentCard = CardUid();
+  cardNonce[0] = '\0';
+}
+
+// Replace an outdated hash (see PasswordHash) now that the password is at
+// hand. The login goes ahead if this fails; the next one tries again.
+static void upgradePassword(const User& user, const char* password) {
+  DynamicJsonDocument entry(512);
+  entry["op"] = "setPassword";
+  entry["user"] = String(accountId(user));
+  entry["passwordHash"] = PasswordHash::of(password).encode();
+  if (store.commit(entry) != TX_OK) Serial.println("Kept the outdated password hash of " + String(accountId(user)));
+}
+
+// API endpoint to log in: ?user= (student ID or staff username, narrowed by
+// ?type= if given) and ?password=, or ?nonce= from the kiosk screen's scan
+// event for the card just read. Staff cards don't log in - a staff session
+// always takes the password. One index lookup and one hash; answers
+// {"ok":true,"token":...,"expiresIn":seconds,"user":{...}}, and the token
+// goes in an "Authorization: Bearer" header from then on.
+void handleLogin() {
+  User* user = nullptr;
+  if (server.hasArg("nonce")) {
+    if (onReader(server.arg("nonce"))) {
+      user = catalog.findUserByCard(currentCard);
+      forgetCard();
+    }
+    if (user && user->type == "staff") {
+      sendTxResult(403, "Staff log in with a password", nullptr);
+      return;
+    }
+  } else if (server.hasArg("user") && server.hasArg("password")) {
+    String userId = server.arg("user");
+    String type = server.arg("type");
+    user = type == "staff"     ? catalog.findUserByUsername(userId.c_str())
+           : type == "student" ? catalog.findUserByStudentId(userId.c_str())
+                               : catalog.findUserById(userId.c_str());
+    if (user && !user->password.matches(server.arg("password").c_str())) user = nullptr;
+    if (user && user->password.outdated()) upgradePassword(*user, server.arg("password").c_str());
+  } else {
+    sendTxResult(400, "Missing user and password, or nonce parameter", nullptr);
+    return;
+  }
+  if (!user) {
+    sendTxResult(401, server.hasArg("nonce") ? "Card not recognised" : "Invalid username, password, or user type",
+                 nullptr);
+    return;
+  }
+  
+  char token[SessionCache::TOKEN_LENGTH + 1];
+  if (!sessions.open(accountId(*user), millis(), token)) {
+    sendTxResult(500, "Account ID too long for a session", nullptr);
+    return;
+  }
+  DynamicJsonDocument doc(768);
+  doc["ok"] = true;
+  doc["token"] = token;
+  doc["expiresIn"] = SessionCache::IDLE_MILLIS / 1000;
+  userToJson(*user, doc.createNestedObject("user"), false);
+  String response;
+  serializeJson(doc, response);
+  server.send(200, "application/json", response);
+}
+
+// Make the browser asking the kiosk's own screen (see KioskKey); answers
+// {"ok":true,"key":...} for it to open the event stream with. Staff only.
+void handleKioskPair() {
+  if (!authorize(STAFF_ONLY)) return;
+  char key[SessionCache::TOKEN_LENGTH + 1];
+  if (!kioskKey.pair(key)) {
+    sendTxResult(500, "Failed to save the kiosk key", nullptr);
+    return;
+  }
+  char response[64];
+  int length = snprintf(response, sizeof(response), "{\"ok\":true,\"key\":\"%s\"}", key);
+  server.send_P(200, "application/json", response, length);
+}
+
+// API endpoint to end the request's session
+void handleLogout() {
+  String header = server.header("Authorization");
+  if (header.startsWith("Bearer ")) sessions.close(header.c_str() + 7);
+  sendTxResult(200, nullptr, nullptr);
+}
+
+// Find the book a transaction refers to - by RFID card or by book ID
+Book* findTxBook() {
+  if (server.hasArg("card")) return catalog.findBookByCard(CardUid::fromHex(server.arg("card").c_str()));
+  if (server.hasArg("id")) return catalog.findBookById(server.arg("id").c_str());
+  return nullptr;
+}
+
+// Parse a JSON request parameter, timed for /api/metrics
+bool parseRequestJson(JsonDocument& doc, const String& json) {
+  unsigned long start = micros();
+  DeserializationError error = deserializeJson(doc, json);
+  metrics.recordJsonParse(micros() - start);
+  return !error;
+}
+
+// Browsers send their clock (?ts= Unix seconds) since we have no NTP
+bool syncClockFromRequest() {
+  if (server.hasArg("ts")) {
+    clockSync((time_t)atol(server.arg("ts").c_str()));
+  }
+  return clockValid();
+}
+
+// API endpoint for overdue loans, oldest first, with the penalty owed.
+// Optional: user (only theirs, with their totals), offset, limit, ts.
+// Served from the loan schedule, so only overdue loans are looked at.
+void handleOverdue() {
+  if (!syncClockFromRequest()) {
+    server.send(400, "text/plain", "Clock not set - missing ts parameter");
+    return;
+  }
+  OverdueQuery query;
+  query.offset = sizeArg("offset", 0);
+  query.limit = sizeArg("limit", SIZE_MAX);
+  query.user = server.arg("user");
+
+  ChunkedResponse response(server, 200, "application/json");
+  catalog.writeOverdue(response, clockNow(), query);
+  response.end();
+}
+
+// API endpoint for lending history from the history log: ?user= and/or
+// ?book=, newest first, paged with offset and limit (50 by default, at most
+// MAX_HISTORY_PAGE - each page is held in RAM while it is written)
+const size_t MAX_HISTORY_PAGE = 200;
+
+void handleHistory() {
+  HistoryQuery query;
+  query.user = server.arg("user");
+  query.book = server.arg("book");
+  if (query.user.length() == 0 && query.book.length() == 0) {
+    server.send(400, "text/plain", "Missing user or book parameter");
+    return;
+  }
+  query.offset = sizeArg("offset", 0);
+  query.limit = std::min(sizeArg("limit", query.limit), MAX_HISTORY_PAGE);
+
+  ChunkedResponse response(server, 200, "application/json");
+  catalog.writeHistory(response, query);
+  response.end();
+}
+
+// API endpoint listing the history segments, oldest first - sealed ones
+// can be downloaded and then archived
+void handleHistorySegments() {
+  ChunkedResponse response(server, 200, "application/json");
+  response.print("{\"segments\":[");
+  const std::vector<HistorySegment>& segments = loanHistory.segments();
+  for (size_t i = 0; i < segments.size(); i++) {
+    if (i > 0) response.print(',');
+    response.printf("{\"id\":%lu,\"records\":%lu,\"bytes\":%lu,\"sealed\":%s}",
+                    (unsigned long)segments[i].id, (unsigned long)segments[i].records,
+                    (unsigned long)(segments[i].records * sizeof(HistoryRecord)),
+                    segments[i].sealed ? "true" : "false");
+  }
+  response.printf("],\"records\":%lu,\"lastSeq\":%lu,\"appendFailures\":%lu}",
+                  (unsigned long)loanHistory.recordCount(), (unsigned long)loanHistory.lastSeq(),
+                  (unsigned long)loanHistory.appendFailures());
+  response.end();
+}
+
+// API endpoint to download one segment as it is on flash (48-byte records,
+// see history.h; tools/catalog.py history turns it into JSON)
+void handleHistorySegment() {
+  String path = loanHistory.segmentPath(sizeArg("id", 0));
+  File file = path.length() > 0 ? openFile(path, "r") : File();
+  if (!file) {
+    server.send(404, "text/plain", "No such history segment");
+    return;
+  }
+  server.streamFile(file, "application/octet-stream");
+  file.close();
+}
+
+// API endpoint to delete sealed segments up to ?through=<id> once they have
+// been downloaded
+void handleHistoryArchive() {
+  if (!authorize(STAFF_ONLY)) return;
+  if (!server.hasArg("through")) {
+    server.send(400, "text/plain", "Missing through parameter");
+    return;
+  }
+  size_t removed = loanHistory.archive(sizeArg("through", 0));
+  server.send(200, "text/plain", "Archived " + String((unsigned long)removed) + " history segments");
+}
+
+// API endpoint to borrow one book: validates, updates the record in place and
+// appends just this change to the journal
+void handleBorrow() {
+  if ((!server.hasArg("card") && !server.hasArg("id")) || !server.hasArg("user")) {
+    sendTxResult(400, "Missing card/id or user parameter", nullptr);
+    return;
+  }
+  if (!authorizeFor(server.arg("user"))) return;
+  if (!syncClockFromRequest()) {
+    sendTxResult(400, "Clock not set - missing ts parameter", nullptr);
+    return;
+  }
+  
+  Book* book = findTxBook();
+  if (!book) {
+    sendTxResult(404, "This card is not registered to any book", nullptr);
+    return;
+  }
+  
+  String userId = server.arg("user");
+  if (!catalog.findUserByStudentId(userId.c_str()) && !catalog.findUserByUsername(userId.c_str())) {
+    sendTxResult(404, "Unknown user", nullptr);
+    return;
+  }
+  if (book->borrowed) {
+    sendTxResult(409, "This book has already been borrowed", book);
+    return;
+  }
+  
+  time_t now = clockNow();
+  DynamicJsonDocument entry(512);
+  entry["op"] = "borrow";
+  entry["book"] = book->id;
+  entry["user"] = userId;
+  entry["borrowDate"] = formatIsoTime(now);
+  entry["returnDate"] = formatIsoTime(now + LOAN_DAYS * 86400L);
+  
+  TxResult result = store.commit(entry);
+  if (result != TX_OK) {
+    sendTxResult(txStatusCode(result), "Failed to save transaction", nullptr);
+    return;
+  }
+  Serial.println("Borrowed " + book->id + " by " + userId);
+  sendTxResult(200, nullptr, book);
+}
+
+// API endpoint to return one book. If ?user= is given, only that borrower
+// may return it; the return desk leaves it out.
+void handleReturn() {
+  if (!server.hasArg("card") && !server.hasArg("id") && !server.hasArg("nonce")) {
+    sendTxResult(400, "Missing card, id or nonce parameter", nullptr);
+    return;
+  }
+  // A book on the reader can be returned without logging in - that's the
+  // return desk, with the nonce from the kiosk screen. Anything else is
+  // done as someone.
+  bool atDesk = !server.hasArg("user") && onReader(server.arg("nonce"));
+  if (server.hasArg("user") ? !authorizeFor(server.arg("user")) : !atDesk && !authorize(STAFF_ONLY)) {
+    return;
+  }
+  if (!syncClockFromRequest()) {
+    sendTxResult(400, "Clock not set - missing ts parameter", nullptr);
+    return;
+  }
+  
+  Book* book = atDesk ? catalog.findBookByCard(currentCard) : findTxBook();
+  if (!book) {
+    sendTxResult(404, "This card is not registered to any book", nullptr);
+    return;
+  }
+  if (!book->borrowed) {
+    sendTxResult(409, "This book is not currently borrowed", book);
+    return;
+  }
+  
+  String userId = server.arg("user");  // Empty when not given
+  if (userId.length() > 0 && book->borrowedBy != userId) {
+    sendTxResult(403, "You can only return books that you have borrowed", book);
+    return;
+  }
+  
+  DynamicJsonDocument entry(512);
+  entry["op"] = "return";
+  entry["book"] = book->id;
+  entry["user"] = userId;
+  entry["returnedAt"] = formatIsoTime(clockNow());
+  
+  TxResult result = store.commit(entry);
+  if (result != TX_OK) {
+    sendTxResult(txStatusCode(result), "Failed to save transaction", nullptr);
+    return;
+  }
+  if (atDesk) forgetCard();
+  Serial.println("Returned " + book->id);
+  sendTxResult(200, nullptr, book);
+}
+
+// Cards collected by the current batch, each with the book it belongs to
+// (null for a card that isn't a book's, e.g. the borrower's own card)
+void handleBatch() {
+  DynamicJsonDocument doc(6144);
+  doc["open"] = batchOpen;
+  doc["count"] = batchCards.size();
+  JsonArray cards = doc.createNestedArray("cards");
+  for (size_t i = 0; i < batchCards.size(); i++) {
+    JsonObject card = cards.createNestedObject();
+    card["uid"] = batchCards[i].hex().text;
+    Book* book = catalog.findBookByCard(batchCards[i]);
+    if (book) {
+      bookToJson(*book, card.createNestedObject("book"), BOOK_ID | BOOK_TITLE | BOOK_BORROWED | BOOK_BORROWED_BY);
+    } else {
+      card["book"] = nullptr;
+    }
+  }
+  
+  String response;
+  serializeJson(doc, response);
+  server.send(200, "application/json", response);
+}
+
+// End the batch on both sides
+void closeBatch() {
+  batchCards.clear();
+  batchOpen = false;
+  readerCommands.push({NORMAL, false});
+}
+
+// API endpoint to check out (?op=borrow&user=) or return (?op=return) every
+// book in the batch as one journal entry. Cards that aren't books' are
+// skipped; if any book can't go (already out, or not out), none do.
+void handleBatchCommit() {
+  String op = server.arg("op");
+  bool borrowing = op == "borrow";
+  if (!borrowing && op != "return") {
+    sendTxResult(400, "Missing or invalid op parameter", nullptr);
+    return;
+  }
+  // Like single returns, a stack on the reader goes back without a login
+  if ((borrowing || server.hasArg("user")) && !authorizeFor(server.arg("user"))) return;
+  if (!syncClockFromRequest()) {
+    sendTxResult(400, "Clock not set - missing ts parameter", nullptr);
+    return;
+  }
+  
+  String userId = server.arg("user");  // Required to borrow, optional to return
+  if (borrowing && !catalog.findUserById(userId.c_str())) {
+    sendTxResult(userId.length() == 0 ? 400 : 404, "Unknown user", nullptr);
+    return;
+  }
+  
+  // Resolve the cards first so a conflict can be reported book by book
+  auto ready = [&](const Book* book) {
+    return borrowing ? !book->borrowed
+                     : book->borrowed && (userId.length() == 0 || book->borrowedBy == userId);
+  };
+  const Book* books[BATCH_MAX_CARDS];
+  size_t count = 0;
+  size_t skipped = 0;
+  size_t conflicts = 0;
+  for (size_t i = 0; i < batchCards.size(); i++) {
+    Book* book = catalog.findBookByCard(batchCards[i]);
+    if (!book) {
+      skipped++;
+      continue;
+    }
+    if (!ready(book)) conflicts++;
+    books[count++] = book;
+  }
+  if (count == 0) {
+    sendTxResult(400, "No book cards in the batch", nullptr);
+    return;
+  }
+  
+  DynamicJsonDocument doc(6144);
+  if (conflicts > 0) {
+    doc["ok"] = false;
+    doc["error"] = borrowing ? "Some books are already borrowed" : "Some books are not borrowed by this user";
+    JsonArray list = doc.createNestedArray("conflicts");
+    for (size_t i = 0; i < count; i++) {
+      if (!ready(books[i])) bookToJson(*books[i], list.createNestedObject(), BOOK_ID | BOOK_TITLE | BOOK_BORROWED_BY);
+    }
+    String response;
+    serializeJson(doc, response);
+    server.send(409, "application/json", response);
+    return;
+  }
+  
+  // Book IDs are short, so even a full batch stays well inside a journal line
+  time_t now = clockNow();
+  DynamicJsonDocument entry(2048);
+  entry["op"] = borrowing ? "borrowMany" : "returnMany";
+  JsonArray ids = entry.createNestedArray("books");
+  for (size_t i = 0; i < count; i++) ids.add(books[i]->id.c_str());
+  entry["user"] = userId;
+  if (borrowing) {
+    entry["borrowDate"] = formatIsoTime(now);
+    entry["returnDate"] = formatIsoTime(now + LOAN_DAYS * 86400L);
+  } else {
+    entry["returnedAt"] = formatIsoTime(now);
+  }
+  
+  TxResult result = store.commit(entry);
+  if (result != TX_OK) {
+    sendTxResult(txStatusCode(result), "Failed to save transaction", nullptr);
+    return;
+  }
+  Serial.println("Batch " + op + " of " + String((unsigned long)count) + " books");
+  closeBatch();
+  
+  doc["ok"] = true;
+  doc["count"] = count;
+  doc["skipped"] = skipped;
+  JsonArray list = doc.createNestedArray("books");
+  for (size_t i = 0; i < count; i++) {
+    bookToJson(*books[i], list.createNestedObject(), BOOK_ID | BOOK_TITLE | BOOK_BORROWED | BOOK_RETURN_DATE);
+  }
+  String response;
+  serializeJson(doc, response);
+  server.send(200, "application/json", response);
+}
+
+// API endpoint to drop the batch without changing anything
+void handleBatchCancel() {
+  closeBatch();
+  server.send(200, "text/plain", "Batch cancelled");
+}
+
+// API endpoint to replace the whole users database (legacy bulk upload)
+void handleUpdateUsers() {
+  if (!authorize(STAFF_ONLY)) return;
+  if (server.hasArg("data")) {
+    if (store.replaceUsers(server.arg("data"))) {
+      server.send(200, "text/plain", "Users data updated successfully");
+    } else {
+      server.send(500, "text/plain", "Failed to update users data");
+    }
+  } else {
+    server.send(400, "text/plain", "Missing data parameter");
+  }
+}
+
+// API endpoint to replace the whole books database (legacy bulk upload)
+void handleUpdateBooks() {
+  if (!authorize(STAFF_ONLY)) return;
+  if (server.hasArg("data")) {
+    if (store.replaceBooks(server.arg("data"))) {
+      server.send(200, "text/plain", "Books data updated successfully");
+    } else {
+      server.send(500, "text/plain", "Failed to update books data");
+    }
+  } else {
+    server.send(400, "text/plain", "Missing data parameter");
+  }
+}
+
+// API endpoint to add one book ({"id":..., "title":..., ...} in ?data=)
+void handleAddBook() {
+  if (!authorize(STAFF_ONLY)) return;
+  DynamicJsonDocument entry(1024);
+  entry["op"] = "addBook";
+  JsonObject record = entry.createNestedObject("record");
+  
+  DynamicJsonDocument input(768);
+  if (!server.hasArg("data") || !parseRequestJson(input, server.arg("data"))) {
+    sendTxResult(400, "Missing or invalid data parameter", nullptr);
+    return;
+  }
+  Book book;
+  bookFromJson(input.as<JsonObject>(), book);
+  book.borrowed = false;  // New books always start on the shelf
+  bookToJson(book, record);
+  
+  TxResult result = store.commit(entry);
+  if (result == TX_CONFLICT) {
+    sendTxResult(409, catalog.findBookById(book.id.c_str())
+                      ? "A book with this ID already exists"
+                      : "This card is already registered", nullptr);
+    return;
+  }
+  if (result != TX_OK) {
+    sendTxResult(txStatusCode(result), "Failed to add book", nullptr);
+    return;
+  }
+  sendTxResult(200, nullptr, catalog.findBookById(book.id.c_str()));
+}
+
+// API endpoint to delete one book by ID
+void handleRemoveBook() {
+  if (!authorize(STAFF_ONLY)) return;
+  if (!server.hasArg("id")) {
+    sendTxResult(400, "Missing id parameter", nullptr);
+    return;
+  }
+  DynamicJsonDocument entry(512);
+  entry["op"] = "removeBook";
+  entry["book"] = server.arg("id");
+  
+  TxResult result = store.commit(entry);
+  if (result == TX_CONFLICT) {
+    sendTxResult(409, "This book cannot be deleted because it is currently borrowed", nullptr);
+  } else if (result != TX_OK) {
+    sendTxResult(txStatusCode(result), "Failed to delete book", nullptr);
+  } else {
+    sendTxResult(200, nullptr, nullptr);
+  }
+}
+
+// API endpoint to add one account ({"type":..., "studentId"/"username":..., ...} in ?data=)
+void handleAddUser() {
+  if (!authorize(STAFF_ONLY)) return;
+  DynamicJsonDocument input(512);
+  if (!server.hasArg("data") || !parseRequestJson(input, server.arg("data"))) {
+    sendTxResult(400, "Missing or invalid data parameter", nullptr);
+    return;
+  }
+  User user;
+  userFromJson(input.as<JsonObject>(), user);  // Hashes the password
+  
+  DynamicJsonDocument entry(768);
+  entry["op"] = "addUser";
+  userToJson(user, entry.createNestedObject("record"), true);  // The journal only sees the hash
+  
+  TxResult result = store.commit(entry);
+  if (result == TX_CONFLICT) {
+    const char* id = user.studentId.length() > 0 ? user.studentId.c_str() : user.username.c_str();
+    sendTxResult(409, catalog.findUserById(id)
+                      ? "An account with this ID already exists"
+                      : "This card is already registered", nullptr);
+  } else if (result != TX_OK) {
+    sendTxResult(txStatusCode(result), "Failed to create account", nullptr);
+  } else {
+    sendTxResult(200, nullptr, nullptr);
+  }
+}
+
+// API endpoint to delete one account by student ID or staff username
+void handleRemoveUser() {
+  if (!authorize(STAFF_ONLY)) return;
+  if (!server.hasArg("user")) {
+    sendTxResult(400, "Missing user parameter", nullptr);
+    return;
+  }
+  DynamicJsonDocument entry(512);
+  entry["op"] = "removeUser";
+  entry["user"] = server.arg("user");
+  
+  TxResult result = store.commit(entry);
+  if (result != TX_OK) {
+    sendTxResult(txStatusCode(result), "Failed to delete account", nullptr);
+  } else {
+    sessions.closeUser(server.arg("user").c_str());
+    sendTxResult(200, nullptr, nullptr);
+  }
+}
+
+// API endpoint to import books or accounts from a file (see bulk.h):
+// POST ?kind=books|users&format=csv|ndjson with the file as the body. This
+// takes the body as it arrives; handleImport() answers at the end.
+void handleImportBody() {
+  HTTPRaw& raw = server.raw();
+  switch (raw.status) {
+    case RAW_START: {
+      if (!authorize(STAFF_ONLY)) return;
+      BulkKind kind;
+      BulkFormat format;
+      if (!parseBulkKind(server.arg("kind"), kind) || !parseBulkFormat(server.arg("format"), format)) {
+        sendTxResult(400, "kind must be books or users and format csv or ndjson", nullptr);
+        return;
+      }
+      bulkImport.begin(kind, format, raw.totalSize);
+      break;
+    }
+    case RAW_WRITE:
+      bulkImport.write(raw.buf, raw.currentSize);
+      break;
+    case RAW_END:
+      bulkImport.end();
+      break;
+    case RAW_ABORTED:
+      bulkImport.abort();
+      break;
+  }
+}
+
+// {"ok":...,"state":...,"imported":N,"skipped":N,"recordsPerSecond":R,
+// "skippedLines":[{"line","error"}],...}
+void sendImportReport(int code) {
+  DynamicJsonDocument doc(2048);
+  doc["ok"] = bulkImport.status() == 200;
+  bulkImport.writeReport(doc.as<JsonObject>());
+  String response;
+  serializeJson(doc, response);
+  server.send(code, "application/json", response);
+}
+
+void handleImport() {
+  sendImportReport(bulkImport.status());
+}
+
+// API endpoint reporting the progress of the import running, or how the
+// last one went
+void handleImportStatus() {
+  sendImportReport(200);
+}
+
+// API endpoint to download every book or account:
+// ?kind=books|users&format=csv|ndjson. Accounts come with their password
+// hashes, so that they import elsewhere.
+void handleExport() {
+  if (!authorize(STAFF_ONLY)) return;
+  BulkKind kind;
+  BulkFormat format;
+  if (!parseBulkKind(server.arg("kind"), kind) || !parseBulkFormat(server.arg("format"), format)) {
+    sendTxResult(400, "kind must be books or users and format csv or ndjson", nullptr);
+    return;
+  }
+  String filename = String(kind == BULK_BOOKS ? "books" : "users") + (format == BULK_CSV ? ".csv" : ".ndjson");
+  server.sendHeader("Content-Disposition", "attachment; filename=\"" + filename + "\"");
+  ChunkedResponse response(server, 200, format == BULK_CSV ? "text/csv" : "application/x-ndjson");
+  writeExport(response, kind, format);
+  response.end();
+}
+
+// API endpoint exposing journal write/latency counters
+void handleJournalStats() {
+  DynamicJsonDocument doc(512);
+  store.writeStats(doc.to<JsonObject>());
+  String response;
+  serializeJson(doc, response);
+  server.send(200, "application/json", response);
+}
+
+// API endpoint reporting replication with the other kiosks: how far each
+// origin has been applied here and by each peer, lag and conflicts
+void handleReplicationStats() {
+  DynamicJsonDocument doc(2048);
+  replicator.writeStats(doc.to<JsonObject>());
+  String response;
+  serializeJson(doc, response);
+  server.send(200, "application/json", response);
+}
+
+void writeLoopStats(const LoopStats& stats, JsonObject obj) {
+  obj["iterations"] = stats.iterations;
+  obj["lastMicros"] = stats.lastMicros;
+  obj["maxMicros"] = stats.maxMicros;
+  obj["avgMicros"] = stats.iterations ? (uint32_t)(stats.totalMicros / stats.iterations) : 0;
+  obj["slowIterations"] = stats.slowIterations;
+}
+
+// API endpoint reporting per-pass latency of the HTTP loop and the reader
+// task, and the HTTP connection counters; ?reset=1 starts a new measurement
+// of the loops. Counters read across cores are only approximately
+// consistent, which is fine for rates.
+void handleLoopStats() {
+  DynamicJsonDocument doc(768);
+  doc["millis"] = millis();
+  doc["slowThresholdMicros"] = SLOW_LOOP_MICROS;
+  writeLoopStats(loopStats, doc.createNestedObject("http"));
+  writeLoopStats(readerStats, doc.createNestedObject("reader"));
+  server.writeStats(doc.createNestedObject("connections"));
+  doc["cardsDelivered"] = cardsDelivered;
+  doc["eventsPending"] = readerEvents.size();
+  doc["eventsDropped"] = readerEvents.dropped();
+  const Display::Stats& lcdStats = display.stats();
+  JsonObject lcdDoc = doc.createNestedObject("display");
+  lcdDoc["lcdBytes"] = lcdStats.lcdBytes;
+  lcdDoc["i2cBytes"] = lcdStats.i2cBytes();
+  lcdDoc["busMicros"] = lcdStats.busMicros();
+  lcdDoc["flushes"] = lcdStats.flushes;
+  lcdDoc["flushMicros"] = lcdStats.flushMicros;
+  String response;
+  serializeJson(doc, response);
+  if (server.arg("reset") == "1") {
+    loopStats = LoopStats();
+    readerStatsReset = true;  // The reader task clears its own counters
+  }
+  server.send(200, "application/json", response);
+}
+
+// API endpoint exposing request latency per route, loop times, scan rates,
+// heap and flash usage and how long boot took. JSON by default; ?format=prometheus gives the
+// Prometheus text format for a scraper.
+void handleMetrics() {
+  if (server.arg("format") == "prometheus") {
+    ChunkedResponse response(server, 200, "text/plain; version=0.0.4");
+    metrics.writePrometheus(response);
+    response.end();
+  } else {
+    ChunkedResponse response(server, 200, "application/json");
+    metrics.writeJson(response);
+    response.end();
+  }
+}
+
+// Routes that read the catalog or the lending history answer 503 until
+// boot has loaded them (see main.cpp). Retry-After marks it as this 503:
+// the pages' apiFetch() tries again after it and on nothing else, so no
+// other refusal should send it. The reader, event and statistics routes
+// work from the start.
+HttpServer::THandlerFunction whenLoaded(void (*handler)()) {
+  return [handler]() {
+    if (!store.ready()) {
+      server.sendHeader("Retry-After", "1");
+      server.send(503, "text/plain", "Starting up");
+      return;
+    }
+    handler();
+  };
+}
+
+void registerApiRoutes() {
+  // Configure API endpoints for web interface to interact with hardware
+  metrics.on(server, "/api/events", HTTP_GET, handleEvents);
+  metrics.on(server, "/api/scan", HTTP_GET, handleScan);
+  metrics.on(server, "/api/clear-card", HTTP_GET, handleClearCard);
+  metrics.on(server, "/api/mode", HTTP_GET, handleMode);
+  metrics.on(server, "/api/login", HTTP_POST, whenLoaded(handleLogin));
+  metrics.on(server, "/api/logout", HTTP_POST, handleLogout);
+  metrics.on(server, "/api/kiosk/pair", HTTP_POST, handleKioskPair);
+  metrics.on(server, "/api/users", HTTP_GET, whenLoaded(handleGetUsers));
+  metrics.on(server, "/api/books", HTTP_GET, whenLoaded(handleGetBooks));
+  metrics.on(server, "/api/users", HTTP_POST, whenLoaded(handleUpdateUsers));
+  metrics.on(server, "/api/books", HTTP_POST, whenLoaded(handleUpdateBooks));
+  metrics.on(server, "/api/search", HTTP_GET, whenLoaded(handleSearch));
+  metrics.on(server, "/api/check-borrowed", HTTP_GET, whenLoaded(handleCheckBorrowed));
+  metrics.on(server, "/api/lookup", HTTP_GET, whenLoaded(handleLookup));
+  metrics.on(server, "/api/borrow", HTTP_POST, whenLoaded(handleBorrow));
+  metrics.on(server, "/api/return", HTTP_POST, whenLoaded(handleReturn));
+  metrics.on(server, "/api/overdue", HTTP_GET, whenLoaded(handleOverdue));
+  metrics.on(server, "/api/history", HTTP_GET, whenLoaded(handleHistory));
+  metrics.on(server, "/api/history/segments", HTTP_GET, whenLoaded(handleHistorySegments));
+  metrics.on(server, "/api/history/segment", HTTP_GET, whenLoaded(handleHistorySegment));
+  metrics.on(server, "/api/history/archive", HTTP_POST, whenLoaded(handleHistoryArchive));
+  metrics.on(server, "/api/batch", HTTP_GET, whenLoaded(handleBatch));
+  metrics.on(server, "/api/batch/commit", HTTP_POST, whenLoaded(handleBatchCommit));
+  metrics.on(server, "/api/batch/cancel", HTTP_POST, handleBatchCancel);
+  metrics.on(server, "/api/books/add", HTTP_POST, whenLoaded(handleAddBook));
+  metrics.on(server, "/api/books/remove", HTTP_POST, whenLoaded(handleRemoveBook));
+  metrics.on(server, "/api/users/add", HTTP_POST, whenLoaded(handleAddUser));
+  metrics.on(server, "/api/users/remove", HTTP_POST, whenLoaded(handleRemoveUser));
+  metrics.on(server, "/api/import", HTTP_POST, whenLoaded(handleImport), whenLoaded(handleImportBody));
+  metrics.on(server, "/api/import", HTTP_GET, handleImportStatus);
+  metrics.on(server, "/api/export", HTTP_GET, whenLoaded(handleExport));
+  metrics.on(server, "/api/journal", HTTP_GET, handleJournalStats);
+  metrics.on(server, "/api/replication", HTTP_GET, handleReplicationStats);
+  metrics.on(server, "/api/loop", HTTP_GET, handleLoopStats);
+  metrics.on(server, "/api/metrics", HTTP_GET, handleMetrics);
+  
+  // Create custom 404 page to help diagnose missing files
+  metrics.onNotFound(server, []() {
+    String message = "File Not Found\n\n";
+    message += "URI: ";
+    message += server.uri();
+    message += "\nMethod: ";
+    message += (server.method() == HTTP_GET) ? "GET" : "POST";
+    message += "\nArguments: ";
+    message += server.args();
+    message += "\n";
+    for (uint8_t i = 0; i < server.args(); i++) {
+      message += " " + server.argName(i) + ": " + server.arg(i) + "\n";
+    }
+    server.send(404, "text/plain", message);
+    Serial.println("404 Error: " + server.uri());
+  });
+  
+  // Request headers the handlers look at: EventSource's replay cursor, what
+  // the asset cache needs for gzip and 304 responses, and session tokens
+  const char* collectedHeaders[] = {"Last-Event-ID", "If-None-Match", "Accept-Encoding", "Authorization"};
+  server.collectHeaders(collectedHeaders, 4);
+}
+
+// Tell a borrower with overdue books so on the LCD when their card is read.
+// Two hash lookups and nothing allocated, like the rest of the scan path.
+void noticeOverdue(const CardUid& uid) {
+  const User* user = catalog.findUserByCard(uid);
+  if (!user) return;
+  const char* id = user->studentId.length() > 0 ? user->studentId.c_str() : user->username.c_str();
+  OverdueTotals owed = catalog.loansAt(clockNow()).totalsFor(id, clockNow());
+  if (owed.books == 0) return;
+
+  // Clamped so each line fits the LCD's 16 columns
+  ReaderNotice notice;
+  snprintf(notice.lines[0], sizeof(notice.lines[0]), "Overdue:%2lu book%s",
+           (unsigned long)std::min<uint32_t>(owed.books, 99), owed.books == 1 ? "" : "s");
+  snprintf(notice.lines[1], sizeof(notice.lines[1]), "Penalty: %lu",
+           (unsigned long)std::min<uint32_t>(owed.penalty, 9999999));
+  readerNotices.push(notice);
+}
+
+// Pick up what the reader task produced since the last pass
+void drainReaderEvents() {
+  ReaderEvent event;
+  while (readerEvents.pop(event)) {
+    if (event.kind == ReaderEvent::SCAN_STARTED) {
+      if (event.mode != BATCH) currentCard = CardUid();
+      metrics.recordScanWindow();
+      continue;
+    }
+    if (event.kind == ReaderEvent::SCAN_TIMED_OUT) {
+      if (event.mode == BATCH) batchOpen = false;
+      metrics.recordScanTimeout();
+      continue;
+    }
+    if (event.mode == BATCH) {
+      // Batch cards only go to the batch (and the browsers), never to
+      // /api/scan, so a stack of books can't log anyone in. A read that
+      // raced a commit or cancel is dropped.
+      if (!batchOpen || !batchCards.add(event.uid)) continue;
+    } else {
+      currentCard = event.uid;
+      lastCardTime = event.time;
+      // Only a normal read can log in or return a book
+      if (event.mode == NORMAL) {
+        randomToken(cardNonce);
+      } else {
+        cardNonce[0] = '\0';
+      }
+    }
+    cardsDelivered++;
+    metrics.recordScan(event.time);
+    scanEvents.publish(event.uid, rfidModeName(event.mode), event.mode == NORMAL ? cardNonce : nullptr);
+    if (event.mode == NORMAL) noticeOverdue(event.uid);
+  }
+}
+
+void httpPass() {
+  unsigned long passStart = micros();
+  
+  // Handle any pending web client requests
+  server.handleClient();
+  
+  // Record scans from the reader task and push them to the browsers
+  drainReaderEvents();
+  
+  // Changes from the other kiosks in, announces and catch-up out
+  replicator.loop();
+  
+  // Fold the journal into fresh snapshots a slice at a time when it grows
+  store.loop();
+  
+  // Keep the scan event streams alive
+  scanEvents.loop();
+  
+  recordLoopTime(loopStats, micros() - passStart);
+}
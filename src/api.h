@@ -0,0 +1,24 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "httpserver.h"
+#include "kiosk.h"
+
+// The HTTP side: the /api/* handlers, the card most recently delivered by
+// the reader task, and one pass of the loop that serves them. Nothing here
+// touches the kiosk hardware directly.
+
+extern HttpServer server;
+extern LoopStats loopStats;  // HTTP loop
+
+// Register every /api/* route, the 404 page and the headers they read.
+// Static files are registered separately by assets.begin().
+void registerApiRoutes();
+
+// Pick up what the reader task produced since the last pass
+void drainReaderEvents();
+
+// One pass of the HTTP loop: requests, scan events to the browsers and
+// background compaction
+void httpPass();
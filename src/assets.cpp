@@ -0,0 +1,147 @@
+#include "assets.h"
+
+#include "datafs.h"
+#include "journal.h"  // crc32Update
+#include "metrics.h"  // openFile, timed routes
+
+AssetServer assets;
+
+// Pages are revalidated on every load (cheap with ETags) so a firmware or
+// filesystem update shows up at once; the script and stylesheet they pull
+// in can be reused for a day without asking.
+static const char* PAGE_CACHE = "no-cache";
+static const char* ASSET_CACHE = "public, max-age=86400";
+
+static Asset routes[] = {
+  {"/index.html", "text/html", PAGE_CACHE, true},
+  {"/admin.html", "text/html", PAGE_CACHE, false},
+  {"/student.html", "text/html", PAGE_CACHE, false},
+  {"/books.html", "text/html", PAGE_CACHE, false},
+  {"/styles.css", "text/css", ASSET_CACHE, true},
+  {"/scripts.js", "application/javascript", ASSET_CACHE, false},
+};
+
+// Older uploads put the web files under /data or without a leading slash
+static String resolvePath(const String& path) {
+  const String candidates[] = {path, "/data" + path, path.substring(1), "/data/" + path.substring(1)};
+  for (const String& candidate : candidates) {
+    if (dataFs().exists(candidate)) return candidate;
+  }
+  return String();
+}
+
+// Strong validator from the exact bytes we'll send
+static String fileEtag(const String& path) {
+  File file = openFile(path, "r");
+  if (!file) return String();
+  uint8_t buffer[256];
+  uint32_t crc = 0;
+  size_t size = 0;
+  while (file.available()) {
+    size_t n = file.read(buffer, sizeof(buffer));
+    if (n == 0) break;
+    crc = crc32Update(crc, buffer, n);
+    size += n;
+  }
+  file.close();
+  char etag[24];
+  snprintf(etag, sizeof(etag), "\"%x-%08lx\"", (unsigned)size, (unsigned long)crc);
+  return String(etag);
+}
+
+static bool loadIntoRam(Asset& asset, const String& path) {
+  File file = openFile(path, "r");
+  if (!file) return false;
+  size_t length = file.size();
+  uint8_t* data = (uint8_t*)malloc(length);
+  if (data && file.read(data, length) != length) {
+    free(data);
+    data = nullptr;
+  }
+  file.close();
+  if (!data) return false;
+  asset.ram = data;
+  asset.ramLength = length;
+  return true;
+}
+
+void AssetServer::begin(HttpServer& webServer) {
+  server = &webServer;
+
+  for (Asset& asset : routes) {
+    Asset* route = &asset;
+    metrics.on(*server, asset.uri, HTTP_GET, [this, route]() { serve(*route); });
+  }
+
+  // The root URL is the login page
+  Asset* index = &routes[0];
+  metrics.on(*server, "/", HTTP_GET, [this, index]() { serve(*index); });
+}
+
+void AssetServer::resolve(Asset& asset) {
+  asset.resolved = true;
+  asset.path = resolvePath(asset.uri);
+  asset.gzipPath = resolvePath(String(asset.uri) + ".gz");
+  if (asset.path.length() == 0 && asset.gzipPath.length() == 0) {
+    Serial.println("Asset missing: " + String(asset.uri));
+    return;
+  }
+  if (asset.path.length() > 0) asset.plainEtag = fileEtag(asset.path);
+  if (asset.gzipPath.length() > 0) asset.etag = fileEtag(asset.gzipPath);
+
+  // RAM copies are always the compressed one when it exists - every
+  // browser that reaches the kiosk accepts gzip
+  if (asset.keepInRam) {
+    loadIntoRam(asset, asset.gzipPath.length() > 0 ? asset.gzipPath : asset.path);
+  }
+  Serial.println("Asset " + String(asset.uri) + " -> " +
+                 (asset.gzipPath.length() > 0 ? asset.gzipPath : asset.path) +
+                 (asset.ram ? " (RAM)" : ""));
+}
+
+bool AssetServer::warm() {
+  for (Asset& asset : routes) {
+    if (asset.resolved) continue;
+    resolve(asset);
+    return false;
+  }
+  return true;
+}
+
+void AssetServer::serve(Asset& asset) {
+  if (!asset.resolved) resolve(asset);
+  if (asset.path.length() == 0 && asset.gzipPath.length() == 0) {
+    server->send(404, "text/plain", "Not found: " + String(asset.uri));
+    return;
+  }
+  bool gzip = asset.gzipPath.length() > 0 &&
+              (asset.path.length() == 0 || server->header("Accept-Encoding").indexOf("gzip") >= 0);
+  const String& etag = gzip ? asset.etag : asset.plainEtag;
+
+  server->sendHeader("Cache-Control", asset.cacheControl);
+  server->sendHeader("ETag", etag);
+  server->sendHeader("Vary", "Accept-Encoding");
+
+  if (etag.length() > 0 && server->header("If-None-Match") == etag) {
+    notModifiedResponses++;
+    server->send(304);
+    return;
+  }
+
+  fullResponses++;
+  bool ramCopyMatches = asset.ram && (gzip || asset.gzipPath.length() == 0);
+  if (ramCopyMatches) {
+    if (gzip) server->sendHeader("Content-Encoding", "gzip");
+    server->send_P(200, asset.contentType, (const char*)asset.ram, asset.ramLength);
+    return;
+  }
+
+  // streamFile() adds Content-Encoding: gzip itself for .gz files
+  File file = openFile(gzip ? asset.gzipPath : asset.path, "r");
+  if (!file) {
+    server->send(500, "text/plain", "Failed to open " + String(asset.uri));
+    return;
+  }
+  server->streamFile(file, asset.contentType);
+  file.close();
+}
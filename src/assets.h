@@ -0,0 +1,54 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "httpserver.h"
+
+// Static web assets. Where each file lives is worked out once - by warm()
+// once boot is done, or by the first request for it if that comes sooner -
+// and kept in a route table, so a request never probes the filesystem. A
+// gzip-compressed copy (name.gz, written by tools/compress_assets.py at
+// build time) is preferred whenever the browser accepts it. Every response
+// carries a strong ETag so revalidation costs a 304 and no body, and the
+// smallest hot assets are held in RAM.
+
+struct Asset {
+  const char* uri;
+  const char* contentType;
+  const char* cacheControl;
+  bool keepInRam;
+
+  // Filled in when resolved
+  bool resolved = false;
+  String path{};          // Uncompressed file, empty if missing
+  String gzipPath{};      // Compressed file, empty if missing
+  String etag{};          // Of the compressed copy when there is one
+  String plainEtag{};
+  uint8_t* ram = nullptr; // Preferred representation held in RAM, or null
+  size_t ramLength = 0;
+};
+
+class AssetServer {
+ public:
+  // Register every asset's route ("/" maps to index.html). Nothing is read
+  // from flash, so the server can start listening straight after.
+  void begin(HttpServer& server);
+
+  // Resolve the next asset not yet resolved, RAM copy included; true once
+  // they all are. Boot calls it until then, one asset per loop() pass.
+  bool warm();
+
+  // Requests served in full vs. answered with 304 Not Modified
+  uint32_t served() const { return fullResponses; }
+  uint32_t notModified() const { return notModifiedResponses; }
+
+ private:
+  void serve(Asset& asset);
+  void resolve(Asset& asset);
+
+  HttpServer* server = nullptr;
+  uint32_t fullResponses = 0;
+  uint32_t notModifiedResponses = 0;
+};
+
+extern AssetServer assets;
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "uid.h"
+
+// The distinct cards seen during one batch scan - a stack of books put on
+// the reader at once. Fixed size, so neither the reader task nor the HTTP
+// loop allocates while a stack is being read, and small enough that the
+// whole batch still fits in one journal line.
+const size_t BATCH_MAX_CARDS = 32;
+
+class CardBatch {
+ public:
+  // Add a card unless it is already in the batch (a tag that drifted out of
+  // the field and back is read again) or the batch is full. True only for a
+  // card not seen before.
+  bool add(const CardUid& uid) {
+    if (uid.empty() || full() || contains(uid)) return false;
+    cards[count++] = uid;
+    return true;
+  }
+
+  bool contains(const CardUid& uid) const {
+    for (size_t i = 0; i < count; i++) {
+      if (cards[i] == uid) return true;
+    }
+    return false;
+  }
+
+  void clear() { count = 0; }
+  bool full() const { return count == BATCH_MAX_CARDS; }
+  size_t size() const { return count; }
+  const CardUid& operator[](size_t i) const { return cards[i]; }
+
+ private:
+  CardUid cards[BATCH_MAX_CARDS];
+  size_t count = 0;
+};
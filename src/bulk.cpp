@@ -0,0 +1,379 @@
+#include "bulk.h"
+
+#include <string.h>
+
+#include "metrics.h"
+#include "store.h"
+
+BulkImport bulkImport;
+
+// What export writes, and the order of its CSV columns
+static const char* const BOOK_COLUMNS[] = {"id",      "isbn",     "title",      "author",
+                                           "shelf",   "floor",    "cardUid",    "borrowed",
+                                           "borrowedBy", "borrowDate", "returnDate"};
+static const char* const USER_COLUMNS[] = {"type", "studentId", "username", "passwordHash",
+                                           "name", "email",     "cardUid"};
+
+// What an imported book keeps: it starts on the shelf
+static const uint16_t IMPORT_BOOK_FIELDS =
+    BOOK_ID | BOOK_ISBN | BOOK_TITLE | BOOK_AUTHOR | BOOK_SHELF | BOOK_FLOOR | BOOK_CARD_UID;
+
+static const size_t RECORD_DOC_SIZE = 2048;  // One parsed line or exported record
+static const size_t BATCH_DOC_SIZE = 4096;   // BATCH_BYTES of records and the replication stamp
+
+bool parseBulkKind(const String& text, BulkKind& kind) {
+  if (text == "books") {
+    kind = BULK_BOOKS;
+  } else if (text == "users") {
+    kind = BULK_USERS;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool parseBulkFormat(const String& text, BulkFormat& format) {
+  if (text.length() == 0 || text == "csv") {
+    format = BULK_CSV;
+  } else if (text == "ndjson") {
+    format = BULK_NDJSON;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// A CSV field, quoted only if it has to be; null is an empty field
+static void writeCsvField(Print& out, JsonVariant value) {
+  if (value.isNull()) return;
+  if (!value.is<const char*>()) {
+    serializeJson(value, out);  // true/false
+    return;
+  }
+  const char* text = value.as<const char*>();
+  if (!strpbrk(text, ",\"\r\n")) {
+    out.print(text);
+    return;
+  }
+  out.write('"');
+  for (const char* c = text; *c; c++) {
+    if (*c == '"') out.write('"');
+    out.write(*c);
+  }
+  out.write('"');
+}
+
+size_t writeExport(Print& out, BulkKind kind, BulkFormat format) {
+  const char* const* columns = kind == BULK_BOOKS ? BOOK_COLUMNS : USER_COLUMNS;
+  size_t columnCount = kind == BULK_BOOKS ? sizeof(BOOK_COLUMNS) / sizeof(BOOK_COLUMNS[0])
+                                          : sizeof(USER_COLUMNS) / sizeof(USER_COLUMNS[0]);
+  if (format == BULK_CSV) {
+    for (size_t i = 0; i < columnCount; i++) {
+      if (i) out.write(',');
+      out.print(columns[i]);
+    }
+    out.print("\r\n");
+  }
+
+  DynamicJsonDocument doc(RECORD_DOC_SIZE);
+  size_t count = kind == BULK_BOOKS ? catalog.allBooks().size() : catalog.allUsers().size();
+  for (size_t i = 0; i < count; i++) {
+    doc.clear();
+    JsonObject obj = doc.to<JsonObject>();
+    if (kind == BULK_BOOKS) {
+      bookToJson(catalog.allBooks()[i], obj);
+    } else {
+      userToJson(catalog.allUsers()[i], obj, true);
+    }
+    if (format == BULK_NDJSON) {
+      serializeJson(doc, out);
+      out.write('\n');
+      continue;
+    }
+    for (size_t c = 0; c < columnCount; c++) {
+      if (c) out.write(',');
+      writeCsvField(out, obj[columns[c]]);
+    }
+    out.print("\r\n");
+  }
+  return count;
+}
+
+// Split a CSV line into its fields in place, unquoting them. Returns how
+// many there are (at most `max`), or 0 for a quote left open.
+static size_t splitCsv(char* text, char** fields, size_t max) {
+  size_t count = 0;
+  char* in = text;
+  for (;;) {
+    char* out = in;
+    if (count < max) fields[count] = out;
+    count++;
+    if (*in == '"') {
+      in++;
+      for (;;) {
+        if (*in == '\0') return 0;
+        if (*in == '"') {
+          if (in[1] != '"') break;
+          in++;
+        }
+        *out++ = *in++;
+      }
+      in++;  // The closing quote; anything up to the comma is dropped
+      while (*in && *in != ',') in++;
+    } else {
+      while (*in && *in != ',') *out++ = *in++;
+    }
+    bool last = *in == '\0';
+    *out = '\0';
+    if (last) break;
+    in++;
+  }
+  return count < max ? count : max;
+}
+
+void BulkImport::begin(BulkKind kind, BulkFormat format, size_t totalBytes) {
+  this->kind = kind;
+  this->format = format;
+  this->totalBytes = totalBytes;
+  state = RUNNING;
+  used = 0;
+  overlong = false;
+  columns.clear();
+  books.clear();
+  users.clear();
+  batchBytes = 0;
+  bytes = 0;
+  lines = imported = skipped = batches = 0;
+  startMillis = millis();
+  endMillis = 0;
+  errors.clear();
+  failure = nullptr;
+  failureCode = 200;
+}
+
+void BulkImport::write(const uint8_t* data, size_t length) {
+  if (state != RUNNING) return;
+  bytes += length;
+  const char* text = (const char*)data;
+  const char* end = text + length;
+  while (text < end && state == RUNNING) {
+    const char* newline = (const char*)memchr(text, '\n', end - text);
+    size_t piece = (newline ? newline : end) - text;
+    if (used + piece > MAX_LINE) {
+      overlong = true;
+    } else {
+      memcpy(line + used, text, piece);
+      used += piece;
+    }
+    if (!newline) break;
+    takeLine();
+    text = newline + 1;
+  }
+}
+
+void BulkImport::end() {
+  if (state != RUNNING) return;
+  if (used > 0 || overlong) takeLine();  // No newline after the last one
+  if (state == RUNNING) flush();
+  if (state == RUNNING) state = DONE;
+  endMillis = millis();
+  Serial.println("Import: " + String(imported) + " added, " + String(skipped) + " skipped in " +
+                 String(endMillis - startMillis) + " ms");
+}
+
+void BulkImport::abort() {
+  if (state != RUNNING) return;
+  books.clear();
+  users.clear();
+  state = ABORTED;
+  endMillis = millis();
+  Serial.println("Import cut off after " + String(imported) + " records");
+}
+
+void BulkImport::takeLine() {
+  lines++;
+  bool tooLong = overlong;
+  size_t length = used;
+  used = 0;
+  overlong = false;
+  if (tooLong) {
+    skip("Line too long");
+    return;
+  }
+  if (length > 0 && line[length - 1] == '\r') length--;
+  line[length] = '\0';
+  char* text = line;
+  if (lines == 1 && strncmp(text, "\xEF\xBB\xBF", 3) == 0) text += 3;  // Byte order mark
+  if (*text == '\0') return;
+
+  if (format == BULK_CSV && columns.empty()) {
+    takeHeader(text);
+  } else {
+    takeRecord(text);
+  }
+}
+
+void BulkImport::takeHeader(char* text) {
+  char* fields[MAX_COLUMNS];
+  size_t count = splitCsv(text, fields, MAX_COLUMNS);
+  bool hasKey = false;
+  for (size_t i = 0; i < count; i++) {
+    String name = fields[i];
+    name.trim();
+    hasKey = hasKey || (kind == BULK_BOOKS ? name == "id" : name == "studentId" || name == "username");
+    columns.push_back(name);
+  }
+  if (!hasKey) {
+    fail(400, kind == BULK_BOOKS ? "The CSV header has no id column"
+                                 : "The CSV header has no studentId or username column");
+  }
+}
+
+void BulkImport::takeRecord(char* text) {
+  DynamicJsonDocument input(RECORD_DOC_SIZE);
+  if (format == BULK_CSV) {
+    char* fields[MAX_COLUMNS];
+    size_t count = splitCsv(text, fields, columns.size() < MAX_COLUMNS ? columns.size() : MAX_COLUMNS);
+    if (count == 0) {
+      skip("Unclosed quote");
+      return;
+    }
+    for (size_t i = 0; i < count; i++) {
+      if (fields[i][0] != '\0') input[columns[i].c_str()] = (const char*)fields[i];
+    }
+  } else {
+    unsigned long parseStart = micros();
+    DeserializationError error = deserializeJson(input, text);
+    metrics.recordJsonParse(micros() - parseStart);
+    if (error || !input.is<JsonObject>()) {
+      skip("Not a JSON object");
+      return;
+    }
+  }
+  if (kind == BULK_BOOKS) {
+    addBook(input.as<JsonObject>());
+  } else {
+    addUser(input.as<JsonObject>());
+  }
+}
+
+void BulkImport::addBook(JsonObject input) {
+  Book book;
+  bookFromJson(input, book);
+  if (book.id.length() == 0) return skip("No id");
+  bool card = book.cardUid.length() > 0;
+  if (catalog.findBookById(book.id.c_str())) return skip("Duplicate id");
+  if (card && catalog.cardInUse(book.cardUid.c_str())) return skip("Duplicate card");
+  for (const Book& other : books) {
+    if (other.id == book.id) return skip("Duplicate id");
+    if (card && other.cardUid == book.cardUid) return skip("Duplicate card");
+  }
+
+  DynamicJsonDocument record(RECORD_DOC_SIZE);
+  bookToJson(book, record.to<JsonObject>(), IMPORT_BOOK_FIELDS);
+  if (!makeRoom(measureJson(record))) return;
+  book.history.clear();
+  books.push_back(book);
+}
+
+void BulkImport::addUser(JsonObject input) {
+  // Checked before the password is hashed, which is the slow part
+  const char* id = input["studentId"] | (input["username"] | "");
+  const char* card = input["cardUid"] | "";
+  if (id[0] == '\0') return skip("No studentId or username");
+  if (!input["passwordHash"].is<const char*>() && !input["password"].is<const char*>()) {
+    return skip("No password");
+  }
+  if (catalog.findUserById(id)) return skip("Duplicate id");
+  if (card[0] != '\0' && catalog.cardInUse(card)) return skip("Duplicate card");
+  for (const User& other : users) {
+    if (other.studentId == id || other.username == id) return skip("Duplicate id");
+    if (card[0] != '\0' && other.cardUid == card) return skip("Duplicate card");
+  }
+
+  User user;
+  userFromJson(input, user);
+  if (user.password.empty()) return skip("No password");
+  DynamicJsonDocument record(RECORD_DOC_SIZE);
+  userToJson(user, record.to<JsonObject>(), true);
+  if (!makeRoom(measureJson(record))) return;
+  users.push_back(user);
+}
+
+// Commit the batch first if a record of this size doesn't fit in it. False
+// if it fits in no batch, or the commit failed.
+bool BulkImport::makeRoom(size_t recordBytes) {
+  recordBytes += 1;  // The comma
+  if (recordBytes > BATCH_BYTES) {
+    skip("Record too long");
+    return false;
+  }
+  if (batchBytes + recordBytes > BATCH_BYTES) flush();
+  batchBytes += recordBytes;
+  return state == RUNNING;
+}
+
+void BulkImport::flush() {
+  size_t count = kind == BULK_BOOKS ? books.size() : users.size();
+  if (count == 0) return;
+  DynamicJsonDocument entry(BATCH_DOC_SIZE);
+  entry["op"] = kind == BULK_BOOKS ? "addBooks" : "addUsers";
+  JsonArray records = entry.createNestedArray("records");
+  for (size_t i = 0; i < count; i++) {
+    if (kind == BULK_BOOKS) {
+      bookToJson(books[i], records.createNestedObject(), IMPORT_BOOK_FIELDS);
+    } else {
+      userToJson(users[i], records.createNestedObject(), true);  // The journal only sees the hash
+    }
+  }
+  books.clear();
+  users.clear();
+  batchBytes = 0;
+
+  TxResult result = store.commit(entry);
+  if (result != TX_OK) {
+    fail(500, result == TX_IO_ERROR ? "Failed to save a batch" : "A batch was rejected");
+    return;
+  }
+  imported += count;
+  batches++;
+}
+
+void BulkImport::skip(const char* reason) {
+  skipped++;
+  if (errors.size() < MAX_ERRORS) errors.push_back({lines, reason});
+}
+
+void BulkImport::fail(int code, const char* reason) {
+  books.clear();
+  users.clear();
+  state = FAILED;
+  failure = reason;
+  failureCode = code;
+  endMillis = millis();
+  Serial.println("Import failed at line " + String(lines) + ": " + String(reason));
+}
+
+void BulkImport::writeReport(JsonObject obj) const {
+  static const char* STATES[] = {"idle", "running", "done", "failed", "cut off"};
+  obj["state"] = STATES[state];
+  if (state == IDLE) return;
+  obj["kind"] = kind == BULK_BOOKS ? "books" : "users";
+  obj["format"] = format == BULK_CSV ? "csv" : "ndjson";
+  if (failure) obj["error"] = failure;
+  obj["bytes"] = bytes;
+  obj["totalBytes"] = totalBytes;
+  obj["lines"] = lines;
+  obj["imported"] = imported;
+  obj["skipped"] = skipped;
+  obj["batches"] = batches;
+  uint32_t elapsed = (state == RUNNING ? millis() : endMillis) - startMillis;
+  obj["millis"] = elapsed;
+  obj["recordsPerSecond"] = elapsed ? imported * 1000.0 / elapsed : 0.0;
+  JsonArray list = obj.createNestedArray("skippedLines");
+  for (const LineError& error : errors) {
+    JsonObject item = list.createNestedObject();
+    item["line"] = error.line;
+    item["error"] = error.reason;
+  }
+}
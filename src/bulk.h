@@ -0,0 +1,114 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "catalog.h"
+
+// Bulk import and export of books and accounts, one record per line:
+//
+//   POST /api/import?kind=books|users&format=csv|ndjson   the file as the body
+//   GET  /api/export?kind=books|users&format=csv|ndjson
+//
+// CSV (the default) starts with a header row naming the columns - the JSON
+// field names, in any order; others are ignored - and quotes a field
+// holding commas or quotes the usual way ("Smith, ""Jo"""). A record can't
+// span lines. NDJSON is one JSON object per line. Export writes every
+// column below, so what it writes imports again.
+//
+// The body streams through one MAX_LINE buffer as it arrives (see
+// HttpServer::raw()), so memory use doesn't depend on the size of the
+// file. Each record is checked against the catalog's indexes and the
+// records before it; one without a key (or an account without a password)
+// or whose key or card is taken is skipped and reported by line number.
+// The rest are committed in batches, each one "addBooks"/"addUsers"
+// journal entry - a durable transaction of its own - kept to BATCH_BYTES
+// so it fits a journal line and a replication datagram. An upload cut off
+// part way keeps the batches committed before; sending the file again
+// skips those as duplicates and adds the rest.
+//
+// Books come in on the shelf: the loan columns are ignored. Accounts take
+// a "password", hashed here, or the "passwordHash" export writes.
+
+enum BulkKind { BULK_BOOKS, BULK_USERS };
+enum BulkFormat { BULK_CSV, BULK_NDJSON };
+
+// ?kind= and ?format= (empty is CSV); false for anything else
+bool parseBulkKind(const String& text, BulkKind& kind);
+bool parseBulkFormat(const String& text, BulkFormat& format);
+
+// Every book or account, one record at a time. Returns how many.
+size_t writeExport(Print& out, BulkKind kind, BulkFormat format);
+
+class BulkImport {
+ public:
+  static const size_t MAX_LINE = 512;     // One record, or the CSV header
+  static const size_t MAX_COLUMNS = 16;
+  static const size_t BATCH_BYTES = 768;  // Records per entry; the rest of a journal line is op, seq and stamp
+  static const size_t MAX_ERRORS = 20;    // Skipped lines listed; the rest are only counted
+
+  // An upload starts (RAW_START), goes on and ends (see api.cpp)
+  void begin(BulkKind kind, BulkFormat format, size_t totalBytes);
+  void write(const uint8_t* data, size_t length);
+  void end();    // Take the last line and commit the last batch
+  void abort();  // Cut off: what isn't committed yet is dropped
+
+  bool running() const { return state == RUNNING; }
+
+  // 200, or what the import failed with: 400 for a CSV header without the
+  // key column, 500 for a batch that couldn't be journaled
+  int status() const { return state == FAILED ? failureCode : 200; }
+
+  // Progress of the import running, or how the last one went
+  void writeReport(JsonObject obj) const;
+
+ private:
+  enum State { IDLE, RUNNING, DONE, FAILED, ABORTED };
+
+  struct LineError {
+    uint32_t line;
+    const char* reason;
+  };
+
+  void takeLine();
+  void takeHeader(char* text);
+  void takeRecord(char* text);
+  void addBook(JsonObject input);
+  void addUser(JsonObject input);
+  bool makeRoom(size_t recordBytes);
+  void flush();
+  void skip(const char* reason);
+  void fail(int code, const char* reason);
+
+  State state = IDLE;
+  BulkKind kind = BULK_BOOKS;
+  BulkFormat format = BULK_CSV;
+
+  char line[MAX_LINE + 1];
+  size_t used = 0;
+  bool overlong = false;        // The line being read didn't fit; drop it whole
+  std::vector<String> columns;  // From the CSV header
+
+  // The batch being filled, committed together
+  std::vector<Book> books;
+  std::vector<User> users;
+  size_t batchBytes = 0;
+
+  size_t totalBytes = 0;  // Content-Length
+  size_t bytes = 0;       // Received so far
+  uint32_t lines = 0;
+  uint32_t imported = 0;
+  uint32_t skipped = 0;
+  uint32_t batches = 0;
+  uint32_t startMillis = 0;
+  uint32_t endMillis = 0;
+  std::vector<LineError> errors;
+  const char* failure = nullptr;
+  int failureCode = 200;
+};
+
+extern BulkImport bulkImport;
@@ -0,0 +1,828 @@
+#include "catalog.h"
+
+#include <ctype.h>
+
+#include <algorithm>
+
+#include "clock.h"
+#include "metrics.h"
+#include "snapshot.h"
+
+Catalog catalog;
+
+// A single book document including a long (legacy) lending history fits
+// easily here. The document is reused for every array element, so this is
+// the peak cost of a load no matter how large the catalog grows.
+static const size_t RECORD_DOC_SIZE = 4096;
+
+// Unset dates come back out as "" so the web interface sees the same shape
+// it always has. Formatted into `out`, off the heap; a char* so ArduinoJson
+// copies it.
+static char* isoOrEmpty(time_t epoch, char (&out)[ISO_TIME_SIZE]) {
+  out[0] = '\0';
+  if (epoch) formatIsoTime(epoch, out, sizeof(out));
+  return out;
+}
+
+Catalog::Catalog()
+    : bookById(&Book::id),
+      bookByIsbn(&Book::isbn),
+      bookByCard(&Book::cardUid),
+      userByCard(&User::cardUid),
+      userByStudentId(&User::studentId),
+      userByUsername(&User::username) {}
+
+static void skipSpace(Stream& file) {
+  while (isspace(file.peek())) file.read();
+}
+
+// Walk the top-level array named `key` one element at a time instead of
+// parsing the whole file into a single JsonDocument. Snapshots written by
+// the data store start with {"journalSeq":N, ...} ahead of the array.
+// False unless the array is there and every element parses up to its "]".
+template <typename Record>
+static bool loadRecords(const char* path, const char* key, std::vector<Record>& out,
+                        void (*fromJson)(JsonObject, Record&), uint32_t* snapshotSeq) {
+  *snapshotSeq = 0;
+  File file = openFile(path, "r");
+  if (!file) {
+    Serial.println("Failed to open file for reading: " + String(path));
+    return false;
+  }
+
+  // Everything before the array is a short header
+  char header[128];
+  size_t length = file.readBytesUntil('[', header, sizeof(header) - 1);
+  header[length] = '\0';
+  String marker = "\"" + String(key) + "\"";
+  if (strstr(header, marker.c_str()) == nullptr) {
+    file.close();
+    Serial.println("No " + marker + " array in " + String(path));
+    return false;
+  }
+  const char* seqField = strstr(header, "\"journalSeq\"");
+  if (seqField) {
+    *snapshotSeq = strtoul(strchr(seqField, ':') + 1, nullptr, 10);
+  }
+
+  bool ok = true;
+  skipSpace(file);
+  if (file.peek() == ']') {
+    file.close();
+    return true;  // An empty array
+  }
+  DynamicJsonDocument doc(RECORD_DOC_SIZE);
+  for (;;) {
+    unsigned long parseStart = micros();
+    DeserializationError error = deserializeJson(doc, file);
+    metrics.recordJsonParse(micros() - parseStart);
+    if (error || !doc.is<JsonObject>()) {
+      Serial.println("Record " + String(out.size()) + " of " + String(path) + ": " + error.c_str());
+      ok = false;
+      break;
+    }
+    Record record;
+    fromJson(doc.as<JsonObject>(), record);
+    out.push_back(record);
+
+    skipSpace(file);
+    int next = file.read();
+    if (next == ']') break;
+    if (next != ',') {
+      Serial.println("Record " + String(out.size()) + " of " + String(path) + ": unterminated array");
+      ok = false;
+      break;
+    }
+  }
+
+  file.close();
+  return ok;
+}
+
+// Both loads go into a scratch vector and only replace the collection once
+// the whole file has read, so a damaged file or a bad upload leaves the
+// catalog as it was
+bool Catalog::loadBooks(const char* path, uint32_t* snapshotSeq, std::vector<Book>* previous) {
+  std::vector<Book> loaded;
+  uint32_t seq = 0;
+  bool ok = isBinarySnapshot(path) ? readBookSnapshot(path, loaded, &seq)
+                                   : loadRecords<Book>(path, "books", loaded, bookFromJson, &seq);
+  *snapshotSeq = ok ? seq : 0;
+  if (!ok) {
+    Serial.println("Catalog: " + String(path) + " did not load, keeping " + String(books.size()) + " books");
+    return false;
+  }
+  books.swap(loaded);
+  books.shrink_to_fit();
+  if (previous) previous->swap(loaded);
+  rebuildBookIndexes();
+  resetBookVersions(seq);
+
+  Serial.println("Catalog loaded: " + String(books.size()) + " books");
+  Serial.println("Search index: " + String(bookSearch.wordCount()) + " words, " +
+                 String(bookSearch.postingCount()) + " postings, " +
+                 String(bookSearch.memoryBytes()) + " bytes");
+  return true;
+}
+
+bool Catalog::loadUsers(const char* path, uint32_t* snapshotSeq, std::vector<User>* previous) {
+  std::vector<User> loaded;
+  uint32_t seq = 0;
+  bool ok = isBinarySnapshot(path) ? readUserSnapshot(path, loaded, &seq)
+                                   : loadRecords<User>(path, "users", loaded, userFromJson, &seq);
+  *snapshotSeq = ok ? seq : 0;
+  if (!ok) {
+    Serial.println("Catalog: " + String(path) + " did not load, keeping " + String(users.size()) + " users");
+    return false;
+  }
+  users.swap(loaded);
+  users.shrink_to_fit();
+  if (previous) previous->swap(loaded);
+  rebuildUserIndexes();
+  resetUserVersions(seq);
+
+  Serial.println("Catalog loaded: " + String(users.size()) + " users");
+  return true;
+}
+
+void Catalog::restoreBooks(std::vector<Book>& previous) {
+  books.swap(previous);
+  std::vector<Book>().swap(previous);
+  rebuildBookIndexes();
+}
+
+void Catalog::restoreUsers(std::vector<User>& previous) {
+  users.swap(previous);
+  std::vector<User>().swap(previous);
+  rebuildUserIndexes();
+}
+
+void Catalog::rebuildBookIndexes() {
+  bookById.rebuild(books);
+  bookByIsbn.rebuild(books);
+  bookByCard.rebuild(books);
+  bookSearch.rebuild(books);
+  loans.rebuild(books);
+}
+
+void Catalog::rebuildUserIndexes() {
+  userByCard.rebuild(users);
+  userByStudentId.rebuild(users);
+  userByUsername.rebuild(users);
+}
+
+void Catalog::resetBookVersions(uint32_t version) {
+  for (Book& book : books) book.version = version;
+  bookVersions.reset(version);
+}
+
+void Catalog::resetUserVersions(uint32_t version) {
+  for (User& user : users) user.version = version;
+  userVersions.reset(version);
+}
+
+void Catalog::Versions::reset(uint32_t version) {
+  current = version;
+  floor = version;
+  removed.clear();
+}
+
+// Forgetting the oldest tombstone means a client from before it can no
+// longer be told about that removal, so deltas must start after it
+void Catalog::Versions::remove(const String& id, uint32_t version) {
+  if (removed.size() >= MAX_TOMBSTONES) {
+    floor = removed.front().version;
+    removed.erase(removed.begin());
+  }
+  removed.push_back({id, version});
+  touch(version);
+}
+
+void Catalog::Versions::writeDelta(Print& out, bool delta, uint32_t since) const {
+  out.print(delta ? ",\"full\":false,\"deleted\":[" : ",\"full\":true");
+  if (!delta) return;
+  StaticJsonDocument<16> id;  // Points at the tombstone's ID, no copy
+  bool first = true;
+  for (const Tombstone& tombstone : removed) {
+    if (tombstone.version <= since) continue;
+    if (!first) out.print(',');
+    first = false;
+    id.set(tombstone.id.c_str());
+    serializeJson(id, out);
+  }
+  out.print(']');
+}
+
+Book* Catalog::findBookById(const char* id) {
+  int slot = bookById.find(books, id);
+  return slot < 0 ? nullptr : &books[slot];
+}
+
+Book* Catalog::findBookByIsbn(const char* isbn) {
+  int slot = bookByIsbn.find(books, isbn);
+  return slot < 0 ? nullptr : &books[slot];
+}
+
+Book* Catalog::findBookByCard(const char* cardUid) {
+  int slot = bookByCard.find(books, cardUid);
+  return slot < 0 ? nullptr : &books[slot];
+}
+
+User* Catalog::findUserByCard(const char* cardUid) {
+  int slot = userByCard.find(users, cardUid);
+  return slot < 0 ? nullptr : &users[slot];
+}
+
+Book* Catalog::findBookByCard(const CardUid& uid) {
+  int slot = bookByCard.find(books, uid.hex().text, uid.hash());
+  return slot < 0 ? nullptr : &books[slot];
+}
+
+User* Catalog::findUserByCard(const CardUid& uid) {
+  int slot = userByCard.find(users, uid.hex().text, uid.hash());
+  return slot < 0 ? nullptr : &users[slot];
+}
+
+User* Catalog::findUserByStudentId(const char* studentId) {
+  int slot = userByStudentId.find(users, studentId);
+  return slot < 0 ? nullptr : &users[slot];
+}
+
+User* Catalog::findUserByUsername(const char* username) {
+  int slot = userByUsername.find(users, username);
+  return slot < 0 ? nullptr : &users[slot];
+}
+
+User* Catalog::findUserById(const char* id) {
+  User* user = findUserByStudentId(id);
+  return user ? user : findUserByUsername(id);
+}
+
+bool Catalog::cardInUse(const char* cardUid) {
+  return findUserByCard(cardUid) != nullptr || findBookByCard(cardUid) != nullptr;
+}
+
+Catalog::LoanOrder Catalog::loanOrder(JsonObject entry, size_t index) {
+  LoanOrder order;
+  order.stamp = entry["stamp"] | 0;
+  order.base = entry.containsKey("bases") ? (entry["bases"][index] | 0) : (entry["base"] | 0);
+  return order;
+}
+
+// Decide a stamped change against the book's last one (see applyMutation())
+// and record it if it wins. A book never lent under replication has stamp
+// 0, which any change made from it beats.
+bool Catalog::settle(Book& book, LoanOrder order) {
+  uint32_t current = book.loanStamp ? book.loanStamp : UINT32_MAX;
+  bool wins = order.base != book.loanBase ? order.base > book.loanBase : order.stamp < current;
+  if (!wins) {
+    conflicts++;
+    return false;
+  }
+  book.loanBase = order.base;
+  book.loanStamp = order.stamp;
+  return true;
+}
+
+TxResult Catalog::borrowBook(const char* bookId, const char* userId, time_t borrowDate,
+                             time_t returnDate, LoanOrder order) {
+  Book* book = findBookById(bookId);
+  if (!book) return TX_NOT_FOUND;
+  if (order.stamp) {
+    if (!settle(*book, order)) return TX_CONFLICT;
+    if (book->borrowed) {
+      // Lent elsewhere at the same time and lost: that loan never happened
+      loans.close(books, book - books.data());
+      conflicts++;
+    }
+  } else if (book->borrowed) {
+    return TX_CONFLICT;
+  }
+
+  book->borrowed = true;
+  book->borrowedBy = userId;
+  book->borrowDate = borrowDate;
+  book->returnDate = returnDate;
+  loans.open(books, book - books.data());
+  book->version = changeSeq;
+  bookVersions.touch(changeSeq);
+  return TX_OK;
+}
+
+TxResult Catalog::returnBook(const char* bookId, time_t returnedAt, LoanOrder order) {
+  Book* book = findBookById(bookId);
+  if (!book) return TX_NOT_FOUND;
+  if (order.stamp) {
+    if (!settle(*book, order)) return TX_CONFLICT;
+    if (!book->borrowed) {
+      conflicts++;  // Returned at two kiosks at once: it's back either way
+      return TX_OK;
+    }
+  } else if (!book->borrowed) {
+    return TX_CONFLICT;
+  }
+
+  loans.close(books, book - books.data());
+  // The journal entry is already durable, so a failed append only costs
+  // the history line (and is counted in /api/history/segments)
+  loanHistory.append(changeSeq, book->id.c_str(), book->borrowedBy.c_str(), book->borrowDate, returnedAt);
+
+  book->borrowed = false;
+  book->borrowedBy = "";
+  book->borrowDate = 0;
+  book->returnDate = 0;
+  book->version = changeSeq;
+  bookVersions.touch(changeSeq);
+  return TX_OK;
+}
+
+TxResult Catalog::addBook(JsonObject record) {
+  Book book;
+  bookFromJson(record, book);
+  if (book.id.length() == 0) return TX_INVALID;
+  if (findBookById(book.id.c_str())) return TX_CONFLICT;
+  if (cardInUse(book.cardUid.c_str())) return TX_CONFLICT;
+
+  book.version = changeSeq;
+  bookVersions.touch(changeSeq);
+  books.push_back(book);
+  // push_back may have moved every record, but slots are indexes so the
+  // tables stay valid - just add the new one
+  bookById.insert(books, books.size() - 1);
+  bookByIsbn.insert(books, books.size() - 1);
+  bookByCard.insert(books, books.size() - 1);
+  bookSearch.add(books, books.size() - 1);
+  return TX_OK;
+}
+
+TxResult Catalog::removeBook(const char* bookId, bool force) {
+  Book* book = findBookById(bookId);
+  if (!book) return TX_NOT_FOUND;
+  if (book->borrowed) {
+    if (!force) return TX_CONFLICT;  // Can't delete a book someone has
+    loans.close(books, book - books.data());
+    conflicts++;
+  }
+
+  bookVersions.remove(book->id, changeSeq);
+  books.erase(books.begin() + (book - books.data()));
+  rebuildBookIndexes();  // Slots after the removed one all shifted
+  return TX_OK;
+}
+
+TxResult Catalog::addUser(JsonObject record) {
+  User user;
+  userFromJson(record, user);
+  const char* id = user.studentId.length() > 0 ? user.studentId.c_str() : user.username.c_str();
+  if (id[0] == '\0' || user.password.empty()) return TX_INVALID;
+  if (findUserById(id)) return TX_CONFLICT;
+  if (cardInUse(user.cardUid.c_str())) return TX_CONFLICT;
+
+  user.version = changeSeq;
+  userVersions.touch(changeSeq);
+  users.push_back(user);
+  userByCard.insert(users, users.size() - 1);
+  userByStudentId.insert(users, users.size() - 1);
+  userByUsername.insert(users, users.size() - 1);
+  return TX_OK;
+}
+
+TxResult Catalog::removeUser(const char* userId) {
+  User* user = findUserById(userId);
+  if (!user) return TX_NOT_FOUND;
+
+  userVersions.remove(user->studentId.length() > 0 ? user->studentId : user->username, changeSeq);
+  users.erase(users.begin() + (user - users.data()));
+  rebuildUserIndexes();
+  return TX_OK;
+}
+
+// Not in any response, so no version changes
+TxResult Catalog::setPassword(const char* userId, const char* passwordHash) {
+  User* user = findUserById(userId);
+  if (!user) return TX_NOT_FOUND;
+  return user->password.decode(passwordHash) ? TX_OK : TX_INVALID;
+}
+
+// A batch is one transaction: every book must exist, appear once and be in
+// the right state, or nothing is written
+TxResult Catalog::validateMany(JsonArray bookIds, bool borrowing, const char* userId) {
+  if (bookIds.size() == 0) return TX_INVALID;
+  if (borrowing && !findUserById(userId)) return TX_NOT_FOUND;
+  for (JsonArray::iterator it = bookIds.begin(); it != bookIds.end(); ++it) {
+    const char* id = *it | "";
+    Book* book = findBookById(id);
+    if (!book) return TX_NOT_FOUND;
+    if (book->borrowed == borrowing) return TX_CONFLICT;
+    for (JsonArray::iterator earlier = bookIds.begin(); earlier != it; ++earlier) {
+      if (strcmp(*earlier | "", id) == 0) return TX_INVALID;
+    }
+  }
+  return TX_OK;
+}
+
+// The key of an "addBook"/"addUser" record
+static const char* recordKey(JsonObject record, bool book) {
+  return book ? record["id"] | "" : record["studentId"] | (record["username"] | "");
+}
+
+// A record to add: it needs a key (and an account a password), and
+// neither the key nor its card may be taken
+TxResult Catalog::validateNewRecord(JsonObject record, bool book) {
+  const char* id = recordKey(record, book);
+  if (id[0] == '\0') return TX_INVALID;
+  if (!book && !record["passwordHash"].is<const char*>() && !record["password"].is<const char*>()) {
+    return TX_INVALID;
+  }
+  bool taken = book ? findBookById(id) != nullptr : findUserById(id) != nullptr;
+  if (taken || cardInUse(record["cardUid"] | "")) return TX_CONFLICT;
+  return TX_OK;
+}
+
+// A bulk import batch is one transaction too: every record must be new to
+// the catalog and to the rest of the batch, or nothing is written
+TxResult Catalog::validateRecords(JsonArray records, bool books) {
+  if (records.size() == 0) return TX_INVALID;
+  for (JsonArray::iterator it = records.begin(); it != records.end(); ++it) {
+    JsonObject record = *it;
+    TxResult result = validateNewRecord(record, books);
+    if (result != TX_OK) return result;
+    const char* card = record["cardUid"] | "";
+    for (JsonArray::iterator earlier = records.begin(); earlier != it; ++earlier) {
+      JsonObject other = *earlier;
+      if (strcmp(recordKey(other, books), recordKey(record, books)) == 0) return TX_CONFLICT;
+      if (card[0] != '\0' && strcmp(other["cardUid"] | "", card) == 0) return TX_CONFLICT;
+    }
+  }
+  return TX_OK;
+}
+
+TxResult Catalog::validateMutation(JsonObject entry) {
+  const char* op = entry["op"] | "";
+  const char* bookId = entry["book"] | "";
+  const char* userId = entry["user"] | "";
+
+  if (strcmp(op, "borrow") == 0) {
+    Book* book = findBookById(bookId);
+    if (!book || !findUserById(userId)) return TX_NOT_FOUND;
+    return book->borrowed ? TX_CONFLICT : TX_OK;
+  }
+  if (strcmp(op, "return") == 0) {
+    Book* book = findBookById(bookId);
+    if (!book) return TX_NOT_FOUND;
+    return book->borrowed ? TX_OK : TX_CONFLICT;
+  }
+  if (strcmp(op, "borrowMany") == 0 || strcmp(op, "returnMany") == 0) {
+    return validateMany(entry["books"], op[0] == 'b', userId);
+  }
+  if (strcmp(op, "addBook") == 0) return validateNewRecord(entry["record"], true);
+  if (strcmp(op, "addBooks") == 0) return validateRecords(entry["records"], true);
+  if (strcmp(op, "removeBook") == 0) {
+    Book* book = findBookById(bookId);
+    if (!book) return TX_NOT_FOUND;
+    return book->borrowed ? TX_CONFLICT : TX_OK;
+  }
+  if (strcmp(op, "addUser") == 0) return validateNewRecord(entry["record"], false);
+  if (strcmp(op, "addUsers") == 0) return validateRecords(entry["records"], false);
+  if (strcmp(op, "removeUser") == 0) {
+    return findUserById(userId) ? TX_OK : TX_NOT_FOUND;
+  }
+  if (strcmp(op, "setPassword") == 0) {
+    if (!findUserById(userId)) return TX_NOT_FOUND;
+    return PasswordHash().decode(entry["passwordHash"] | "") ? TX_OK : TX_INVALID;
+  }
+  return TX_INVALID;
+}
+
+TxResult Catalog::applyMutation(JsonObject entry) {
+  const char* op = entry["op"] | "";
+  const char* bookId = entry["book"] | "";
+  const char* userId = entry["user"] | "";
+  changeSeq = entry["seq"] | 0;  // Unnumbered legacy entries change no versions
+
+  if (strcmp(op, "borrow") == 0) {
+    return borrowBook(bookId, userId, parseIsoTime(entry["borrowDate"] | ""),
+                      parseIsoTime(entry["returnDate"] | ""), loanOrder(entry, 0));
+  }
+  if (strcmp(op, "return") == 0) {
+    return returnBook(bookId, parseIsoTime(entry["returnedAt"] | ""), loanOrder(entry, 0));
+  }
+  if (strcmp(op, "borrowMany") == 0 || strcmp(op, "returnMany") == 0) {
+    // Validated as a whole before it was journaled, so every book applies
+    bool borrowing = op[0] == 'b';
+    time_t borrowDate = parseIsoTime(entry["borrowDate"] | "");
+    time_t returnDate = parseIsoTime(entry["returnDate"] | "");
+    time_t returnedAt = parseIsoTime(entry["returnedAt"] | "");
+    TxResult result = TX_OK;
+    size_t index = 0;
+    for (JsonVariant id : entry["books"].as<JsonArray>()) {
+      LoanOrder order = loanOrder(entry, index++);
+      TxResult one = borrowing ? borrowBook(id | "", userId, borrowDate, returnDate, order)
+                               : returnBook(id | "", returnedAt, order);
+      if (one != TX_OK) result = one;
+    }
+    return result;
+  }
+  if (strcmp(op, "addBook") == 0) return addBook(entry["record"]);
+  if (strcmp(op, "removeBook") == 0) return removeBook(bookId, entry.containsKey("stamp"));
+  if (strcmp(op, "addUser") == 0) return addUser(entry["record"]);
+  if (strcmp(op, "addBooks") == 0 || strcmp(op, "addUsers") == 0) {
+    // Like borrowMany, validated as a whole before it was journaled
+    bool books = op[3] == 'B';
+    TxResult result = TX_OK;
+    for (JsonObject record : entry["records"].as<JsonArray>()) {
+      TxResult one = books ? addBook(record) : addUser(record);
+      if (one != TX_OK) result = one;
+    }
+    return result;
+  }
+  if (strcmp(op, "removeUser") == 0) return removeUser(userId);
+  if (strcmp(op, "setPassword") == 0) return setPassword(userId, entry["passwordHash"] | "");
+
+  Serial.println("Unknown journal op: " + String(op));
+  return TX_INVALID;
+}
+
+size_t Catalog::writeBooks(Print& out, const BookQuery& query) const {
+  DynamicJsonDocument doc(RECORD_DOC_SIZE);
+  size_t matched = 0;
+  size_t written = 0;
+  bool delta = query.delta && bookVersions.reaches(query.since);
+
+  out.print("{\"books\":[");
+  for (const Book& book : books) {
+    if (delta && book.version <= query.since) continue;
+    if (!query.matches(book)) continue;
+    // Keep counting past the page so clients get the total for paging
+    if (matched++ < query.offset || written >= query.limit) continue;
+    if (written++ > 0) out.print(',');
+    doc.clear();
+    bookToJson(book, doc.to<JsonObject>(), query.fields);
+    serializeJson(doc, out);
+  }
+  out.print("],\"version\":");
+  out.print((unsigned long)bookVersions.current);
+  if (query.delta) bookVersions.writeDelta(out, delta, query.since);
+  out.print(",\"offset\":");
+  out.print((unsigned long)query.offset);
+  out.print(",\"total\":");
+  out.print((unsigned long)matched);
+  out.print('}');
+  return matched;
+}
+
+size_t Catalog::writeSearch(Print& out, const char* text, const BookQuery& query) const {
+  std::vector<uint8_t> scores;
+  bookSearch.search(books, text, scores);
+  std::vector<uint32_t> hits;
+  for (size_t slot = 0; slot < books.size(); slot++) {
+    if (scores[slot] > 0 && query.matches(books[slot])) hits.push_back(slot);
+  }
+
+  // Best first, catalog order among equals. Only hits up to the end of the
+  // requested page need to be in order.
+  size_t end = std::min(hits.size(), query.offset + std::min(query.limit, hits.size()));
+  std::partial_sort(hits.begin(), hits.begin() + end, hits.end(), [&](uint32_t a, uint32_t b) {
+    return scores[a] != scores[b] ? scores[a] > scores[b] : a < b;
+  });
+
+  DynamicJsonDocument doc(RECORD_DOC_SIZE);
+  out.print("{\"books\":[");
+  for (size_t i = query.offset; i < end; i++) {
+    if (i > query.offset) out.print(',');
+    doc.clear();
+    JsonObject book = doc.to<JsonObject>();
+    bookToJson(books[hits[i]], book, query.fields);
+    book["score"] = scores[hits[i]];
+    serializeJson(doc, out);
+  }
+  out.print("],\"offset\":");
+  out.print((unsigned long)query.offset);
+  out.print(",\"total\":");
+  out.print((unsigned long)hits.size());
+  out.print('}');
+  return hits.size();
+}
+
+size_t Catalog::writeUsers(Print& out, const UserQuery& query) const {
+  DynamicJsonDocument doc(512);
+  size_t matched = 0;
+  size_t written = 0;
+  bool delta = query.delta && userVersions.reaches(query.since);
+
+  out.print("{\"users\":[");
+  for (const User& user : users) {
+    if (delta && user.version <= query.since) continue;
+    if (query.type.length() > 0 && user.type != query.type) continue;
+    if (matched++ < query.offset || written >= query.limit) continue;
+    if (written++ > 0) out.print(',');
+    doc.clear();
+    userToJson(user, doc.to<JsonObject>(), false);
+    serializeJson(doc, out);
+  }
+  out.print("],\"version\":");
+  out.print((unsigned long)userVersions.current);
+  if (query.delta) userVersions.writeDelta(out, delta, query.since);
+  out.print(",\"offset\":");
+  out.print((unsigned long)query.offset);
+  out.print(",\"total\":");
+  out.print((unsigned long)matched);
+  out.print('}');
+  return matched;
+}
+
+size_t Catalog::writeOverdue(Print& out, time_t now, const OverdueQuery& query) {
+  loans.advance(books, now);
+  const char* user = query.user.c_str();
+  OverdueTotals totals = user[0] ? loans.totalsFor(user, now) : loans.totals(now);
+  DynamicJsonDocument doc(512);
+  size_t matched = 0;
+  size_t written = 0;
+
+  out.print("{\"overdue\":[");
+  for (const LoanSchedule::Loan& loan : loans.overdue()) {
+    const Book& book = books[loan.slot];
+    if (user[0] && book.borrowedBy != user) continue;
+    if (matched++ < query.offset || written >= query.limit) continue;
+    if (written++ > 0) out.print(',');
+    uint32_t days = LoanSchedule::daysLate(loan.due, now);
+    doc.clear();
+    doc["book"] = book.id;
+    doc["title"] = book.title;
+    doc["user"] = book.borrowedBy;
+    doc["returnDate"] = formatIsoTime(loan.due);
+    doc["days"] = days;
+    doc["penalty"] = days * PENALTY_PER_DAY;
+    serializeJson(doc, out);
+  }
+  out.print("],\"books\":");
+  out.print((unsigned long)totals.books);
+  out.print(",\"penalty\":");
+  out.print((unsigned long)totals.penalty);
+  out.print(",\"offset\":");
+  out.print((unsigned long)query.offset);
+  out.print(",\"total\":");
+  out.print((unsigned long)matched);
+  out.print('}');
+  return matched;
+}
+
+size_t Catalog::moveHistoryToLog(uint32_t seq) {
+  // Every closed loan, ordered by when it was returned, so the log reads
+  // oldest first like one written as the loans came back
+  struct Closed {
+    uint32_t returnDate;
+    uint32_t slot;
+    uint32_t loan;
+  };
+  std::vector<Closed> closed;
+  size_t withHistory = 0;
+  for (size_t slot = 0; slot < books.size(); slot++) {
+    const std::vector<LoanRecord>& history = books[slot].history;
+    if (history.empty()) continue;
+    withHistory++;
+    for (size_t i = 0; i < history.size(); i++) {
+      if (history[i].returnDate > 0) closed.push_back({(uint32_t)history[i].returnDate, (uint32_t)slot, (uint32_t)i});
+    }
+  }
+  std::stable_sort(closed.begin(), closed.end(),
+                   [](const Closed& a, const Closed& b) { return a.returnDate < b.returnDate; });
+
+  if (loanHistory.empty() || seq > loanHistory.lastSeq()) {
+    loanHistory.beginBulk();
+    for (const Closed& entry : closed) {
+      const Book& book = books[entry.slot];
+      const LoanRecord& loan = book.history[entry.loan];
+      loanHistory.append(seq, book.id.c_str(), loan.username.c_str(), loan.borrowDate, loan.returnDate);
+    }
+    loanHistory.endBulk();
+    Serial.println("Moved " + String(closed.size()) + " loans into the history log");
+  }
+  for (Book& book : books) std::vector<LoanRecord>().swap(book.history);
+  return withHistory;
+}
+
+size_t Catalog::writeHistory(Print& out, const HistoryQuery& query) {
+  std::vector<HistoryRecord> page;
+  size_t matched = loanHistory.find(query, page);
+  DynamicJsonDocument doc(512);
+
+  out.print("{\"history\":[");
+  for (size_t i = 0; i < page.size(); i++) {
+    const HistoryRecord& record = page[i];
+    if (i > 0) out.print(',');
+    doc.clear();
+    doc["book"] = record.book;
+    const Book* book = findBookById(record.book);
+    if (book) {
+      doc["title"] = book->title;
+    } else {
+      doc["title"] = nullptr;
+    }
+    doc["user"] = record.user;
+    char date[ISO_TIME_SIZE];
+    doc["borrowDate"] = isoOrEmpty(record.borrowDate, date);
+    doc["returnDate"] = isoOrEmpty(record.returnDate, date);
+    serializeJson(doc, out);
+  }
+  out.print("],\"offset\":");
+  out.print((unsigned long)query.offset);
+  out.print(",\"total\":");
+  out.print((unsigned long)matched);
+  out.print('}');
+  return matched;
+}
+
+bool BookQuery::matches(const Book& book) const {
+  if (borrowed >= 0 && book.borrowed != (borrowed == 1)) return false;
+  if (floor.length() > 0 && book.floor != floor) return false;
+  if (borrowedBy.length() > 0 && (!book.borrowed || book.borrowedBy != borrowedBy)) return false;
+  return true;
+}
+
+uint16_t parseBookFields(const char* list) {
+  static const struct {
+    const char* name;
+    uint16_t bit;
+  } names[] = {
+    {"id", BOOK_ID}, {"isbn", BOOK_ISBN}, {"title", BOOK_TITLE}, {"author", BOOK_AUTHOR},
+    {"shelf", BOOK_SHELF}, {"floor", BOOK_FLOOR}, {"borrowed", BOOK_BORROWED},
+    {"borrowedBy", BOOK_BORROWED_BY}, {"borrowDate", BOOK_BORROW_DATE},
+    {"returnDate", BOOK_RETURN_DATE}, {"cardUid", BOOK_CARD_UID},
+  };
+
+  uint16_t fields = 0;
+  while (*list) {
+    const char* end = strchr(list, ',');
+    size_t length = end ? (size_t)(end - list) : strlen(list);
+    for (const auto& field : names) {
+      if (strlen(field.name) == length && strncmp(field.name, list, length) == 0) {
+        fields |= field.bit;
+      }
+    }
+    list += length;
+    if (*list == ',') list++;
+  }
+  return fields;
+}
+
+void bookFromJson(JsonObject obj, Book& book) {
+  book.id = obj["id"] | "";
+  book.isbn = obj["isbn"] | "";
+  book.title = obj["title"] | "";
+  book.author = obj["author"] | "";
+  book.shelf = obj["shelf"] | "";
+  book.floor = obj["floor"] | "";
+  book.borrowed = obj["borrowed"] | false;
+  book.borrowedBy = obj["borrowedBy"] | "";
+  book.borrowDate = parseIsoTime(obj["borrowDate"] | "");
+  book.returnDate = parseIsoTime(obj["returnDate"] | "");
+  book.cardUid = obj["cardUid"] | "";
+
+  book.history.clear();
+  for (JsonObject entry : obj["history"].as<JsonArray>()) {
+    LoanRecord record;
+    record.username = entry["username"] | "";
+    record.borrowDate = parseIsoTime(entry["borrowDate"] | "");
+    record.returnDate = parseIsoTime(entry["returnDate"] | "");
+    book.history.push_back(record);
+  }
+}
+
+void bookToJson(const Book& book, JsonObject obj, uint16_t fields) {
+  if (fields & BOOK_ID) obj["id"] = book.id;
+  if (fields & BOOK_ISBN) obj["isbn"] = book.isbn;
+  if (fields & BOOK_TITLE) obj["title"] = book.title;
+  if (fields & BOOK_AUTHOR) obj["author"] = book.author;
+  if (fields & BOOK_SHELF) obj["shelf"] = book.shelf;
+  if (fields & BOOK_FLOOR) obj["floor"] = book.floor;
+  if (fields & BOOK_BORROWED) obj["borrowed"] = book.borrowed;
+  if (book.borrowed) {
+    char date[ISO_TIME_SIZE];
+    if (fields & BOOK_BORROWED_BY) obj["borrowedBy"] = book.borrowedBy;
+    if (fields & BOOK_BORROW_DATE) obj["borrowDate"] = isoOrEmpty(book.borrowDate, date);
+    if (fields & BOOK_RETURN_DATE) obj["returnDate"] = isoOrEmpty(book.returnDate, date);
+  }
+  if (fields & BOOK_CARD_UID) obj["cardUid"] = book.cardUid;
+}
+
+void userFromJson(JsonObject obj, User& user) {
+  user.type = obj["type"] | "";
+  user.username = obj["username"] | "";
+  user.studentId = obj["studentId"] | "";
+  user.password.load(obj["passwordHash"] | (obj["password"] | ""));
+  user.name = obj["name"] | "";
+  user.email = obj["email"] | "";
+  user.cardUid = obj["cardUid"] | "";
+}
+
+void userToJson(const User& user, JsonObject obj, bool includePasswordHash) {
+  obj["type"] = user.type;
+  // Only emit the fields that belong to this account type
+  if (user.username.length() > 0) obj["username"] = user.username;
+  if (user.studentId.length() > 0) obj["studentId"] = user.studentId;
+  if (includePasswordHash) obj["passwordHash"] = user.password.encode();
+  if (user.name.length() > 0) obj["name"] = user.name;
+  if (user.email.length() > 0) obj["email"] = user.email;
+  obj["cardUid"] = user.cardUid;
+}
@@ -0,0 +1,302 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <stdint.h>
+#include <time.h>
+#include <vector>
+
+#include "hashindex.h"
+#include "history.h"
+#include "loans.h"
+#include "password.h"
+#include "search.h"
+#include "uid.h"
+
+// One entry in a book's lending history, as older snapshots and uploads
+// carry it (see Catalog::moveHistoryToLog())
+struct LoanRecord {
+  String username;        // Student ID or staff username of the borrower
+  time_t borrowDate = 0;  // Unix seconds
+  time_t returnDate = 0;  // 0 while the loan is still open
+};
+
+// A library book. Dates are kept as Unix seconds and only become ISO-8601
+// strings at the JSON boundary.
+struct Book {
+  String id;
+  String isbn;
+  String title;
+  String author;
+  String shelf;
+  String floor;
+  bool borrowed = false;
+  String borrowedBy;  // Empty when the book is available
+  time_t borrowDate = 0;
+  time_t returnDate = 0;
+  String cardUid;     // RFID tag stuck in the book, empty if none assigned
+  std::vector<LoanRecord> history;  // Only until moved into the history log
+  uint32_t version = 0;  // Journal seq of the last change (see Catalog::booksVersion())
+  uint32_t loanStamp = 0;  // Replication stamp of the last lend or return, 0 if none
+  uint32_t loanBase = 0;   // ...and the stamp the book had when it was made
+};
+
+// A student or staff account
+struct User {
+  String type;       // "student" or "staff"
+  String username;   // Staff login name
+  String studentId;  // Student login ID
+  PasswordHash password;  // Never the password itself (see password.h)
+  String name;
+  String email;
+  String cardUid;
+  uint32_t version = 0;  // Journal seq of the last change
+};
+
+static_assert(HashIndex<Book>::hashKey("53C4734302A380") == CardUid::fromHex("53c4734302a380").hash(),
+              "CardUid::hash() must match the card indexes");
+
+// Book fields that can be selected with ?fields= on GET /api/books
+enum BookField : uint16_t {
+  BOOK_ID          = 1 << 0,
+  BOOK_ISBN        = 1 << 1,
+  BOOK_TITLE       = 1 << 2,
+  BOOK_AUTHOR      = 1 << 3,
+  BOOK_SHELF       = 1 << 4,
+  BOOK_FLOOR       = 1 << 5,
+  BOOK_BORROWED    = 1 << 6,
+  BOOK_BORROWED_BY = 1 << 7,
+  BOOK_BORROW_DATE = 1 << 8,
+  BOOK_RETURN_DATE = 1 << 9,
+  BOOK_CARD_UID    = 1 << 10,
+  BOOK_ALL_FIELDS  = 0x07FF
+};
+
+// Turn "id,title,author" into a BookField mask (unknown names - including
+// "history", which is now served by GET /api/history - are ignored)
+uint16_t parseBookFields(const char* list);
+
+// Filter, projection and paging for GET /api/books
+struct BookQuery {
+  size_t offset = 0;
+  size_t limit = SIZE_MAX;
+  int8_t borrowed = -1;   // -1 = any, 0 = available only, 1 = borrowed only
+  String floor;           // Empty = any floor
+  String borrowedBy;      // Empty = any borrower
+  uint16_t fields = BOOK_ALL_FIELDS;
+  bool delta = false;     // ?since= given: only what changed after `since`
+  uint32_t since = 0;
+
+  bool matches(const Book& book) const;
+};
+
+// Filter and paging for GET /api/users
+struct UserQuery {
+  size_t offset = 0;
+  size_t limit = SIZE_MAX;
+  String type;            // "student", "staff" or empty for both
+  bool delta = false;     // As for BookQuery
+  uint32_t since = 0;
+};
+
+// Filter and paging for GET /api/overdue
+struct OverdueQuery {
+  size_t offset = 0;
+  size_t limit = SIZE_MAX;
+  String user;            // Empty for every borrower
+};
+
+// Outcome of a catalog transaction
+enum TxResult {
+  TX_OK,
+  TX_NOT_FOUND,  // No such book or user
+  TX_CONFLICT,   // Already borrowed / not borrowed / duplicate key
+  TX_INVALID,    // Malformed mutation
+  TX_IO_ERROR    // Could not be made durable
+};
+
+// Resident copy of the books and users databases with O(1) lookups.
+// Snapshots are loaded once at boot; after that every change goes through
+// applyMutation() so live updates and journal replay share one code path.
+class Catalog {
+ public:
+  Catalog();
+
+  // Load a binary snapshot or a JSON file (hand-written, uploaded or from
+  // older firmware - the format is detected). *snapshotSeq receives the last
+  // journal sequence already folded into it, 0 if it has none. False if
+  // the file doesn't read to the end; the collection is then left as it was.
+  // With `previous`, the replaced collection is handed back there instead of
+  // freed, so a caller can undo the load with restoreBooks()/restoreUsers().
+  bool loadBooks(const char* path, uint32_t* snapshotSeq, std::vector<Book>* previous = nullptr);
+  bool loadUsers(const char* path, uint32_t* snapshotSeq, std::vector<User>* previous = nullptr);
+
+  // Put back a collection handed out by loadBooks()/loadUsers()
+  void restoreBooks(std::vector<Book>& previous);
+  void restoreUsers(std::vector<User>& previous);
+
+  // Check a mutation against the current state without changing anything,
+  // so it can be rejected before it is written to the journal
+  TxResult validateMutation(JsonObject entry);
+
+  // Apply one mutation: {"op":"borrow"|"return"|"addBook"|"removeBook"|
+  // "addUser"|"removeUser"|"setPassword", ...}. "borrowMany"/"returnMany"
+  // carry a "books" array instead of "book" and lend or return all of them
+  // at once; "addBooks"/"addUsers" (bulk import, see bulk.h) a "records"
+  // array. "setPassword" replaces a "user"'s "passwordHash" (an outdated
+  // hash upgraded at login).
+  //
+  // Mutations shared between kiosks (see replication.h) also carry a
+  // "stamp", and lends and returns the loanStamp each book had where they
+  // were made: "base", or "bases" beside "books". Of two changes to one
+  // book, the one made from the later state wins; made from the same
+  // state - two kiosks lending the same copy at once - the lower stamp
+  // wins, and a loan it displaces is dropped without history. Any order of
+  // arrival ends in the same loan. A stamped removeBook also ends a loan
+  // made concurrently elsewhere.
+  TxResult applyMutation(JsonObject entry);
+
+  // Stamped changes that lost to another or displaced one, since boot
+  uint32_t loanConflicts() const { return conflicts; }
+
+  Book* findBookById(const char* id);
+  Book* findBookByIsbn(const char* isbn);
+  Book* findBookByCard(const char* cardUid);
+  Book* findBookByCard(const CardUid& uid);  // No String, no allocation
+
+  User* findUserByCard(const char* cardUid);
+  User* findUserByCard(const CardUid& uid);
+  User* findUserByStudentId(const char* studentId);
+  User* findUserByUsername(const char* username);
+  User* findUserById(const char* id);  // Student ID or staff username
+
+  // True if any user or book already owns this card
+  bool cardInUse(const char* cardUid);
+
+  const std::vector<Book>& allBooks() const { return books; }
+  const std::vector<User>& allUsers() const { return users; }
+
+  // Each collection has a version: the journal seq of its latest change.
+  // Records carry the seq of their own last change and removals leave a
+  // tombstone, so a client holding version N can be sent only what changed
+  // after it. Versions never go backwards, reboots included.
+  uint32_t booksVersion() const { return bookVersions.current; }
+  uint32_t usersVersion() const { return userVersions.current; }
+
+  // Stamp every record with `version` after a bulk replace, when what
+  // changed is unknown - clients holding anything older get a full copy
+  void resetBookVersions(uint32_t version);
+  void resetUserVersions(uint32_t version);
+
+  // Serialize the records matching a query as
+  // {"books":[...],"version":V,"offset":N,"total":M} / {"users":[...],...}.
+  // With query.delta, only records changed after query.since are written,
+  // followed by "full":false and the "deleted" IDs - or, when the tombstones
+  // no longer reach back that far, everything and "full":true.
+  // Records are written one at a time, so memory use doesn't depend on how
+  // many there are. Returns the number of matching records.
+  size_t writeBooks(Print& out, const BookQuery& query) const;
+  size_t writeUsers(Print& out, const UserQuery& query) const;  // Without password hashes
+
+  // Ranked search over title, author, isbn, shelf and floor, written like
+  // writeBooks() with a "score" on each book, best first. The query's
+  // filters and projection apply to the hits.
+  size_t writeSearch(Print& out, const char* text, const BookQuery& query) const;
+  const SearchIndex& searchIndex() const { return bookSearch; }
+
+  // Open loans by due date, with what is overdue brought up to `now` first
+  const LoanSchedule& loansAt(time_t now) {
+    loans.advance(books, now);
+    return loans;
+  }
+
+  // Serialize the loans overdue at `now`, oldest first, as
+  // {"overdue":[{"book","title","user","returnDate","days","penalty"},...],
+  // "books":N,"penalty":P,"offset":N,"total":M} - books and penalty being
+  // the totals for query.user, or for everyone. Returns the number listed.
+  size_t writeOverdue(Print& out, time_t now, const OverdueQuery& query);
+
+  // Move the lending history that came in with the books (older snapshots
+  // and uploads) into loanHistory, stamped with `seq`, oldest return first.
+  // Open loans are left out - the book itself records them. Loans an
+  // interrupted earlier boot already moved are not logged twice. Returns
+  // how many books had history, so the caller knows to snapshot.
+  size_t moveHistoryToLog(uint32_t seq);
+
+  // Serialize a page of loanHistory, newest first, as
+  // {"history":[{"book","title","user","borrowDate","returnDate"},...],
+  // "offset":N,"total":M} - title null for books no longer in the catalog.
+  // Returns the number of matching loans.
+  size_t writeHistory(Print& out, const HistoryQuery& query);
+
+ private:
+  // Where a lend or return stands in replication order; stamp 0 for an
+  // unstamped (local-only or older) mutation
+  struct LoanOrder {
+    uint32_t base = 0;
+    uint32_t stamp = 0;
+  };
+  static LoanOrder loanOrder(JsonObject entry, size_t index);
+  bool settle(Book& book, LoanOrder order);
+
+  TxResult borrowBook(const char* bookId, const char* userId, time_t borrowDate, time_t returnDate,
+                      LoanOrder order);
+  TxResult returnBook(const char* bookId, time_t returnedAt, LoanOrder order);
+  TxResult validateMany(JsonArray bookIds, bool borrowing, const char* userId);
+  TxResult validateNewRecord(JsonObject record, bool book);
+  TxResult validateRecords(JsonArray records, bool books);
+  TxResult addBook(JsonObject record);
+  TxResult removeBook(const char* bookId, bool force);
+  TxResult addUser(JsonObject record);
+  TxResult removeUser(const char* userId);
+  TxResult setPassword(const char* userId, const char* passwordHash);
+
+  void rebuildBookIndexes();
+  void rebuildUserIndexes();
+
+  // Change tracking for one collection (see booksVersion())
+  struct Tombstone {
+    String id;
+    uint32_t version;
+  };
+  struct Versions {
+    uint32_t current = 0;
+    uint32_t floor = 0;               // Oldest version a delta can start from
+    std::vector<Tombstone> removed;   // Oldest first, at most MAX_TOMBSTONES
+
+    void reset(uint32_t version);
+    void touch(uint32_t version) {
+      if (version > current) current = version;
+    }
+    void remove(const String& id, uint32_t version);
+    bool reaches(uint32_t since) const { return since >= floor && since <= current; }
+    void writeDelta(Print& out, bool delta, uint32_t since) const;
+  };
+  static const size_t MAX_TOMBSTONES = 64;
+
+  Versions bookVersions;
+  Versions userVersions;
+  uint32_t changeSeq = 0;  // Seq of the mutation being applied
+  uint32_t conflicts = 0;
+
+  std::vector<Book> books;
+  std::vector<User> users;
+
+  HashIndex<Book> bookById;
+  HashIndex<Book> bookByIsbn;
+  HashIndex<Book> bookByCard;
+  HashIndex<User> userByCard;
+  HashIndex<User> userByStudentId;
+  HashIndex<User> userByUsername;
+  SearchIndex bookSearch;
+  LoanSchedule loans;
+};
+
+// JSON conversion helpers shared by the API handlers
+void bookFromJson(JsonObject obj, Book& book);
+void bookToJson(const Book& book, JsonObject obj, uint16_t fields = BOOK_ALL_FIELDS);
+// "passwordHash" is the stored form; a "password" in plaintext is hashed
+void userFromJson(JsonObject obj, User& user);
+void userToJson(const User& user, JsonObject obj, bool includePasswordHash);
+
+extern Catalog catalog;
@@ -0,0 +1,40 @@
+#include "chunked.h"
+
+#include <algorithm>
+
+ChunkedResponse::ChunkedResponse(HttpServer& server, int code, const char* contentType)
+    : server(server) {
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(code, contentType, "");
+}
+
+size_t ChunkedResponse::write(uint8_t c) {
+  return write(&c, 1);
+}
+
+size_t ChunkedResponse::write(const uint8_t* data, size_t length) {
+  if (finished) return 0;
+  size_t remaining = length;
+  while (remaining > 0) {
+    size_t n = std::min(remaining, BUFFER_SIZE - used);
+    memcpy(buffer + used, data, n);
+    used += n;
+    data += n;
+    remaining -= n;
+    if (used == BUFFER_SIZE) flush();
+  }
+  return length;
+}
+
+void ChunkedResponse::flush() {
+  if (used == 0) return;
+  server.sendContent(buffer, used);
+  used = 0;
+}
+
+void ChunkedResponse::end() {
+  if (finished) return;
+  flush();
+  server.sendContent("");  // Zero-length chunk ends the response
+  finished = true;
+}
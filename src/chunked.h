@@ -0,0 +1,30 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "httpserver.h"
+
+// Print target that streams a response body with chunked transfer encoding.
+// Output is collected in a small fixed buffer and sent whenever it fills, so
+// a response of any size costs the same amount of heap.
+class ChunkedResponse : public Print {
+ public:
+  ChunkedResponse(HttpServer& server, int code, const char* contentType);
+  ~ChunkedResponse() { end(); }
+
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t* data, size_t length) override;
+
+  // Flush what's buffered and send the terminating chunk
+  void end();
+
+ private:
+  static const size_t BUFFER_SIZE = 512;
+
+  void flush();
+
+  HttpServer& server;
+  char buffer[BUFFER_SIZE];
+  size_t used = 0;
+  bool finished = false;
+};
@@ -0,0 +1,60 @@
+#include "clock.h"
+
+#include <sys/time.h>
+
+// Anything before 2020 means the RTC was never set since power-on
+static const time_t MIN_VALID_EPOCH = 1577836800;
+
+// Don't keep nudging the clock for small differences between browsers
+static const time_t MAX_DRIFT_SECONDS = 60;
+
+void clockSync(time_t epoch) {
+  if (epoch < MIN_VALID_EPOCH) return;
+  time_t now = time(nullptr);
+  if (now >= MIN_VALID_EPOCH && labs((long)(now - epoch)) <= MAX_DRIFT_SECONDS) return;
+
+  struct timeval tv = { epoch, 0 };
+  settimeofday(&tv, nullptr);
+  Serial.println("Clock set from client: " + formatIsoTime(epoch));
+}
+
+bool clockValid() {
+  return time(nullptr) >= MIN_VALID_EPOCH;
+}
+
+time_t clockNow() {
+  return clockValid() ? time(nullptr) : 0;
+}
+
+void formatIsoTime(time_t epoch, char* out, size_t size) {
+  struct tm tm;
+  gmtime_r(&epoch, &tm);
+  strftime(out, size, "%Y-%m-%dT%H:%M:%SZ", &tm);
+}
+
+String formatIsoTime(time_t epoch) {
+  char buffer[ISO_TIME_SIZE];
+  formatIsoTime(epoch, buffer, sizeof(buffer));
+  return String(buffer);
+}
+
+// Days since 1970-01-01 for a proleptic Gregorian date (avoids timegm(),
+// which newlib doesn't provide)
+static long daysFromCivil(int y, unsigned m, unsigned d) {
+  y -= m <= 2;
+  const long era = (y >= 0 ? y : y - 399) / 400;
+  const unsigned yoe = (unsigned)(y - era * 400);
+  const unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + (long)doe - 719468;
+}
+
+time_t parseIsoTime(const char* iso) {
+  if (iso == nullptr) return 0;
+  int year, month, day, hour = 0, minute = 0, second = 0;
+  if (sscanf(iso, "%d-%d-%dT%d:%d:%d", &year, &month, &day, &hour, &minute, &second) < 3) {
+    return 0;
+  }
+  if (month < 1 || month > 12 || day < 1 || day > 31) return 0;
+  return (time_t)daysFromCivil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <Arduino.h>
+#include <time.h>
+
+// The kiosk runs its own access point with no internet, so there is no NTP.
+// Browsers send their clock with every transaction and we adopt it until the
+// next reboot.
+
+// Adopt the given Unix time if our clock is unset or has drifted noticeably
+void clockSync(time_t epoch);
+
+// True once the clock has been set from a client
+bool clockValid();
+
+// Current Unix time (seconds), 0 if the clock was never set
+time_t clockNow();
+
+// Format as ISO-8601 UTC, e.g. "2025-04-02T10:15:00Z"
+String formatIsoTime(time_t epoch);
+
+// Same into a caller's buffer of at least ISO_TIME_SIZE bytes, without
+// touching the heap
+const size_t ISO_TIME_SIZE = 24;
+void formatIsoTime(time_t epoch, char* out, size_t size);
+
+// Parse an ISO-8601 UTC timestamp written by formatIsoTime() or a browser's
+// toISOString(); returns 0 on failure
+time_t parseIsoTime(const char* iso);
@@ -0,0 +1,236 @@
+#include "datafs.h"
+
+#include <LittleFS.h>
+#include <SPIFFS.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+
+#include <algorithm>
+
+#include "journal.h"  // crc32Update
+
+static const char* MIGRATING_PATH = "/migrating";  // Written before the files, removed after
+
+static bool littleFs = false;
+static const char* migration = "none";
+
+fs::FS& dataFs() {
+  if (littleFs) return LittleFS;
+  return SPIFFS;
+}
+
+const char* dataFsName() {
+  return littleFs ? "littlefs" : "spiffs";
+}
+
+size_t dataFsTotalBytes() {
+  return littleFs ? LittleFS.totalBytes() : SPIFFS.totalBytes();
+}
+
+size_t dataFsUsedBytes() {
+  return littleFs ? LittleFS.usedBytes() : SPIFFS.usedBytes();
+}
+
+const char* dataFsMigration() {
+  return migration;
+}
+
+bool replaceFile(const String& tmpPath, const String& path) {
+  if (!littleFs) dataFs().remove(path);
+  return dataFs().rename(tmpPath, path);
+}
+
+// The staged copy in the spare app slot: a header alone in the first
+// sector, written last, then every file as (u16 path length, path, u32
+// length, data). A header that is there with a CRC that matches means the
+// copy is whole.
+static const char STAGE_MAGIC[4] = {'L', 'M', 'I', 'G'};
+static const size_t STAGE_DATA = SPI_FLASH_SEC_SIZE;
+static const size_t COPY_CHUNK = 512;
+static const size_t MAX_PATH = 64;
+
+struct StageHeader {
+  char magic[4];
+  uint32_t files;
+  uint32_t bytes;  // Of the entries after the header's sector
+  uint32_t crc;    // CRC-32 of those
+};
+
+static size_t stageCapacity(const esp_partition_t* slot) {
+  return slot && slot->size > STAGE_DATA ? slot->size - STAGE_DATA : 0;
+}
+
+static bool readStage(const esp_partition_t* slot, StageHeader& header) {
+  if (!slot || esp_partition_read(slot, 0, &header, sizeof(header)) != ESP_OK ||
+      memcmp(header.magic, STAGE_MAGIC, sizeof(STAGE_MAGIC)) != 0 || header.bytes > stageCapacity(slot)) {
+    return false;
+  }
+  uint8_t chunk[COPY_CHUNK];
+  uint32_t crc = 0;
+  for (size_t done = 0; done < header.bytes;) {
+    size_t n = std::min(sizeof(chunk), (size_t)header.bytes - done);
+    if (esp_partition_read(slot, STAGE_DATA + done, chunk, n) != ESP_OK) return false;
+    crc = crc32Update(crc, chunk, n);
+    done += n;
+  }
+  return crc == header.crc;
+}
+
+static void clearStage(const esp_partition_t* slot) {
+  esp_partition_erase_range(slot, 0, SPI_FLASH_SEC_SIZE);
+}
+
+// Copy everything on the mounted SPIFFS partition into the spare slot and
+// read it back. False, with dataFsMigration() saying why, if there is no
+// slot, the files don't fit or the copy didn't take.
+static bool stageSpiffs(const esp_partition_t* slot, StageHeader& header) {
+  if (!slot) {
+    migration = "no spare slot";
+    return false;
+  }
+  size_t needed = 0;
+  File root = SPIFFS.open("/");
+  for (File file = root.openNextFile(); file; file = root.openNextFile()) {
+    if (strlen(file.path()) >= MAX_PATH) {
+      migration = "failed";
+      return false;
+    }
+    needed += sizeof(uint16_t) + strlen(file.path()) + sizeof(uint32_t) + file.size();
+  }
+  root.close();
+  if (needed > stageCapacity(slot)) {
+    migration = "too big";
+    return false;
+  }
+  size_t sectors = (STAGE_DATA + needed + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE;
+  if (esp_partition_erase_range(slot, 0, sectors * SPI_FLASH_SEC_SIZE) != ESP_OK) {
+    migration = "failed";
+    return false;
+  }
+
+  memcpy(header.magic, STAGE_MAGIC, sizeof(STAGE_MAGIC));
+  header.files = 0;
+  header.crc = 0;
+  size_t offset = STAGE_DATA;
+  bool ok = true;
+  auto put = [&](const void* data, size_t length) {
+    ok = ok && offset + length <= STAGE_DATA + needed && esp_partition_write(slot, offset, data, length) == ESP_OK;
+    header.crc = crc32Update(header.crc, (const uint8_t*)data, length);
+    offset += length;
+  };
+  uint8_t chunk[COPY_CHUNK];
+  root = SPIFFS.open("/");
+  for (File file = root.openNextFile(); file && ok; file = root.openNextFile()) {
+    uint16_t pathLength = strlen(file.path());
+    uint32_t length = file.size();
+    put(&pathLength, sizeof(pathLength));
+    put(file.path(), pathLength);
+    put(&length, sizeof(length));
+    for (uint32_t done = 0; done < length && ok;) {
+      size_t n = file.read(chunk, std::min(sizeof(chunk), (size_t)(length - done)));
+      ok = n > 0;
+      put(chunk, n);
+      done += n;
+    }
+    header.files++;
+  }
+  root.close();
+  header.bytes = offset - STAGE_DATA;
+
+  StageHeader check;
+  ok = ok && esp_partition_write(slot, 0, &header, sizeof(header)) == ESP_OK && readStage(slot, check);
+  if (!ok) {
+    migration = "failed";
+    clearStage(slot);
+    return false;
+  }
+  Serial.println("Migration: staged " + String(header.files) + " files, " + String(header.bytes) + " bytes");
+  return true;
+}
+
+// Write the staged files to the mounted LittleFS partition. The marker is
+// there until they all are; the copy is cleared after.
+static bool restoreStage(const esp_partition_t* slot, const StageHeader& header) {
+  File marker = LittleFS.open(MIGRATING_PATH, "w");
+  if (!marker) return false;
+  marker.close();
+
+  uint8_t chunk[COPY_CHUNK];
+  size_t offset = STAGE_DATA;
+  for (uint32_t i = 0; i < header.files; i++) {
+    uint16_t pathLength = 0;
+    uint32_t length = 0;
+    char path[MAX_PATH];
+    if (esp_partition_read(slot, offset, &pathLength, sizeof(pathLength)) != ESP_OK || pathLength >= MAX_PATH ||
+        esp_partition_read(slot, offset + sizeof(pathLength), path, pathLength) != ESP_OK ||
+        esp_partition_read(slot, offset + sizeof(pathLength) + pathLength, &length, sizeof(length)) != ESP_OK) {
+      return false;
+    }
+    path[pathLength] = '\0';
+    offset += sizeof(pathLength) + pathLength + sizeof(length);
+
+    File file = LittleFS.open(path, "w");
+    for (uint32_t done = 0; done < length;) {
+      size_t n = std::min(sizeof(chunk), (size_t)(length - done));
+      if (!file || esp_partition_read(slot, offset + done, chunk, n) != ESP_OK || file.write(chunk, n) != n) {
+        Serial.println("Migration: can't write " + String(path));
+        return false;
+      }
+      done += n;
+    }
+    file.close();
+    offset += length;
+  }
+  if (!LittleFS.remove(MIGRATING_PATH)) return false;
+  clearStage(slot);
+  return true;
+}
+
+bool mountDataFs(bool preferLittleFs) {
+  littleFs = false;
+  migration = "none";
+  if (!preferLittleFs) return SPIFFS.begin(true);
+
+  const esp_partition_t* slot = esp_ota_get_next_update_partition(nullptr);
+  StageHeader staged;
+  bool resumable = readStage(slot, staged);
+
+  if (LittleFS.begin(false)) {
+    littleFs = true;
+    if (LittleFS.exists(MIGRATING_PATH)) {
+      // Cut off while writing the files back; the staged copy has them all
+      if (resumable) {
+        bool written = restoreStage(slot, staged);
+        migration = written ? "migrated" : "interrupted";
+        Serial.println(written ? "Migrated to LittleFS after a restart" : "Migration to LittleFS failed again");
+        return written;
+      }
+      migration = "interrupted";
+      Serial.println("Migration to LittleFS was interrupted - files may be missing");
+    } else if (resumable) {
+      clearStage(slot);  // Finished just before the copy was cleared
+    }
+    return true;
+  }
+
+  // With a staged copy, formatting was cut off and the copy is all there is
+  if (!resumable) {
+    // Blank or damaged: nothing to carry over
+    if (!SPIFFS.begin(false)) {
+      littleFs = true;
+      return LittleFS.begin(true);
+    }
+    if (!stageSpiffs(slot, staged)) {
+      Serial.println("Migration to LittleFS: " + String(migration) + ", staying on SPIFFS");
+      return true;
+    }
+    SPIFFS.end();
+  }
+  // A kiosk that can't write every file back doesn't start on some of
+  // them; the staged copy waits for the next boot
+  littleFs = true;
+  bool written = LittleFS.format() && LittleFS.begin(false) && restoreStage(slot, staged);
+  migration = written ? "migrated" : "interrupted";
+  Serial.println(written ? "Migrated to LittleFS" : "Migration to LittleFS failed part way");
+  return written;
+}
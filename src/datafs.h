@@ -0,0 +1,43 @@
+#pragma once
+
+#include <Arduino.h>
+#include <FS.h>
+
+// The flash filesystem behind the catalog, journal, history log and web
+// files. Everything reaches it through dataFs() (files through openFile()
+// in metrics.h), so which one it is gets decided once, at boot.
+//
+// SPIFFS unless the firmware is built with -DKIOSK_LITTLEFS=1 (the
+// esp32dev-littlefs environment). LittleFS mounts without scanning the
+// whole partition, which is most of SPIFFS's share of boot time, and its
+// rename() replaces the target atomically. SPIFFS's refuses to, so
+// replaceFile() removes first there and boot recovery finishes the rename
+// (see DataStore::begin()).
+//
+// The first boot of a LittleFS build finds the partition still holding
+// SPIFFS. Every file on it is first copied into the spare OTA app slot
+// (the one an update would be written to, never the running firmware) and
+// read back against a CRC. Only then is the partition formatted as
+// LittleFS and the files written back from that copy. A power cut at any
+// point leaves either SPIFFS untouched or a whole staged copy, and the
+// next boot finishes from the copy. Files that don't fit in the slot (a
+// stock esp32dev app1 holds about 1.25 MB), or a partition table without
+// a spare slot, leave the kiosk on SPIFFS. /api/metrics says which.
+
+// Mount the data filesystem (formatting a blank or damaged one). With
+// preferLittleFs, mount LittleFS, migrating from SPIFFS if needed. False
+// if a migration couldn't write the files back; the next boot tries again.
+bool mountDataFs(bool preferLittleFs);
+
+fs::FS& dataFs();
+const char* dataFsName();  // "spiffs" or "littlefs"
+size_t dataFsTotalBytes();
+size_t dataFsUsedBytes();
+
+// What became of a SPIFFS partition on a LittleFS build: "none",
+// "migrated", "too big", "no spare slot", "failed" or "interrupted" (by
+// firmware from before the staged copy, or a copy that no longer reads)
+const char* dataFsMigration();
+
+// Put the complete file tmpPath in place of path
+bool replaceFile(const String& tmpPath, const String& path);
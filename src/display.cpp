@@ -0,0 +1,92 @@
+#include "display.h"
+
+#include <string.h>
+
+Display::Display(LiquidCrystal_I2C& lcd) : lcd(lcd) {
+  memset(base, ' ', sizeof(base));
+  memset(shown, ' ', sizeof(shown));
+}
+
+void Display::begin() {
+  lcd.init();
+  lcd.backlight();
+  lcd.clear();
+  counters.lcdBytes++;
+  counters.clears++;
+  memset(shown, ' ', sizeof(shown));
+}
+
+void Display::fill(char (&row)[COLUMNS], const char* text) {
+  size_t length = strnlen(text, COLUMNS);
+  memcpy(row, text, length);
+  memset(row + length, ' ', COLUMNS - length);
+}
+
+void Display::setLine(uint8_t row, const char* text) {
+  if (row >= ROWS) return;
+  fill(base[row], text);
+  dirty = true;
+}
+
+bool Display::post(const char* top, const char* bottom, uint32_t holdMillis, bool replace) {
+  if (replace) dropMessages();
+  if (messageCount == MAX_MESSAGES) return false;
+  Message& message = messages[(firstMessage + messageCount) % MAX_MESSAGES];
+  fill(message.lines[0], top);
+  fill(message.lines[1], bottom);
+  message.holdMillis = holdMillis;
+  dirty = true;
+  if (messageCount++ == 0) messageShownAt = millis();
+  return true;
+}
+
+void Display::dropMessages() {
+  firstMessage = 0;
+  messageCount = 0;
+  dirty = true;
+}
+
+void Display::tick(unsigned long now) {
+  // The next message gets its whole hold from now, however late this pass
+  while (messageCount > 0 && now - messageShownAt >= messages[firstMessage].holdMillis) {
+    firstMessage = (firstMessage + 1) % MAX_MESSAGES;
+    messageCount--;
+    messageShownAt = now;
+    dirty = true;
+  }
+}
+
+void Display::flush() {
+  if (!dirty) return;  // Most passes: nothing to compare
+  dirty = false;
+  unsigned long start = micros();
+  const char(*screen)[COLUMNS] = messageCount > 0 ? messages[firstMessage].lines : base;
+  uint32_t sent = 0;
+
+  for (uint8_t row = 0; row < ROWS; row++) {
+    uint8_t column = 0;
+    while (column < COLUMNS) {
+      if (screen[row][column] == shown[row][column]) {
+        column++;
+        continue;
+      }
+      // A run of changed cells, carried over single unchanged cells: one
+      // character costs the same as the setCursor it would take to skip it
+      uint8_t end = column + 1;
+      while (end < COLUMNS && (screen[row][end] != shown[row][end] ||
+                               (end + 1 < COLUMNS && screen[row][end + 1] != shown[row][end + 1]))) {
+        end++;
+      }
+      lcd.setCursor(column, row);
+      lcd.write((const uint8_t*)&screen[row][column], end - column);
+      memcpy(&shown[row][column], &screen[row][column], end - column);
+      sent += 1 + (end - column);
+      column = end;
+    }
+  }
+
+  if (sent == 0) return;
+  counters.lcdBytes += sent;
+  counters.flushes++;
+  counters.flushMicros += micros() - start;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <Arduino.h>
+#include <LiquidCrystal_I2C.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Shadow framebuffer in front of the 16x2 I2C LCD, owned by the reader task.
+//
+// Screens are composed in RAM - a base screen (the welcome text, the scan
+// countdown...) and timed messages over it - and flush() sends only the
+// cells that differ from what the panel already shows: one setCursor per
+// run of changed cells, then their characters. lcd.clear() is never
+// needed after begin(), which saves its 2 ms busy wait and the blank
+// flash, and a line that stays the same (the IP address under the
+// scrolling text) costs nothing after it is first drawn.
+//
+// Each byte to the panel is two 4-bit nibbles through a PCF8574 backpack,
+// three expander writes apiece, so the bus carries about 12 I2C bytes per
+// LCD byte. stats() counts LCD bytes; i2cBytes() is the estimate.
+class Display {
+ public:
+  static const uint8_t COLUMNS = 16;
+  static const uint8_t ROWS = 2;
+  static const size_t MAX_MESSAGES = 4;
+  static const uint32_t I2C_BYTES_PER_LCD_BYTE = 12;
+  static const uint32_t I2C_CLOCK_HZ = 100000;  // Wire's default
+
+  struct Stats {
+    uint32_t lcdBytes = 0;     // Commands and characters sent to the panel
+    uint32_t clears = 0;
+    uint32_t flushes = 0;      // flush() calls that sent anything
+    uint64_t flushMicros = 0;  // Time spent in flush(), bus writes included
+
+    uint64_t i2cBytes() const { return (uint64_t)lcdBytes * I2C_BYTES_PER_LCD_BYTE; }
+    // Time the bus was busy: 9 bits per I2C byte, plus the clear command's wait
+    uint64_t busMicros() const { return i2cBytes() * 9 * 1000000 / I2C_CLOCK_HZ + clears * 2000ull; }
+  };
+
+  explicit Display(LiquidCrystal_I2C& lcd);
+
+  // Initialise the panel and clear it - the only clear() it ever needs
+  void begin();
+
+  // Base screen: a row's text is cut or space-padded to the display width.
+  // Nothing reaches the panel until flush().
+  void setLine(uint8_t row, const char* text);
+  void setLines(const char* top, const char* bottom) {
+    setLine(0, top);
+    setLine(1, bottom);
+  }
+
+  // Timed messages, shown over the base screen one after another for
+  // `holdMillis` each. With `replace`, the message on screen and any
+  // waiting are dropped and this one shows now. False if the queue is full.
+  bool post(const char* top, const char* bottom, uint32_t holdMillis, bool replace = false);
+  void dropMessages();
+  bool showingMessage() const { return messageCount > 0; }
+
+  // Retire messages whose time is up; call once per pass before looking
+  // at showingMessage()
+  void tick(unsigned long now);
+
+  // Bring the panel in line with the current screen
+  void flush();
+
+  const Stats& stats() const { return counters; }
+  void resetStats() { counters = Stats(); }
+
+ private:
+  struct Message {
+    char lines[ROWS][COLUMNS];
+    uint32_t holdMillis;
+  };
+
+  static void fill(char (&row)[COLUMNS], const char* text);
+
+  LiquidCrystal_I2C& lcd;
+  char base[ROWS][COLUMNS];
+  char shown[ROWS][COLUMNS];  // What the panel has
+  Message messages[MAX_MESSAGES];
+  size_t firstMessage = 0;
+  size_t messageCount = 0;
+  unsigned long messageShownAt = 0;
+  bool dirty = false;  // Something changed since the last flush()
+  Stats counters;
+};
@@ -0,0 +1,101 @@
+#include "events.h"
+
+#include <algorithm>
+
+#include "clock.h"
+
+ScanEvents scanEvents;
+
+// Events older than this are not replayed - same window as the card itself
+static const unsigned long REPLAY_WINDOW = 10000;
+
+static const unsigned long HEARTBEAT_INTERVAL = 15000;
+
+void ScanEvents::subscribe(WiFiClient client, uint32_t since, Audience audience) {
+  client.setNoDelay(true);  // Events are tiny, don't let Nagle hold them back
+  client.print("HTTP/1.1 200 OK\r\n"
+               "Content-Type: text/event-stream\r\n"
+               "Cache-Control: no-cache\r\n"
+               "Connection: keep-alive\r\n"
+               "Access-Control-Allow-Origin: *\r\n"
+               "\r\n"
+               "retry: 1000\n\n");
+
+  // A cursor from before a reboot (or from the future) can't be honoured
+  if (since > seq) since = 0;
+  if (since > 0) {
+    uint32_t first = seq > RING_SIZE ? seq - RING_SIZE + 1 : 1;
+    for (uint32_t s = std::max(since + 1, first); s <= seq; s++) {
+      const ScanEvent& event = ring[(s - 1) % RING_SIZE];
+      if (millis() - event.time > REPLAY_WINDOW) continue;
+      send(client, event, audience);
+    }
+  }
+
+  // Use a free slot, or take the one held longest (most likely a tab that
+  // was closed without the socket being torn down)
+  size_t slot = 0;
+  for (size_t i = 0; i < MAX_SUBSCRIBERS; i++) {
+    if (!subscribers[i].connected()) {
+      slot = i;
+      break;
+    }
+    if (subscribedAt[i] < subscribedAt[slot]) slot = i;
+  }
+  subscribers[slot].stop();
+  subscribers[slot] = client;
+  subscribedAt[slot] = millis();
+  audiences[slot] = audience;
+}
+
+const ScanEvent& ScanEvents::publish(const CardUid& uid, const char* mode, const char* nonce) {
+  seq++;
+  ScanEvent& event = ring[(seq - 1) % RING_SIZE];
+  event.seq = seq;
+  event.uid = uid;
+  event.mode = mode;
+  event.time = millis();
+  event.at = clockNow();
+  strlcpy(event.nonce, nonce ? nonce : "", sizeof(event.nonce));
+
+  for (size_t i = 0; i < MAX_SUBSCRIBERS; i++) {
+    if (subscribers[i].connected() && !send(subscribers[i], event, audiences[i])) {
+      subscribers[i].stop();
+    }
+  }
+  return event;
+}
+
+void ScanEvents::loop() {
+  if (millis() - lastHeartbeat < HEARTBEAT_INTERVAL) return;
+  lastHeartbeat = millis();
+
+  for (size_t i = 0; i < MAX_SUBSCRIBERS; i++) {
+    if (!subscribers[i].connected()) continue;
+    // SSE comment line - ignored by EventSource, fails on a dead socket
+    if (subscribers[i].print(":\n\n") == 0) subscribers[i].stop();
+  }
+}
+
+size_t ScanEvents::subscriberCount() {
+  size_t count = 0;
+  for (size_t i = 0; i < MAX_SUBSCRIBERS; i++) {
+    if (subscribers[i].connected()) count++;
+  }
+  return count;
+}
+
+bool ScanEvents::send(WiFiClient& client, const ScanEvent& event, Audience audience) {
+  char message[256];
+  char at[ISO_TIME_SIZE] = "";
+  if (event.at) formatIsoTime(event.at, at, sizeof(at));
+  bool nonce = audience == KIOSK_SCREEN && event.nonce[0];
+  int length = snprintf(message, sizeof(message),
+                        "id: %lu\nevent: scan\ndata: {\"seq\":%lu,\"uid\":\"%s\",\"mode\":\"%s\","
+                        "\"time\":%lu,\"at\":%s%s%s%s%s%s}\n\n",
+                        (unsigned long)event.seq, (unsigned long)event.seq,
+                        audience == ANYONE ? "" : event.uid.hex().text, event.mode, event.time,
+                        event.at ? "\"" : "", event.at ? at : "null", event.at ? "\"" : "",
+                        nonce ? ",\"nonce\":\"" : "", nonce ? event.nonce : "", nonce ? "\"" : "");
+  return client.write((const uint8_t*)message, length) == (size_t)length;
+}
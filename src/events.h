@@ -0,0 +1,70 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WiFi.h>
+
+#include "session.h"
+#include "uid.h"
+
+// Scan events pushed to browsers with Server-Sent Events.
+//
+// Browsers open GET /api/events with an EventSource and keep the connection.
+// Every card read in loop() is written to all open streams at once as
+//
+//   id: 12
+//   event: scan
+//   data: {"seq":12,"uid":"A286FF03","mode":"normal","time":81234,"at":"..."}
+//
+// What a stream gets depends on who opened it. Anyone may learn that a card
+// was read ("uid" is empty); signed-in pages get the UID; the paired kiosk
+// screen also gets the read's one-time "nonce" (see KioskKey), which is
+// what logs the card in.
+//
+// Recent events are kept in a small ring so a client that reconnects (the
+// browser sends Last-Event-ID automatically) or a page that was just opened
+// with ?since=<seq> gets what it missed. Publishing formats each event on
+// the stack and never allocates.
+
+struct ScanEvent {
+  uint32_t seq = 0;
+  CardUid uid;
+  const char* mode = "normal";
+  unsigned long time = 0;      // millis() when the card was read
+  time_t at = 0;               // Wall clock, 0 if not known yet
+  char nonce[SessionCache::TOKEN_LENGTH + 1] = "";  // Normal-mode reads only
+};
+
+class ScanEvents {
+ public:
+  enum Audience : uint8_t { ANYONE, SIGNED_IN, KIOSK_SCREEN };
+
+  // Take over an HTTP connection as an event stream and replay the events
+  // after `since` that are still fresh enough to act on
+  void subscribe(WiFiClient client, uint32_t since, Audience audience);
+
+  // Record a card read and push it to every open stream. `nonce` goes to
+  // the kiosk screen only.
+  const ScanEvent& publish(const CardUid& uid, const char* mode, const char* nonce = nullptr);
+
+  // Heartbeats so dead connections are noticed and their slots freed
+  void loop();
+
+  uint32_t lastSeq() const { return seq; }
+  const ScanEvent* latest() const { return seq ? &ring[(seq - 1) % RING_SIZE] : nullptr; }
+  size_t subscriberCount();
+
+ private:
+  static const size_t RING_SIZE = 16;
+  static const size_t MAX_SUBSCRIBERS = 4;
+
+  bool send(WiFiClient& client, const ScanEvent& event, Audience audience);
+
+  ScanEvent ring[RING_SIZE];
+  uint32_t seq = 0;
+  WiFiClient subscribers[MAX_SUBSCRIBERS];
+  unsigned long subscribedAt[MAX_SUBSCRIBERS] = {};
+  Audience audiences[MAX_SUBSCRIBERS] = {};
+  unsigned long lastHeartbeat = 0;
+};
+
+extern ScanEvents scanEvents;
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <Arduino.h>
+#include <stdint.h>
+#include <vector>
+
+// Open-addressing hash index over one String field of a record vector.
+// The table only stores (hash, slot) pairs, so a lookup hashes the key,
+// probes a few entries and compares against the record itself - no heap
+// allocation and no flash access on the request path.
+template <typename Record>
+class HashIndex {
+ public:
+  explicit HashIndex(String Record::*field) : field(field) {}
+
+  // Rebuild the whole table, e.g. after loading or removing records
+  void rebuild(const std::vector<Record>& records) {
+    size_t capacity = 16;
+    while (capacity < records.size() * 2) capacity <<= 1;  // Keep load factor <= 0.5
+    table.assign(capacity, Entry());
+    used = 0;
+    for (size_t i = 0; i < records.size(); i++) {
+      insert(records, i);
+    }
+  }
+
+  // Index a record that was just appended (or updated) at the given slot
+  void insert(const std::vector<Record>& records, size_t slot) {
+    const String& key = records[slot].*field;
+    if (key.length() == 0) return;  // Unassigned keys (e.g. no card yet) aren't indexed
+    if ((used + 1) * 2 > table.size()) {
+      rebuild(records);  // Grow; rebuild re-inserts this slot too
+      return;
+    }
+    uint32_t hash = hashKey(key.c_str());
+    size_t mask = table.size() - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+      if (table[i].slot == EMPTY) {
+        table[i].hash = hash;
+        table[i].slot = slot;
+        used++;
+        return;
+      }
+      if (table[i].slot == slot) return;  // Already indexed
+    }
+  }
+
+  // Find the slot of the first record whose field equals key, or -1
+  int find(const std::vector<Record>& records, const char* key) const {
+    return key == nullptr ? -1 : find(records, key, hashKey(key));
+  }
+
+  // Same, with hashKey(key) already known
+  int find(const std::vector<Record>& records, const char* key, uint32_t hash) const {
+    if (key[0] == '\0' || table.empty()) return -1;
+    size_t mask = table.size() - 1;
+    for (size_t i = hash & mask; table[i].slot != EMPTY; i = (i + 1) & mask) {
+      if (table[i].hash == hash && strcmp((records[table[i].slot].*field).c_str(), key) == 0) {
+        return table[i].slot;
+      }
+    }
+    return -1;
+  }
+
+  // FNV-1a - small, fast and good enough for IDs and card UIDs
+  static constexpr uint32_t hashKey(const char* key) {
+    uint32_t hash = 2166136261u;
+    while (*key) {
+      hash ^= (uint8_t)*key++;
+      hash *= 16777619u;
+    }
+    return hash;
+  }
+
+ private:
+  static const uint32_t EMPTY = 0xFFFFFFFF;
+  struct Entry {
+    uint32_t hash = 0;
+    uint32_t slot = EMPTY;  // Same 8-byte entry as a uint16_t slot after padding
+  };
+
+  String Record::*field;
+  std::vector<Entry> table;
+  size_t used = 0;
+};
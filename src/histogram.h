@@ -0,0 +1,45 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include <algorithm>
+
+// Latency histogram with fixed buckets from 50 us to 1 s. Recording is a
+// few compares and adds with no allocation, so one can sit on every route
+// and loop and stay on in production.
+struct Histogram {
+  static const uint8_t BUCKETS = 14;  // The last one has no upper bound
+
+  // Upper bound of bucket i in microseconds (i < BUCKETS - 1)
+  static uint32_t bound(uint8_t i) {
+    static const uint32_t BOUNDS[BUCKETS - 1] = {50,    100,   250,    500,    1000,   2500,   5000,
+                                                 10000, 25000, 50000, 100000, 250000, 1000000};
+    return BOUNDS[i];
+  }
+
+  uint32_t counts[BUCKETS] = {};
+  uint32_t count = 0;
+  uint64_t totalMicros = 0;
+  uint32_t maxMicros = 0;
+
+  void record(uint32_t micros) {
+    uint8_t i = 0;
+    while (i < BUCKETS - 1 && micros > bound(i)) i++;
+    counts[i]++;
+    count++;
+    totalMicros += micros;
+    if (micros > maxMicros) maxMicros = micros;
+  }
+
+  // Upper bound of the bucket holding the p-th fraction of samples - an
+  // upper estimate of that percentile, never above the largest sample
+  uint32_t percentile(float p) const {
+    uint32_t rank = (uint32_t)(p * count);
+    uint32_t seen = 0;
+    for (uint8_t i = 0; i < BUCKETS - 1; i++) {
+      seen += counts[i];
+      if (seen > rank) return std::min(bound(i), maxMicros);
+    }
+    return maxMicros;
+  }
+};
@@ -0,0 +1,370 @@
+#include "history.h"
+
+#include <algorithm>
+
+#include "datafs.h"
+#include "hashindex.h"
+#include "metrics.h"  // openFile
+
+HistoryLog loanHistory;
+
+static const char INDEX_MAGIC[4] = {'L', 'H', 'I', 'X'};
+
+static_assert(sizeof(HistoryRecord) == 48, "HistoryRecord layout changed");
+static_assert(sizeof(HistoryIndexHeader) == 8, "HistoryIndexHeader layout changed");
+static_assert(sizeof(HistoryIndexEntry) == 8, "HistoryIndexEntry layout changed");
+
+static String historyPath(uint32_t id, const char* extension) {
+  char path[24];
+  snprintf(path, sizeof(path), "/hist%05lu.%s", (unsigned long)id, extension);
+  return String(path);
+}
+
+// The ID as the log stores it: cut to HISTORY_ID_LENGTH, NUL-padded
+static void cutId(const char* id, char (&out)[HISTORY_ID_LENGTH + 1]) {
+  memset(out, 0, sizeof(out));
+  strncpy(out, id, HISTORY_ID_LENGTH);
+}
+
+static uint32_t idHash(const char* id) {
+  char cut[HISTORY_ID_LENGTH + 1];
+  cutId(id, cut);
+  return HashIndex<HistoryRecord>::hashKey(cut);
+}
+
+static size_t expectedIndexSize(uint32_t records) {
+  return sizeof(HistoryIndexHeader) + 2 * records * sizeof(HistoryIndexEntry);
+}
+
+// "hist00042.seg" (or "/hist00042.seg" on older cores) -> 42
+static bool parseSegmentName(const char* name, const char* extension, uint32_t* id) {
+  if (name[0] == '/') name++;
+  char suffix[8];
+  unsigned long number;
+  if (strlen(name) != 13 || sscanf(name, "hist%5lu.%3s", &number, suffix) != 2) return false;
+  if (strcmp(suffix, extension) != 0) return false;
+  *id = number;
+  return true;
+}
+
+// Copy the whole records of a segment with a torn tail to a temp file and
+// swap it in. A temp file found at boot is finished or dropped the same
+// way as a snapshot's.
+static bool truncateSegment(uint32_t id, uint32_t records) {
+  String path = historyPath(id, "seg");
+  String tmpPath = historyPath(id, "tmp");
+  File in = openFile(path, "r");
+  File out = openFile(tmpPath, "w");
+  if (!in || !out) return false;
+  uint8_t buffer[sizeof(HistoryRecord)];
+  bool ok = true;
+  for (uint32_t i = 0; i < records && ok; i++) {
+    ok = in.read(buffer, sizeof(buffer)) == sizeof(buffer) && out.write(buffer, sizeof(buffer)) == sizeof(buffer);
+  }
+  in.close();
+  out.close();
+  metrics.recordFileWrite(records * sizeof(HistoryRecord));
+  if (!ok) {
+    dataFs().remove(tmpPath);
+    return false;
+  }
+  return replaceFile(tmpPath, path);
+}
+
+void HistoryLog::begin() {
+  segmentList.clear();
+  openHashes.clear();
+  sealedRecords = 0;
+  seq = 0;
+  bootSeq = 0;
+  bootSeqLeft = 0;
+
+  std::vector<uint32_t> ids;
+  std::vector<uint32_t> tmpIds;
+  File root = openFile("/");
+  for (File file = root.openNextFile(); file; file = root.openNextFile()) {
+    uint32_t id;
+    if (parseSegmentName(file.name(), "seg", &id)) ids.push_back(id);
+    if (parseSegmentName(file.name(), "tmp", &id)) tmpIds.push_back(id);
+  }
+  root.close();
+  for (uint32_t id : tmpIds) {
+    if (std::find(ids.begin(), ids.end(), id) != ids.end()) {
+      dataFs().remove(historyPath(id, "tmp"));
+    } else if (dataFs().rename(historyPath(id, "tmp"), historyPath(id, "seg"))) {
+      ids.push_back(id);
+    }
+  }
+  std::sort(ids.begin(), ids.end());
+
+  for (size_t i = 0; i < ids.size(); i++) {
+    File file = openFile(historyPath(ids[i], "seg"), "r");
+    size_t bytes = file ? file.size() : 0;
+    uint32_t records = bytes / sizeof(HistoryRecord);
+    bool last = i + 1 == ids.size();
+    HistoryRecord record;
+
+    if (records > 0) {
+      file.seek((records - 1) * sizeof(HistoryRecord));
+      if (file.read((uint8_t*)&record, sizeof(record)) == sizeof(record)) seq = record.seq;
+    }
+    // Only the open segment is appended to, so only it can be torn
+    if (last && records < SEGMENT_RECORDS) {
+      file.seek(0);
+      for (uint32_t r = 0; r < records && file.read((uint8_t*)&record, sizeof(record)) == sizeof(record); r++) {
+        openHashes.push_back({HashIndex<HistoryRecord>::hashKey(record.user),
+                              HashIndex<HistoryRecord>::hashKey(record.book)});
+      }
+      file.close();
+      if (bytes % sizeof(HistoryRecord) != 0) {
+        Serial.println("History: dropping a torn record in segment " + String(ids[i]));
+        truncateSegment(ids[i], records);
+      }
+      segmentList.push_back({ids[i], records, false});
+      continue;
+    }
+    file.close();
+
+    // An index torn by a power cut has the wrong size and is rebuilt
+    File index = openFile(historyPath(ids[i], "idx"), "r");
+    bool indexed = index && index.size() == expectedIndexSize(records);
+    index.close();
+    if (!indexed && !indexSegment(ids[i], records)) {
+      Serial.println("History: failed to index segment " + String(ids[i]));
+    }
+    segmentList.push_back({ids[i], records, true});
+    sealedRecords += records;
+  }
+  // A batch return logs one record per book under one seq, so count how
+  // many of the newest records share it
+  bootSeq = seq;
+  bootSeqLeft = 0;
+  for (size_t s = segmentList.size(); s > 0 && seq > 0; s--) {
+    File file = openFile(historyPath(segmentList[s - 1].id, "seg"), "r");
+    uint32_t r = segmentList[s - 1].records;
+    HistoryRecord record;
+    for (; r > 0; r--) {
+      file.seek((r - 1) * sizeof(HistoryRecord));
+      if (file.read((uint8_t*)&record, sizeof(record)) != sizeof(record) || record.seq != seq) break;
+      bootSeqLeft++;
+    }
+    file.close();
+    if (r > 0) break;
+  }
+
+  Serial.println("History: " + String(segmentList.size()) + " segments, " + String(recordCount()) +
+                 " records, last seq " + String(seq));
+}
+
+bool HistoryLog::append(uint32_t recordSeq, const char* book, const char* user, uint32_t borrowDate,
+                        uint32_t returnDate) {
+  // Replayed and already logged
+  if (recordSeq != 0 && recordSeq < bootSeq) return true;
+  if (recordSeq != 0 && recordSeq == bootSeq && bootSeqLeft > 0) {
+    bootSeqLeft--;
+    return true;
+  }
+
+  if (!hasOpenSegment()) {
+    uint32_t id = segmentList.empty() ? 1 : segmentList.back().id + 1;
+    segmentList.push_back({id, 0, false});
+  }
+  HistorySegment& segment = segmentList.back();
+
+  HistoryRecord record;
+  memset(&record, 0, sizeof(record));
+  record.seq = recordSeq;
+  record.borrowDate = borrowDate;
+  record.returnDate = returnDate;
+  cutId(book, record.book);
+  cutId(user, record.user);
+
+  File file = bulk && bulkFile ? bulkFile : openFile(historyPath(segment.id, "seg"), "a");
+  size_t written = file ? file.write((const uint8_t*)&record, sizeof(record)) : 0;
+  if (bulk) {
+    bulkFile = file;
+  } else {
+    file.close();  // Flushes, as for the journal
+  }
+  metrics.recordFileWrite(written);
+  if (written != sizeof(record)) {
+    // Whatever made it to flash is cut off at the next boot; seal what is
+    // good so the next record starts a fresh segment
+    failures++;
+    Serial.println("History: append to segment " + String(segment.id) + " failed");
+    if (segment.records > 0) {
+      seal();
+    } else {
+      bulkFile.close();
+      dataFs().remove(historyPath(segment.id, "seg"));
+      segmentList.pop_back();
+    }
+    return false;
+  }
+
+  openHashes.push_back({HashIndex<HistoryRecord>::hashKey(record.user),
+                        HashIndex<HistoryRecord>::hashKey(record.book)});
+  segment.records++;
+  if (recordSeq > seq) seq = recordSeq;
+  if (segment.records >= SEGMENT_RECORDS) seal();
+  return true;
+}
+
+void HistoryLog::endBulk() {
+  bulkFile.close();
+  bulk = false;
+}
+
+void HistoryLog::seal() {
+  HistorySegment& segment = segmentList.back();
+  bulkFile.close();
+  if (!writeIndex(segment.id, openHashes)) {
+    // Lookups fall back to nothing for this segment until boot rebuilds it
+    Serial.println("History: failed to index segment " + String(segment.id));
+  }
+  segment.sealed = true;
+  sealedRecords += segment.records;
+  openHashes.clear();
+}
+
+bool HistoryLog::indexSegment(uint32_t id, uint32_t records) const {
+  File file = openFile(historyPath(id, "seg"), "r");
+  if (!file) return false;
+  std::vector<Hashes> hashes;
+  hashes.reserve(records);
+  HistoryRecord record;
+  for (uint32_t r = 0; r < records && file.read((uint8_t*)&record, sizeof(record)) == sizeof(record); r++) {
+    hashes.push_back({HashIndex<HistoryRecord>::hashKey(record.user),
+                      HashIndex<HistoryRecord>::hashKey(record.book)});
+  }
+  file.close();
+  return hashes.size() == records && writeIndex(id, hashes);
+}
+
+bool HistoryLog::writeIndex(uint32_t id, const std::vector<Hashes>& hashes) const {
+  std::vector<HistoryIndexEntry> entries(hashes.size());
+  File file = openFile(historyPath(id, "idx"), "w");
+  if (!file) return false;
+
+  HistoryIndexHeader header;
+  memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+  header.version = HISTORY_INDEX_VERSION;
+  header.count = hashes.size();
+  size_t written = file.write((const uint8_t*)&header, sizeof(header));
+
+  // Users then books, each sorted by hash and then record number
+  for (int section = 0; section < 2; section++) {
+    for (size_t r = 0; r < hashes.size(); r++) {
+      entries[r].hash = section == 0 ? hashes[r].user : hashes[r].book;
+      entries[r].record = r;
+      entries[r].reserved = 0;
+    }
+    std::sort(entries.begin(), entries.end(), [](const HistoryIndexEntry& a, const HistoryIndexEntry& b) {
+      return a.hash != b.hash ? a.hash < b.hash : a.record < b.record;
+    });
+    written += file.write((const uint8_t*)entries.data(), entries.size() * sizeof(HistoryIndexEntry));
+  }
+  file.close();
+  metrics.recordFileWrite(written);
+  return written == expectedIndexSize(hashes.size());
+}
+
+// Record numbers in a sealed segment whose user (or book) hash is `hash`,
+// ascending: a binary search for the first one, then a forward read
+void HistoryLog::findSealed(const HistorySegment& segment, bool byUser, uint32_t hash,
+                            std::vector<uint16_t>& records) const {
+  File file = openFile(historyPath(segment.id, "idx"), "r");
+  if (!file) return;
+  HistoryIndexHeader header;
+  if (file.read((uint8_t*)&header, sizeof(header)) != sizeof(header) ||
+      memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) != 0 || header.version != HISTORY_INDEX_VERSION) {
+    file.close();
+    return;
+  }
+  size_t section = sizeof(header) + (byUser ? 0 : header.count * sizeof(HistoryIndexEntry));
+  HistoryIndexEntry entry;
+  size_t low = 0;
+  size_t high = header.count;
+  while (low < high) {
+    size_t middle = (low + high) / 2;
+    file.seek(section + middle * sizeof(entry));
+    if (file.read((uint8_t*)&entry, sizeof(entry)) != sizeof(entry)) break;
+    if (entry.hash < hash) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  file.seek(section + low * sizeof(entry));
+  for (size_t i = low; i < header.count; i++) {
+    if (file.read((uint8_t*)&entry, sizeof(entry)) != sizeof(entry) || entry.hash != hash) break;
+    records.push_back(entry.record);
+  }
+  file.close();
+}
+
+size_t HistoryLog::find(const HistoryQuery& query, std::vector<HistoryRecord>& page) const {
+  bool byUser = query.user.length() > 0;
+  const char* key = byUser ? query.user.c_str() : query.book.c_str();
+  if (key[0] == '\0') return 0;
+  char wanted[HISTORY_ID_LENGTH + 1];
+  char also[HISTORY_ID_LENGTH + 1];  // The book, when both were given
+  cutId(key, wanted);
+  cutId(byUser ? query.book.c_str() : "", also);
+  uint32_t hash = idHash(key);
+
+  size_t matched = 0;
+  std::vector<uint16_t> records;
+  for (size_t s = segmentList.size(); s > 0; s--) {
+    const HistorySegment& segment = segmentList[s - 1];
+    records.clear();
+    if (segment.sealed) {
+      findSealed(segment, byUser, hash, records);
+    } else {
+      for (size_t r = 0; r < openHashes.size(); r++) {
+        if ((byUser ? openHashes[r].user : openHashes[r].book) == hash) records.push_back(r);
+      }
+    }
+    if (records.empty()) continue;
+
+    // Records outside the page are only counted: unless the query has a
+    // second filter, the 32-bit hash is taken at its word for those
+    File file = openFile(historyPath(segment.id, "seg"), "r");
+    if (!file) continue;
+    for (size_t i = records.size(); i > 0; i--) {
+      bool inPage = matched >= query.offset && page.size() < query.limit;
+      if (!inPage && also[0] == '\0') {
+        matched++;
+        continue;
+      }
+      HistoryRecord record;
+      file.seek(records[i - 1] * sizeof(HistoryRecord));
+      if (file.read((uint8_t*)&record, sizeof(record)) != sizeof(record)) break;
+      if (strcmp(byUser ? record.user : record.book, wanted) != 0) continue;
+      if (also[0] && strcmp(record.book, also) != 0) continue;
+      if (matched++ >= query.offset && page.size() < query.limit) page.push_back(record);
+    }
+    file.close();
+  }
+  return matched;
+}
+
+size_t HistoryLog::archive(uint32_t throughId) {
+  size_t removed = 0;
+  while (!segmentList.empty() && segmentList.front().sealed && segmentList.front().id <= throughId) {
+    const HistorySegment& segment = segmentList.front();
+    dataFs().remove(historyPath(segment.id, "idx"));
+    if (!dataFs().remove(historyPath(segment.id, "seg"))) break;
+    sealedRecords -= segment.records;
+    segmentList.erase(segmentList.begin());
+    removed++;
+  }
+  return removed;
+}
+
+String HistoryLog::segmentPath(uint32_t id) const {
+  for (const HistorySegment& segment : segmentList) {
+    if (segment.id == id) return historyPath(id, "seg");
+  }
+  return String();
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <Arduino.h>
+#include <FS.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+// Lending history, kept out of the catalog so the snapshots and the boot
+// load stop growing with every loan.
+//
+// Each returned loan is appended to a segment file as one fixed-width
+// HistoryRecord: /hist00001.seg, /hist00002.seg, ... Only the newest
+// segment is written to; once it holds SEGMENT_RECORDS records it is
+// sealed and gets a sidecar index, /histNNNNN.idx, with the record numbers
+// sorted by user and by book hash:
+//
+//   HistoryIndexHeader   magic "LHIX", version, record count
+//   HistoryIndexEntry    count entries sorted by (user hash, record)
+//   HistoryIndexEntry    count entries sorted by (book hash, record)
+//
+// A lookup binary-searches each sealed index on flash and scans the open
+// segment's hashes in RAM (8 bytes a record, at most SEGMENT_RECORDS), so
+// nothing in RAM grows with the number of sealed segments but their IDs.
+// Sealed segments never change, so they can be downloaded, compressed
+// and stored elsewhere, then dropped with archive().
+//
+// The journal is the write-ahead log for history too: a record carries
+// the seq of the "return" that closed the loan, and replay after a crash
+// skips whatever the log already had at boot.
+
+// One closed loan. IDs longer than HISTORY_ID_LENGTH are cut short, in the
+// log and in queries alike. All integers are little-endian.
+static const size_t HISTORY_ID_LENGTH = 17;
+
+struct HistoryRecord {
+  uint32_t seq;         // Journal seq of the return (or of the snapshot it came from)
+  uint32_t borrowDate;  // Unix seconds
+  uint32_t returnDate;
+  char book[HISTORY_ID_LENGTH + 1];  // NUL-padded
+  char user[HISTORY_ID_LENGTH + 1];
+};
+
+static const uint16_t HISTORY_INDEX_VERSION = 1;
+
+struct HistoryIndexHeader {
+  char magic[4];  // "LHIX"
+  uint16_t version;
+  uint16_t count;
+};
+
+struct HistoryIndexEntry {
+  uint32_t hash;    // FNV-1a of the (cut) ID, as HashIndex
+  uint16_t record;  // In the segment
+  uint16_t reserved;
+};
+
+// Filter and paging for GET /api/history
+struct HistoryQuery {
+  size_t offset = 0;
+  size_t limit = 50;
+  String user;  // At least one of user and book
+  String book;
+};
+
+// Per-segment figures for GET /api/history/segments
+struct HistorySegment {
+  uint32_t id;
+  uint32_t records;
+  bool sealed;
+};
+
+class HistoryLog {
+ public:
+  static const uint32_t SEGMENT_RECORDS = 512;  // 24 KB of records, 8 KB of index
+
+  // Find the segments, drop a torn record at the end of the open one and
+  // index any sealed segment whose index is missing
+  void begin();
+
+  // Append one closed loan. Records the log already had at boot - the
+  // same seq, as many times as it was there - are skipped, so journal
+  // replay can append again (seq 0 = unnumbered, always kept).
+  bool append(uint32_t seq, const char* book, const char* user, uint32_t borrowDate,
+              uint32_t returnDate);
+
+  // Keep the open segment's file open across appends, for moving a lot of
+  // history in at once. Nothing is known to be on flash until endBulk().
+  void beginBulk() { bulk = true; }
+  void endBulk();
+
+  // Records for query.user (or else query.book), newest first: the ones in
+  // the offset/limit window go into `page`. Returns how many match in all.
+  size_t find(const HistoryQuery& query, std::vector<HistoryRecord>& page) const;
+
+  // Delete sealed segments up to and including `throughId`. Returns how
+  // many were removed; the open segment is never archived.
+  size_t archive(uint32_t throughId);
+
+  const std::vector<HistorySegment>& segments() const { return segmentList; }
+  String segmentPath(uint32_t id) const;  // Empty if there is no such segment
+
+  bool empty() const { return segmentList.empty(); }
+  uint32_t lastSeq() const { return seq; }
+  uint32_t recordCount() const { return sealedRecords + openHashes.size(); }
+  uint32_t appendFailures() const { return failures; }
+
+ private:
+  struct Hashes {
+    uint32_t user;
+    uint32_t book;
+  };
+
+  bool hasOpenSegment() const { return !segmentList.empty() && !segmentList.back().sealed; }
+  void seal();
+  bool indexSegment(uint32_t id, uint32_t records) const;
+  bool writeIndex(uint32_t id, const std::vector<Hashes>& hashes) const;
+  void findSealed(const HistorySegment& segment, bool byUser, uint32_t hash,
+                  std::vector<uint16_t>& records) const;
+
+  std::vector<HistorySegment> segmentList;  // Oldest first; only the last can be open
+  std::vector<Hashes> openHashes;           // One per record of the open segment
+  uint32_t sealedRecords = 0;
+  uint32_t seq = 0;                         // Highest record seq in the log
+  uint32_t bootSeq = 0;                     // ...when begin() ran
+  uint32_t bootSeqLeft = 0;                 // Records with bootSeq replay may append again
+  uint32_t failures = 0;
+  bool bulk = false;
+  File bulkFile;
+};
+
+extern HistoryLog loanHistory;
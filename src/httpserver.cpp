@@ -0,0 +1,598 @@
+#include "httpserver.h"
+
+#include <algorithm>
+
+static String urlDecode(const char* text, size_t length) {
+  String decoded;
+  decoded.reserve(length);
+  for (size_t i = 0; i < length; i++) {
+    char c = text[i];
+    if (c == '+') {
+      decoded += ' ';
+    } else if (c == '%' && i + 2 < length) {
+      char hex[3] = {text[i + 1], text[i + 2], '\0'};
+      decoded += (char)strtol(hex, nullptr, 16);
+      i += 2;
+    } else {
+      decoded += c;
+    }
+  }
+  return decoded;
+}
+
+// "a=1&b=two" -> args
+static void parseArgs(const char* text, size_t length, std::vector<std::pair<String, String>>& args) {
+  const char* end = text + length;
+  while (text < end) {
+    const char* pairEnd = std::find(text, end, '&');
+    const char* equals = std::find(text, pairEnd, '=');
+    if (pairEnd > text) {
+      args.emplace_back(urlDecode(text, equals - text),
+                        equals < pairEnd ? urlDecode(equals + 1, pairEnd - equals - 1) : String());
+    }
+    text = pairEnd + 1;
+  }
+}
+
+// Value of a request header, ending at its "\r", or null. Only the header
+// lines are searched, not the body after them.
+static const char* findHeader(const char* head, const char* name) {
+  size_t nameLength = strlen(name);
+  const char* line = strstr(head, "\r\n");
+  while (line && line[2] != '\r' && line[2] != '\0') {
+    line += 2;
+    if (strncasecmp(line, name, nameLength) == 0 && line[nameLength] == ':') {
+      const char* value = line + nameLength + 1;
+      while (*value == ' ' || *value == '\t') value++;
+      return value;
+    }
+    line = strstr(line, "\r\n");
+  }
+  return nullptr;
+}
+
+static String headerString(const char* value) {
+  return value ? String(value, strcspn(value, "\r")) : String();
+}
+
+// Whether a header value mentions `token` ("keep-alive" in "Keep-Alive, Upgrade")
+static bool headerHas(const char* value, const char* token) {
+  if (!value) return false;
+  size_t length = strlen(token);
+  for (const char* end = value + strcspn(value, "\r"); value + length <= end; value++) {
+    if (strncasecmp(value, token, length) == 0) return true;
+  }
+  return false;
+}
+
+static const char* statusText(int code) {
+  switch (code) {
+    case 200: return "OK";
+    case 201: return "Created";
+    case 204: return "No Content";
+    case 304: return "Not Modified";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 409: return "Conflict";
+    case 413: return "Payload Too Large";
+    case 431: return "Request Header Fields Too Large";
+    case 500: return "Internal Server Error";
+    case 503: return "Service Unavailable";
+    default: return "";
+  }
+}
+
+static HTTPMethod parseMethod(const char* text, size_t length) {
+  static const struct {
+    const char* name;
+    HTTPMethod method;
+  } METHODS[] = {{"GET", HTTP_GET},     {"POST", HTTP_POST},   {"PUT", HTTP_PUT},
+                 {"DELETE", HTTP_DELETE}, {"PATCH", HTTP_PATCH}, {"HEAD", HTTP_HEAD},
+                 {"OPTIONS", HTTP_OPTIONS}};
+  for (const auto& entry : METHODS) {
+    if (strlen(entry.name) == length && strncmp(entry.name, text, length) == 0) return entry.method;
+  }
+  return HTTP_ANY;  // Not one we serve
+}
+
+void HttpServer::begin() {
+  listeningAt = millis();
+  listener.begin();
+  listener.setNoDelay(true);
+}
+
+void HttpServer::on(const String& uri, HTTPMethod method, THandlerFunction handler,
+                    THandlerFunction rawHandler) {
+  routes.push_back({uri, method, handler, rawHandler});
+}
+
+void HttpServer::collectHeaders(const char* names[], size_t count) {
+  collected.assign(names, names + count);
+}
+
+void HttpServer::handleClient() {
+  unsigned long now = millis();
+  accept(now);
+  for (size_t i = 0; i < MAX_CONNECTIONS; i++) {
+    Connection& connection = connections[(nextConnection + i) % MAX_CONNECTIONS];
+    if (connection.open) serve(connection, now);
+  }
+  nextConnection = (nextConnection + 1) % MAX_CONNECTIONS;
+}
+
+bool HttpServer::hasFreeSlot() const {
+  for (const Connection& connection : connections) {
+    if (!connection.open) return true;
+  }
+  return false;
+}
+
+void HttpServer::accept(unsigned long now) {
+  if (!listener.hasClient()) return;
+
+  // Someone is waiting: free the slots of clients that have gone, and if
+  // every slot is still taken, close the connection idle longest, if any
+  // is between requests
+  for (Connection& connection : connections) {
+    if (connection.open && !connection.client.connected()) close(connection);
+  }
+  if (!hasFreeSlot()) {
+    Connection* idlest = nullptr;
+    for (Connection& connection : connections) {
+      if (connection.used > 0 || connection.client.available() > 0) continue;
+      if (!idlest || now - connection.since > now - idlest->since) idlest = &connection;
+    }
+    if (idlest) {
+      closedForWaiting++;
+      close(*idlest);
+    }
+  }
+
+  uint8_t open = 0;
+  for (Connection& connection : connections) {
+    if (!connection.open && listener.hasClient()) {
+      WiFiClient client = listener.available();
+      client.setNoDelay(true);  // Responses are written whole; don't hold back their last segment
+      connection.client = client;
+      connection.open = true;
+      connection.since = now;
+      connection.requests = 0;
+      accepted++;
+    }
+    open += connection.open;
+  }
+  peakOpen = std::max(peakOpen, open);
+}
+
+void HttpServer::serve(Connection& connection, unsigned long now) {
+  if (receive(connection, now)) {
+    dispatch(connection, now);
+    return;
+  }
+  if (!connection.open) return;  // Refused
+  if (!connection.client.connected()) {
+    close(connection);
+  } else if (now - connection.since > (connection.used == 0 ? IDLE_MILLIS : REQUEST_MILLIS)) {
+    timedOut++;
+    close(connection);
+  }
+}
+
+// Read what has arrived; true once the request is complete
+bool HttpServer::receive(Connection& connection, unsigned long now) {
+  if (connection.headLength == 0) {
+    int available = connection.client.available();
+    size_t room = HEAD_SIZE - connection.used;
+    if (available > 0 && room > 0) {
+      int n = connection.client.read((uint8_t*)connection.head + connection.used,
+                                     std::min((size_t)available, room));
+      if (n > 0) {
+        if (connection.used == 0) connection.since = now;
+        connection.used += n;
+        connection.head[connection.used] = '\0';
+      }
+    }
+    const char* end = strstr(connection.head, "\r\n\r\n");
+    if (!end) {
+      if (connection.used == HEAD_SIZE) refuse(connection, 431, "Request headers too large");
+      return false;
+    }
+    connection.headLength = end + 4 - connection.head;
+
+    const char* length = findHeader(connection.head, "Content-Length");
+    connection.bodyLength = length ? strtoul(length, nullptr, 10) : 0;
+    int rawRoute = rawRouteFor(connection.head);
+    if (rawRoute < 0 && connection.bodyLength > MAX_BODY) {
+      refuse(connection, 413, "Request body too large");
+      return false;
+    }
+    size_t buffered = std::min(connection.bodyLength, connection.used - connection.headLength);
+    connection.consumed = connection.headLength + buffered;
+    if (rawRoute >= 0) {
+      if (!startRaw(connection, rawRoute, now)) return false;
+    } else if (connection.bodyLength > 0) {
+      if (bodyBytes + connection.bodyLength > MAX_BODIES || !connection.body.reserve(connection.bodyLength)) {
+        refuse(connection, 503, "Too many uploads at once, try again");
+        return false;
+      }
+      connection.reserved = connection.bodyLength;
+      bodyBytes += connection.reserved;
+      connection.body.concat(connection.head + connection.headLength, buffered);
+    }
+    const char* expect = findHeader(connection.head, "Expect");
+    if (expect && buffered < connection.bodyLength && strncasecmp(expect, "100-continue", 12) == 0) {
+      connection.client.print("HTTP/1.1 100 Continue\r\n\r\n");
+    }
+  }
+
+  if (connection.rawRoute >= 0) return feedRaw(connection, now);
+  while (connection.body.length() < connection.bodyLength) {
+    char chunk[512];
+    int available = connection.client.available();
+    if (available <= 0) return false;
+    size_t wanted = std::min({sizeof(chunk), (size_t)available, connection.bodyLength - connection.body.length()});
+    int n = connection.client.read((uint8_t*)chunk, wanted);
+    if (n <= 0) return false;
+    connection.body.concat(chunk, n);
+  }
+  return true;
+}
+
+// The route with a raw handler that a request's line names, or -1
+int HttpServer::rawRouteFor(const char* head) const {
+  const char* lineEnd = strstr(head, "\r\n");
+  const char* space = std::find(head, lineEnd, ' ');
+  if (space == lineEnd) return -1;
+  HTTPMethod method = parseMethod(head, space - head);
+  const char* target = space + 1;
+  size_t length = std::find(target, std::find(target, lineEnd, ' '), '?') - target;
+  for (size_t i = 0; i < routes.size(); i++) {
+    const Route& route = routes[i];
+    if (route.rawHandler && (route.method == HTTP_ANY || route.method == method) &&
+        route.uri.length() == length && strncmp(route.uri.c_str(), target, length) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Hand the raw handler RAW_START with the request parsed, as a handler
+// would see it. False if the upload isn't going ahead: another is running,
+// or the raw handler answered.
+bool HttpServer::startRaw(Connection& connection, int route, unsigned long now) {
+  if (rawOwner) {
+    refuse(connection, 503, "Another upload is in progress");
+    return false;
+  }
+  if (!parseRequest(connection)) {
+    refuse(connection, 400, "Bad request");
+    return false;
+  }
+  beginResponse(connection);
+  keepAlive = false;  // An answer now leaves the body unread
+  rawOwner = &connection;
+  connection.rawRoute = route;
+  connection.rawFed = 0;
+  rawUpload.totalSize = connection.bodyLength;
+  rawUpload.status = RAW_START;
+  rawUpload.currentSize = 0;
+  routes[route].rawHandler();
+  if (!responded) {
+    current = nullptr;
+    return true;
+  }
+  requests++;
+  connection.rawRoute = -1;
+  rawOwner = nullptr;
+  finish(connection, now);
+  return false;
+}
+
+// Give the raw handler the next piece of the body: what came in with the
+// headers first, then from the client. True once it has had RAW_END.
+bool HttpServer::feedRaw(Connection& connection, unsigned long now) {
+  size_t buffered = connection.consumed - connection.headLength;
+  if (connection.rawFed < connection.bodyLength) {
+    int n;
+    if (connection.rawFed < buffered) {
+      n = std::min(buffered - connection.rawFed, (size_t)HTTP_RAW_BUFLEN);
+      memcpy(rawUpload.buf, connection.head + connection.headLength + connection.rawFed, n);
+    } else {
+      int available = connection.client.available();
+      if (available <= 0) return false;
+      n = connection.client.read(rawUpload.buf, std::min({(size_t)HTTP_RAW_BUFLEN, (size_t)available,
+                                                          connection.bodyLength - connection.rawFed}));
+      if (n <= 0) return false;
+    }
+    connection.rawFed += n;
+    connection.since = now;  // A slow upload is fine as long as it keeps coming
+    callRaw(connection, RAW_WRITE, n);
+    if (connection.rawFed < connection.bodyLength) return false;
+  }
+  callRaw(connection, RAW_END, 0);
+  connection.rawRoute = -1;
+  rawOwner = nullptr;
+  return true;
+}
+
+void HttpServer::callRaw(Connection& connection, HTTPRawStatus status, size_t size) {
+  rawUpload.status = status;
+  rawUpload.currentSize = size;
+  routes[connection.rawRoute].rawHandler();
+}
+
+// Request line, args and the collected headers of the complete request
+bool HttpServer::parseRequest(Connection& connection) {
+  const char* line = connection.head;
+  const char* lineEnd = strstr(line, "\r\n");
+  const char* space = std::find(line, lineEnd, ' ');
+  const char* target = space + 1;
+  const char* targetEnd = std::find(target, lineEnd, ' ');
+  if (space == lineEnd || targetEnd == lineEnd) return false;
+  requestMethod = parseMethod(line, space - line);
+  if (requestMethod == HTTP_ANY) return false;
+  http10 = strncmp(targetEnd + 1, "HTTP/1.0", 8) == 0;
+
+  const char* query = std::find(target, targetEnd, '?');
+  requestUri.remove(0);  // Keeps its buffer for the next request
+  requestUri.concat(target, query - target);
+  requestArgs.clear();
+  if (query < targetEnd) parseArgs(query + 1, targetEnd - query - 1, requestArgs);
+
+  if (headerHas(findHeader(connection.head, "Content-Type"), "application/x-www-form-urlencoded")) {
+    parseArgs(connection.body.c_str(), connection.body.length(), requestArgs);
+  } else if (connection.body.length() > 0) {
+    requestArgs.emplace_back("plain", connection.body);
+  }
+
+  requestHeaders.clear();
+  for (const String& name : collected) {
+    const char* value = findHeader(connection.head, name.c_str());
+    if (value) requestHeaders.emplace_back(name, headerString(value));
+  }
+
+  const char* connectionHeader = findHeader(connection.head, "Connection");
+  keepAlive = http10 ? headerHas(connectionHeader, "keep-alive") : !headerHas(connectionHeader, "close");
+  return true;
+}
+
+void HttpServer::beginResponse(Connection& connection) {
+  current = &connection;
+  contentLength = CONTENT_LENGTH_NOT_SET;
+  pendingHeaders.remove(0);
+  responded = chunked = chunkEnded = handedOver = writeFailed = false;
+}
+
+void HttpServer::dispatch(Connection& connection, unsigned long now) {
+  if (!parseRequest(connection)) {
+    refuse(connection, 400, "Bad request");
+    return;
+  }
+  beginResponse(connection);
+
+  // Others are waiting to connect: let them have this slot after the response
+  if (keepAlive && !hasFreeSlot() && listener.hasClient()) {
+    keepAlive = false;
+    closedForWaiting++;
+  }
+  requests++;
+  if (connection.requests++ > 0) reused++;
+
+  THandlerFunction handler = notFound;
+  for (const Route& route : routes) {
+    if (route.uri == requestUri && (route.method == HTTP_ANY || route.method == requestMethod)) {
+      handler = route.handler;
+      break;
+    }
+  }
+  if (handler) {
+    handler();
+  } else {
+    send(404, "text/plain", "Not found: " + requestUri);
+  }
+  finish(connection, now);
+}
+
+// After the handler: end the response, then close the connection or keep
+// it for the next request
+void HttpServer::finish(Connection& connection, unsigned long now) {
+  if (responded && chunked && !http10 && !chunkEnded) sendContent("", 0);
+  if (responded && firstResponseAt == 0) firstResponseAt = millis();
+  current = nullptr;
+
+  if (handedOver) {
+    connection.client = WiFiClient();  // Still open, now somebody else's
+    close(connection);
+    return;
+  }
+  if (!responded || writeFailed || !keepAlive) {
+    close(connection);
+    return;
+  }
+
+  // Keep what has already arrived of the next request
+  connection.used -= connection.consumed;
+  memmove(connection.head, connection.head + connection.consumed, connection.used);
+  connection.head[connection.used] = '\0';
+  connection.headLength = connection.bodyLength = connection.consumed = 0;
+  dropBody(connection);
+  connection.since = now;
+}
+
+void HttpServer::refuse(Connection& connection, int code, const char* message) {
+  refused++;
+  char response[192];
+  int length = snprintf(response, sizeof(response),
+                        "HTTP/1.1 %d %s\r\nContent-Type: text/plain\r\nContent-Length: %u\r\n"
+                        "Connection: close\r\n\r\n%s",
+                        code, statusText(code), (unsigned)strlen(message), message);
+  connection.client.write((const uint8_t*)response, length);
+  close(connection);
+}
+
+void HttpServer::close(Connection& connection) {
+  if (connection.rawRoute >= 0) {
+    callRaw(connection, RAW_ABORTED, 0);  // Closed or timed out mid-upload
+    connection.rawRoute = -1;
+    rawOwner = nullptr;
+  }
+  connection.client.stop();
+  connection.client = WiFiClient();
+  connection.open = false;
+  connection.used = connection.headLength = connection.bodyLength = connection.consumed = 0;
+  connection.head[0] = '\0';
+  dropBody(connection);
+}
+
+// Free a buffered body and give its share of MAX_BODIES back
+void HttpServer::dropBody(Connection& connection) {
+  connection.body = String();
+  bodyBytes -= connection.reserved;
+  connection.reserved = 0;
+}
+
+String HttpServer::arg(const String& name) const {
+  for (const auto& arg : requestArgs) {
+    if (arg.first == name) return arg.second;
+  }
+  return String();
+}
+
+String HttpServer::arg(int index) const {
+  return index >= 0 && index < (int)requestArgs.size() ? requestArgs[index].second : String();
+}
+
+String HttpServer::argName(int index) const {
+  return index >= 0 && index < (int)requestArgs.size() ? requestArgs[index].first : String();
+}
+
+bool HttpServer::hasArg(const String& name) const {
+  for (const auto& arg : requestArgs) {
+    if (arg.first == name) return true;
+  }
+  return false;
+}
+
+String HttpServer::header(const String& name) const {
+  for (const auto& header : requestHeaders) {
+    if (header.first.equalsIgnoreCase(name)) return header.second;
+  }
+  return String();
+}
+
+bool HttpServer::hasHeader(const String& name) const {
+  for (const auto& header : requestHeaders) {
+    if (header.first.equalsIgnoreCase(name)) return true;
+  }
+  return false;
+}
+
+WiFiClient HttpServer::client() {
+  if (!current) return WiFiClient();
+  handedOver = true;
+  return current->client;
+}
+
+void HttpServer::sendHeader(const String& name, const String& value, bool first) {
+  if (first) {
+    pendingHeaders = name + ": " + value + "\r\n" + pendingHeaders;
+    return;
+  }
+  pendingHeaders += name;
+  pendingHeaders += ": ";
+  pendingHeaders += value;
+  pendingHeaders += "\r\n";
+}
+
+void HttpServer::write(const char* data, size_t length) {
+  if (writeFailed || length == 0) return;
+  if (current->client.write((const uint8_t*)data, length) != length) writeFailed = true;
+}
+
+void HttpServer::respond(int code, const char* contentType, const char* content, size_t length) {
+  if (!current || responded) return;
+  responded = true;
+  size_t declared = contentLength == CONTENT_LENGTH_NOT_SET ? length : contentLength;
+  chunked = declared == CONTENT_LENGTH_UNKNOWN;
+  if (chunked && http10) keepAlive = false;  // The body ends where the connection does
+
+  // Status line, headers and a small body go out in one write
+  if (requestMethod == HTTP_HEAD) length = 0;
+  bool inlineBody = !chunked && length <= INLINE_BODY;
+  String& head = responseHead;
+  head.remove(0);
+  head.reserve(160 + pendingHeaders.length() + (inlineBody ? length : 0));
+  head += "HTTP/1.1 ";
+  head += code;
+  head += ' ';
+  head += statusText(code);
+  head += "\r\nContent-Type: ";
+  head += contentType ? contentType : "text/html";
+  head += "\r\n";
+  head += pendingHeaders;
+  if (!chunked) {
+    head += "Content-Length: ";
+    head += (unsigned long)declared;
+    head += "\r\n";
+  } else if (!http10) {
+    head += "Transfer-Encoding: chunked\r\n";
+  }
+  head += keepAlive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+  pendingHeaders.remove(0);
+  if (inlineBody) {
+    head.concat(content, length);
+    write(head.c_str(), head.length());
+    return;
+  }
+  write(head.c_str(), head.length());
+  if (length > 0) sendContent(content, length);
+}
+
+void HttpServer::send(int code, const char* contentType, const String& content) {
+  respond(code, contentType, content.c_str(), content.length());
+}
+
+void HttpServer::send_P(int code, PGM_P contentType, PGM_P content, size_t length) {
+  respond(code, contentType, content, length);
+}
+
+void HttpServer::sendContent(const char* content, size_t length) {
+  if (!current || !responded || requestMethod == HTTP_HEAD) return;
+  if (!chunked || http10) {
+    write(content, length);
+    return;
+  }
+  if (chunkEnded) return;
+  if (length == 0) {
+    write("0\r\n\r\n", 5);
+    chunkEnded = true;
+    return;
+  }
+  // Size line, data and CRLF in one write when the chunk is small
+  char frame[16 + INLINE_BODY];
+  int prefix = snprintf(frame, 16, "%x\r\n", (unsigned)length);
+  if (length <= INLINE_BODY) {
+    memcpy(frame + prefix, content, length);
+    memcpy(frame + prefix + length, "\r\n", 2);
+    write(frame, prefix + length + 2);
+  } else {
+    write(frame, prefix);
+    write(content, length);
+    write("\r\n", 2);
+  }
+}
+
+void HttpServer::writeStats(JsonObject obj) const {
+  uint8_t open = 0;
+  for (const Connection& connection : connections) open += connection.open;
+  obj["open"] = open;
+  obj["peakOpen"] = peakOpen;
+  obj["accepted"] = accepted;
+  obj["requests"] = requests;
+  obj["keptAlive"] = reused;
+  obj["closedForWaiting"] = closedForWaiting;
+  obj["timedOut"] = timedOut;
+  obj["refused"] = refused;
+}
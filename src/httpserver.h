@@ -0,0 +1,231 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <WiFi.h>
+
+#include <functional>
+#include <utility>
+#include <vector>
+
+// The kiosk's HTTP server. It replaces the core's WebServer, which served
+// one connection at a time and closed it after every response, so each of
+// the browser's small fetches paid for a new TCP connection over the
+// soft-AP and one slow client held up the rest.
+//
+// Up to MAX_CONNECTIONS are open at once and stay open between requests
+// (HTTP/1.1 keep-alive). Each pass of handleClient() reads whatever has
+// arrived on every connection into that connection's fixed HEAD_SIZE
+// buffer, without waiting, and answers at most one complete request per
+// connection, so a busy browser can't starve the others or the rest of the
+// HTTP loop. A request whose headers don't fit is refused with 431 and a
+// body over MAX_BODY with 413. The bodies being read in share MAX_BODIES
+// between them, so six uploads at once can't take the heap: one that
+// would go over it, or whose buffer can't be allocated, gets 503 and can
+// be sent again.
+//
+// When every slot is taken and another client is waiting to connect, the
+// next response on each connection closes it ("Connection: close") to make
+// room; connections idle for IDLE_MILLIS, or taking over REQUEST_MILLIS to
+// send a request, are closed too.
+//
+// Handlers use the same calls as with WebServer (arg(), header(), send(),
+// sendContent()...), so the route table is unchanged.
+//
+// A route registered with a raw handler as well gets its body streamed
+// instead, as WebServer's raw uploads do: the raw handler is called with
+// RAW_START, then RAW_WRITE for each HTTP_RAW_BUFLEN or less - one per
+// pass - and RAW_END, and only then the route's handler. MAX_BODY doesn't
+// apply, and one such upload runs at a time (503 for another).
+
+enum HTTPMethod { HTTP_ANY, HTTP_GET, HTTP_HEAD, HTTP_POST, HTTP_PUT, HTTP_PATCH, HTTP_DELETE, HTTP_OPTIONS };
+
+enum HTTPRawStatus { RAW_START, RAW_WRITE, RAW_END, RAW_ABORTED };
+
+#define HTTP_RAW_BUFLEN 1436  // One TCP segment
+
+struct HTTPRaw {
+  HTTPRawStatus status = RAW_START;
+  size_t totalSize = 0;    // Content-Length
+  size_t currentSize = 0;  // Bytes in buf for RAW_WRITE
+  uint8_t buf[HTTP_RAW_BUFLEN];
+};
+
+#define CONTENT_LENGTH_UNKNOWN ((size_t)-1)
+#define CONTENT_LENGTH_NOT_SET ((size_t)-2)
+
+class HttpServer {
+ public:
+  typedef std::function<void(void)> THandlerFunction;
+
+  static const size_t MAX_CONNECTIONS = 6;           // What one browser opens to a host
+  static const size_t HEAD_SIZE = 1536;              // Request line and headers
+  static const size_t MAX_BODY = 64 * 1024;          // The bulk uploads are the big ones
+  static const size_t MAX_BODIES = 72 * 1024;        // All buffered at once: one of those and some forms
+  static const unsigned long IDLE_MILLIS = 5000;     // Between requests
+  static const unsigned long REQUEST_MILLIS = 5000;  // To send a whole request
+
+  explicit HttpServer(uint16_t port = 80) : listener(port) {}
+
+  void begin();
+
+  // One pass: accept, read, and answer what is complete. Never waits for
+  // a client; call it from the HTTP loop.
+  void handleClient();
+
+  void on(const String& uri, THandlerFunction handler) { on(uri, HTTP_ANY, handler); }
+  void on(const String& uri, HTTPMethod method, THandlerFunction handler) {
+    on(uri, method, handler, THandlerFunction());
+  }
+  void on(const String& uri, HTTPMethod method, THandlerFunction handler, THandlerFunction rawHandler);
+  void onNotFound(THandlerFunction handler) { notFound = handler; }
+  void collectHeaders(const char* names[], size_t count);
+
+  // The request being handled. Query string and form fields are both args;
+  // any other body is the "plain" arg.
+  String uri() const { return requestUri; }
+  HTTPMethod method() const { return requestMethod; }
+  int args() const { return requestArgs.size(); }
+  String arg(const String& name) const;
+  String arg(int index) const;
+  String argName(int index) const;
+  bool hasArg(const String& name) const;
+  String header(const String& name) const;  // Only those named to collectHeaders()
+  bool hasHeader(const String& name) const;
+
+  // The body of a raw upload, for its raw handler. The request above is
+  // only valid at RAW_START - later calls come in later passes, after
+  // other requests - and only then may the raw handler answer, which
+  // refuses the upload (the connection is closed).
+  HTTPRaw& raw() { return rawUpload; }
+
+  // Take the connection over from the server (an event stream). It leaves
+  // the connection table; nothing is sent for the request.
+  WiFiClient client();
+
+  // The response. Without setContentLength() the length is that of the
+  // content given to send(); CONTENT_LENGTH_UNKNOWN sends the rest with
+  // sendContent() in chunks, ended by an empty one.
+  void setContentLength(size_t length) { contentLength = length; }
+  void sendHeader(const String& name, const String& value, bool first = false);
+  void send(int code, const char* contentType = nullptr, const String& content = String());
+  void send(int code, const String& contentType, const String& content) {
+    send(code, contentType.c_str(), content);
+  }
+  void send(int code, const char* contentType, const char* content) {
+    send(code, contentType, String(content));
+  }
+  void send_P(int code, PGM_P contentType, PGM_P content, size_t length);
+  void sendContent(const String& content) { sendContent(content.c_str(), content.length()); }
+  void sendContent(const char* content, size_t length);
+
+  template <typename T>
+  size_t streamFile(T& file, const String& contentType, int code = 200) {
+    String name = file.name();
+    if (name.endsWith(".gz") && contentType != "application/x-gzip" &&
+        contentType != "application/octet-stream") {
+      sendHeader("Content-Encoding", "gzip");
+    }
+    setContentLength(file.size());
+    send(code, contentType, String());
+    uint8_t buffer[1024];
+    size_t total = 0;
+    for (size_t n = file.read(buffer, sizeof(buffer)); n > 0; n = file.read(buffer, sizeof(buffer))) {
+      sendContent((const char*)buffer, n);
+      total += n;
+    }
+    return total;
+  }
+
+  // Connection counters for /api/loop
+  void writeStats(JsonObject obj) const;
+
+  // millis() when begin() was called and when the first response went
+  // out, 0 until then: how long after power-on the kiosk was reachable
+  uint32_t listeningMillis() const { return listeningAt; }
+  uint32_t firstResponseMillis() const { return firstResponseAt; }
+
+ private:
+  typedef std::vector<std::pair<String, String>> Fields;
+
+  struct Route {
+    String uri;
+    HTTPMethod method;
+    THandlerFunction handler;
+    THandlerFunction rawHandler;  // Empty unless the body is streamed to it
+  };
+
+  struct Connection {
+    WiFiClient client;
+    bool open = false;
+    char head[HEAD_SIZE + 1];  // What has arrived of the next request, NUL-terminated
+    size_t used = 0;
+    size_t headLength = 0;     // Through the blank line; 0 until it has arrived
+    size_t bodyLength = 0;     // Content-Length
+    size_t consumed = 0;       // Bytes of head[] that belong to this request
+    String body;
+    size_t reserved = 0;       // Of bodyBytes, for body
+    int rawRoute = -1;         // Index of the route whose raw handler takes the body
+    size_t rawFed = 0;         // Body bytes given to it so far
+    unsigned long since = 0;   // Last request finished, or this one started
+    uint32_t requests = 0;
+  };
+
+  void accept(unsigned long now);
+  void serve(Connection& connection, unsigned long now);
+  bool receive(Connection& connection, unsigned long now);
+  void dispatch(Connection& connection, unsigned long now);
+  void finish(Connection& connection, unsigned long now);
+  int rawRouteFor(const char* head) const;
+  bool startRaw(Connection& connection, int route, unsigned long now);
+  bool feedRaw(Connection& connection, unsigned long now);
+  void callRaw(Connection& connection, HTTPRawStatus status, size_t size);
+  bool parseRequest(Connection& connection);
+  void beginResponse(Connection& connection);
+  void refuse(Connection& connection, int code, const char* message);
+  void close(Connection& connection);
+  void dropBody(Connection& connection);
+  bool hasFreeSlot() const;
+  void respond(int code, const char* contentType, const char* content, size_t length);
+  void write(const char* data, size_t length);
+
+  static const size_t INLINE_BODY = 1024;  // Bodies up to this go out with the headers
+
+  WiFiServer listener;
+  Connection connections[MAX_CONNECTIONS];
+  size_t nextConnection = 0;  // Where the next pass starts, so each gets to go first
+  std::vector<Route> routes;
+  THandlerFunction notFound;
+  std::vector<String> collected;
+  size_t bodyBytes = 0;  // Set aside for the bodies being buffered, up to MAX_BODIES
+
+  // The request being handled and its response
+  Connection* current = nullptr;
+  HTTPMethod requestMethod = HTTP_GET;
+  String requestUri;
+  Fields requestArgs;
+  Fields requestHeaders;
+  bool keepAlive = false;
+  bool http10 = false;
+  size_t contentLength = CONTENT_LENGTH_NOT_SET;
+  String pendingHeaders;
+  String responseHead;  // Reused, like pendingHeaders, so a response doesn't allocate for them
+  bool responded = false;
+  bool chunked = false;
+  bool chunkEnded = false;
+  bool handedOver = false;
+  bool writeFailed = false;
+
+  HTTPRaw rawUpload;
+  Connection* rawOwner = nullptr;  // The connection streaming a raw upload
+
+  uint32_t accepted = 0;
+  uint32_t requests = 0;
+  uint32_t reused = 0;     // Requests on a connection kept alive from an earlier one
+  uint32_t closedForWaiting = 0;
+  uint32_t timedOut = 0;
+  uint32_t refused = 0;    // 400, 413, 431, 503
+  uint8_t peakOpen = 0;
+  uint32_t listeningAt = 0;
+  uint32_t firstResponseAt = 0;
+};
@@ -0,0 +1,113 @@
+#include "journal.h"
+
+#include "datafs.h"
+#include "metrics.h"
+
+// Longest line we accept on replay; real entries are a few hundred bytes
+static const size_t MAX_LINE_LENGTH = 1024;
+
+uint32_t crc32Update(uint32_t crc, const uint8_t* data, size_t length) {
+  crc = ~crc;
+  while (length--) {
+    crc ^= *data++;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+    }
+  }
+  return ~crc;
+}
+
+Journal::Journal(const char* path) : path(path) {}
+
+bool Journal::append(JsonDocument& entry) {
+  unsigned long start = micros();
+  entry["seq"] = seq + 1;
+
+  if (measureJson(entry) >= MAX_LINE_LENGTH) {
+    Serial.println("Journal entry too large");
+    return false;
+  }
+
+  // Serialize into a stack buffer first so the line goes out in one write
+  char line[MAX_LINE_LENGTH + 12];
+  size_t length = serializeJson(entry, line, MAX_LINE_LENGTH);
+  uint32_t crc = crc32Update(0, (const uint8_t*)line, length);
+  length += snprintf(line + length, sizeof(line) - length, "*%08lX\n", (unsigned long)crc);
+
+  File file = openFile(path, "a");
+  if (!file) {
+    Serial.println("Failed to open journal for append: " + String(path));
+    return false;
+  }
+  size_t written = file.write((const uint8_t*)line, length);
+  file.close();  // Close flushes the flash page so the entry survives a reset
+  metrics.recordFileWrite(written);
+  if (written != length) {
+    return false;
+  }
+
+  seq++;
+  bytes += length;
+
+  uint32_t elapsed = micros() - start;
+  counters.appends++;
+  counters.bytesAppended += length;
+  counters.lastCommitMicros = elapsed;
+  counters.totalCommitMicros += elapsed;
+  if (elapsed > counters.maxCommitMicros) counters.maxCommitMicros = elapsed;
+  return true;
+}
+
+size_t Journal::replay(uint32_t afterSeq, void (*apply)(JsonObject entry)) {
+  seq = afterSeq;
+  bytes = 0;
+  counters.replayed = 0;
+  counters.discarded = 0;
+  if (!dataFs().exists(path)) return 0;
+  File file = openFile(path, "r");
+  if (!file) return 0;
+  bytes = file.size();
+
+  // A batch line is mostly short book IDs, and each one costs a variant
+  // slot on top of its text, so the pool needs more room than the line
+  DynamicJsonDocument doc(2 * MAX_LINE_LENGTH);
+  while (file.available()) {
+    String line = file.readStringUntil('\n');
+    int star = line.lastIndexOf('*');
+    if (star <= 0 || line.length() - star != 9) {
+      counters.discarded++;
+      break;  // Torn final line - everything after it is unreliable too
+    }
+    uint32_t expected = strtoul(line.c_str() + star + 1, nullptr, 16);
+    if (crc32Update(0, (const uint8_t*)line.c_str(), star) != expected) {
+      counters.discarded++;
+      break;
+    }
+    unsigned long parseStart = micros();
+    DeserializationError error = deserializeJson(doc, line.c_str(), star);
+    metrics.recordJsonParse(micros() - parseStart);
+    if (error) {
+      counters.discarded++;
+      break;
+    }
+
+    uint32_t entrySeq = doc["seq"] | 0;
+    if (entrySeq <= seq) continue;  // Already folded into the snapshot
+    apply(doc.as<JsonObject>());
+    seq = entrySeq;
+    counters.replayed++;
+  }
+  file.close();
+
+  if (counters.discarded > 0) {
+    Serial.println("Journal: discarded damaged tail after seq " + String(seq));
+  }
+  return counters.replayed;
+}
+
+void Journal::truncate() {
+  if (dataFs().exists(path)) {
+    dataFs().remove(path);
+  }
+  bytes = 0;
+}
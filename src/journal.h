@@ -0,0 +1,57 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+// Write-ahead log of record-level changes. Instead of rewriting a whole
+// database file for every update, each mutation is appended as one line:
+//
+//   {"seq":42,"op":"borrow",...}*1A2B3C4D
+//
+// The trailing CRC-32 lets replay stop cleanly at a line torn by a power cut.
+// Sequence numbers increase monotonically across compactions, so a snapshot
+// can record the last sequence it contains and replay skips anything older.
+
+// Counters for judging write amplification and commit latency
+struct JournalStats {
+  uint32_t appends = 0;            // Mutations committed
+  uint32_t bytesAppended = 0;      // Journal bytes written
+  uint32_t lastCommitMicros = 0;   // Latency of the most recent append
+  uint32_t maxCommitMicros = 0;
+  uint64_t totalCommitMicros = 0;
+  uint32_t replayed = 0;           // Entries applied at the last boot
+  uint32_t discarded = 0;          // Torn or corrupt lines skipped
+};
+
+class Journal {
+ public:
+  explicit Journal(const char* path);
+
+  // Stamp the entry with the next sequence number and append it durably.
+  // Returns false (and leaves the sequence untouched) if the write failed.
+  bool append(JsonDocument& entry);
+
+  // Apply every entry with seq > afterSeq in order and remember the highest
+  // sequence seen so new appends continue from there
+  size_t replay(uint32_t afterSeq, void (*apply)(JsonObject entry));
+
+  // Drop all entries once a snapshot covering them has been installed
+  void truncate();
+
+  // Use up a sequence number without writing an entry, for a change that
+  // only the snapshot taken right after it records (a bulk upload)
+  uint32_t skip() { return ++seq; }
+
+  uint32_t lastSeq() const { return seq; }
+  size_t sizeBytes() const { return bytes; }
+  const JournalStats& stats() const { return counters; }
+
+ private:
+  const char* path;
+  uint32_t seq = 0;
+  size_t bytes = 0;
+  JournalStats counters;
+};
+
+// CRC-32 (IEEE) used for journal lines
+uint32_t crc32Update(uint32_t crc, const uint8_t* data, size_t length);
@@ -0,0 +1,379 @@
+#include "kiosk.h"
+
+#include <SPI.h>
+#include <WiFi.h>
+#include <Wire.h>
+
+// Pin definitions - hardware connections for our system
+#define RST_PIN 16  // Reset pin for RFID module
+#define SS_PIN 5    // SDA/SS pin for RFID module (chip select)
+#define IR_PIN 4    // IR motion sensor input pin
+#define SDA_PIN 21  // I2C data line for LCD display
+#define SCL_PIN 22  // I2C clock line for LCD display
+
+// Hardware objects
+MFRC522 rfid(SS_PIN, RST_PIN);  // RFID reader instance
+LiquidCrystal_I2C lcd(0x27, 16, 2); // LCD screen (I2C address may need adjustment for your specific LCD)
+Display display(lcd);                // Everything reaches the LCD through this
+
+// Motion detection variables to manage user presence
+volatile bool motionDetected = false;  // Flag set by interrupt
+const unsigned long SCAN_TIMEOUT = 5000; // 5 seconds window to scan card after motion
+const unsigned long MESSAGE_HOLD = 2000; // How long scan results stay on the LCD
+const unsigned long NOTICE_HOLD = 4000;  // Notices (e.g. overdue books) get longer to read
+const unsigned long BATCH_IDLE_TIMEOUT = 30000; // Batch mode gives up after this long without a new tag
+const size_t BATCH_READS_PER_PASS = 4;   // Tags selected per pass, keeps each pass a few ms
+
+// What the kiosk is doing between reader task passes. Every state is timed
+// with millis() rather than delay() so each pass stays short.
+enum KioskState {
+  IDLE,             // Scrolling the welcome text, waiting for motion
+  SCANNING,         // Motion seen, counting down while polling the reader
+  SHOWING_RESULT,   // Holding the scanned UID on the LCD
+  SHOWING_TIMEOUT,  // Holding the "Scan timeout" message
+  SHOWING_NOTICE,   // Holding a notice from the HTTP side
+  BATCH_SCANNING    // Reading every tag in the field until the batch is closed
+};
+
+KioskState kioskState = IDLE;
+unsigned long stateEnteredAt = 0;      // millis() when kioskState last changed
+
+// LCD display management for scrolling text
+String scrollText = "";               // Text to scroll on LCD
+int scrollPosition = 0;               // Current position in scrolling text
+unsigned long lastScrollTime = 0;     // Time tracking for smooth scrolling
+const int scrollSpeed = 400;          // Milliseconds between scroll updates
+char ipLine[Display::COLUMNS + 1];    // "IP: ..." under the welcome text, formatted once
+
+RFIDMode currentMode = NORMAL;  // Start in normal scanning mode (reader task only)
+
+CardBatch batchSeen;                  // Tags already reported in this batch
+unsigned long lastBatchTag = 0;       // millis() of the last new tag
+
+SpscRing<ReaderEvent, 16> readerEvents;     // Reader task -> HTTP loop
+SpscRing<ReaderCommand, 4> readerCommands;  // HTTP loop -> reader task
+SpscRing<ReaderNotice, 4> readerNotices;    // HTTP loop -> reader task
+
+LoopStats readerStats;  // Reader task
+volatile bool readerStatsReset = false;
+
+// Mode names used in scan events
+const char* rfidModeName(RFIDMode mode) {
+  switch (mode) {
+    case NEW_USER: return "user";
+    case NEW_BOOK: return "book";
+    case BATCH: return "batch";
+    default: return "normal";
+  }
+}
+
+// Interrupt handler for IR sensor - runs when motion is detected
+// IRAM_ATTR ensures this runs from RAM for faster response time
+void IRAM_ATTR motionInterrupt() {
+  motionDetected = true;  // Just set the flag, keep ISR short and simple
+}
+
+// The welcome screen at the current scroll position: the text runs round
+// with a three-space gap before it repeats, the IP address stays below
+void showWelcomeScreen() {
+  const char* text = scrollText.c_str();
+  size_t length = scrollText.length();
+  char window[Display::COLUMNS + 1];
+  if (length <= Display::COLUMNS) {
+    display.setLine(0, text);  // Fits - no scrolling
+  } else {
+    for (size_t i = 0; i < Display::COLUMNS; i++) {
+      size_t at = (scrollPosition + i) % (length + 3);
+      window[i] = at < length ? text[at] : ' ';
+    }
+    window[Display::COLUMNS] = '\0';
+    display.setLine(0, window);
+  }
+  display.setLine(1, ipLine);
+}
+
+// Handles the scrolling text effect on our LCD display. Only the cells that
+// moved are sent; the IP line below is never resent.
+void scrollLcdText() {
+  if (scrollText.length() > 16) {  // Only scroll if text is longer than display width
+    unsigned long currentTime = millis();
+    if (currentTime - lastScrollTime > scrollSpeed) {  // Time to scroll one position
+      lastScrollTime = currentTime;
+      
+      // Increment scroll position and reset if we're past the end
+      scrollPosition++;
+      if (scrollPosition >= (int)scrollText.length() + 3) {  // +3 for the spaces
+        scrollPosition = 0;  // Start over from the beginning
+      }
+      showWelcomeScreen();
+    }
+  }
+}
+
+void kioskBegin() {
+  // Initialize LCD display and show startup message
+  Wire.begin(SDA_PIN, SCL_PIN);
+  display.begin();
+  display.setLines("Library System", "Initializing...");
+  display.flush();
+  
+  // Initialize SPI communication and RFID reader
+  SPI.begin();
+  rfid.PCD_Init();
+  delay(4);  // Brief delay for RFID module to stabilize
+  Serial.println("RFID reader initialized");
+  
+  // Set up IR motion sensor with interrupt for user detection
+  pinMode(IR_PIN, INPUT);
+  Serial.println("Setting up IR sensor interrupt on pin " + String(IR_PIN));
+  attachInterrupt(digitalPinToInterrupt(IR_PIN), motionInterrupt, RISING);
+  Serial.println("IR sensor interrupt set up");
+}
+
+void kioskShowWelcome(const String& text) {
+  scrollText = text;
+  scrollPosition = 0;
+  // The address doesn't change while the access point is up
+  snprintf(ipLine, sizeof(ipLine), "IP: %s", WiFi.softAPIP().toString().c_str());
+  showWelcomeScreen();
+  display.flush();
+}
+
+void enterState(KioskState state) {
+  kioskState = state;
+  stateEnteredAt = millis();
+}
+
+// Motion seen - clear the last card and start the countdown
+void startScanning() {
+  // Clear any previous card data for security
+  ReaderEvent event = {ReaderEvent::SCAN_STARTED, currentMode, millis(), CardUid()};
+  readerEvents.push(event);
+  
+  // Update LCD to show scan instructions
+  display.dropMessages();
+  display.setLines("Motion detected", "Scan in 5 sec...");
+  Serial.println("Motion detected, ready to scan");
+  
+  enterState(SCANNING);
+}
+
+// Poll the reader once and keep the countdown on the LCD current
+void updateScanning(unsigned long currentTime) {
+  unsigned long elapsedTime = currentTime - stateEnteredAt;
+  
+  if (elapsedTime >= SCAN_TIMEOUT) {
+    // Scan timeout reached - no card detected
+    display.post("Scan timeout", "Try again", MESSAGE_HOLD);
+    ReaderEvent event = {ReaderEvent::SCAN_TIMED_OUT, currentMode, currentTime, CardUid()};
+    readerEvents.push(event);
+    enterState(SHOWING_TIMEOUT);
+    return;
+  }
+  
+  // Only the digit reaches the panel, and only when the second changes
+  char countdown[Display::COLUMNS + 1];
+  snprintf(countdown, sizeof(countdown), "Scan in %d sec...", (int)(5 - elapsedTime / 1000));
+  display.setLine(1, countdown);
+  
+  // Check for RFID card presence during the scan window
+  if (!rfid.PICC_IsNewCardPresent() || !rfid.PICC_ReadCardSerial()) {
+    return;
+  }
+  
+  // Successfully read a card - hand it to the HTTP side, which records it
+  // and pushes it to every open browser. From here to the browsers the UID
+  // stays a CardUid and the hex is formatted on the stack: a card read
+  // never allocates.
+  CardUid uid = CardUid::fromBytes(rfid.uid.uidByte, rfid.uid.size);
+  CardUid::Hex hex = uid.hex();
+  ReaderEvent event = {ReaderEvent::CARD_READ, currentMode, currentTime, uid};
+  if (!readerEvents.push(event)) {
+    Serial.print("Scan queue full, dropped card ");
+    Serial.println(hex.text);
+  }
+  
+  // Show different messages based on current mode
+  const char* title;
+  if (currentMode == NEW_USER) {
+    title = "New User Card";
+    Serial.print("New user card: ");
+  } else if (currentMode == NEW_BOOK) {
+    title = "New Book Card";
+    Serial.print("New book card: ");
+  } else {
+    title = "Card Detected";
+    Serial.print("Card scanned: ");
+  }
+  Serial.println(hex.text);
+  // Registration modes are one-shot, so they end with the card that answers them
+  currentMode = NORMAL;
+  
+  // Card info and mode, with the UID on the second line, held briefly
+  char uidLine[24];
+  snprintf(uidLine, sizeof(uidLine), "UID: %s", hex.text);
+  display.post(title, uidLine, MESSAGE_HOLD);
+  
+  // Stop RFID communication to release the card
+  rfid.PICC_HaltA();
+  rfid.PCD_StopCrypto1();
+  
+  enterState(SHOWING_RESULT);
+}
+
+// Batch mode requested - keep the reader open and start an empty batch
+void startBatch() {
+  batchSeen.clear();
+  lastBatchTag = millis();
+  ReaderEvent event = {ReaderEvent::SCAN_STARTED, BATCH, lastBatchTag, CardUid()};
+  readerEvents.push(event);
+  
+  display.dropMessages();
+  display.setLines("Batch scan", "Tags: 0");
+  Serial.println("Batch scan started");
+  
+  enterState(BATCH_SCANNING);
+}
+
+// Show how the batch ended and hold the message like a single scan result
+void finishBatch(const char* message, KioskState next) {
+  char tags[Display::COLUMNS + 1];
+  snprintf(tags, sizeof(tags), "Tags: %d", (int)batchSeen.size());
+  display.post(message, tags, MESSAGE_HOLD);
+  Serial.print(message);
+  Serial.print(", tags: ");
+  Serial.println((int)batchSeen.size());
+  enterState(next);
+}
+
+// Read every tag in the field. A tag that has been read is halted and
+// ignores REQA from then on, so each PICC_IsNewCardPresent() is answered
+// only by tags not read yet, and PICC_ReadCardSerial()'s anticollision
+// loop selects one of them. A tag that leaves the field and comes back
+// wakes up and is read again; batchSeen drops the repeat.
+void updateBatch(unsigned long currentTime) {
+  size_t before = batchSeen.size();
+  
+  // Leave room in the ring for the timeout event, so no tag is read (and
+  // halted) without being delivered
+  for (size_t reads = 0; reads < BATCH_READS_PER_PASS && readerEvents.size() < readerEvents.capacity() - 1; reads++) {
+    if (!rfid.PICC_IsNewCardPresent() || !rfid.PICC_ReadCardSerial()) break;
+    CardUid uid = CardUid::fromBytes(rfid.uid.uidByte, rfid.uid.size);
+    rfid.PICC_HaltA();
+    if (!batchSeen.add(uid)) continue;  // Repeat read, or the batch is full
+    
+    ReaderEvent event = {ReaderEvent::CARD_READ, BATCH, currentTime, uid};
+    readerEvents.push(event);
+    lastBatchTag = currentTime;
+    Serial.print("Batch card: ");
+    Serial.println(uid.hex().text);
+  }
+  
+  if (batchSeen.size() != before) {
+    char tags[Display::COLUMNS + 1];
+    snprintf(tags, sizeof(tags), "Tags: %d%s", (int)batchSeen.size(), batchSeen.full() ? " (full)" : "");
+    display.setLine(1, tags);
+  }
+  
+  if (currentTime - lastBatchTag >= BATCH_IDLE_TIMEOUT) {
+    // Nobody is adding books - stop reading, the HTTP side keeps what it has
+    ReaderEvent event = {ReaderEvent::SCAN_TIMED_OUT, BATCH, currentTime, CardUid()};
+    readerEvents.push(event);
+    currentMode = NORMAL;
+    finishBatch("Batch timeout", SHOWING_TIMEOUT);
+  }
+}
+
+void recordLoopTime(LoopStats& stats, uint32_t elapsed) {
+  stats.iterations++;
+  stats.lastMicros = elapsed;
+  stats.totalMicros += elapsed;
+  if (elapsed > stats.maxMicros) stats.maxMicros = elapsed;
+  if (elapsed > SLOW_LOOP_MICROS) stats.slowIterations++;
+  stats.passes.record(elapsed);
+}
+
+// One pass of the reader task. Never blocks: every wait is a state with a
+// deadline, so the task can poll the reader again within a tick.
+void readerPass() {
+  unsigned long passStart = micros();
+  
+  // Apply mode changes requested from the web interface
+  ReaderCommand command;
+  while (readerCommands.pop(command)) {
+    if (kioskState == BATCH_SCANNING && command.mode != BATCH) {
+      finishBatch("Batch closed", SHOWING_RESULT);
+    }
+    currentMode = command.mode;
+    if (command.mode == BATCH) {
+      if (kioskState != BATCH_SCANNING) startBatch();
+    } else if (command.startScan) {
+      motionDetected = true;
+    }
+  }
+  
+  // Notices about the card just read replace its result on the LCD
+  ReaderNotice notice;
+  while (readerNotices.pop(notice)) {
+    if (kioskState != SHOWING_RESULT && kioskState != SHOWING_NOTICE) continue;
+    display.post(notice.lines[0], notice.lines[1], NOTICE_HOLD, true);
+    enterState(SHOWING_NOTICE);
+  }
+  
+  // Get current time for timing operations
+  unsigned long currentTime = millis();
+  display.tick(currentTime);
+  
+  switch (kioskState) {
+    case IDLE:
+      if (motionDetected) {
+        // Reset the flag so we don't trigger again until next motion
+        motionDetected = false;
+        startScanning();
+      } else {
+        scrollLcdText();
+      }
+      break;
+    
+    case SCANNING:
+      updateScanning(currentTime);
+      break;
+    
+    case BATCH_SCANNING:
+      updateBatch(currentTime);
+      break;
+    
+    case SHOWING_RESULT:
+    case SHOWING_TIMEOUT:
+    case SHOWING_NOTICE:
+      // Held until the display has run through its messages
+      if (!display.showingMessage()) {
+        // Back to the info display, starting from the top
+        scrollPosition = 0;
+        lastScrollTime = currentTime;
+        showWelcomeScreen();
+        enterState(IDLE);
+      }
+      break;
+  }
+  display.flush();
+  
+  if (readerStatsReset) {
+    readerStats = LoopStats();
+    display.resetStats();
+    readerStatsReset = false;
+  }
+  recordLoopTime(readerStats, micros() - passStart);
+}
+
+// Reader task: IR sensor, RFID polling and the LCD. Pinned to its own core
+// so a slow HTTP request never delays a scan, and I2C/SPI traffic never
+// delays a request.
+void readerTask(void*) {
+  for (;;) {
+    readerPass();
+    
+    // One tick between polls leaves the core to WiFi and the idle task
+    vTaskDelay(1);
+  }
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <Arduino.h>
+#include <MFRC522.h>
+#include <LiquidCrystal_I2C.h>
+
+#include "batch.h"
+#include "display.h"
+#include "histogram.h"
+#include "ring.h"
+#include "uid.h"
+
+// The kiosk hardware side: IR sensor, RFID reader and LCD, driven by the
+// reader task. It shares nothing with the HTTP side except the rings
+// below, so either side can be driven on its own (the native benchmarks
+// step it one pass at a time).
+
+// RFID reading modes to determine how to handle scanned cards
+enum RFIDMode {
+  NORMAL,   // Regular card scanning (checkout/return)
+  NEW_USER, // Registering a card for a new user
+  NEW_BOOK, // Registering a card for a new book
+  BATCH     // Collecting every tag in a stack of books until told to stop
+};
+
+// Mode names used in scan events
+const char* rfidModeName(RFIDMode mode);
+
+// The reader task (IR sensor, RFID, LCD) and the HTTP loop run on different
+// cores and share no state. Each direction is a single-producer/
+// single-consumer ring instead.
+struct ReaderEvent {
+  enum Kind : uint8_t {
+    SCAN_STARTED,   // Motion seen - forget the previous card
+    CARD_READ,      // In BATCH mode, once per distinct tag
+    SCAN_TIMED_OUT  // The window closed without a card (BATCH: no new tag for a while)
+  } kind;
+  RFIDMode mode;
+  unsigned long time;
+  CardUid uid;
+};
+
+struct ReaderCommand {
+  RFIDMode mode;    // Switching away from BATCH ends the batch
+  bool startScan;   // Open a scan window as if motion had been seen
+};
+
+// Two lines for the LCD from the HTTP side, e.g. about the card just read.
+// Shown in place of the scan result, unless a new scan or a batch has
+// started by the time it arrives.
+struct ReaderNotice {
+  char lines[2][17];
+};
+
+extern SpscRing<ReaderEvent, 16> readerEvents;     // Reader task -> HTTP loop
+extern SpscRing<ReaderCommand, 4> readerCommands;  // HTTP loop -> reader task
+extern SpscRing<ReaderNotice, 4> readerNotices;    // HTTP loop -> reader task
+
+const BaseType_t READER_CORE = 0;  // WiFi also lives here; loop() runs on core 1
+
+// Time taken by each pass of a task loop - for the HTTP loop this bounds how
+// long a request can wait before server.handleClient() runs again
+struct LoopStats {
+  uint32_t iterations = 0;
+  uint32_t lastMicros = 0;
+  uint32_t maxMicros = 0;
+  uint64_t totalMicros = 0;
+  uint32_t slowIterations = 0;  // Passes over SLOW_LOOP_MICROS
+  Histogram passes;             // For /api/metrics
+};
+
+const uint32_t SLOW_LOOP_MICROS = 20000;
+void recordLoopTime(LoopStats& stats, uint32_t elapsed);
+
+extern LoopStats readerStats;
+extern volatile bool readerStatsReset;  // Set by the HTTP side, cleared by the reader task
+
+extern MFRC522 rfid;
+extern LiquidCrystal_I2C lcd;
+extern Display display;  // Shadow framebuffer in front of lcd - draw through this
+
+// Bring up the LCD, RFID reader and IR sensor interrupt
+void kioskBegin();
+
+// Text scrolled on the first LCD line while idle; the second shows the IP
+void kioskShowWelcome(const String& text);
+
+// One pass of the reader task: commands, IR sensor, RFID poll, LCD
+void readerPass();
+
+// Reader task entry point - readerPass() forever, one tick apart
+void readerTask(void*);
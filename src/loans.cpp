@@ -0,0 +1,157 @@
+#include "loans.h"
+
+#include <algorithm>
+
+#include "catalog.h"
+
+static const uint32_t SECONDS_PER_DAY = 86400;
+static const uint32_t NOT_QUEUED = 0xFFFFFFFF;  // Book slot with no loan in the heap
+
+void LoanSchedule::rebuild(const std::vector<Book>& books) {
+  heap.clear();
+  late.clear();
+  borrowers.clear();
+  borrowerByUser.rebuild(borrowers);
+  everyone = Borrower();
+  position.assign(books.size(), NOT_QUEUED);
+  for (size_t slot = 0; slot < books.size(); slot++) {
+    if (books[slot].borrowed && books[slot].returnDate > 0) {
+      heap.push_back({(uint32_t)books[slot].returnDate, (uint32_t)slot});
+    }
+  }
+  // Floyd's heap construction: O(n) rather than n pushes
+  for (size_t i = 0; i < heap.size(); i++) position[heap[i].slot] = i;
+  for (size_t i = heap.size() / 2; i > 0; i--) siftDown(i - 1);
+}
+
+void LoanSchedule::open(const std::vector<Book>& books, uint32_t slot) {
+  const Book& book = books[slot];
+  if (book.returnDate <= 0) return;  // No due date, never overdue
+  if (position.size() < books.size()) position.resize(books.size(), NOT_QUEUED);
+  push({(uint32_t)book.returnDate, slot});
+}
+
+void LoanSchedule::close(const std::vector<Book>& books, uint32_t slot) {
+  if (slot < position.size() && position[slot] != NOT_QUEUED) {
+    removeAt(position[slot]);
+    return;
+  }
+  // Not waiting, so either overdue or never scheduled
+  Loan loan = {(uint32_t)books[slot].returnDate, slot};
+  auto found = std::lower_bound(late.begin(), late.end(), loan, before);
+  if (found == late.end() || found->slot != slot) return;
+  count(books[slot], loan, false);
+  late.erase(found);
+}
+
+void LoanSchedule::advance(const std::vector<Book>& books, time_t now) {
+  // The clock was set back (browsers set it): loans not due after all wait again
+  while (!late.empty() && (time_t)late.back().due >= now) {
+    count(books[late.back().slot], late.back(), false);
+    push(late.back());
+    late.pop_back();
+  }
+  while (!heap.empty() && (time_t)heap[0].due < now) {
+    Loan loan = heap[0];
+    removeAt(0);
+    // Loans fall due in order, so this is the end of the list unless one
+    // was lent already overdue
+    late.insert(std::upper_bound(late.begin(), late.end(), loan, before), loan);
+    count(books[loan.slot], loan, true);
+  }
+}
+
+OverdueTotals LoanSchedule::totalsFor(const char* user, time_t now) const {
+  int slot = borrowerByUser.find(borrowers, user);
+  return slot < 0 ? OverdueTotals() : owed(borrowers[slot], now);
+}
+
+size_t LoanSchedule::memoryBytes() const {
+  return (heap.capacity() + late.capacity()) * sizeof(Loan) + position.capacity() * sizeof(uint32_t) +
+         borrowers.capacity() * sizeof(Borrower);
+}
+
+uint32_t LoanSchedule::daysLate(uint32_t due, time_t now) {
+  if (now <= (time_t)due) return 0;
+  return (uint32_t)(now / SECONDS_PER_DAY - due / SECONDS_PER_DAY);
+}
+
+// books * today - sum of due days = the days each loan is late, summed
+OverdueTotals LoanSchedule::owed(const Borrower& borrower, time_t now) {
+  OverdueTotals totals;
+  totals.books = borrower.books;
+  uint64_t today = (uint64_t)(now / SECONDS_PER_DAY) * borrower.books;
+  if (today > borrower.dueDays) totals.penalty = (uint32_t)(today - borrower.dueDays) * PENALTY_PER_DAY;
+  return totals;
+}
+
+// Add an overdue loan to its borrower's total, or take it off again
+void LoanSchedule::count(const Book& book, const Loan& loan, bool adding) {
+  uint32_t dueDay = loan.due / SECONDS_PER_DAY;
+  Borrower* totals[2] = {&everyone, nullptr};
+  int slot = borrowerByUser.find(borrowers, book.borrowedBy.c_str());
+  if (slot < 0 && adding && book.borrowedBy.length() > 0) {
+    Borrower borrower;
+    borrower.user = book.borrowedBy;
+    borrowers.push_back(borrower);
+    slot = borrowers.size() - 1;
+    borrowerByUser.insert(borrowers, slot);
+  }
+  if (slot >= 0) totals[1] = &borrowers[slot];
+
+  for (Borrower* borrower : totals) {
+    if (!borrower) continue;
+    if (adding) {
+      borrower->books++;
+      borrower->dueDays += dueDay;
+    } else if (borrower->books > 0) {
+      borrower->books--;
+      borrower->dueDays -= dueDay;
+    }
+  }
+}
+
+void LoanSchedule::push(const Loan& loan) {
+  heap.push_back(loan);
+  position[loan.slot] = heap.size() - 1;
+  siftUp(heap.size() - 1);
+}
+
+void LoanSchedule::removeAt(size_t index) {
+  position[heap[index].slot] = NOT_QUEUED;
+  Loan last = heap.back();
+  heap.pop_back();
+  if (index == heap.size()) return;
+  place(index, last);
+  siftDown(index);
+  siftUp(index);
+}
+
+void LoanSchedule::siftUp(size_t index) {
+  Loan loan = heap[index];
+  while (index > 0) {
+    size_t parent = (index - 1) / 2;
+    if (!before(loan, heap[parent])) break;
+    place(index, heap[parent]);
+    index = parent;
+  }
+  place(index, loan);
+}
+
+void LoanSchedule::siftDown(size_t index) {
+  Loan loan = heap[index];
+  for (;;) {
+    size_t child = 2 * index + 1;
+    if (child >= heap.size()) break;
+    if (child + 1 < heap.size() && before(heap[child + 1], heap[child])) child++;
+    if (!before(heap[child], loan)) break;
+    place(index, heap[child]);
+    index = child;
+  }
+  place(index, loan);
+}
+
+void LoanSchedule::place(size_t index, const Loan& loan) {
+  heap[index] = loan;
+  position[loan.slot] = index;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <Arduino.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <vector>
+
+#include "hashindex.h"
+
+struct Book;
+
+// Fine for each day a book is late, in the same units the pages show
+const uint32_t PENALTY_PER_DAY = 1;
+
+// What one borrower - or everyone - owes for overdue books
+struct OverdueTotals {
+  uint32_t books = 0;
+  uint32_t penalty = 0;
+};
+
+// Open loans ordered by due date, so what is overdue and what each borrower
+// owes is known without walking the catalog.
+//
+// Loans that are not due yet wait in a min-heap keyed by due date.
+// advance() pops the ones whose date has passed onto the overdue list,
+// which so stays oldest first, and adds them to their borrower's running
+// total. Lending and returning are O(log n) and a borrower's total is one
+// hash lookup. Each loan costs 8 bytes, plus 4 per book for its position
+// in the heap.
+//
+// A loan's penalty counts the days started since it fell due (UTC
+// midnights passed), which lets a total be kept as a count and a sum of
+// due days instead of one figure per loan.
+class LoanSchedule {
+ public:
+  struct Loan {
+    uint32_t due;   // Unix seconds
+    uint32_t slot;  // Of the book in the catalog
+  };
+
+  // Schedule every borrowed book afresh, e.g. after slots shifted
+  void rebuild(const std::vector<Book>& books);
+
+  // The book at `slot` was just lent / is about to be returned (borrower
+  // and return date still set)
+  void open(const std::vector<Book>& books, uint32_t slot);
+  void close(const std::vector<Book>& books, uint32_t slot);
+
+  // Move every loan due before `now` to the overdue list (and back, if the
+  // clock went backwards). Costs nothing when no loan has fallen due since
+  // the last call.
+  void advance(const std::vector<Book>& books, time_t now);
+
+  // As of the last advance()
+  const std::vector<Loan>& overdue() const { return late; }
+  OverdueTotals totals(time_t now) const { return owed(everyone, now); }
+  OverdueTotals totalsFor(const char* user, time_t now) const;
+
+  size_t openCount() const { return heap.size() + late.size(); }
+  size_t memoryBytes() const;
+
+  // Whole days a loan due at `due` is late at `now`
+  static uint32_t daysLate(uint32_t due, time_t now);
+
+ private:
+  // The overdue loans of one borrower, as a count and a sum of due days
+  struct Borrower {
+    String user;
+    uint32_t books = 0;
+    uint64_t dueDays = 0;
+  };
+
+  static bool before(const Loan& a, const Loan& b) {
+    return a.due != b.due ? a.due < b.due : a.slot < b.slot;
+  }
+  static OverdueTotals owed(const Borrower& borrower, time_t now);
+
+  void push(const Loan& loan);
+  void removeAt(size_t index);
+  void siftUp(size_t index);
+  void siftDown(size_t index);
+  void place(size_t index, const Loan& loan);
+  void count(const Book& book, const Loan& loan, bool adding);
+
+  std::vector<Loan> heap;          // Not yet due, earliest at the root
+  std::vector<uint32_t> position;  // Heap index of each book slot's loan
+  std::vector<Loan> late;          // Overdue, oldest first
+  std::vector<Borrower> borrowers;
+  HashIndex<Borrower> borrowerByUser{&Borrower::user};
+  Borrower everyone;
+};
@@ -0,0 +1,320 @@
+#include "metrics.h"
+
+#include "api.h"    // loopStats, server
+#include "datafs.h"
+#include "kiosk.h"  // readerStats, readerEvents
+
+Metrics metrics;
+
+static const unsigned long RATE_PERIOD = 10000;  // One MinuteRate bucket
+
+void MinuteRate::advance(unsigned long now) {
+  uint32_t current = now / RATE_PERIOD;
+  if (current - period >= 6) {
+    memset(buckets, 0, sizeof(buckets));
+  } else {
+    while (period != current) buckets[++period % 6] = 0;
+  }
+  period = current;
+}
+
+void MinuteRate::record(unsigned long now) {
+  advance(now);
+  buckets[period % 6]++;
+}
+
+uint32_t MinuteRate::total(unsigned long now) {
+  advance(now);
+  uint32_t sum = 0;
+  for (uint16_t count : buckets) sum += count;
+  return sum;
+}
+
+Metrics::Route* Metrics::addRoute(const char* uri, HTTPMethod method) {
+  if (routeCount == MAX_ROUTES) {
+    Serial.println("Metrics: no room to time " + String(uri));
+    return nullptr;
+  }
+  Route* route = &routes[routeCount++];
+  route->uri = uri;
+  route->method = method;
+  return route;
+}
+
+// A raw upload's time is that of its last handler call, not of the upload
+void Metrics::on(HttpServer& server, const char* uri, HTTPMethod method, HttpServer::THandlerFunction handler,
+                 HttpServer::THandlerFunction rawHandler) {
+  Route* route = addRoute(uri, method);
+  if (!route) {
+    server.on(uri, method, handler, rawHandler);
+    return;
+  }
+  server.on(uri, method, [route, handler]() {
+    unsigned long start = micros();
+    handler();
+    route->latency.record(micros() - start);
+  }, rawHandler);
+}
+
+void Metrics::onNotFound(HttpServer& server, HttpServer::THandlerFunction handler) {
+  Route* route = addRoute("(not found)", HTTP_ANY);
+  server.onNotFound([route, handler]() {
+    unsigned long start = micros();
+    handler();
+    if (route) route->latency.record(micros() - start);
+  });
+}
+
+File openFile(const String& path, const char* mode) {
+  metrics.recordFileOpen();
+  return dataFs().open(path, mode);
+}
+
+void Metrics::recordBootPhase(const char* name) {
+  uint32_t now = millis();
+  Serial.println("Boot: " + String(name) + " done at " + String(now) + " ms");
+  if (bootPhaseCount == MAX_BOOT_PHASES) return;
+  bootPhases[bootPhaseCount++] = {name, now};
+}
+
+static const char* methodName(HTTPMethod method) {
+  switch (method) {
+    case HTTP_GET: return "GET";
+    case HTTP_POST: return "POST";
+    case HTTP_PUT: return "PUT";
+    case HTTP_DELETE: return "DELETE";
+    default: return "ANY";
+  }
+}
+
+// ---------------------------------------------------------------------------
+// JSON - summary figures plus raw bucket counts (bounds listed once)
+
+static void writeHistogramJson(Print& out, const Histogram& histogram) {
+  out.print("\"count\":");
+  out.print(histogram.count);
+  out.print(",\"avgMicros\":");
+  out.print(histogram.count ? (unsigned long)(histogram.totalMicros / histogram.count) : 0UL);
+  out.print(",\"p50Micros\":");
+  out.print(histogram.percentile(0.5f));
+  out.print(",\"p99Micros\":");
+  out.print(histogram.percentile(0.99f));
+  out.print(",\"maxMicros\":");
+  out.print(histogram.maxMicros);
+  out.print(",\"buckets\":[");
+  for (uint8_t i = 0; i < Histogram::BUCKETS; i++) {
+    if (i > 0) out.print(',');
+    out.print(histogram.counts[i]);
+  }
+  out.print(']');
+}
+
+static void writeLoopJson(Print& out, const char* name, const LoopStats& stats) {
+  out.print('"');
+  out.print(name);
+  out.print("\":{");
+  writeHistogramJson(out, stats.passes);
+  out.print(",\"slow\":");
+  out.print(stats.slowIterations);
+  out.print('}');
+}
+
+void Metrics::writeJson(Print& out) {
+  unsigned long now = millis();
+  out.print("{\"uptimeMillis\":");
+  out.print(now);
+  out.print(",\"bucketBoundsMicros\":[");
+  for (uint8_t i = 0; i < Histogram::BUCKETS - 1; i++) {
+    if (i > 0) out.print(',');
+    out.print(Histogram::bound(i));
+  }
+  out.print("],\"routes\":[");
+  for (uint8_t i = 0; i < routeCount; i++) {
+    if (i > 0) out.print(',');
+    out.print("{\"uri\":\"");
+    out.print(routes[i].uri);
+    out.print("\",\"method\":\"");
+    out.print(methodName(routes[i].method));
+    out.print("\",");
+    writeHistogramJson(out, routes[i].latency);
+    out.print('}');
+  }
+
+  out.print("],\"loops\":{");
+  writeLoopJson(out, "http", loopStats);
+  out.print(',');
+  writeLoopJson(out, "reader", readerStats);
+
+  out.print("},\"scans\":{\"total\":");
+  out.print(scans);
+  out.print(",\"lastMinute\":");
+  out.print(scanRate.total(now));
+  out.print(",\"windows\":");
+  out.print(scanWindows);
+  out.print(",\"timeouts\":");
+  out.print(scanTimeouts);
+  out.print(",\"timeoutRate\":");
+  out.print(scanWindows ? (double)scanTimeouts / scanWindows : 0.0, 3);
+  out.print(",\"eventsDropped\":");
+  out.print(readerEvents.dropped());
+
+  out.print("},\"heap\":{\"size\":");
+  out.print(ESP.getHeapSize());
+  out.print(",\"free\":");
+  out.print(ESP.getFreeHeap());
+  out.print(",\"largestFreeBlock\":");
+  out.print(ESP.getMaxAllocHeap());
+  out.print(",\"minFree\":");
+  out.print(ESP.getMinFreeHeap());
+
+  out.print("},\"fs\":{\"type\":\"");
+  out.print(dataFsName());
+  out.print("\",\"migration\":\"");
+  out.print(dataFsMigration());
+  out.print("\",\"totalBytes\":");
+  out.print((unsigned long)dataFsTotalBytes());
+  out.print(",\"usedBytes\":");
+  out.print((unsigned long)dataFsUsedBytes());
+  out.print(",\"bytesWritten\":");
+  out.print((unsigned long)bytesWritten);
+  out.print(",\"opens\":");
+  out.print(fileOpens);
+
+  // Milliseconds since power-on; a phase's time is from the end of the one
+  // before it. 0 = not yet.
+  out.print("},\"boot\":{\"phases\":[");
+  for (uint8_t i = 0; i < bootPhaseCount; i++) {
+    if (i > 0) out.print(',');
+    out.print("{\"name\":\"");
+    out.print(bootPhases[i].name);
+    out.print("\",\"millis\":");
+    out.print(bootPhases[i].endMillis - (i > 0 ? bootPhases[i - 1].endMillis : 0));
+    out.print('}');
+  }
+  out.print("],\"listeningMillis\":");
+  out.print(server.listeningMillis());
+  out.print(",\"firstResponseMillis\":");
+  out.print(server.firstResponseMillis());
+  out.print(",\"bootedMillis\":");
+  out.print(bootedMillis);
+
+  out.print("},\"jsonParse\":{");
+  writeHistogramJson(out, jsonParse);
+  out.print("}}");
+}
+
+// ---------------------------------------------------------------------------
+// Prometheus text exposition format (version 0.0.4). Durations in seconds,
+// buckets cumulative as the format requires.
+
+static void writeHeader(Print& out, const char* name, const char* type, const char* help) {
+  out.print("# HELP ");
+  out.print(name);
+  out.print(' ');
+  out.println(help);
+  out.print("# TYPE ");
+  out.print(name);
+  out.print(' ');
+  out.println(type);
+}
+
+static void writeSample(Print& out, const char* name, const String& labels, double value, int decimals = 0) {
+  out.print(name);
+  if (labels.length() > 0) {
+    out.print('{');
+    out.print(labels);
+    out.print('}');
+  }
+  out.print(' ');
+  out.println(String(value, decimals));
+}
+
+static void writeHistogramSamples(Print& out, const char* name, const String& labels,
+                                  const Histogram& histogram) {
+  String prefix = labels.length() > 0 ? labels + "," : String();
+  String bucket = String(name) + "_bucket";
+  uint32_t cumulative = 0;
+  for (uint8_t i = 0; i < Histogram::BUCKETS - 1; i++) {
+    cumulative += histogram.counts[i];
+    writeSample(out, bucket.c_str(), prefix + "le=\"" + String(Histogram::bound(i) / 1e6, 6) + "\"",
+                cumulative);
+  }
+  writeSample(out, bucket.c_str(), prefix + "le=\"+Inf\"", histogram.count);
+  writeSample(out, (String(name) + "_sum").c_str(), labels, histogram.totalMicros / 1e6, 6);
+  writeSample(out, (String(name) + "_count").c_str(), labels, histogram.count);
+}
+
+void Metrics::writePrometheus(Print& out) {
+  unsigned long now = millis();
+
+  writeHeader(out, "kiosk_uptime_seconds", "gauge", "Time since boot");
+  writeSample(out, "kiosk_uptime_seconds", "", now / 1000.0, 3);
+
+  // Routes not requested since boot are left out to keep scrapes small
+  writeHeader(out, "kiosk_http_request_duration_seconds", "histogram", "Handler time per route");
+  for (uint8_t i = 0; i < routeCount; i++) {
+    if (routes[i].latency.count == 0) continue;
+    String labels = "route=\"" + String(routes[i].uri) + "\",method=\"" + methodName(routes[i].method) + "\"";
+    writeHistogramSamples(out, "kiosk_http_request_duration_seconds", labels, routes[i].latency);
+  }
+
+  writeHeader(out, "kiosk_loop_duration_seconds", "histogram", "Time per pass of the HTTP loop and reader task");
+  writeHistogramSamples(out, "kiosk_loop_duration_seconds", "loop=\"http\"", loopStats.passes);
+  writeHistogramSamples(out, "kiosk_loop_duration_seconds", "loop=\"reader\"", readerStats.passes);
+  writeHeader(out, "kiosk_loop_slow_total", "counter", "Loop passes over the slow threshold");
+  writeSample(out, "kiosk_loop_slow_total", "loop=\"http\"", loopStats.slowIterations);
+  writeSample(out, "kiosk_loop_slow_total", "loop=\"reader\"", readerStats.slowIterations);
+
+  writeHeader(out, "kiosk_scans_total", "counter", "Cards read");
+  writeSample(out, "kiosk_scans_total", "", scans);
+  writeHeader(out, "kiosk_scans_last_minute", "gauge", "Cards read in the last 60 seconds");
+  writeSample(out, "kiosk_scans_last_minute", "", scanRate.total(now));
+  writeHeader(out, "kiosk_scan_windows_total", "counter", "Scan windows opened by motion or a registration mode");
+  writeSample(out, "kiosk_scan_windows_total", "", scanWindows);
+  writeHeader(out, "kiosk_scan_timeouts_total", "counter", "Scan windows that closed without a card");
+  writeSample(out, "kiosk_scan_timeouts_total", "", scanTimeouts);
+  writeHeader(out, "kiosk_reader_events_dropped_total", "counter", "Reader events lost to a full queue");
+  writeSample(out, "kiosk_reader_events_dropped_total", "", readerEvents.dropped());
+
+  writeHeader(out, "kiosk_heap_size_bytes", "gauge", "Total heap");
+  writeSample(out, "kiosk_heap_size_bytes", "", ESP.getHeapSize());
+  writeHeader(out, "kiosk_heap_free_bytes", "gauge", "Free heap");
+  writeSample(out, "kiosk_heap_free_bytes", "", ESP.getFreeHeap());
+  writeHeader(out, "kiosk_heap_largest_free_block_bytes", "gauge", "Largest allocatable block");
+  writeSample(out, "kiosk_heap_largest_free_block_bytes", "", ESP.getMaxAllocHeap());
+  writeHeader(out, "kiosk_heap_min_free_bytes", "gauge", "Lowest free heap since boot");
+  writeSample(out, "kiosk_heap_min_free_bytes", "", ESP.getMinFreeHeap());
+
+  writeHeader(out, "kiosk_fs_info", "gauge", "Data filesystem and what became of a SPIFFS partition on a LittleFS build");
+  writeSample(out, "kiosk_fs_info",
+              "type=\"" + String(dataFsName()) + "\",migration=\"" + dataFsMigration() + "\"", 1);
+  writeHeader(out, "kiosk_fs_total_bytes", "gauge", "Data filesystem capacity");
+  writeSample(out, "kiosk_fs_total_bytes", "", dataFsTotalBytes());
+  writeHeader(out, "kiosk_fs_used_bytes", "gauge", "Data filesystem bytes in use");
+  writeSample(out, "kiosk_fs_used_bytes", "", dataFsUsedBytes());
+  writeHeader(out, "kiosk_fs_written_bytes_total", "counter", "Bytes written to flash");
+  writeSample(out, "kiosk_fs_written_bytes_total", "", bytesWritten);
+  writeHeader(out, "kiosk_fs_opens_total", "counter", "Flash files opened");
+  writeSample(out, "kiosk_fs_opens_total", "", fileOpens);
+
+  writeHeader(out, "kiosk_json_parse_duration_seconds", "histogram", "Time per JSON document parsed");
+  writeHistogramSamples(out, "kiosk_json_parse_duration_seconds", "", jsonParse);
+
+  // Boot figures are left out until they happen
+  writeHeader(out, "kiosk_boot_phase_seconds", "gauge", "Time each phase of boot took");
+  for (uint8_t i = 0; i < bootPhaseCount; i++) {
+    uint32_t phaseMillis = bootPhases[i].endMillis - (i > 0 ? bootPhases[i - 1].endMillis : 0);
+    writeSample(out, "kiosk_boot_phase_seconds", "phase=\"" + String(bootPhases[i].name) + "\"",
+                phaseMillis / 1000.0, 3);
+  }
+  writeHeader(out, "kiosk_boot_listening_seconds", "gauge", "Power-on to the HTTP server listening");
+  if (server.listeningMillis()) {
+    writeSample(out, "kiosk_boot_listening_seconds", "", server.listeningMillis() / 1000.0, 3);
+  }
+  writeHeader(out, "kiosk_boot_first_response_seconds", "gauge", "Power-on to the first HTTP response");
+  if (server.firstResponseMillis()) {
+    writeSample(out, "kiosk_boot_first_response_seconds", "", server.firstResponseMillis() / 1000.0, 3);
+  }
+  writeHeader(out, "kiosk_boot_complete_seconds", "gauge", "Power-on to the catalog loaded and every boot step done");
+  if (bootedMillis) writeSample(out, "kiosk_boot_complete_seconds", "", bootedMillis / 1000.0, 3);
+}
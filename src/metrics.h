@@ -0,0 +1,91 @@
+#pragma once
+
+#include <Arduino.h>
+#include <FS.h>
+
+#include "histogram.h"
+#include "httpserver.h"
+
+// Telemetry for /api/metrics: a latency histogram per route, loop pass
+// times, scan rates, heap, flash traffic, JSON parse time and how long boot
+// took. Everything is a fixed-size counter updated in place, cheap enough
+// to leave on.
+// Served as JSON or, with ?format=prometheus, in Prometheus text format.
+
+// Events in the last minute, kept as six 10-second buckets
+struct MinuteRate {
+  uint16_t buckets[6] = {};
+  uint32_t period = 0;  // Current 10 s period since boot
+
+  void record(unsigned long now);
+  uint32_t total(unsigned long now);
+
+ private:
+  void advance(unsigned long now);
+};
+
+class Metrics {
+ public:
+  // server.on() with every request to the route counted and timed
+  void on(HttpServer& server, const char* uri, HTTPMethod method, HttpServer::THandlerFunction handler,
+          HttpServer::THandlerFunction rawHandler = HttpServer::THandlerFunction());
+  void onNotFound(HttpServer& server, HttpServer::THandlerFunction handler);
+
+  // Reader activity, as the HTTP loop drains it from the reader task
+  void recordScanWindow() { scanWindows++; }
+  void recordScanTimeout() { scanTimeouts++; }
+  void recordScan(unsigned long now) {
+    scans++;
+    scanRate.record(now);
+  }
+
+  void recordJsonParse(uint32_t micros) { jsonParse.record(micros); }
+  void recordFileOpen() { fileOpens++; }
+  void recordFileWrite(size_t bytes) { bytesWritten += bytes; }
+
+  // Boot: call as each phase of setup() and the steps deferred from it
+  // ends, then once more when the last has
+  void recordBootPhase(const char* name);
+  void recordBooted() { bootedMillis = millis(); }
+
+  void writeJson(Print& out);
+  void writePrometheus(Print& out);
+
+ private:
+  struct Route {
+    const char* uri;
+    HTTPMethod method;
+    Histogram latency;
+  };
+
+  Route* addRoute(const char* uri, HTTPMethod method);
+
+  static const uint8_t MAX_ROUTES = 48;
+  Route routes[MAX_ROUTES];
+  uint8_t routeCount = 0;
+
+  uint32_t scans = 0;
+  uint32_t scanWindows = 0;   // Motion or a registration mode opened the reader
+  uint32_t scanTimeouts = 0;  // ...and no card came before SCAN_TIMEOUT
+  MinuteRate scanRate;
+
+  struct BootPhase {
+    const char* name;
+    uint32_t endMillis;  // Since power-on
+  };
+
+  static const uint8_t MAX_BOOT_PHASES = 12;
+  BootPhase bootPhases[MAX_BOOT_PHASES];
+  uint8_t bootPhaseCount = 0;
+  uint32_t bootedMillis = 0;
+
+  Histogram jsonParse;
+  uint32_t fileOpens = 0;
+  uint64_t bytesWritten = 0;
+};
+
+extern Metrics metrics;
+
+// dataFs().open() (see datafs.h), counted for /api/metrics. The firmware
+// opens every file through here.
+File openFile(const String& path, const char* mode = "r");
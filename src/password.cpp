@@ -0,0 +1,140 @@
+#include "password.h"
+
+#include <mbedtls/md.h>
+#include <mbedtls/pkcs5.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char* PREFIX = "pbkdf2-sha256$";
+static const size_t PREFIX_LENGTH = 14;
+static const char* LEGACY_PREFIX = "sha256$";
+static const size_t LEGACY_PREFIX_LENGTH = 7;
+
+static uint32_t plaintextCount = 0;
+
+// The digest `hash`'s salt and iteration count give `password`. False only
+// if mbedtls couldn't set up (out of memory).
+static bool derive(const PasswordHash& hash, const char* password, uint8_t (&digest)[PasswordHash::DIGEST_BYTES]) {
+  memset(digest, 0, sizeof(digest));
+  mbedtls_md_context_t md;
+  mbedtls_md_init(&md);
+  bool ok = mbedtls_md_setup(&md, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1) == 0;
+  if (ok && hash.iterations == 0) {
+    uint8_t full[32];
+    ok = mbedtls_md_starts(&md) == 0 &&
+         mbedtls_md_update(&md, hash.salt, PasswordHash::LEGACY_SALT_BYTES) == 0 &&
+         mbedtls_md_update(&md, (const unsigned char*)password, strlen(password)) == 0 &&
+         mbedtls_md_finish(&md, full) == 0;
+    memcpy(digest, full, PasswordHash::LEGACY_DIGEST_BYTES);
+  } else if (ok) {
+    ok = mbedtls_pkcs5_pbkdf2_hmac(&md, (const unsigned char*)password, strlen(password), hash.salt,
+                                   PasswordHash::SALT_BYTES, hash.iterations, PasswordHash::DIGEST_BYTES,
+                                   digest) == 0;
+  }
+  mbedtls_md_free(&md);
+  return ok;
+}
+
+static bool readHex(const char* text, uint8_t* out, size_t bytes) {
+  for (size_t i = 0; i < 2 * bytes; i++) {
+    char c = text[i];
+    int nibble = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+    if (nibble < 0) return false;
+    out[i / 2] = (uint8_t)((i % 2) ? (out[i / 2] | nibble) : (nibble << 4));
+  }
+  return true;
+}
+
+static char* writeHex(char* out, const uint8_t* bytes, size_t count) {
+  static const char DIGITS[] = "0123456789abcdef";
+  for (size_t i = 0; i < count; i++) {
+    *out++ = DIGITS[bytes[i] >> 4];
+    *out++ = DIGITS[bytes[i] & 0x0F];
+  }
+  return out;
+}
+
+PasswordHash PasswordHash::of(const char* password) {
+  PasswordHash hash;
+  for (size_t i = 0; i < SALT_BYTES; i += 4) {
+    uint32_t random = esp_random();
+    memcpy(hash.salt + i, &random, 4);
+  }
+  hash.iterations = ITERATIONS;
+  derive(hash, password, hash.digest);
+  return hash;
+}
+
+void PasswordHash::load(const char* stored) {
+  if (decode(stored)) return;
+  if (stored[0] == '\0') {
+    *this = PasswordHash();
+    return;
+  }
+  *this = of(stored);
+  plaintextCount++;
+}
+
+// "<salt hex>$<digest hex>" with the given sizes, and nothing after it
+static bool decodeParts(const char* text, PasswordHash& hash, size_t saltBytes, size_t digestBytes) {
+  return strlen(text) == 2 * saltBytes + 1 + 2 * digestBytes && text[2 * saltBytes] == '$' &&
+         readHex(text, hash.salt, saltBytes) && readHex(text + 2 * saltBytes + 1, hash.digest, digestBytes);
+}
+
+bool PasswordHash::decode(const char* encoded) {
+  PasswordHash decoded;
+  if (strncmp(encoded, PREFIX, PREFIX_LENGTH) == 0) {
+    const char* count = encoded + PREFIX_LENGTH;
+    char* end;
+    unsigned long iterations = strtoul(count, &end, 10);
+    if (count[0] < '1' || count[0] > '9' || *end != '$' || iterations > MAX_ITERATIONS ||
+        !decodeParts(end + 1, decoded, SALT_BYTES, DIGEST_BYTES)) {
+      return false;
+    }
+    decoded.iterations = iterations;
+  } else if (strncmp(encoded, LEGACY_PREFIX, LEGACY_PREFIX_LENGTH) != 0 ||
+             !decodeParts(encoded + LEGACY_PREFIX_LENGTH, decoded, LEGACY_SALT_BYTES, LEGACY_DIGEST_BYTES)) {
+    return false;
+  }
+  *this = decoded;
+  return true;
+}
+
+String PasswordHash::encode() const {
+  if (empty()) return String();
+  char text[MAX_ENCODED_LENGTH + 1];
+  char* end;
+  if (iterations == 0) {
+    memcpy(text, LEGACY_PREFIX, LEGACY_PREFIX_LENGTH);
+    end = writeHex(text + LEGACY_PREFIX_LENGTH, salt, LEGACY_SALT_BYTES);
+    *end++ = '$';
+    end = writeHex(end, digest, LEGACY_DIGEST_BYTES);
+  } else {
+    end = text + snprintf(text, sizeof(text), "%s%lu$", PREFIX, (unsigned long)iterations);
+    end = writeHex(end, salt, SALT_BYTES);
+    *end++ = '$';
+    end = writeHex(end, digest, DIGEST_BYTES);
+  }
+  *end = '\0';
+  return String(text);
+}
+
+bool PasswordHash::empty() const {
+  uint8_t bits = 0;
+  for (uint8_t byte : salt) bits |= byte;
+  for (uint8_t byte : digest) bits |= byte;
+  return bits == 0;
+}
+
+bool PasswordHash::matches(const char* password) const {
+  if (empty()) return false;
+  uint8_t computed[DIGEST_BYTES];
+  if (!derive(*this, password, computed)) return false;
+  uint8_t difference = 0;
+  for (size_t i = 0; i < DIGEST_BYTES; i++) difference |= computed[i] ^ digest[i];
+  return difference == 0;
+}
+
+uint32_t plaintextPasswordsHashed() {
+  return plaintextCount;
+}
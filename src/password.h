@@ -0,0 +1,55 @@
+#pragma once
+
+#include <Arduino.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A password as the kiosk keeps it: PBKDF2-HMAC-SHA256 (mbedtls) of the
+// password under a per-account random salt, with the iteration count kept
+// beside it so it can be raised without invalidating anything. This is all
+// that reaches RAM, the snapshots, the journal and /api/export; plaintext
+// from a hand-written users.json, an older snapshot or an older journal is
+// hashed as it is loaded.
+//
+// ITERATIONS is what the board can afford on the HTTP loop per login. A
+// hash made with fewer - or a "sha256$" one from older firmware, a single
+// salted SHA-256 - still logs in, and is outdated(): the login replaces it
+// with a fresh hash (see handleLogin()).
+struct PasswordHash {
+  static const size_t SALT_BYTES = 16;
+  static const size_t DIGEST_BYTES = 32;
+  static const uint32_t ITERATIONS = 4096;
+  static const uint32_t MAX_ITERATIONS = 1000000;  // Refused when decoding, so a login can't stall
+  // Stored form: "pbkdf2-sha256$<iterations>$<salt hex>$<digest hex>"
+  static const size_t MAX_ENCODED_LENGTH = 14 + 7 + 1 + 2 * SALT_BYTES + 1 + 2 * DIGEST_BYTES;
+
+  // Older firmware's "sha256$<salt hex>$<digest hex>": SHA-256 of an 8-byte
+  // salt and the password, cut to 16 bytes. Kept in the front of salt and
+  // digest, with iterations 0.
+  static const size_t LEGACY_SALT_BYTES = 8;
+  static const size_t LEGACY_DIGEST_BYTES = 16;
+
+  uint32_t iterations = 0;
+  uint8_t salt[SALT_BYTES] = {};
+  uint8_t digest[DIGEST_BYTES] = {};
+
+  // Hash `password` under a fresh random salt
+  static PasswordHash of(const char* password);
+
+  // Take a stored value: the encoded form, or else plaintext, which is
+  // hashed here and counted in plaintextPasswordsHashed(). "" stays empty.
+  void load(const char* stored);
+  bool decode(const char* encoded);
+  String encode() const;  // "" for no password
+
+  bool empty() const;
+  // Compares every byte, so the time taken doesn't say where they differ
+  bool matches(const char* password) const;
+  // Weaker than a hash made now would be
+  bool outdated() const { return !empty() && iterations < ITERATIONS; }
+};
+
+// Plaintext passwords load() has hashed since boot. Those hashed while
+// the snapshots and journal were loaded are still on flash until the next
+// snapshot.
+uint32_t plaintextPasswordsHashed();
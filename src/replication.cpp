@@ -0,0 +1,469 @@
+#include "replication.h"
+
+#include <mbedtls/md.h>
+
+#include <algorithm>
+
+#include "catalog.h"
+#include "datafs.h"
+#include "metrics.h"  // openFile
+#include "session.h"
+#include "store.h"
+
+Replicator replicator;
+
+static const char* CONFIG_PATH = "/replication.json";
+static const char* STATE_PATH = "/replica.bin";
+static const char* STATE_TMP_PATH = "/replica.tmp";
+
+static const char STATE_MAGIC[4] = {'L', 'R', 'E', 'P'};
+static const uint16_t STATE_VERSION = 1;
+
+// What /replica.bin holds: the clock and applied counts as of the last
+// snapshot, the journal carrying everything after it
+struct ReplicaState {
+  char magic[4];  // "LREP"
+  uint16_t version;
+  uint8_t kiosk;
+  uint8_t reserved;
+  uint32_t lamport;
+  uint32_t applied[Replicator::MAX_KIOSKS];
+};
+
+static_assert(sizeof(ReplicaState) == 12 + 4 * Replicator::MAX_KIOSKS, "ReplicaState layout changed");
+
+// "192.168.1.32" or "192.168.1.32:4211"
+static bool parsePeer(const char* text, IPAddress& ip, uint16_t& port) {
+  char host[16];
+  const char* colon = strchr(text, ':');
+  size_t length = colon ? (size_t)(colon - text) : strlen(text);
+  if (length >= sizeof(host)) return false;
+  memcpy(host, text, length);
+  host[length] = '\0';
+  if (colon) port = (uint16_t)atoi(colon + 1);
+  return ip.fromString(host) && port != 0;
+}
+
+// The tag a datagram carries: HMAC-SHA256 of the rest under the secret
+static bool computeTag(const String& secret, const char* data, size_t length,
+                       uint8_t (&tag)[Replicator::TAG_BYTES]) {
+  return mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), (const unsigned char*)secret.c_str(),
+                         secret.length(), (const unsigned char*)data, length, tag) == 0;
+}
+
+// Compared in full, so the time taken doesn't tell how much matched
+static bool tagsMatch(const uint8_t* a, const uint8_t* b) {
+  uint8_t difference = 0;
+  for (size_t i = 0; i < Replicator::TAG_BYTES; i++) difference |= a[i] ^ b[i];
+  return difference == 0;
+}
+
+static bool isLoanOp(const char* op) {
+  return strcmp(op, "borrow") == 0 || strcmp(op, "return") == 0 || strcmp(op, "borrowMany") == 0 ||
+         strcmp(op, "returnMany") == 0;
+}
+
+void Replicator::reset() {
+  udp.stop();
+  kiosk = 0;
+  port = DEFAULT_PORT;
+  secret = "";
+  peers.clear();
+  lamport = 0;
+  memset(applied, 0, sizeof(applied));
+  retained.clear();
+  retainedBytes = 0;
+  for (Pending& slot : pending) slot = Pending();
+  lastAnnounce = 0;
+  pushed = resent = received = rejected = duplicates = early = oversize = announces = stranded = 0;
+  lag = Histogram();
+}
+
+void Replicator::begin() {
+  reset();
+  File file = openFile(CONFIG_PATH, "r");
+  if (!file) {
+    Serial.println("Replication off (no " + String(CONFIG_PATH) + ")");
+    return;
+  }
+  DynamicJsonDocument config(1024);
+  DeserializationError error = deserializeJson(config, file);
+  file.close();
+  uint8_t id = config["kiosk"] | 0;
+  if (error || id < 1 || id > MAX_KIOSKS) {
+    Serial.println("Replication off: " + String(CONFIG_PATH) + " needs a kiosk ID from 1 to " +
+                   String(MAX_KIOSKS));
+    return;
+  }
+  const char* shared = config["secret"] | "";
+  if (strlen(shared) < MIN_SECRET_LENGTH) {
+    Serial.println("Replication off: " + String(CONFIG_PATH) + " needs a \"secret\" of at least " +
+                   String((unsigned)MIN_SECRET_LENGTH) + " characters");
+    return;
+  }
+  secret = shared;
+
+  port = config["port"] | DEFAULT_PORT;
+  for (JsonVariant address : config["peers"].as<JsonArray>()) {
+    Peer peer;
+    if (peers.size() >= MAX_PEERS || !parsePeer(address | "", peer.ip, peer.port)) {
+      Serial.println("Replication: ignored peer " + String(address | ""));
+      continue;
+    }
+    peers.push_back(peer);
+  }
+
+  const char* ssid = config["ssid"] | "";
+  if (ssid[0] != '\0') {
+    WiFi.mode(WIFI_AP_STA);  // Keep the access point for the browsers
+    WiFi.begin(ssid, config["password"] | "");
+  }
+  if (!udp.begin(port)) {
+    Serial.println("Replication off: can't open UDP port " + String(port));
+    secret = "";
+    return;
+  }
+
+  kiosk = id;
+  loadState();
+  Serial.println("Replicating as kiosk " + String(kiosk) + " with " + String((unsigned long)peers.size()) +
+                 " peers on port " + String(port));
+}
+
+void Replicator::end() {
+  reset();
+}
+
+void Replicator::loadState() {
+  File file = openFile(STATE_PATH, "r");
+  if (!file) return;
+  ReplicaState state;
+  bool ok = file.read((uint8_t*)&state, sizeof(state)) == sizeof(state) &&
+            memcmp(state.magic, STATE_MAGIC, sizeof(STATE_MAGIC)) == 0 && state.version == STATE_VERSION;
+  file.close();
+  if (!ok) {
+    Serial.println("Replication: ignored damaged " + String(STATE_PATH));
+    return;
+  }
+  lamport = std::max(lamport, state.lamport);
+  for (uint8_t i = 0; i < MAX_KIOSKS; i++) applied[i] = std::max(applied[i], state.applied[i]);
+}
+
+bool Replicator::save() {
+  if (!enabled()) return true;
+  ReplicaState state;
+  memset(&state, 0, sizeof(state));
+  memcpy(state.magic, STATE_MAGIC, sizeof(STATE_MAGIC));
+  state.version = STATE_VERSION;
+  state.kiosk = kiosk;
+  state.lamport = lamport;
+  memcpy(state.applied, applied, sizeof(applied));
+
+  File file = openFile(STATE_TMP_PATH, "w");
+  if (!file) return false;
+  bool ok = file.write((const uint8_t*)&state, sizeof(state)) == sizeof(state);
+  file.close();
+  metrics.recordFileWrite(sizeof(state));
+  if (!ok) return false;
+  return replaceFile(STATE_TMP_PATH, STATE_PATH);
+}
+
+bool Replicator::stamp(JsonDocument& entry) {
+  if (!enabled()) return true;
+  entry["origin"] = kiosk;
+  entry["oseq"] = applied[kiosk - 1] + 1;
+  entry["stamp"] = (lamport + 1) << 8 | kiosk;
+
+  // Trailing origins with nothing applied are left out
+  uint8_t count = MAX_KIOSKS;
+  while (count > 0 && (count == kiosk || applied[count - 1] == 0)) count--;
+  if (count > 0) {
+    JsonArray deps = entry.createNestedArray("deps");
+    for (uint8_t i = 0; i < count; i++) deps.add(i == kiosk - 1 ? 0 : applied[i]);
+  }
+
+  const char* op = entry["op"] | "";
+  if (isLoanOp(op)) {
+    if (entry.containsKey("books")) {
+      JsonArray bases = entry.createNestedArray("bases");
+      for (JsonVariant id : entry["books"].as<JsonArray>()) {
+        const Book* book = catalog.findBookById(id | "");
+        bases.add(book ? book->loanStamp : 0);
+      }
+    } else {
+      const Book* book = catalog.findBookById(entry["book"] | "");
+      entry["base"] = book ? book->loanStamp : 0;
+    }
+  }
+  return !entry.overflowed();
+}
+
+void Replicator::observe(JsonObject entry) {
+  if (!enabled()) return;
+  uint8_t origin = entry["origin"] | 0;
+  uint32_t oseq = entry["oseq"] | 0;
+  if (origin < 1 || origin > MAX_KIOSKS || oseq == 0) return;  // Not stamped
+  lamport = std::max(lamport, (uint32_t)(entry["stamp"] | 0) >> 8);
+  if (oseq <= applied[origin - 1]) return;  // Replayed from before the last snapshot
+  applied[origin - 1] = oseq;
+
+  Retained kept;
+  kept.origin = origin;
+  kept.oseq = oseq;
+  serializeJson(entry, kept.line);
+  retainedBytes += kept.line.length();
+  retained.push_back(kept);
+  while (retainedBytes > RETAINED_BYTES && retained.size() > 1) {
+    retainedBytes -= retained.front().line.length();
+    retained.pop_front();
+  }
+}
+
+void Replicator::committed(JsonObject entry) {
+  if (!enabled()) return;
+  observe(entry);
+  uint32_t oseq = applied[kiosk - 1];
+  Pending& slot = pending[oseq % PENDING];
+  slot.oseq = oseq;
+  slot.micros = micros();
+  slot.acked = 0;
+
+  const String& line = retained.back().line;
+  if (line.length() > MAX_DATAGRAM) {
+    oversize++;
+    Serial.println("Replication: change " + String(oseq) + " is too big to send");
+    return;
+  }
+  // A peer that is missing earlier ones would only drop it; catch-up
+  // sends it in order
+  for (Peer& peer : peers) {
+    if (peer.sent[kiosk - 1] + 1 != oseq) continue;
+    if (send(peer, line.c_str(), line.length())) pushed++;
+    peer.sent[kiosk - 1] = oseq;
+    peer.sentAt = millis();
+  }
+}
+
+Replicator::Peer* Replicator::findPeer(IPAddress ip, uint16_t fromPort) {
+  for (Peer& peer : peers) {
+    if (peer.ip == ip && peer.port == fromPort) return &peer;
+  }
+  return nullptr;
+}
+
+bool Replicator::send(Peer& peer, const char* line, size_t length) {
+  uint8_t tag[TAG_BYTES];
+  if (!computeTag(secret, line, length, tag) || !udp.beginPacket(peer.ip, peer.port)) return false;
+  udp.write(tag, sizeof(tag));
+  udp.write((const uint8_t*)line, length);
+  return udp.endPacket();
+}
+
+void Replicator::loop() {
+  if (!enabled()) return;
+  unsigned long now = millis();
+  for (size_t i = 0; i < PACKETS_PER_PASS && receive(now); i++) {
+  }
+
+  if (now - lastAnnounce >= ANNOUNCE_MILLIS) {
+    lastAnnounce = now;
+    for (Peer& peer : peers) peer.ackDue = true;
+  }
+  // One announce a peer however much arrived from it this pass
+  for (Peer& peer : peers) {
+    if (peer.ackDue) announce(peer);
+  }
+}
+
+bool Replicator::receive(unsigned long now) {
+  int size = udp.parsePacket();
+  if (size <= 0) return false;
+  static char packet[TAG_BYTES + MAX_DATAGRAM + 1];
+  if ((size_t)size > TAG_BYTES + MAX_DATAGRAM) {
+    oversize++;
+    return true;
+  }
+  size = udp.read(packet, size);
+  Peer* peer = findPeer(udp.remoteIP(), udp.remotePort());
+  if (!peer) return true;  // Only configured kiosks are listened to
+
+  uint8_t tag[TAG_BYTES];
+  char* line = packet + TAG_BYTES;
+  size_t length = size > (int)TAG_BYTES ? size - TAG_BYTES : 0;
+  if (length == 0 || !computeTag(secret, line, length, tag) || !tagsMatch(tag, (uint8_t*)packet)) {
+    forged++;
+    return true;
+  }
+  line[length] = '\0';
+
+  // Parsed in place: the strings stay in `packet`
+  DynamicJsonDocument doc(3 * MAX_DATAGRAM);
+  if (deserializeJson(doc, line, length)) return true;
+  peer->lastSeen = now;
+  peer->seen = true;
+  if (doc.containsKey("applied")) {
+    onAnnounce(*peer, doc.as<JsonObject>(), now);
+  } else {
+    onEntry(*peer, doc);
+  }
+  return true;
+}
+
+bool Replicator::dependenciesMet(JsonObject entry) const {
+  uint8_t origin = entry["origin"];
+  uint8_t i = 0;
+  for (JsonVariant dep : entry["deps"].as<JsonArray>()) {
+    if (i >= MAX_KIOSKS) break;
+    if (i + 1 != origin && (uint32_t)(dep | 0) > applied[i]) return false;
+    i++;
+  }
+  return true;
+}
+
+void Replicator::onEntry(Peer& peer, JsonDocument& entry) {
+  uint8_t origin = entry["origin"] | 0;
+  uint32_t oseq = entry["oseq"] | 0;
+  if (origin < 1 || origin > MAX_KIOSKS || origin == kiosk || oseq == 0) return;
+  peer.ackDue = true;  // Whatever happens, it learns where we are
+
+  if (oseq <= applied[origin - 1]) {
+    duplicates++;
+    return;
+  }
+  if (oseq != applied[origin - 1] + 1 || !dependenciesMet(entry.as<JsonObject>())) {
+    early++;
+    peer.gap = true;
+    return;
+  }
+
+  TxResult result = store.applyReplicated(entry);
+  if (result == TX_IO_ERROR) return;  // Not journaled - it will be sent again
+  if (result != TX_OK) rejected++;
+  // Signed-in browsers of an account removed elsewhere go too
+  if (strcmp(entry["op"] | "", "removeUser") == 0) sessions.closeUser(entry["user"] | "");
+  received++;
+  observe(entry.as<JsonObject>());
+}
+
+void Replicator::announce(Peer& peer) {
+  char line[160];
+  int length = snprintf(line, sizeof(line), "{\"kiosk\":%u,\"gap\":%s,\"applied\":[", kiosk,
+                        peer.gap ? "true" : "false");
+  for (uint8_t i = 0; i < MAX_KIOSKS; i++) {
+    length += snprintf(line + length, sizeof(line) - length, i ? ",%lu" : "%lu", (unsigned long)applied[i]);
+  }
+  length += snprintf(line + length, sizeof(line) - length, "]}");
+  if (send(peer, line, length)) announces++;
+  peer.ackDue = false;
+  peer.gap = false;
+}
+
+void Replicator::onAnnounce(Peer& peer, JsonObject announce, unsigned long now) {
+  peer.kiosk = announce["kiosk"] | 0;
+  uint32_t theirs[MAX_KIOSKS] = {};
+  uint8_t i = 0;
+  for (JsonVariant count : announce["applied"].as<JsonArray>()) {
+    if (i >= MAX_KIOSKS) break;
+    theirs[i++] = count | 0;
+  }
+
+  size_t index = &peer - peers.data();
+  recordAcks(index, peer.applied[kiosk - 1], theirs[kiosk - 1]);
+  memcpy(peer.applied, theirs, sizeof(theirs));
+
+  // What we sent a moment ago may still be on its way; past RESEND_MILLIS,
+  // or when it saw a gap, it is taken as lost
+  bool lost = (announce["gap"] | false) || now - peer.sentAt >= RESEND_MILLIS;
+  for (uint8_t o = 0; o < MAX_KIOSKS; o++) {
+    peer.sent[o] = lost ? theirs[o] : std::max(peer.sent[o], theirs[o]);
+  }
+  sendMissing(peer, now);
+}
+
+void Replicator::recordAcks(size_t peerIndex, uint32_t from, uint32_t to) {
+  uint32_t newest = applied[kiosk - 1];
+  if (to > newest) to = newest;
+  if (newest >= PENDING && from < newest - PENDING) from = newest - PENDING;
+  uint32_t now = micros();
+  for (uint32_t oseq = from + 1; oseq <= to; oseq++) {
+    Pending& slot = pending[oseq % PENDING];
+    if (slot.oseq != oseq || (slot.acked & (1 << peerIndex))) continue;
+    slot.acked |= 1 << peerIndex;
+    lag.record(now - slot.micros);
+  }
+}
+
+// Retained changes are in the order they were applied here, so sending
+// them in that order never gets ahead of a dependency
+void Replicator::sendMissing(Peer& peer, unsigned long now) {
+  size_t budget = RESENDS_PER_ANNOUNCE;
+  for (const Retained& kept : retained) {
+    if (budget == 0) break;
+    uint32_t& sent = peer.sent[kept.origin - 1];
+    if (kept.oseq != sent + 1) continue;
+    if (kept.line.length() > MAX_DATAGRAM || !send(peer, kept.line.c_str(), kept.line.length())) break;
+    sent = kept.oseq;
+    peer.sentAt = now;
+    resent++;
+    budget--;
+  }
+
+  // With budget left, anything still missing is older than we retain
+  bool behind = false;
+  for (uint8_t o = 0; o < MAX_KIOSKS && budget > 0; o++) {
+    if (peer.sent[o] < applied[o]) behind = true;
+  }
+  if (behind && !peer.stranded) {
+    stranded++;
+    Serial.println("Replication: " + peer.ip.toString() + ":" + String(peer.port) +
+                   " is behind the retained changes - copy the catalog to it");
+  }
+  peer.stranded = behind;
+}
+
+void Replicator::writeStats(JsonObject obj) const {
+  obj["enabled"] = enabled();
+  if (!enabled()) return;
+  obj["kiosk"] = kiosk;
+  obj["port"] = port;
+  obj["lamport"] = lamport;
+  JsonArray counts = obj.createNestedArray("applied");
+  for (uint32_t count : applied) counts.add(count);
+  obj["pushed"] = pushed;
+  obj["resent"] = resent;
+  obj["received"] = received;
+  obj["rejected"] = rejected;
+  obj["duplicates"] = duplicates;
+  obj["early"] = early;
+  obj["oversize"] = oversize;
+  obj["forged"] = forged;
+  obj["announces"] = announces;
+  obj["stranded"] = stranded;
+  obj["loanConflicts"] = catalog.loanConflicts();
+  obj["retained"] = retained.size();
+  obj["retainedBytes"] = retainedBytes;
+
+  // Commit here to a peer's announce saying it has applied the change
+  JsonObject latency = obj.createNestedObject("lag");
+  latency["count"] = lag.count;
+  latency["avgMicros"] = lag.count ? (uint32_t)(lag.totalMicros / lag.count) : 0;
+  latency["p50Micros"] = lag.percentile(0.5f);
+  latency["p99Micros"] = lag.percentile(0.99f);
+  latency["maxMicros"] = lag.maxMicros;
+
+  unsigned long now = millis();
+  JsonArray list = obj.createNestedArray("peers");
+  for (const Peer& peer : peers) {
+    JsonObject item = list.createNestedObject();
+    item["address"] = peer.ip.toString() + ":" + String(peer.port);
+    item["kiosk"] = peer.kiosk;
+    item["up"] = peer.seen && now - peer.lastSeen < PEER_TIMEOUT_MILLIS;
+    if (peer.seen) item["lastSeenMillis"] = now - peer.lastSeen;
+    uint32_t behind = 0;
+    for (uint8_t o = 0; o < MAX_KIOSKS; o++) {
+      if (applied[o] > peer.applied[o]) behind += applied[o] - peer.applied[o];
+    }
+    item["behind"] = behind;  // Changes it lacks, as of its last announce
+    item["stranded"] = peer.stranded;
+  }
+}
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <WiFi.h>
+#include <WiFiUdp.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <vector>
+
+#include "histogram.h"
+
+// Sharing one catalog between the kiosks of a library.
+//
+// /replication.json turns it on; without it a kiosk works alone and
+// journals exactly what it did before:
+//
+//   {"kiosk":1,"port":4210,"peers":["192.168.1.32","192.168.1.33:4211"],
+//    "secret":"...","ssid":"Library","password":"..."}
+//
+// Kiosk IDs run from 1 to MAX_KIOSKS and must be unique. "ssid" is the
+// network the kiosks share; their own access points stay up for the
+// browsers. All kiosks start from the same catalog.
+//
+// "secret" is shared by all the kiosks, at least MIN_SECRET_LENGTH
+// characters; without it replication stays off. Every datagram starts
+// with its HMAC-SHA256 under the secret, and one whose tag doesn't match
+// is dropped - a peer's address alone is easily forged. A datagram sent
+// again by someone else only repeats what a kiosk already has.
+//
+// Every change committed here is stamped before it is journaled:
+//
+//   "origin"  this kiosk's ID
+//   "oseq"    1, 2, 3... per origin; each origin's changes apply in order
+//   "stamp"   Lamport clock << 8 | origin, so stamps are unique and a
+//             change always has a higher one than anything it could see
+//   "deps"    how far this kiosk had applied every origin; a change waits
+//             for those, so a loan never arrives before its book
+//   "base"    for lends and returns (see Catalog::applyMutation())
+//
+// and sent at once, one UDP datagram per peer. Changes from peers are
+// journaled and applied like local ones, so they survive a reboot, and
+// where two kiosks lent the same copy at once every kiosk keeps the same
+// loan.
+//
+// Catch-up: every ANNOUNCE_MILLIS, and right after applying what came in,
+// a kiosk tells its peers how far it has applied each origin. A peer with
+// more sends the missing changes from the last RETAINED_BYTES it keeps in
+// RAM - its own and those it got from others - so lost datagrams and a
+// kiosk that was switched off are both caught up from whoever is on. A
+// kiosk further behind than any peer retains is reported as "stranded" in
+// /api/replication and needs the catalog copied to it.
+//
+// The same announces give the replication lag: the time from a commit here
+// to a peer saying it has applied it.
+//
+// Bulk uploads (POST /api/books and /api/users) replace a collection on
+// one kiosk only - upload the same file to each.
+class Replicator {
+ public:
+  static const uint8_t MAX_KIOSKS = 8;
+  static const uint8_t MAX_PEERS = MAX_KIOSKS - 1;
+  static const uint16_t DEFAULT_PORT = 4210;
+  static const size_t MAX_DATAGRAM = 1400;            // A change bigger than this isn't sent
+  static const size_t TAG_BYTES = 32;                 // HMAC-SHA256 ahead of each datagram
+  static const size_t MIN_SECRET_LENGTH = 16;
+  static const size_t RETAINED_BYTES = 16 * 1024;     // Changes kept for catch-up
+  static const unsigned long ANNOUNCE_MILLIS = 500;
+  static const unsigned long RESEND_MILLIS = 200;     // Before sending the same change again
+  static const unsigned long PEER_TIMEOUT_MILLIS = 3 * ANNOUNCE_MILLIS;
+
+  // Read /replication.json, join the shared network and open the socket.
+  // Runs before store.begin(), whose journal replay goes through observe().
+  void begin();
+
+  // Close the socket and forget everything in RAM (the host tests use it
+  // for a kiosk being switched off)
+  void end();
+
+  bool enabled() const { return kiosk != 0; }
+  uint8_t kioskId() const { return kiosk; }
+
+  // Stamp a change about to be committed here. False if the document had
+  // no room for the stamp, which must not be journaled half-written.
+  bool stamp(JsonDocument& entry);
+
+  // A change stamped here is journaled and applied: send it to the peers
+  void committed(JsonObject entry);
+
+  // A stamped change is journaled and applied, here or elsewhere, or is
+  // being replayed: advance the clock and applied counts, and keep it for
+  // peers that are behind
+  void observe(JsonObject entry);
+
+  // Write the clock and applied counts to flash. The data store calls this
+  // before truncating the journal, whose entries carried them until then.
+  bool save();
+
+  // Take changes and announces from the peers, announce, resend what a
+  // peer is missing. Call from the HTTP loop; a pass handles at most
+  // PACKETS_PER_PASS datagrams.
+  void loop();
+
+  // Counters for /api/replication
+  void writeStats(JsonObject obj) const;
+
+ private:
+  static const size_t PACKETS_PER_PASS = 8;
+  static const size_t RESENDS_PER_ANNOUNCE = 16;
+  static const size_t PENDING = 32;  // Own changes awaiting acknowledgement, for the lag
+
+  struct Peer {
+    IPAddress ip;
+    uint16_t port = DEFAULT_PORT;
+    uint8_t kiosk = 0;                   // From its announces, 0 until the first
+    uint32_t applied[MAX_KIOSKS] = {};   // What it last said it has applied
+    uint32_t sent[MAX_KIOSKS] = {};      // What we have sent it, per origin
+    unsigned long sentAt = 0;
+    unsigned long lastSeen = 0;
+    bool seen = false;
+    bool ackDue = false;
+    bool gap = false;                    // It sent us something out of order
+    bool stranded = false;
+  };
+
+  struct Retained {
+    uint8_t origin;
+    uint32_t oseq;
+    String line;  // The entry as sent
+  };
+
+  struct Pending {
+    uint32_t oseq = 0;
+    uint32_t micros = 0;
+    uint8_t acked = 0;  // One bit per peer
+  };
+
+  void reset();
+  void loadState();
+  Peer* findPeer(IPAddress ip, uint16_t port);
+  bool send(Peer& peer, const char* line, size_t length);
+  bool receive(unsigned long now);
+  void onEntry(Peer& peer, JsonDocument& entry);
+  void onAnnounce(Peer& peer, JsonObject announce, unsigned long now);
+  void announce(Peer& peer);
+  void sendMissing(Peer& peer, unsigned long now);
+  void recordAcks(size_t peerIndex, uint32_t from, uint32_t to);
+  bool dependenciesMet(JsonObject entry) const;
+
+  uint8_t kiosk = 0;  // 0 = replication off
+  uint16_t port = DEFAULT_PORT;
+  String secret;
+  WiFiUDP udp;
+  std::vector<Peer> peers;
+  uint32_t lamport = 0;
+  uint32_t applied[MAX_KIOSKS] = {};  // Highest oseq applied per origin, ours included
+  std::deque<Retained> retained;      // Oldest first, in the order applied here
+  size_t retainedBytes = 0;
+  Pending pending[PENDING];
+  unsigned long lastAnnounce = 0;
+
+  uint32_t pushed = 0;      // Own changes sent to peers
+  uint32_t resent = 0;      // Changes sent again for catch-up
+  uint32_t received = 0;    // Peers' changes applied here
+  uint32_t rejected = 0;    // ...that lost a conflict or no longer fitted
+  uint32_t duplicates = 0;  // Changes that arrived again
+  uint32_t early = 0;       // Changes that arrived before one they follow
+  uint32_t oversize = 0;    // Too big for a datagram
+  uint32_t forged = 0;      // Datagrams without the secret's tag, dropped
+  uint32_t announces = 0;
+  uint32_t stranded = 0;    // Times a peer fell behind the retained changes
+  Histogram lag;
+};
+
+extern Replicator replicator;
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+// Bounded single-producer/single-consumer queue. One task pushes, another
+// pops, with no lock: each side only writes its own index, and the
+// release/acquire pair on that index publishes the slot it guards.
+// N must be a power of two so the free-running indexes wrap cleanly.
+template <typename T, size_t N>
+class SpscRing {
+  static_assert(N > 0 && (N & (N - 1)) == 0, "SpscRing size must be a power of two");
+
+ public:
+  // Producer side. Returns false (and counts a drop) when the ring is full.
+  bool push(const T& item) {
+    uint32_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) == N) {
+      drops.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    items[h & (N - 1)] = item;
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side. Returns false when there is nothing to take.
+  bool pop(T& item) {
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    if (t == head.load(std::memory_order_acquire)) return false;
+    item = items[t & (N - 1)];
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  size_t size() const {
+    return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+  }
+  static constexpr size_t capacity() { return N; }
+  uint32_t dropped() const { return drops.load(std::memory_order_relaxed); }
+
+ private:
+  T items[N];
+  std::atomic<uint32_t> head{0};   // Next slot to fill, written by the producer
+  std::atomic<uint32_t> tail{0};   // Next slot to drain, written by the consumer
+  std::atomic<uint32_t> drops{0};
+};
@@ -0,0 +1,284 @@
+#include "search.h"
+
+#include <Arduino.h>
+
+#include <algorithm>
+
+#include "catalog.h"
+
+// Score of a prefix match in each field; a whole-word match counts double.
+// MAX_QUERY_WORDS whole-word title matches must still fit in a byte.
+static const uint8_t FIELD_WEIGHT[SearchIndex::FIELD_COUNT] = {12, 10, 8, 6, 4};
+static_assert(12 * 2 * SearchIndex::MAX_QUERY_WORDS <= 255, "Search scores must fit in a byte");
+
+// A posting is (slot << 3 | field), stored as the gap from the previous one
+static const uint8_t FIELD_BITS = 3;
+
+static const String& fieldText(const Book& book, uint8_t field) {
+  switch (field) {
+    case SearchIndex::TITLE: return book.title;
+    case SearchIndex::AUTHOR: return book.author;
+    case SearchIndex::ISBN: return book.isbn;
+    case SearchIndex::SHELF: return book.shelf;
+    default: return book.floor;
+  }
+}
+
+// Letters and digits; bytes of UTF-8 sequences are kept inside words too
+static bool isWordChar(char c) {
+  return isalnum((uint8_t)c) || (uint8_t)c >= 0x80;
+}
+
+// Call visit(offset, length) for each word in text
+template <typename F>
+static void forEachWord(const char* text, F visit) {
+  size_t i = 0;
+  while (text[i]) {
+    if (!isWordChar(text[i])) {
+      i++;
+      continue;
+    }
+    size_t start = i;
+    while (isWordChar(text[i])) i++;
+    visit(start, i - start);
+  }
+}
+
+// Case-insensitive ordering of two words that aren't NUL-terminated
+static int compareWords(const char* a, size_t aLength, const char* b, size_t bLength) {
+  for (size_t i = 0; i < aLength && i < bLength; i++) {
+    int difference = tolower((uint8_t)a[i]) - tolower((uint8_t)b[i]);
+    if (difference != 0) return difference;
+  }
+  return aLength < bLength ? -1 : (aLength > bLength ? 1 : 0);
+}
+
+static bool hasPrefix(const char* word, size_t wordLength, const char* prefix, size_t prefixLength) {
+  return wordLength >= prefixLength && compareWords(word, prefixLength, prefix, prefixLength) == 0;
+}
+
+static void putVarint(std::vector<uint8_t>& out, uint32_t value) {
+  while (value >= 0x80) {
+    out.push_back((uint8_t)(value | 0x80));
+    value >>= 7;
+  }
+  out.push_back((uint8_t)value);
+}
+
+static uint32_t getVarint(const uint8_t*& in) {
+  uint32_t value = 0;
+  for (int shift = 0;; shift += 7) {
+    uint8_t byte = *in++;
+    value |= (uint32_t)(byte & 0x7F) << shift;
+    if (byte < 0x80) return value;
+  }
+}
+
+// FNV-1a of the lower-cased word, for finding repeats while building
+static uint32_t hashWord(const char* text, size_t length) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (uint8_t)tolower((uint8_t)text[i]);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// Builds in two linear passes and one small sort. Pass one walks the
+// books in slot order, assigning each distinct word an ID through a hash
+// table and recording (word ID, posting) per occurrence - so each word's
+// postings come out already in slot order. Then only the distinct words
+// are sorted, and the postings are grouped by word in that order.
+void SearchIndex::rebuild(const std::vector<Book>& books) {
+  const uint32_t EMPTY = 0xFFFFFFFF;
+  std::vector<Word> found;         // First occurrence of each distinct word, by ID
+  std::vector<uint32_t> hashes;    // hashWord() of each, for growing the table
+  std::vector<uint32_t> counts;    // Occurrences of each
+  std::vector<uint32_t> table(1024, EMPTY);
+  std::vector<uint32_t> occurrenceWord;
+  std::vector<uint32_t> occurrencePosting;
+
+  auto wordText = [&](const Word& word) {
+    return fieldText(books[word.slot], word.field).c_str() + word.offset;
+  };
+
+  for (size_t slot = 0; slot < books.size(); slot++) {
+    for (uint8_t field = 0; field < FIELD_COUNT; field++) {
+      const char* text = fieldText(books[slot], field).c_str();
+      forEachWord(text, [&](size_t offset, size_t length) {
+        if (offset > UINT16_MAX) return;
+        length = std::min<size_t>(length, 255);  // Longer words are indexed by their start
+        uint32_t hash = hashWord(text + offset, length);
+        size_t mask = table.size() - 1;
+        size_t i = hash & mask;
+        for (; table[i] != EMPTY; i = (i + 1) & mask) {
+          const Word& word = found[table[i]];
+          if (hashes[table[i]] == hash &&
+              compareWords(wordText(word), word.length, text + offset, length) == 0) {
+            break;
+          }
+        }
+        if (table[i] == EMPTY) {
+          table[i] = found.size();
+          found.push_back({(uint32_t)slot, (uint16_t)offset, (uint8_t)length, field, 0});
+          hashes.push_back(hash);
+          counts.push_back(0);
+          if (found.size() * 2 > table.size()) {  // Keep the load factor <= 0.5
+            table.assign(table.size() * 2, EMPTY);
+            mask = table.size() - 1;
+            for (uint32_t id = 0; id < found.size(); id++) {
+              size_t j = hashes[id] & mask;
+              while (table[j] != EMPTY) j = (j + 1) & mask;
+              table[j] = id;
+            }
+          }
+          i = found.size() - 1;  // Now the ID rather than the table position
+        } else {
+          i = table[i];
+        }
+        counts[i]++;
+        occurrenceWord.push_back(i);
+        occurrencePosting.push_back((uint32_t)slot << FIELD_BITS | field);
+      });
+    }
+  }
+  table = std::vector<uint32_t>();
+  hashes = std::vector<uint32_t>();
+
+  // Alphabetical order of the distinct words. Each is sorted by its first
+  // eight lower-cased characters packed into an integer, so the text (a
+  // cache miss or two away, in the record) is only read to break ties.
+  std::vector<std::pair<uint64_t, uint32_t>> keyed(found.size());
+  for (uint32_t id = 0; id < found.size(); id++) {
+    const char* text = wordText(found[id]);
+    uint64_t key = 0;
+    for (size_t i = 0; i < 8; i++) {
+      key = key << 8 | (i < found[id].length ? (uint8_t)tolower((uint8_t)text[i]) : 0);
+    }
+    keyed[id] = {key, id};
+  }
+  std::sort(keyed.begin(), keyed.end(), [&](const std::pair<uint64_t, uint32_t>& a,
+                                            const std::pair<uint64_t, uint32_t>& b) {
+    if (a.first != b.first) return a.first < b.first;
+    const Word& x = found[a.second];
+    const Word& y = found[b.second];
+    return compareWords(wordText(x), x.length, wordText(y), y.length) < 0;
+  });
+  std::vector<uint32_t> order(found.size());
+  for (size_t i = 0; i < keyed.size(); i++) order[i] = keyed[i].second;
+  keyed = std::vector<std::pair<uint64_t, uint32_t>>();
+
+  // Group the postings by word: start[id] is where that word's run begins
+  std::vector<uint32_t> start(found.size());
+  uint32_t next = 0;
+  for (uint32_t id : order) {
+    start[id] = next;
+    next += counts[id];
+  }
+  std::vector<uint32_t> grouped(occurrencePosting.size());
+  for (size_t i = 0; i < occurrencePosting.size(); i++) {
+    grouped[start[occurrenceWord[i]]++] = occurrencePosting[i];
+  }
+  occurrenceWord = std::vector<uint32_t>();
+  occurrencePosting = std::vector<uint32_t>();
+
+  words.clear();
+  words.reserve(found.size());
+  postings.clear();
+  postingTotal = 0;
+  next = 0;
+  for (uint32_t id : order) {
+    Word word = found[id];
+    word.postings = postings.size();
+    words.push_back(word);
+    uint32_t previous = 0;
+    for (uint32_t i = next; i < next + counts[id]; i++) {
+      if (i > next && grouped[i] == grouped[i - 1]) continue;  // The same word twice in one field
+      putVarint(postings, grouped[i] - previous);
+      previous = grouped[i];
+      postingTotal++;
+    }
+    next += counts[id];
+  }
+
+  postings.shrink_to_fit();
+  pending.clear();
+  pending.shrink_to_fit();
+}
+
+void SearchIndex::add(const std::vector<Book>& books, size_t slot) {
+  if (pending.size() >= MAX_PENDING) {
+    rebuild(books);
+  } else {
+    pending.push_back(slot);
+  }
+}
+
+size_t SearchIndex::search(const std::vector<Book>& books, const char* query,
+                           std::vector<uint8_t>& scores) const {
+  scores.assign(books.size(), 0);
+
+  struct Term {
+    const char* text;
+    size_t length;
+  };
+  Term terms[MAX_QUERY_WORDS];
+  size_t termCount = 0;
+  forEachWord(query, [&](size_t offset, size_t length) {
+    if (termCount < MAX_QUERY_WORDS) terms[termCount++] = {query + offset, length};
+  });
+  if (termCount == 0 || books.empty()) return 0;
+
+  auto wordText = [&](const Word& word) {
+    return fieldText(books[word.slot], word.field).c_str() + word.offset;
+  };
+
+  std::vector<uint8_t> termScores(books.size());
+  for (size_t t = 0; t < termCount; t++) {
+    const Term& term = terms[t];
+    std::fill(termScores.begin(), termScores.end(), 0);
+
+    // Words starting with the term sort together, right from the first
+    // word that isn't ordered before it
+    auto first = std::lower_bound(words.begin(), words.end(), term, [&](const Word& word, const Term& term) {
+      return compareWords(wordText(word), word.length, term.text, term.length) < 0;
+    });
+    for (auto word = first; word != words.end(); ++word) {
+      if (!hasPrefix(wordText(*word), word->length, term.text, term.length)) break;
+      uint8_t multiplier = word->length == term.length ? 2 : 1;
+      const uint8_t* in = postings.data() + word->postings;
+      const uint8_t* end = postings.data() + (word + 1 == words.end() ? postings.size() : (word + 1)->postings);
+      uint32_t posting = 0;
+      while (in < end) {
+        posting += getVarint(in);
+        uint32_t slot = posting >> FIELD_BITS;
+        uint8_t score = FIELD_WEIGHT[posting & ((1 << FIELD_BITS) - 1)] * multiplier;
+        if (score > termScores[slot]) termScores[slot] = score;
+      }
+    }
+
+    // Books appended since the build are matched word by word
+    for (uint32_t slot : pending) {
+      for (uint8_t field = 0; field < FIELD_COUNT; field++) {
+        const char* text = fieldText(books[slot], field).c_str();
+        forEachWord(text, [&](size_t offset, size_t length) {
+          if (!hasPrefix(text + offset, length, term.text, term.length)) return;
+          uint8_t score = FIELD_WEIGHT[field] * (length == term.length ? 2 : 1);
+          if (score > termScores[slot]) termScores[slot] = score;
+        });
+      }
+    }
+
+    // Every term has to match
+    for (size_t slot = 0; slot < books.size(); slot++) {
+      bool matched = termScores[slot] > 0 && (t == 0 || scores[slot] > 0);
+      scores[slot] = matched ? scores[slot] + termScores[slot] : 0;
+    }
+  }
+
+  return books.size() - std::count(scores.begin(), scores.end(), 0);
+}
+
+size_t SearchIndex::memoryBytes() const {
+  return words.capacity() * sizeof(Word) + postings.capacity() + pending.capacity() * sizeof(uint32_t);
+}
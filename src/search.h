@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+struct Book;
+
+// Inverted index for GET /api/search over title, author, isbn, shelf and
+// floor. Words are runs of letters and digits, matched case-insensitively,
+// and every word of a query must match the start of a word in the book
+// ("intro prog" finds "Introduction to Programming").
+//
+// Sized to sit next to the catalog: the dictionary doesn't copy any text,
+// each word points back into the first record that has it (12 bytes per
+// distinct word), and each posting is a varint gap of (slot, field) -
+// usually 1-3 bytes. A query needs two score bytes per book and no sorting
+// until the hits are ranked.
+class SearchIndex {
+ public:
+  // Fields a word can come from, best match first: a title word outranks
+  // the same word in an author's name, and so on down to the floor
+  enum Field : uint8_t { TITLE, AUTHOR, ISBN, SHELF, FLOOR, FIELD_COUNT };
+
+  // Index every book. Slots shift when a book is removed, so removals
+  // rebuild; builds cost a sort over every word in the catalog.
+  void rebuild(const std::vector<Book>& books);
+
+  // A book was appended at `slot`. Appended books are scanned directly at
+  // query time until there are enough of them to be worth a rebuild.
+  void add(const std::vector<Book>& books, size_t slot);
+
+  // Score every book against `query` into scores[slot] (0 = no match).
+  // Each query word adds the weight of the best field it matched, doubled
+  // for a whole-word match. Returns the number of matching books.
+  size_t search(const std::vector<Book>& books, const char* query, std::vector<uint8_t>& scores) const;
+
+  size_t wordCount() const { return words.size(); }
+  size_t postingCount() const { return postingTotal; }
+  size_t memoryBytes() const;
+
+  static const size_t MAX_QUERY_WORDS = 8;  // Keeps the summed score in a byte
+  static const size_t MAX_PENDING = 64;     // Appended books scanned before a rebuild
+
+ private:
+  // A distinct word, shown by reference into the catalog. Sorted by
+  // lower-cased text; its postings run to the next word's offset.
+  struct Word {
+    uint32_t slot;      // Record the text is taken from
+    uint16_t offset;    // Into that record's field
+    uint8_t length;
+    uint8_t field;
+    uint32_t postings;  // Offset into postings
+  };
+
+  std::vector<Word> words;
+  std::vector<uint8_t> postings;
+  std::vector<uint32_t> pending;  // Slots appended since the last build
+  size_t postingTotal = 0;
+};
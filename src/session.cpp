@@ -0,0 +1,147 @@
+#include "session.h"
+
+#include <Arduino.h>
+#include <string.h>
+
+#include "datafs.h"
+#include "metrics.h"  // openFile
+
+SessionCache sessions;
+KioskKey kioskKey;
+
+static const char* KEY_PATH = "/kiosk.key";
+static const char* KEY_TMP_PATH = "/kiosk.tmp";
+
+static const char DIGITS[] = "0123456789abcdef";
+
+static void fillRandom(uint8_t (&token)[SessionCache::TOKEN_BYTES]) {
+  for (size_t i = 0; i < SessionCache::TOKEN_BYTES; i += 4) {
+    uint32_t random = esp_random();
+    memcpy(token + i, &random, 4);
+  }
+}
+
+static void formatToken(const uint8_t (&bytes)[SessionCache::TOKEN_BYTES],
+                        char (&token)[SessionCache::TOKEN_LENGTH + 1]) {
+  for (size_t i = 0; i < SessionCache::TOKEN_BYTES; i++) {
+    token[2 * i] = DIGITS[bytes[i] >> 4];
+    token[2 * i + 1] = DIGITS[bytes[i] & 0x0F];
+  }
+  token[SessionCache::TOKEN_LENGTH] = '\0';
+}
+
+static bool parseToken(const char* text, uint8_t (&token)[SessionCache::TOKEN_BYTES]) {
+  if (strlen(text) != SessionCache::TOKEN_LENGTH) return false;
+  for (size_t i = 0; i < SessionCache::TOKEN_LENGTH; i++) {
+    char c = text[i];
+    int nibble = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+    if (nibble < 0) return false;
+    token[i / 2] = (uint8_t)((i % 2) ? (token[i / 2] | nibble) : (nibble << 4));
+  }
+  return true;
+}
+
+bool SessionCache::open(const char* userId, unsigned long now, char (&token)[TOKEN_LENGTH + 1]) {
+  if (strlen(userId) > MAX_USER_ID) return false;
+
+  // A free or expired slot, or else the one used least recently
+  Session* slot = &table[0];
+  for (Session& session : table) {
+    if (!live(session, now)) {
+      slot = &session;
+      break;
+    }
+    if (now - session.lastUsed > now - slot->lastUsed) slot = &session;
+  }
+
+  fillRandom(slot->token);
+  strcpy(slot->user, userId);
+  slot->lastUsed = now;
+  slot->open = true;
+  formatToken(slot->token, token);
+  return true;
+}
+
+SessionCache::Session* SessionCache::find(const char* token, unsigned long now) {
+  uint8_t wanted[TOKEN_BYTES];
+  if (!parseToken(token, wanted)) return nullptr;
+  // Every byte of every slot is compared, so timing doesn't narrow a guess
+  Session* found = nullptr;
+  for (Session& session : table) {
+    uint8_t difference = 0;
+    for (size_t i = 0; i < TOKEN_BYTES; i++) difference |= session.token[i] ^ wanted[i];
+    if (difference == 0 && live(session, now)) found = &session;
+  }
+  return found;
+}
+
+const char* SessionCache::check(const char* token, unsigned long now) {
+  Session* session = find(token, now);
+  if (!session) return nullptr;
+  session->lastUsed = now;
+  return session->user;
+}
+
+bool SessionCache::close(const char* token) {
+  Session* session = find(token, millis());
+  if (!session) return false;
+  session->open = false;
+  return true;
+}
+
+void SessionCache::closeUser(const char* userId) {
+  for (Session& session : table) {
+    if (session.open && strcmp(session.user, userId) == 0) session.open = false;
+  }
+}
+
+void SessionCache::closeAll() {
+  for (Session& session : table) session.open = false;
+}
+
+size_t SessionCache::openCount(unsigned long now) const {
+  size_t count = 0;
+  for (const Session& session : table) count += live(session, now);
+  return count;
+}
+
+void randomToken(char (&token)[SessionCache::TOKEN_LENGTH + 1]) {
+  uint8_t bytes[SessionCache::TOKEN_BYTES];
+  fillRandom(bytes);
+  formatToken(bytes, token);
+}
+
+bool tokensMatch(const char* a, const char* b) {
+  size_t length = strlen(b);
+  if (strlen(a) != length) return false;
+  uint8_t difference = 0;
+  for (size_t i = 0; i < length; i++) difference |= a[i] ^ b[i];
+  return difference == 0;
+}
+
+void KioskKey::begin() {
+  current[0] = '\0';
+  File file = openFile(KEY_PATH, "r");
+  if (!file) return;
+  char saved[SessionCache::TOKEN_LENGTH + 1] = "";
+  size_t length = file.read((uint8_t*)saved, SessionCache::TOKEN_LENGTH);
+  file.close();
+  uint8_t bytes[SessionCache::TOKEN_BYTES];
+  if (length == SessionCache::TOKEN_LENGTH && parseToken(saved, bytes)) {
+    strcpy(current, saved);
+  } else {
+    Serial.println("Ignored damaged " + String(KEY_PATH) + ", pair the kiosk screen again");
+  }
+}
+
+bool KioskKey::pair(char (&key)[SessionCache::TOKEN_LENGTH + 1]) {
+  randomToken(key);
+  File file = openFile(KEY_TMP_PATH, "w");
+  if (!file) return false;
+  bool ok = file.write((const uint8_t*)key, SessionCache::TOKEN_LENGTH) == SessionCache::TOKEN_LENGTH;
+  file.close();
+  metrics.recordFileWrite(SessionCache::TOKEN_LENGTH);
+  if (!ok || !replaceFile(KEY_TMP_PATH, KEY_PATH)) return false;
+  strcpy(current, key);
+  return true;
+}
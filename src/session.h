@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Logged-in browsers, for the endpoints that change something. POST
+// /api/login opens a session and hands back its token; requests then carry
+// it as "Authorization: Bearer <token>".
+//
+// A fixed table: a check compares the token against MAX_SESSIONS entries
+// and allocates nothing, and when the table is full the session used least
+// recently makes room. A session ends after IDLE_MILLIS without a request,
+// at logout, when its account is removed, or at a reboot.
+class SessionCache {
+ public:
+  static const size_t MAX_SESSIONS = 16;
+  static const size_t TOKEN_BYTES = 16;                // Random, from esp_random()
+  static const size_t TOKEN_LENGTH = 2 * TOKEN_BYTES;  // As hex
+  static const size_t MAX_USER_ID = 31;
+  static const unsigned long IDLE_MILLIS = 30UL * 60 * 1000;
+
+  // Open a session for `userId` and write its token. False if the ID is
+  // longer than MAX_USER_ID.
+  bool open(const char* userId, unsigned long now, char (&token)[TOKEN_LENGTH + 1]);
+
+  // The user ID behind `token`, or null if there is no such session or it
+  // has expired. Counts as use, so the session stays open.
+  const char* check(const char* token, unsigned long now);
+
+  bool close(const char* token);
+  void closeUser(const char* userId);
+  void closeAll();
+
+  size_t openCount(unsigned long now) const;
+
+ private:
+  struct Session {
+    uint8_t token[TOKEN_BYTES];
+    char user[MAX_USER_ID + 1];
+    unsigned long lastUsed;
+    bool open;
+  };
+
+  bool live(const Session& session, unsigned long now) const {
+    return session.open && now - session.lastUsed < IDLE_MILLIS;
+  }
+  Session* find(const char* token, unsigned long now);
+
+  Session table[MAX_SESSIONS] = {};
+};
+
+// TOKEN_BYTES from esp_random(), as hex: session tokens, the kiosk key and
+// card nonces
+void randomToken(char (&token)[SessionCache::TOKEN_LENGTH + 1]);
+
+// Every byte is compared, so timing doesn't narrow a guess
+bool tokensMatch(const char* a, const char* b);
+
+// The browser that is the kiosk's own screen. A card UID is no secret - it
+// is printed on some cards and anyone can read it - so a card read only
+// counts where staff have paired the screen (POST /api/kiosk/pair): its
+// event stream alone gets a nonce with each read, and that nonce logs the
+// card in or returns the book, once. The key is kept in /kiosk.key across
+// reboots; pairing another browser replaces it.
+class KioskKey {
+ public:
+  void begin();  // Read the key saved by pair(), if any
+
+  // Make a new key and save it. False if it couldn't be saved.
+  bool pair(char (&key)[SessionCache::TOKEN_LENGTH + 1]);
+
+  bool check(const char* key) const { return current[0] && tokensMatch(key, current); }
+  bool paired() const { return current[0] != '\0'; }
+
+ private:
+  char current[SessionCache::TOKEN_LENGTH + 1] = "";
+};
+
+extern SessionCache sessions;
+extern KioskKey kioskKey;
@@ -0,0 +1,460 @@
+#include "snapshot.h"
+
+#include <stddef.h>
+
+#include <algorithm>
+
+#include "metrics.h"  // openFile
+#include "uid.h"
+
+static const char SNAPSHOT_MAGIC[4] = {'L', 'C', 'A', 'T'};
+
+static_assert(sizeof(SnapshotHeader) == 48, "SnapshotHeader layout changed");
+static_assert(sizeof(BookRecord) == 44, "BookRecord layout changed");
+static_assert(offsetof(BookRecord, loanStamp) == BOOK_RECORD_V1_SIZE, "Fields may only be appended");
+static_assert(sizeof(LoanEntry) == 12, "LoanEntry layout changed");
+static_assert(sizeof(UserRecord) == 16, "UserRecord layout changed");
+
+// Card UID into a record's uid/uidLength/flags; returns false if it has to
+// go into the text section instead. Only 1-7 bytes of uppercase hex are
+// packed, so the text reads back exactly as it was.
+static bool packUid(const String& cardUid, uint8_t* uid, uint8_t* uidLength, uint8_t* flags) {
+  *uidLength = 0;
+  if (cardUid.length() == 0) return true;
+  CardUid parsed = CardUid::fromHex(cardUid.c_str());
+  if (parsed.size > 0 && parsed.size <= 7 && strcmp(parsed.hex().text, cardUid.c_str()) == 0) {
+    memcpy(uid, parsed.bytes, parsed.size);
+    *uidLength = parsed.size;
+    return true;
+  }
+  *flags |= RECORD_UID_TEXT;
+  return false;
+}
+
+static String unpackUid(const uint8_t* uid, uint8_t uidLength) {
+  return String(CardUid::fromBytes(uid, std::min<uint8_t>(uidLength, 7)).hex().text);
+}
+
+static size_t textSize(const String& value) {
+  return 2 + value.length();
+}
+
+// ---------------------------------------------------------------------------
+// Reading
+
+static bool readExact(File& file, void* data, size_t length) {
+  return file.read((uint8_t*)data, length) == length;
+}
+
+static bool readString(File& file, String& out) {
+  uint16_t length;
+  if (!readExact(file, &length, sizeof(length))) return false;
+  out = "";
+  out.reserve(length);
+  char chunk[65];
+  while (length > 0) {
+    size_t n = std::min<size_t>(length, sizeof(chunk) - 1);
+    if (!readExact(file, chunk, n)) return false;
+    chunk[n] = '\0';
+    out += chunk;
+    length -= n;
+  }
+  return true;
+}
+
+// The sections follow each other in order, hold what the counts say and
+// end exactly where the file does. The header is written first with the
+// final sizes, so a file cut short by a power failure never passes.
+static bool sectionsFit(const SnapshotHeader& header, size_t fileSize) {
+  uint64_t recordsEnd = (uint64_t)header.recordsOffset + (uint64_t)header.recordCount * header.recordSize;
+  uint64_t loansEnd = (uint64_t)header.loansOffset + (uint64_t)header.loanCount * header.loanSize;
+  return header.stringsOffset >= sizeof(SnapshotHeader) && header.recordsOffset >= header.stringsOffset &&
+         recordsEnd <= header.loansOffset && loansEnd <= header.textOffset &&
+         (uint64_t)header.textOffset + header.textBytes == fileSize;
+}
+
+// Read and sanity-check the header, leaving the file at the string table.
+// Records must be at least minRecordSize bytes.
+static bool readHeader(File& file, uint16_t kind, uint16_t minRecordSize, SnapshotHeader& header) {
+  file.seek(0);
+  if (!readExact(file, &header, sizeof(header))) return false;
+  if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) return false;
+  if (header.version != SNAPSHOT_VERSION || header.kind != kind) {
+    Serial.println("Snapshot: unsupported version " + String(header.version) +
+                   " kind " + String(header.kind));
+    return false;
+  }
+  if (header.recordSize < minRecordSize || (header.loanCount > 0 && header.loanSize < sizeof(LoanEntry))) {
+    return false;
+  }
+  if (!sectionsFit(header, file.size())) {
+    Serial.println("Snapshot: truncated file");
+    return false;
+  }
+  return file.seek(header.stringsOffset);
+}
+
+static bool readStringTable(File& file, const SnapshotHeader& header, std::vector<String>& strings) {
+  strings.resize(header.stringCount);
+  for (String& value : strings) {
+    if (!readString(file, value)) return false;
+  }
+  return true;
+}
+
+static const String& stringAt(const std::vector<String>& strings, uint16_t index) {
+  static const String empty;
+  return index < strings.size() ? strings[index] : empty;
+}
+
+bool isBinarySnapshot(const char* path) {
+  File file = openFile(path, "r");
+  if (!file) return false;
+  char magic[4];
+  bool binary = readExact(file, magic, sizeof(magic)) && memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) == 0;
+  file.close();
+  return binary;
+}
+
+bool isCompleteSnapshot(const char* path) {
+  File file = openFile(path, "r");
+  if (!file) return false;
+  SnapshotHeader header;
+  bool complete = readExact(file, &header, sizeof(header)) &&
+                  memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0 &&
+                  header.version == SNAPSHOT_VERSION && sectionsFit(header, file.size());
+  file.close();
+  return complete;
+}
+
+bool readBookSnapshot(const char* path, std::vector<Book>& out, uint32_t* journalSeq) {
+  // One cursor per section; all three advance in record order
+  File file = openFile(path, "r");
+  File loans = openFile(path, "r");
+  File text = openFile(path, "r");
+  SnapshotHeader header;
+  std::vector<String> strings;
+  if (!file || !loans || !text || !readHeader(file, SNAPSHOT_BOOKS, BOOK_RECORD_V1_SIZE, header) ||
+      !readStringTable(file, header, strings) || !loans.seek(header.loansOffset) ||
+      !text.seek(header.textOffset) || !file.seek(header.recordsOffset)) {
+    return false;
+  }
+  *journalSeq = header.journalSeq;
+
+  out.reserve(out.size() + header.recordCount);
+  bool ok = true;
+  for (uint32_t i = 0; i < header.recordCount && ok; i++) {
+    BookRecord record;
+    memset(&record, 0, sizeof(record));
+    size_t recordBytes = std::min<size_t>(header.recordSize, sizeof(record));
+    ok = readExact(file, &record, recordBytes) &&
+         file.seek(file.position() + header.recordSize - recordBytes);
+    if (!ok) break;
+
+    Book book;
+    ok = readString(text, book.id) && readString(text, book.isbn) && readString(text, book.title);
+    if (ok && (record.flags & RECORD_UID_TEXT)) {
+      ok = readString(text, book.cardUid);
+    } else {
+      book.cardUid = unpackUid(record.uid, record.uidLength);
+    }
+    book.author = stringAt(strings, record.author);
+    book.shelf = stringAt(strings, record.shelf);
+    book.floor = stringAt(strings, record.floor);
+    book.borrowed = record.flags & RECORD_BORROWED;
+    book.borrowedBy = stringAt(strings, record.borrowedBy);
+    book.borrowDate = record.borrowDate;
+    book.returnDate = record.returnDate;
+    book.loanStamp = record.loanStamp;
+    book.loanBase = record.loanBase;
+
+    book.history.reserve(record.loanCount);
+    for (uint16_t j = 0; j < record.loanCount && ok; j++) {
+      LoanEntry entry;
+      ok = readExact(loans, &entry, sizeof(entry)) &&
+           loans.seek(loans.position() + header.loanSize - sizeof(entry));
+      if (!ok) break;
+      LoanRecord loan;
+      loan.username = stringAt(strings, entry.user);
+      loan.borrowDate = entry.borrowDate;
+      loan.returnDate = entry.returnDate;
+      book.history.push_back(loan);
+    }
+    out.push_back(book);
+  }
+
+  file.close();
+  loans.close();
+  text.close();
+  return ok;
+}
+
+bool readUserSnapshot(const char* path, std::vector<User>& out, uint32_t* journalSeq) {
+  File file = openFile(path, "r");
+  File text = openFile(path, "r");
+  SnapshotHeader header;
+  std::vector<String> strings;
+  if (!file || !text || !readHeader(file, SNAPSHOT_USERS, sizeof(UserRecord), header) ||
+      !readStringTable(file, header, strings) || !text.seek(header.textOffset) ||
+      !file.seek(header.recordsOffset)) {
+    return false;
+  }
+  *journalSeq = header.journalSeq;
+
+  out.reserve(out.size() + header.recordCount);
+  bool ok = true;
+  for (uint32_t i = 0; i < header.recordCount && ok; i++) {
+    UserRecord record;
+    ok = readExact(file, &record, sizeof(record)) &&
+         file.seek(file.position() + header.recordSize - sizeof(record));
+    if (!ok) break;
+
+    User user;
+    String password;  // Hashed, or plaintext from older firmware
+    ok = readString(text, user.username) && readString(text, user.studentId) &&
+         readString(text, password) && readString(text, user.name) &&
+         readString(text, user.email);
+    user.password.load(password.c_str());
+    if (ok && (record.flags & RECORD_UID_TEXT)) {
+      ok = readString(text, user.cardUid);
+    } else {
+      user.cardUid = unpackUid(record.uid, record.uidLength);
+    }
+    user.type = stringAt(strings, record.type);
+    out.push_back(user);
+  }
+
+  file.close();
+  text.close();
+  return ok;
+}
+
+// ---------------------------------------------------------------------------
+// Writing
+
+static void initHeader(SnapshotHeader& header, uint16_t kind, uint32_t journalSeq) {
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+  header.version = SNAPSHOT_VERSION;
+  header.kind = kind;
+  header.journalSeq = journalSeq;
+}
+
+uint16_t BookSnapshotWriter::intern(const String& value) {
+  if (value.length() == 0) return NO_STRING;
+  int slot = stringIndex.find(strings, value.c_str());
+  if (slot >= 0) return slot;
+  if (strings.size() >= NO_STRING) {
+    error = true;  // More distinct authors/shelves/borrowers than we can reference
+    return NO_STRING;
+  }
+  strings.push_back({value});
+  stringIndex.insert(strings, strings.size() - 1);
+  return strings.size() - 1;
+}
+
+uint16_t BookSnapshotWriter::lookup(const String& value) const {
+  if (value.length() == 0) return NO_STRING;
+  int slot = stringIndex.find(strings, value.c_str());
+  return slot < 0 ? NO_STRING : slot;
+}
+
+bool BookSnapshotWriter::put(const void* data, size_t length) {
+  if (error) return false;
+  if (file->write((const uint8_t*)data, length) != length) {
+    error = true;
+    return false;
+  }
+  written += length;
+  return true;
+}
+
+bool BookSnapshotWriter::putString(const String& value) {
+  uint16_t length = value.length();
+  return put(&length, sizeof(length)) && put(value.c_str(), length);
+}
+
+bool BookSnapshotWriter::begin(File& out, const std::vector<Book>& source, uint32_t journalSeq) {
+  file = &out;
+  books = &source;
+  strings.clear();
+  stringIndex.rebuild(strings);
+  section = RECORDS;
+  cursor = 0;
+  nextText = 0;
+  nextLoan = 0;
+  written = 0;
+  error = false;
+
+  // Everything shared goes into the string table; the sizes of the other
+  // sections follow from the records
+  uint32_t loanCount = 0;
+  uint32_t textBytes = 0;
+  uint32_t stringBytes = 0;
+  for (const Book& book : source) {
+    size_t before = strings.size();
+    intern(book.author);
+    intern(book.shelf);
+    intern(book.floor);
+    intern(book.borrowedBy);
+    for (const LoanRecord& loan : book.history) intern(loan.username);
+    for (size_t i = before; i < strings.size(); i++) stringBytes += textSize(strings[i].value);
+
+    loanCount += book.history.size();
+    textBytes += textSize(book.id) + textSize(book.isbn) + textSize(book.title);
+    uint8_t uid[7], uidLength, flags = 0;
+    if (!packUid(book.cardUid, uid, &uidLength, &flags)) textBytes += textSize(book.cardUid);
+    if (book.history.size() > 0xFFFF) error = true;
+  }
+  if (error) return false;
+
+  SnapshotHeader header;
+  initHeader(header, SNAPSHOT_BOOKS, journalSeq);
+  header.recordCount = source.size();
+  header.recordSize = sizeof(BookRecord);
+  header.loanSize = sizeof(LoanEntry);
+  header.loanCount = loanCount;
+  header.stringCount = strings.size();
+  header.stringsOffset = sizeof(SnapshotHeader);
+  header.recordsOffset = header.stringsOffset + stringBytes;
+  header.loansOffset = header.recordsOffset + source.size() * sizeof(BookRecord);
+  header.textOffset = header.loansOffset + loanCount * sizeof(LoanEntry);
+  header.textBytes = textBytes;
+
+  if (!put(&header, sizeof(header))) return false;
+  for (const Interned& value : strings) {
+    if (!putString(value.value)) return false;
+  }
+  return true;
+}
+
+bool BookSnapshotWriter::step(size_t count) {
+  const std::vector<Book>& source = *books;
+  size_t end = source.size() - cursor > count ? cursor + count : source.size();
+
+  for (; cursor < end && !error; cursor++) {
+    const Book& book = source[cursor];
+    switch (section) {
+      case RECORDS: {
+        BookRecord record;
+        memset(&record, 0, sizeof(record));
+        record.text = nextText;
+        record.firstLoan = nextLoan;
+        record.borrowDate = book.borrowDate;
+        record.returnDate = book.returnDate;
+        record.loanCount = book.history.size();
+        record.author = lookup(book.author);
+        record.shelf = lookup(book.shelf);
+        record.floor = lookup(book.floor);
+        record.borrowedBy = lookup(book.borrowedBy);
+        if (book.borrowed) record.flags |= RECORD_BORROWED;
+        record.loanStamp = book.loanStamp;
+        record.loanBase = book.loanBase;
+        bool packed = packUid(book.cardUid, record.uid, &record.uidLength, &record.flags);
+        put(&record, sizeof(record));
+
+        nextText += textSize(book.id) + textSize(book.isbn) + textSize(book.title);
+        if (!packed) nextText += textSize(book.cardUid);
+        nextLoan += book.history.size();
+        break;
+      }
+
+      case LOANS:
+        for (const LoanRecord& loan : book.history) {
+          LoanEntry entry;
+          memset(&entry, 0, sizeof(entry));
+          entry.borrowDate = loan.borrowDate;
+          entry.returnDate = loan.returnDate;
+          entry.user = lookup(loan.username);
+          put(&entry, sizeof(entry));
+        }
+        break;
+
+      case TEXT: {
+        putString(book.id);
+        putString(book.isbn);
+        putString(book.title);
+        uint8_t uid[7], uidLength, flags = 0;
+        if (!packUid(book.cardUid, uid, &uidLength, &flags)) putString(book.cardUid);
+        break;
+      }
+
+      case DONE:
+        break;
+    }
+  }
+
+  if (cursor >= source.size() && section != DONE) {
+    section = (Section)(section + 1);
+    cursor = 0;
+  }
+  return section == DONE || error;
+}
+
+bool writeUserSnapshot(File& file, const std::vector<User>& users, uint32_t journalSeq) {
+  // Account types are the only shared strings
+  std::vector<String> types;
+  auto typeIndex = [&types](const String& type) -> uint16_t {
+    if (type.length() == 0) return NO_STRING;
+    for (size_t i = 0; i < types.size(); i++) {
+      if (types[i] == type) return i;
+    }
+    types.push_back(type);
+    return types.size() - 1;
+  };
+
+  uint32_t textBytes = 0;
+  uint32_t stringBytes = 0;
+  for (const User& user : users) {
+    size_t before = types.size();
+    typeIndex(user.type);
+    if (types.size() > before) stringBytes += textSize(user.type);
+    textBytes += textSize(user.username) + textSize(user.studentId) + textSize(user.password.encode()) +
+                 textSize(user.name) + textSize(user.email);
+    uint8_t uid[7], uidLength, flags = 0;
+    if (!packUid(user.cardUid, uid, &uidLength, &flags)) textBytes += textSize(user.cardUid);
+  }
+
+  SnapshotHeader header;
+  initHeader(header, SNAPSHOT_USERS, journalSeq);
+  header.recordCount = users.size();
+  header.recordSize = sizeof(UserRecord);
+  header.stringCount = types.size();
+  header.stringsOffset = sizeof(SnapshotHeader);
+  header.recordsOffset = header.stringsOffset + stringBytes;
+  header.loansOffset = header.recordsOffset + users.size() * sizeof(UserRecord);
+  header.textOffset = header.loansOffset;
+  header.textBytes = textBytes;
+
+  bool ok = file.write((const uint8_t*)&header, sizeof(header)) == sizeof(header);
+  auto putString = [&file, &ok](const String& value) {
+    uint16_t length = value.length();
+    ok = ok && file.write((const uint8_t*)&length, sizeof(length)) == sizeof(length) &&
+         file.write((const uint8_t*)value.c_str(), length) == length;
+  };
+  for (const String& type : types) putString(type);
+
+  uint32_t nextText = 0;
+  for (const User& user : users) {
+    UserRecord record;
+    memset(&record, 0, sizeof(record));
+    record.text = nextText;
+    record.type = typeIndex(user.type);
+    bool packed = packUid(user.cardUid, record.uid, &record.uidLength, &record.flags);
+    ok = ok && file.write((const uint8_t*)&record, sizeof(record)) == sizeof(record);
+    nextText += textSize(user.username) + textSize(user.studentId) + textSize(user.password.encode()) +
+                textSize(user.name) + textSize(user.email);
+    if (!packed) nextText += textSize(user.cardUid);
+  }
+
+  for (const User& user : users) {
+    putString(user.username);
+    putString(user.studentId);
+    putString(user.password.encode());
+    putString(user.name);
+    putString(user.email);
+    uint8_t uid[7], uidLength, flags = 0;
+    if (!packUid(user.cardUid, uid, &uidLength, &flags)) putString(user.cardUid);
+  }
+  return ok;
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <Arduino.h>
+#include <FS.h>
+#include <vector>
+
+#include "catalog.h"
+
+// Binary snapshot format for the books and users databases.
+//
+// JSON snapshots spent most of their bytes on key names, ISO date strings
+// and the same author/shelf/floor text repeated for every book, and had to
+// be parsed with ArduinoJson at boot. A binary snapshot is laid out as
+//
+//   SnapshotHeader       magic, version, section offsets and counts
+//   string table         interned strings: authors, shelves, floors, user
+//                        IDs in loans, account types - each (u16 len, bytes)
+//   records              fixed-width BookRecord / UserRecord, so record i
+//                        is at recordsOffset + i * recordSize
+//   loans                fixed-width LoanEntry, each book's run contiguous
+//                        (lending history - only older snapshots have any,
+//                        it lives in the history log now)
+//   text                 per-record unique strings (id, ISBN, title...),
+//                        each (u16 len, bytes), in record order
+//
+// All integers are little-endian. Dates are Unix seconds (0 = none) and
+// card UIDs are up to 7 raw bytes; anything that isn't plain uppercase hex
+// of that size is kept as text instead so every snapshot round-trips to
+// the same JSON. Records, loans and text are all written in record order,
+// so a reader can stream the file record by record with one cursor per
+// section and never hold more than one record in memory.
+
+static const uint16_t SNAPSHOT_VERSION = 1;
+static const uint16_t SNAPSHOT_BOOKS = 1;
+static const uint16_t SNAPSHOT_USERS = 2;
+static const uint16_t NO_STRING = 0xFFFF;  // Interned reference to ""
+
+struct SnapshotHeader {
+  char magic[4];           // "LCAT"
+  uint16_t version;
+  uint16_t kind;           // SNAPSHOT_BOOKS or SNAPSHOT_USERS
+  uint32_t journalSeq;     // Last journal entry folded into this snapshot
+  uint32_t recordCount;
+  uint16_t recordSize;     // Newer versions may append fields; readers skip them
+  uint16_t loanSize;
+  uint32_t loanCount;
+  uint32_t stringCount;
+  uint32_t stringsOffset;
+  uint32_t recordsOffset;
+  uint32_t loansOffset;
+  uint32_t textOffset;
+  uint32_t textBytes;      // The file ends exactly at textOffset + textBytes
+};
+
+// Flag bits shared by book and user records
+static const uint8_t RECORD_BORROWED = 0x01;  // Books only
+static const uint8_t RECORD_UID_TEXT = 0x02;  // Card UID stored as the last text string
+
+struct BookRecord {
+  uint32_t text;           // Offset in the text section of id, isbn, title
+  uint32_t firstLoan;      // Index of this book's first loan
+  uint32_t borrowDate;
+  uint32_t returnDate;
+  uint16_t loanCount;
+  uint16_t author;         // Interned string references
+  uint16_t shelf;
+  uint16_t floor;
+  uint16_t borrowedBy;
+  uint8_t flags;
+  uint8_t uidLength;       // 0 = no card
+  uint8_t uid[7];
+  uint8_t reserved;
+  // Appended for replication; records from before end above and read as 0
+  uint32_t loanStamp;      // See Catalog::applyMutation()
+  uint32_t loanBase;
+};
+
+// Size of a BookRecord before loanStamp was appended
+static const uint16_t BOOK_RECORD_V1_SIZE = 36;
+
+struct LoanEntry {
+  uint32_t borrowDate;
+  uint32_t returnDate;     // 0 while the loan is open
+  uint16_t user;           // Interned
+  uint16_t reserved;
+};
+
+struct UserRecord {
+  uint32_t text;           // Offset of username, studentId, password hash, name, email
+  uint16_t type;           // Interned
+  uint8_t flags;
+  uint8_t uidLength;
+  uint8_t uid[7];
+  uint8_t reserved;
+};
+
+// True if the file starts with the binary snapshot magic (JSON otherwise)
+bool isBinarySnapshot(const char* path);
+
+// True if the file is a whole snapshot: the header is ours and its
+// sections add up to the size of the file
+bool isCompleteSnapshot(const char* path);
+
+// Stream a snapshot into `out` record by record; *journalSeq receives the
+// sequence stored in the header. Returns false for a damaged or foreign file.
+bool readBookSnapshot(const char* path, std::vector<Book>& out, uint32_t* journalSeq);
+bool readUserSnapshot(const char* path, std::vector<User>& out, uint32_t* journalSeq);
+
+// Write a users snapshot in one go (there are only ever a few hundred)
+bool writeUserSnapshot(File& file, const std::vector<User>& users, uint32_t journalSeq);
+
+// Books snapshot writer that works in slices so compaction can run from
+// loop() without stalling requests. The books must not change between
+// begin() and the last step() - the data store restarts on any commit.
+class BookSnapshotWriter {
+ public:
+  // Intern the shared strings, lay out the sections and write everything
+  // up to the first record
+  bool begin(File& file, const std::vector<Book>& books, uint32_t journalSeq);
+
+  // Write up to `count` more books' worth of the current section. Returns
+  // true once the whole file has been written; check failed() afterwards.
+  bool step(size_t count);
+
+  bool failed() const { return error; }
+  size_t bytesWritten() const { return written; }
+
+ private:
+  struct Interned {
+    String value;
+  };
+
+  enum Section { RECORDS, LOANS, TEXT, DONE };
+
+  uint16_t intern(const String& value);
+  uint16_t lookup(const String& value) const;
+  bool put(const void* data, size_t length);
+  bool putString(const String& value);
+
+  File* file = nullptr;
+  const std::vector<Book>* books = nullptr;
+  std::vector<Interned> strings;
+  HashIndex<Interned> stringIndex{&Interned::value};
+  Section section = DONE;
+  size_t cursor = 0;
+  uint32_t nextText = 0;
+  uint32_t nextLoan = 0;
+  size_t written = 0;
+  bool error = false;
+};
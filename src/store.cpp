@@ -0,0 +1,392 @@
+#include "store.h"
+
+#include <algorithm>
+
+#include "datafs.h"
+#include "metrics.h"
+#include "replication.h"
+
+DataStore store;
+
+static const char* BOOKS_PATH = "/books.bin";
+static const char* USERS_PATH = "/users.bin";
+static const char* LEGACY_BOOKS_PATH = "/books.json";  // JSON snapshots, converted at boot
+static const char* LEGACY_USERS_PATH = "/users.json";
+static const char* BOOKS_TMP_PATH = "/books.tmp";
+static const char* USERS_TMP_PATH = "/users.tmp";
+static const char* JOURNAL_PATH = "/journal.log";
+static const char* UPLOAD_TMP_PATH = "/upload.tmp";
+static const char* LEGACY_JOURNAL_PATH = "/books.log";  // Unchecksummed log from older firmware
+
+// The sample catalog, for a first boot without the data/ image. Written as
+// the JSON snapshots, which begin() then converts like any others.
+static const char DEFAULT_USERS_JSON[] = "{\"users\":[{\"type\":\"staff\",\"username\":\"admin\",\"password\":\"admin123\",\"cardUid\":\"A286FF03\"},{\"type\":\"staff\",\"username\":\"staff1\",\"password\":\"staff123\",\"cardUid\":\"530D2349029380\"},{\"type\":\"student\",\"studentId\":\"S001\",\"password\":\"student123\",\"name\":\"John Smith\",\"email\":\"john.smith@example.com\",\"cardUid\":\"538426E2023F80\"},{\"type\":\"student\",\"studentId\":\"S002\",\"password\":\"student456\",\"name\":\"Emily Davis\",\"email\":\"emily.davis@example.com\",\"cardUid\":\"53ADFDCE028D80\"},{\"type\":\"student\",\"studentId\":\"S003\",\"password\":\"student789\",\"name\":\"David Johnson\",\"email\":\"david.johnson@example.com\",\"cardUid\":\"5395276302DC80\"}]}";
+static const char DEFAULT_BOOKS_JSON[] = "{\"books\":[{\"id\":\"B001\",\"isbn\":\"B001\",\"title\":\"Introduction to Programming\",\"author\":\"Jane Smith\",\"shelf\":\"R1C1\",\"floor\":\"1\",\"borrowed\":false,\"cardUid\":\"53C4734302A380\",\"history\":[]},{\"id\":\"B002\",\"isbn\":\"B002\",\"title\":\"Data Structures and Algorithms\",\"author\":\"Robert Johnson\",\"shelf\":\"R2C3\",\"floor\":\"1\",\"borrowed\":true,\"borrowedBy\":\"S001\",\"borrowDate\":\"2025-04-02T10:15:00Z\",\"returnDate\":\"2025-04-16T10:15:00Z\",\"cardUid\":\"53FC884B020880\",\"history\":[{\"username\":\"S001\",\"borrowDate\":\"2025-04-02T10:15:00Z\",\"returnDate\":null},{\"username\":\"S002\",\"borrowDate\":\"2025-03-01T14:30:00Z\",\"returnDate\":\"2025-03-14T11:45:00Z\"}]},{\"id\":\"B003\",\"isbn\":\"B003\",\"title\":\"Database Management Systems\",\"author\":\"Michael Chen\",\"shelf\":\"R3C2\",\"floor\":\"1\",\"borrowed\":false,\"cardUid\":\"53E5BCC6021280\",\"history\":[{\"username\":\"S003\",\"borrowDate\":\"2025-02-10T09:20:00Z\",\"returnDate\":\"2025-02-20T16:30:00Z\"}]},{\"id\":\"B004\",\"isbn\":\"B004\",\"title\":\"Computer Networks\",\"author\":\"Sarah Williams\",\"shelf\":\"R1C4\",\"floor\":\"2\",\"borrowed\":true,\"borrowedBy\":\"S002\",\"borrowDate\":\"2025-04-05T13:40:00Z\",\"returnDate\":\"2025-04-19T13:40:00Z\",\"cardUid\":\"53940740028780\",\"history\":[{\"username\":\"S002\",\"borrowDate\":\"2025-04-05T13:40:00Z\",\"returnDate\":null}]},{\"id\":\"B005\",\"isbn\":\"B005\",\"title\":\"Artificial Intelligence\",\"author\":\"David Brown\",\"shelf\":\"R2C1\",\"floor\":\"2\",\"borrowed\":false,\"cardUid\":\"53DD0760026780\",\"history\":[]},{\"id\":\"B006\",\"isbn\":\"B006\",\"title\":\"Operating Systems\",\"author\":\"Patricia Garcia\",\"shelf\":\"R3C3\",\"floor\":\"2\",\"borrowed\":false,\"cardUid\":\"53FCD8C402C580\",\"history\":[{\"username\":\"S001\",\"borrowDate\":\"2025-01-15T11:10:00Z\",\"returnDate\":\"2025-01-29T15:25:00Z\"}]},{\"id\":\"B007\",\"isbn\":\"B007\",\"title\":\"Software Engineering\",\"author\":\"Thomas Lee\",\"shelf\":\"R1C2\",\"floor\":\"3\",\"borrowed\":true,\"borrowedBy\":\"S003\",\"borrowDate\":\"2025-03-28T10:30:00Z\",\"returnDate\":\"2025-04-11T10:30:00Z\",\"cardUid\":\"530C524C02F680\",\"history\":[{\"username\":\"S003\",\"borrowDate\":\"2025-03-28T10:30:00Z\",\"returnDate\":null}]},{\"id\":\"B008\",\"isbn\":\"B008\",\"title\":\"Web Development\",\"author\":\"Lisa Johnson\",\"shelf\":\"R2C4\",\"floor\":\"3\",\"borrowed\":false,\"cardUid\":\"53BDECCB02E080\",\"history\":[]},{\"id\":\"B009\",\"isbn\":\"B009\",\"title\":\"Machine Learning Basics\",\"author\":\"Alan Turner\",\"shelf\":\"R4C1\",\"floor\":\"1\",\"borrowed\":true,\"borrowedBy\":\"S001\",\"borrowDate\":\"2025-03-15T10:30:00Z\",\"returnDate\":\"2025-03-29T10:30:00Z\",\"cardUid\":\"53ABCDEF02E080\",\"history\":[{\"username\":\"S001\",\"borrowDate\":\"2025-03-15T10:30:00Z\",\"returnDate\":null}]}]}";
+
+// Compact once the journal holds this much - small enough to replay quickly
+// at boot, large enough that snapshots are rare
+static const size_t COMPACT_THRESHOLD = 16 * 1024;
+
+// If commits keep interrupting background compaction, the journal would grow
+// without bound - past this size we compact synchronously instead
+static const size_t COMPACT_FORCE_THRESHOLD = 64 * 1024;
+
+// Book records written per loop() pass while compacting (~a few ms of flash)
+static const size_t BOOKS_PER_SLICE = 16;
+
+DataStore::DataStore() : journal(JOURNAL_PATH) {}
+
+// Which snapshot a journal entry belongs to
+static bool isUserOp(JsonObject entry) {
+  const char* op = entry["op"] | "";
+  return strcmp(op, "addUser") == 0 || strcmp(op, "addUsers") == 0 || strcmp(op, "removeUser") == 0;
+}
+
+// Replay callback - skips entries already folded into the matching snapshot
+static uint32_t replayBooksSeq = 0;
+static uint32_t replayUsersSeq = 0;
+static void replayEntry(JsonObject entry) {
+  replicator.observe(entry);  // Even if a snapshot has it, for the applied counts
+  uint32_t seq = entry["seq"] | 0;
+  if (seq <= (isUserOp(entry) ? replayUsersSeq : replayBooksSeq)) return;
+  // A stamped loan that lost a conflict (see Catalog::applyMutation()) lost
+  // the first time too
+  TxResult result = catalog.applyMutation(entry);
+  if (result != TX_OK && !(result == TX_CONFLICT && entry.containsKey("stamp"))) {
+    Serial.println("Journal entry " + String(seq) + " did not apply cleanly");
+  }
+}
+
+static void replayLegacyEntry(JsonObject entry) {
+  catalog.applyMutation(entry);
+}
+
+// A temp snapshot next to its live file is an unfinished compaction and is
+// dropped (the journal still has everything), and so is one next to the
+// JSON file it was converting - that is still the snapshot. A temp file on
+// its own means we died between removing the old snapshot and renaming the
+// new one (on SPIFFS - see replaceFile()), and is finished if it is whole.
+static void recoverSnapshot(const char* path, const char* tmpPath, const char* legacyPath) {
+  if (!dataFs().exists(tmpPath)) return;
+  if (dataFs().exists(path) || dataFs().exists(legacyPath)) {
+    dataFs().remove(tmpPath);
+    Serial.println("Dropped unfinished snapshot " + String(tmpPath));
+  } else if (isCompleteSnapshot(tmpPath)) {
+    dataFs().rename(tmpPath, path);
+    Serial.println("Recovered snapshot " + String(path));
+  } else {
+    dataFs().remove(tmpPath);
+    Serial.println("Dropped damaged snapshot " + String(tmpPath));
+  }
+}
+
+static void seedFile(const char* path, const char* json) {
+  if (dataFs().exists(path)) return;
+  Serial.println("Creating default " + String(path));
+  File file = openFile(path, "w");
+  if (!file) return;
+  size_t length = strlen(json);
+  file.write((const uint8_t*)json, length);
+  file.close();
+  metrics.recordFileWrite(length);
+}
+
+void DataStore::begin() {
+  recoverSnapshot(BOOKS_PATH, BOOKS_TMP_PATH, LEGACY_BOOKS_PATH);
+  recoverSnapshot(USERS_PATH, USERS_TMP_PATH, LEGACY_USERS_PATH);
+  if (dataFs().exists(UPLOAD_TMP_PATH)) dataFs().remove(UPLOAD_TMP_PATH);
+
+  // Until the first compaction after an upgrade, the JSON files are the snapshots
+  bool legacyUsers = !dataFs().exists(USERS_PATH);
+  bool legacyBooks = !dataFs().exists(BOOKS_PATH);
+  if (legacyUsers) seedFile(LEGACY_USERS_PATH, DEFAULT_USERS_JSON);
+  if (legacyBooks) seedFile(LEGACY_BOOKS_PATH, DEFAULT_BOOKS_JSON);
+  uint32_t loadStart = millis();
+  loanHistory.begin();
+  usersDamaged = !catalog.loadUsers(legacyUsers ? LEGACY_USERS_PATH : USERS_PATH, &usersSeq);
+  booksDamaged = !catalog.loadBooks(legacyBooks ? LEGACY_BOOKS_PATH : BOOKS_PATH, &booksSeq);
+  // A binary snapshot that won't read may still have the JSON it was
+  // converted from next to it
+  if (usersDamaged && !legacyUsers && dataFs().exists(LEGACY_USERS_PATH)) {
+    legacyUsers = true;
+    usersDamaged = !catalog.loadUsers(LEGACY_USERS_PATH, &usersSeq);
+  }
+  if (booksDamaged && !legacyBooks && dataFs().exists(LEGACY_BOOKS_PATH)) {
+    legacyBooks = true;
+    booksDamaged = !catalog.loadBooks(LEGACY_BOOKS_PATH, &booksSeq);
+  }
+  if (usersDamaged || booksDamaged) {
+    Serial.println("Snapshot damaged - not compacting until the collection is uploaded again");
+  }
+  Serial.println("Loaded " + String(catalog.allBooks().size()) + " books, " +
+                 String(catalog.allUsers().size()) + " users in " + String(millis() - loadStart) +
+                 " ms");
+
+  // History in the books snapshot predates the history log - move it
+  // there, ahead of anything the journal adds
+  bool movedHistory = catalog.moveHistoryToLog(booksSeq) > 0;
+
+  replayBooksSeq = booksSeq;
+  replayUsersSeq = usersSeq;
+  size_t replayed = journal.replay(std::min(booksSeq, usersSeq), replayEntry);
+  Serial.println("Journal replayed: " + String(replayed) + " entries, last seq " +
+                 String(journal.lastSeq()));
+
+  bool needsSnapshot = journal.stats().discarded > 0;  // Don't append after a torn line
+  bool converting = legacyUsers || legacyBooks;
+  bool plaintext = plaintextPasswordsHashed() > 0;  // Only hashes should stay on flash
+  needsSnapshot = needsSnapshot || converting || movedHistory || plaintext;
+
+  if (dataFs().exists(LEGACY_JOURNAL_PATH)) {
+    File legacy = openFile(LEGACY_JOURNAL_PATH, "r");
+    DynamicJsonDocument doc(512);
+    while (legacy) {
+      unsigned long parseStart = micros();
+      DeserializationError error = deserializeJson(doc, legacy);
+      metrics.recordJsonParse(micros() - parseStart);
+      if (error) break;
+      replayLegacyEntry(doc.as<JsonObject>());
+    }
+    legacy.close();
+    needsSnapshot = true;
+  }
+
+  if (needsSnapshot && compactNow()) {
+    dataFs().remove(LEGACY_JOURNAL_PATH);
+    if (converting) {
+      dataFs().remove(LEGACY_BOOKS_PATH);
+      dataFs().remove(LEGACY_USERS_PATH);
+      Serial.println("Converted JSON snapshots to binary");
+    }
+  }
+  loaded = true;
+}
+
+TxResult DataStore::commit(JsonDocument& entry) {
+  TxResult result = catalog.validateMutation(entry.as<JsonObject>());
+  if (result != TX_OK) return result;
+
+  if (!replicator.stamp(entry)) return TX_INVALID;
+  // Log first, then apply - if the write fails nothing has changed
+  if (!journal.append(entry)) return TX_IO_ERROR;
+  result = catalog.applyMutation(entry.as<JsonObject>());
+  generation++;
+  replicator.committed(entry.as<JsonObject>());
+  return result;
+}
+
+TxResult DataStore::applyReplicated(JsonDocument& entry) {
+  if (!journal.append(entry)) return TX_IO_ERROR;
+  TxResult result = catalog.applyMutation(entry.as<JsonObject>());
+  generation++;
+  return result;
+}
+
+// Uploads are loaded through a temp file so parsing stays
+// record-at-a-time, then snapshotted immediately since the journal no
+// longer describes what's in RAM. The old collection is held until the
+// snapshot is installed, so a failed write can put it back.
+static bool stageUpload(const String& json) {
+  File file = openFile(UPLOAD_TMP_PATH, "w");
+  if (!file) return false;
+  bool written = file.print(json) == json.length();
+  file.close();
+  metrics.recordFileWrite(json.length());
+  return written;
+}
+
+bool DataStore::replaceBooks(const String& json) {
+  std::vector<Book> previous;
+  uint32_t ignored;
+  bool ok = stageUpload(json) && catalog.loadBooks(UPLOAD_TMP_PATH, &ignored, &previous);
+  dataFs().remove(UPLOAD_TMP_PATH);
+  if (!ok) return false;
+
+  bool wasDamaged = booksDamaged;
+  booksDamaged = false;
+  generation++;
+  uint32_t seq = journal.skip();
+  catalog.resetBookVersions(seq);  // Every record may have changed
+  // Once books.bin holds the upload it stands, even if a later step of
+  // the compaction failed - the next one finishes the job
+  compactNow();
+  if (booksSeq != seq) {
+    catalog.restoreBooks(previous);
+    catalog.resetBookVersions(seq);  // Clients may have fetched the upload
+    booksDamaged = wasDamaged;
+    return false;
+  }
+  // The snapshot keeps the upload's history until the next compaction;
+  // boot sees the log already holds it (see begin())
+  catalog.moveHistoryToLog(seq);
+  return true;
+}
+
+bool DataStore::replaceUsers(const String& json) {
+  std::vector<User> previous;
+  uint32_t ignored;
+  bool ok = stageUpload(json) && catalog.loadUsers(UPLOAD_TMP_PATH, &ignored, &previous);
+  dataFs().remove(UPLOAD_TMP_PATH);
+  if (!ok) return false;
+
+  bool wasDamaged = usersDamaged;
+  usersDamaged = false;
+  generation++;
+  uint32_t seq = journal.skip();
+  catalog.resetUserVersions(seq);  // Every record may have changed
+  compactNow();
+  if (usersSeq != seq) {
+    catalog.restoreUsers(previous);
+    catalog.resetUserVersions(seq);
+    usersDamaged = wasDamaged;
+    return false;
+  }
+  return true;
+}
+
+bool DataStore::startCompaction() {
+  snapshotFile = openFile(BOOKS_TMP_PATH, "w");
+  if (!snapshotFile) {
+    Serial.println("Compaction: failed to open " + String(BOOKS_TMP_PATH));
+    return false;
+  }
+  snapshotSeq = journal.lastSeq();
+  snapshotGeneration = generation;
+  compactionStartMillis = millis();
+  if (!bookWriter.begin(snapshotFile, catalog.allBooks(), snapshotSeq)) {
+    snapshotFile.close();
+    dataFs().remove(BOOKS_TMP_PATH);
+    Serial.println("Compaction: failed to write " + String(BOOKS_TMP_PATH));
+    return false;
+  }
+  phase = WRITING_BOOKS;
+  return true;
+}
+
+void DataStore::abortCompaction() {
+  if (phase == WRITING_BOOKS) snapshotFile.close();
+  dataFs().remove(BOOKS_TMP_PATH);
+  dataFs().remove(USERS_TMP_PATH);
+  phase = IDLE;
+}
+
+bool DataStore::writeUsersSnapshot() {
+  File file = openFile(USERS_TMP_PATH, "w");
+  if (!file) return false;
+  bool ok = writeUserSnapshot(file, catalog.allUsers(), snapshotSeq);
+  snapshotBytes += file.position();
+  metrics.recordFileWrite(file.position());
+  file.close();
+  return ok;
+}
+
+// Swap both snapshots in, then drop the journal entries they now contain.
+// Each step leaves something recoverable by begin() if power fails.
+bool DataStore::installSnapshots() {
+  if (!writeUsersSnapshot()) return false;
+
+  if (!replaceFile(BOOKS_TMP_PATH, BOOKS_PATH)) return false;
+  booksSeq = snapshotSeq;
+  if (!replaceFile(USERS_TMP_PATH, USERS_PATH)) return false;
+  usersSeq = snapshotSeq;
+  // The journal's stamps are the only other record of what was applied
+  if (!replicator.save()) return false;
+
+  journal.truncate();
+  compactions++;
+  lastCompactionMillis = millis() - compactionStartMillis;
+  Serial.println("Compaction done at seq " + String(snapshotSeq) + " in " +
+                 String(lastCompactionMillis) + " ms");
+  return true;
+}
+
+void DataStore::loop() {
+  if (!loaded || booksDamaged || usersDamaged) return;
+  if (journal.sizeBytes() > COMPACT_FORCE_THRESHOLD) {
+    compactNow();
+    return;
+  }
+
+  switch (phase) {
+    case IDLE:
+      if (journal.sizeBytes() > COMPACT_THRESHOLD) startCompaction();
+      break;
+
+    case WRITING_BOOKS: {
+      // A commit since we started means the records already written may be
+      // stale, so start over from the new state
+      if (generation != snapshotGeneration) {
+        compactionRestarts++;
+        abortCompaction();
+        break;
+      }
+      if (bookWriter.step(BOOKS_PER_SLICE)) {
+        snapshotBytes += bookWriter.bytesWritten();
+        metrics.recordFileWrite(bookWriter.bytesWritten());
+        snapshotFile.close();
+        if (bookWriter.failed()) {
+          Serial.println("Compaction: write failed, will retry");
+          abortCompaction();
+          break;
+        }
+        phase = INSTALLING;
+      }
+      break;
+    }
+
+    case INSTALLING:
+      if (generation != snapshotGeneration) {
+        compactionRestarts++;
+        abortCompaction();
+        break;
+      }
+      if (!installSnapshots()) {
+        Serial.println("Compaction: install failed, will retry");
+      }
+      phase = IDLE;
+      break;
+  }
+}
+
+bool DataStore::compactNow() {
+  if (phase != IDLE) abortCompaction();
+  // RAM doesn't hold what the damaged snapshot did; don't write over it
+  if (booksDamaged || usersDamaged) return false;
+  if (!startCompaction()) return false;
+
+  while (!bookWriter.step(SIZE_MAX)) {
+    // Each step finishes one section of the file
+  }
+  snapshotBytes += bookWriter.bytesWritten();
+  metrics.recordFileWrite(bookWriter.bytesWritten());
+  snapshotFile.close();
+
+  if (bookWriter.failed()) {
+    abortCompaction();
+    return false;
+  }
+  bool ok = installSnapshots();
+  phase = IDLE;
+  return ok;
+}
+
+void DataStore::writeStats(JsonObject obj) const {
+  const JournalStats& stats = journal.stats();
+  obj["seq"] = journal.lastSeq();
+  obj["journalBytes"] = journal.sizeBytes();
+  obj["appends"] = stats.appends;
+  obj["bytesAppended"] = stats.bytesAppended;
+  obj["snapshotBytes"] = snapshotBytes;
+  // Flash bytes written per committed mutation, snapshots included
+  obj["bytesPerCommit"] = stats.appends ? (stats.bytesAppended + snapshotBytes) / stats.appends : 0;
+  obj["lastCommitMicros"] = stats.lastCommitMicros;
+  obj["maxCommitMicros"] = stats.maxCommitMicros;
+  obj["avgCommitMicros"] = stats.appends ? (uint32_t)(stats.totalCommitMicros / stats.appends) : 0;
+  obj["replayed"] = stats.replayed;
+  obj["discarded"] = stats.discarded;
+  obj["compactions"] = compactions;
+  obj["compactionRestarts"] = compactionRestarts;
+  obj["lastCompactionMillis"] = lastCompactionMillis;
+  obj["compacting"] = phase != IDLE;
+  obj["snapshotDamaged"] = booksDamaged || usersDamaged;
+}
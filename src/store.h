@@ -0,0 +1,91 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <FS.h>
+
+#include "catalog.h"
+#include "journal.h"
+#include "snapshot.h"
+
+// Durable storage behind the in-RAM catalog.
+//
+// /books.bin and /users.bin are binary snapshots (see snapshot.h); every
+// change after them is a line in /journal.log. JSON snapshots left by older
+// firmware or the data/ image are loaded once and converted. Once the
+// journal passes COMPACT_THRESHOLD bytes, loop() rewrites the snapshots a
+// slice at a time into temp files, swaps them in and truncates the journal.
+// Boot recovers from a crash at any point of that.
+// Lending history lives in its own append-only log (see history.h), so
+// neither grows with circulation.
+class DataStore {
+ public:
+  DataStore();
+
+  // Recover interrupted compactions, load snapshots and replay the journal.
+  // A first boot without snapshots starts from the sample catalog. A
+  // snapshot that won't load is left as it is, and nothing is compacted
+  // until that collection is uploaded again.
+  void begin();
+
+  // begin() has run, so the catalog is loaded. Boot defers it until the
+  // HTTP server is up (see main.cpp).
+  bool ready() const { return loaded; }
+
+  // Validate, journal and apply one mutation (see Catalog::applyMutation).
+  // Nothing is changed unless the journal write succeeded. With
+  // replication on, the entry is stamped first and sent to the other
+  // kiosks after (see replication.h).
+  TxResult commit(JsonDocument& entry);
+
+  // Journal and apply a change another kiosk committed. Nothing is checked
+  // first: stamped loans settle conflicts themselves, and an edit that no
+  // longer fits is journaled anyway so replay sees the same stream.
+  // TX_IO_ERROR if the journal write failed, else what applying gave.
+  TxResult applyReplicated(JsonDocument& entry);
+
+  // Replace a whole collection from a legacy bulk upload ({"books":[...]}).
+  // False, with nothing changed, unless the whole upload parses and its
+  // snapshot is installed - RAM never holds what flash doesn't.
+  bool replaceBooks(const String& json);
+  bool replaceUsers(const String& json);
+
+  // Advance background compaction by one slice; call from loop()
+  void loop();
+
+  // Write fresh snapshots right now and truncate the journal
+  bool compactNow();
+
+  // Counters for /api/journal
+  void writeStats(JsonObject obj) const;
+
+ private:
+  enum CompactionPhase { IDLE, WRITING_BOOKS, INSTALLING };
+
+  bool startCompaction();
+  bool writeUsersSnapshot();
+  bool installSnapshots();
+  void abortCompaction();
+
+  Journal journal;
+  uint32_t booksSeq = 0;   // Last journal seq contained in books.bin
+  uint32_t usersSeq = 0;   // Last journal seq contained in users.bin
+  uint32_t generation = 0; // Bumped on every commit to detect changes mid-compaction
+  bool loaded = false;
+  bool booksDamaged = false;  // Its snapshot wouldn't load; compaction would persist the loss
+  bool usersDamaged = false;
+
+  CompactionPhase phase = IDLE;
+  File snapshotFile;
+  BookSnapshotWriter bookWriter;
+  uint32_t snapshotSeq = 0;
+  uint32_t snapshotGeneration = 0;
+
+  uint32_t compactions = 0;
+  uint32_t compactionRestarts = 0;
+  uint32_t snapshotBytes = 0;       // Bytes written by compaction
+  uint32_t compactionStartMillis = 0;
+  uint32_t lastCompactionMillis = 0;  // Duration of the last compaction
+};
+
+extern DataStore store;
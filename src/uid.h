@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A card UID as the reader returns it: up to 10 bytes (triple-size ISO
+// 14443 UIDs) plus a length. Plain data, copied by value from rfid.uid
+// through the reader ring and the scan event ring without touching the
+// heap. Its text form is the upper-case hex stored in cardUid fields.
+struct CardUid {
+  static const uint8_t MAX_BYTES = 10;
+
+  // Hex text in a fixed buffer, e.g. for printing: uid.hex().text
+  struct Hex {
+    char text[2 * MAX_BYTES + 1] = {};
+  };
+
+  uint8_t size = 0;
+  uint8_t bytes[MAX_BYTES] = {};
+
+  constexpr bool empty() const { return size == 0; }
+
+  static constexpr CardUid fromBytes(const uint8_t* data, uint8_t length) {
+    CardUid uid;
+    uid.size = length < MAX_BYTES ? length : MAX_BYTES;
+    for (uint8_t i = 0; i < uid.size; i++) uid.bytes[i] = data[i];
+    return uid;
+  }
+
+  // Either case of hex digits; anything else (odd length, more than
+  // MAX_BYTES, a non-hex character) gives an empty UID
+  static constexpr CardUid fromHex(const char* text) {
+    CardUid uid;
+    size_t length = 0;
+    while (text[length]) length++;
+    if (length % 2 != 0 || length > 2 * MAX_BYTES) return CardUid();
+    for (size_t i = 0; i < length; i += 2) {
+      int high = digitValue(text[i]);
+      int low = digitValue(text[i + 1]);
+      if (high < 0 || low < 0) return CardUid();
+      uid.bytes[uid.size++] = (uint8_t)(high << 4 | low);
+    }
+    return uid;
+  }
+
+  constexpr Hex hex() const {
+    Hex out;
+    for (uint8_t i = 0; i < size; i++) {
+      out.text[2 * i] = digit(bytes[i] >> 4);
+      out.text[2 * i + 1] = digit(bytes[i] & 0x0F);
+    }
+    return out;
+  }
+
+  // FNV-1a of the hex text - the value HashIndex::hashKey() gives for it,
+  // so a UID can probe the card indexes without being formatted first
+  constexpr uint32_t hash() const {
+    uint32_t hash = 2166136261u;
+    for (uint8_t i = 0; i < size; i++) {
+      hash = (hash ^ (uint8_t)digit(bytes[i] >> 4)) * 16777619u;
+      hash = (hash ^ (uint8_t)digit(bytes[i] & 0x0F)) * 16777619u;
+    }
+    return hash;
+  }
+
+  constexpr bool operator==(const CardUid& other) const {
+    if (size != other.size) return false;
+    for (uint8_t i = 0; i < size; i++) {
+      if (bytes[i] != other.bytes[i]) return false;
+    }
+    return true;
+  }
+  constexpr bool operator!=(const CardUid& other) const { return !(*this == other); }
+
+ private:
+  static constexpr char digit(uint8_t value) { return "0123456789ABCDEF"[value]; }
+
+  static constexpr int digitValue(char c) {
+    return c >= '0' && c <= '9' ? c - '0'
+         : c >= 'A' && c <= 'F' ? c - 'A' + 10
+         : c >= 'a' && c <= 'f' ? c - 'a' + 10
+         : -1;
+  }
+};
+
+static_assert(CardUid::fromHex("53c4734302A380").size == 7 &&
+              CardUid::fromHex("53c4734302A380").hex().text[2] == 'C' &&
+              CardUid::fromHex("53C4734302A380") == CardUid::fromHex("53c4734302a380"),
+              "CardUid hex round trip");
+static_assert(CardUid::fromHex("A28").empty() && CardUid::fromHex("A2G6").empty(),
+              "CardUid rejects malformed hex");
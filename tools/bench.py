@@ -0,0 +1,252 @@
+#!/usr/bin/env python3
+"""Load benchmark for the kiosk.
+
+Replays kiosk traffic from several simulated browsers at once and reports
+HTTP requests/sec and latency percentiles for each number of clients. Each
+client keeps one connection open (HTTP/1.1 keep-alive, as a browser does)
+and cycles through what the pages do: /api/scan polls, catalog pages, card
+lookups, and a borrow and return of a book of its own as staff.
+
+Before and after each run it reads /api/loop, so it also reports how often
+the reader task polled the RFID reader (polls/sec) while the server was
+under load, the worst loop pass on each side, and how many connections the
+server opened and kept alive.
+
+    python3 tools/bench.py --host 192.168.4.1 --clients 1,5,20 --seconds 20
+
+--path replaces the kiosk mix with GETs of the given endpoints, and
+--close opens a new connection for every request as the old server made
+browsers do. --import N instead uploads a CSV of N new books to
+/api/import and reports records/s (the books stay in the catalog). The
+host build serves the same firmware on loopback:
+
+    .pio/build/native/program --serve 8080 1000 &
+    python3 tools/bench.py --host 127.0.0.1:8080
+"""
+
+import argparse
+import http.client
+import json
+import random
+import threading
+import time
+import urllib.parse
+
+
+class Client:
+    """One browser: a connection that is reopened only when the kiosk closes it"""
+
+    def __init__(self, host, keep_alive, timeout=5.0):
+        self.host = host
+        self.keep_alive = keep_alive
+        self.timeout = timeout
+        self.connection = None
+        self.connects = 0
+
+    def request(self, method, path, body=None, headers=None):
+        headers = dict(headers or {})
+        if body is not None:
+            headers.setdefault("Content-Type", "application/x-www-form-urlencoded")
+        if not self.keep_alive:
+            headers["Connection"] = "close"
+        for attempt in range(2):
+            if self.connection is None:
+                self.connection = http.client.HTTPConnection(self.host, timeout=self.timeout)
+                self.connects += 1
+            try:
+                self.connection.request(method, path, body=body, headers=headers)
+                response = self.connection.getresponse()
+                data = response.read()
+            except (http.client.HTTPException, OSError):
+                # A kept-alive connection the kiosk closed in the meantime;
+                # a fresh one gets a second try
+                self.close()
+                if attempt == 1:
+                    raise
+                continue
+            if response.will_close:
+                self.close()
+            return response.status, data
+
+    def close(self):
+        if self.connection is not None:
+            self.connection.close()
+        self.connection = None
+
+
+def fetch_json(host, path, method="GET", body=None):
+    client = Client(host, keep_alive=False)
+    status, data = client.request(method, path, body=body)
+    if status != 200:
+        raise SystemExit("%s %s answered %d: %s" % (method, path, status, data[:200]))
+    return json.loads(data)
+
+
+class KioskMix:
+    """The requests the kiosk pages make, for client number `index`"""
+
+    def __init__(self, book, card_uids, student, token):
+        self.book = book
+        self.card_uids = card_uids
+        self.student = student
+        self.auth = {"Authorization": "Bearer " + token}
+
+    def requests(self):
+        while True:
+            ts = "&ts=%d" % time.time()
+            yield "GET", "/api/scan", None, None
+            yield "GET", "/api/books?limit=20&offset=%d" % random.randrange(1000), None, None
+            yield "GET", "/api/scan", None, None
+            yield "GET", "/api/lookup?uid=" + random.choice(self.card_uids), None, None
+            yield "GET", "/api/scan", None, None
+            yield "POST", "/api/borrow", "id=%s&user=%s%s" % (self.book, self.student, ts), self.auth
+            yield "GET", "/api/scan", None, None
+            yield "POST", "/api/return", "id=%s%s" % (self.book, ts), self.auth
+
+
+def paths_mix(paths):
+    while True:
+        for path in paths:
+            yield "GET", path, None, None
+
+
+def worker(client, requests, deadline, results, lock):
+    local = []
+    failed = 0
+    while time.monotonic() < deadline:
+        method, path, body, headers = next(requests)
+        start = time.monotonic()
+        try:
+            status, _ = client.request(method, path, body, headers)
+            if status >= 400:
+                failed += 1
+            else:
+                local.append(time.monotonic() - start)
+        except Exception:
+            failed += 1
+    client.close()
+    with lock:
+        results["latencies"].extend(local)
+        results["errors"] += failed
+        results["connects"] += client.connects
+
+
+def percentile(sorted_values, p):
+    if not sorted_values:
+        return 0.0
+    k = min(len(sorted_values) - 1, int(round(p / 100.0 * (len(sorted_values) - 1))))
+    return sorted_values[k]
+
+
+def kiosk_mixes(host, clients, user, password):
+    login = fetch_json(host, "/api/login", "POST",
+                       urllib.parse.urlencode({"user": user, "password": password, "type": "staff"}))
+    if not login.get("ok"):
+        raise SystemExit("staff login failed: %s" % login.get("error"))
+    books = fetch_json(host, "/api/books?borrowed=false&fields=id,cardUid&limit=%d" % max(clients, 100))["books"]
+    students = fetch_json(host, "/api/users?type=student&limit=%d" % clients)["users"]
+    if len(books) < clients or not students:
+        raise SystemExit("need %d books on the shelf and a student account" % clients)
+    card_uids = [book["cardUid"] for book in books if book.get("cardUid")]
+    return [KioskMix(books[i]["id"], card_uids, students[i % len(students)]["studentId"], login["token"])
+            for i in range(clients)]
+
+
+def import_books(args):
+    login = fetch_json(args.host, "/api/login", "POST",
+                       urllib.parse.urlencode({"user": args.user, "password": args.password, "type": "staff"}))
+    if not login.get("ok"):
+        raise SystemExit("staff login failed: %s" % login.get("error"))
+    prefix = "I%x-" % int(time.time())  # New IDs on every run
+    lines = ["id,isbn,title,author,shelf,floor"]
+    for i in range(args.import_books):
+        lines.append("%s%d,978%010d,Donated Volume %d,Author %d,R%dC%d,%d" % (
+            prefix, i, i, i, i % 97, 1 + i % 40, 1 + i % 8, 1 + i % 4))
+    body = ("\r\n".join(lines) + "\r\n").encode()
+
+    client = Client(args.host, keep_alive=False, timeout=120)
+    start = time.monotonic()
+    status, data = client.request("POST", "/api/import?kind=books&format=csv", body,
+                                  {"Authorization": "Bearer " + login["token"], "Content-Type": "text/csv"})
+    elapsed = time.monotonic() - start
+    report = json.loads(data)
+    if status != 200:
+        raise SystemExit("import answered %d: %s" % (status, report.get("error")))
+    print("Import: %d books (%d KB) in %.1f s, %.0f records/s; kiosk's clock %.0f records/s, %d batches, %d skipped" % (
+        report["imported"], len(body) // 1024, elapsed, report["imported"] / elapsed,
+        report["recordsPerSecond"], report["batches"], report["skipped"]))
+
+
+def run(args, clients):
+    if args.path:
+        mixes = [paths_mix(args.path) for _ in range(clients)]
+    else:
+        mixes = [mix.requests() for mix in kiosk_mixes(args.host, clients, args.user, args.password)]
+
+    # Reset so the max/slow counters cover just this run
+    fetch_json(args.host, "/api/loop?reset=1")
+    before = fetch_json(args.host, "/api/loop")
+
+    results = {"latencies": [], "errors": 0, "connects": 0}
+    lock = threading.Lock()
+    deadline = time.monotonic() + args.seconds
+    threads = [threading.Thread(target=worker,
+                                args=(Client(args.host, not args.close), mix, deadline, results, lock))
+               for mix in mixes]
+    started = time.monotonic()
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    elapsed = time.monotonic() - started
+
+    after = fetch_json(args.host, "/api/loop")
+    device_seconds = (after["millis"] - before["millis"]) / 1000.0
+    reader_polls = after["reader"]["iterations"] - before["reader"]["iterations"]
+    latencies = sorted(results["latencies"])
+    served = len(latencies)
+
+    print("%d client%s:" % (clients, "" if clients == 1 else "s"))
+    print("  HTTP: %d requests, %d errors, %.1f req/s, %.1f requests per connection" % (
+        served, results["errors"], served / elapsed, served / max(1, results["connects"])))
+    print("        latency p50 %.1f ms  p95 %.1f ms  p99 %.1f ms  max %.1f ms" % (
+        percentile(latencies, 50) * 1000, percentile(latencies, 95) * 1000,
+        percentile(latencies, 99) * 1000, (latencies[-1] if latencies else 0) * 1000))
+    print("  Reader: %.0f polls/s, worst pass %.1f ms" % (
+        reader_polls / device_seconds if device_seconds > 0 else 0, after["reader"]["maxMicros"] / 1000.0))
+    print("  HTTP loop: worst pass %.1f ms, %d passes over %d ms" % (
+        after["http"]["maxMicros"] / 1000.0, after["http"]["slowIterations"],
+        after["slowThresholdMicros"] // 1000))
+    if "connections" in after:  # Older firmware served one connection at a time
+        connections = after["connections"]
+        print("  Connections: %d opened, %d requests kept alive, %d closed for waiting clients, peak %d open" % (
+            connections["accepted"] - before["connections"]["accepted"],
+            connections["keptAlive"] - before["connections"]["keptAlive"],
+            connections["closedForWaiting"] - before["connections"]["closedForWaiting"],
+            connections["peakOpen"]))
+    print("  Scan events: %d delivered, %d dropped" % (
+        after["cardsDelivered"] - before["cardsDelivered"], after["eventsDropped"]))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--host", default="192.168.4.1", help="host[:port]")
+    parser.add_argument("--clients", default="1,5,20", help="numbers of concurrent clients, one run each")
+    parser.add_argument("--seconds", type=float, default=20, help="per run")
+    parser.add_argument("--path", action="append", help="endpoint to GET instead of the kiosk mix (repeatable)")
+    parser.add_argument("--close", action="store_true", help="a new connection for every request")
+    parser.add_argument("--user", default="admin", help="staff account for the borrows and returns")
+    parser.add_argument("--password", default="admin123")
+    parser.add_argument("--import", dest="import_books", type=int, metavar="N",
+                        help="upload N new books as CSV instead and report records/s")
+    args = parser.parse_args()
+
+    if args.import_books:
+        import_books(args)
+        return
+    for clients in [int(n) for n in args.clients.split(",")]:
+        run(args, clients)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,332 @@
+#!/usr/bin/env python3
+"""Convert the catalog between JSON and the kiosk's binary snapshot format.
+
+The firmware keeps /books.bin and /users.bin on flash (layout documented in
+src/snapshot.h) and converts any /books.json or /users.json it finds at
+boot, so the data/ image can keep shipping JSON. This tool does the same
+conversion on a PC, e.g. to inspect a snapshot pulled off a kiosk or to
+size a large catalog before uploading it:
+
+    python3 tools/catalog.py to-bin data/books.json books.bin
+    python3 tools/catalog.py to-json books.bin books.json
+    python3 tools/catalog.py generate 20000 big.json
+    python3 tools/catalog.py size big.json
+    python3 tools/catalog.py history hist00001.seg history.json
+
+`size` reports the JSON size, the binary size and the bytes per record.
+`history` decodes lending history segments downloaded from
+/api/history/segment?id=N (layout in src/history.h), oldest loan first.
+"""
+
+import argparse
+import calendar
+import json
+import random
+import re
+import struct
+import sys
+import time
+
+MAGIC = b"LCAT"
+VERSION = 1
+KIND_BOOKS = 1
+KIND_USERS = 2
+NO_STRING = 0xFFFF
+
+FLAG_BORROWED = 0x01
+FLAG_UID_TEXT = 0x02
+
+HEADER = struct.Struct("<4sHHIIHHIIIIIII")
+BOOK_RECORD = struct.Struct("<IIIIHHHHHBB7sB")
+LOAN_ENTRY = struct.Struct("<IIHH")
+USER_RECORD = struct.Struct("<IHBB7sB")
+HISTORY_RECORD = struct.Struct("<III18s18s")
+
+UID_PATTERN = re.compile(r"^(?:[0-9A-F]{2}){1,7}$")
+ISO_PATTERN = re.compile(r"^(\d+)-(\d+)-(\d+)(?:T(\d+):(\d+):(\d+))?")
+
+
+def parse_iso(value):
+    """Same rules as parseIsoTime(): anything unparseable is 0."""
+    match = ISO_PATTERN.match(value or "")
+    if not match:
+        return 0
+    year, month, day, hour, minute, second = (int(g or 0) for g in match.groups())
+    if not 1 <= month <= 12 or not 1 <= day <= 31:
+        return 0
+    return calendar.timegm((year, month, day, hour, minute, second))
+
+
+def format_iso(epoch):
+    return time.strftime("%Y-%m-%dT%H:%M:%SZ", time.gmtime(epoch))
+
+
+def pack_uid(uid):
+    """(length, bytes) for a hex UID, or None if it has to be stored as text."""
+    if not uid:
+        return 0, b""
+    if not UID_PATTERN.match(uid):
+        return None
+    raw = bytes.fromhex(uid)
+    return len(raw), raw
+
+
+def encode_string(value):
+    raw = (value or "").encode("utf-8")
+    return struct.pack("<H", len(raw)) + raw
+
+
+class StringTable:
+    def __init__(self):
+        self.strings = []
+        self.index = {}
+
+    def intern(self, value):
+        if not value:
+            return NO_STRING
+        if value not in self.index:
+            if len(self.strings) >= NO_STRING:
+                raise ValueError("more than 65535 distinct shared strings")
+            self.index[value] = len(self.strings)
+            self.strings.append(value)
+        return self.index[value]
+
+    def encode(self):
+        return b"".join(encode_string(s) for s in self.strings)
+
+
+def books_to_bin(doc):
+    table = StringTable()
+    records, loans, text = bytearray(), bytearray(), bytearray()
+    for book in doc.get("books", []):
+        history = book.get("history") or []
+        packed = pack_uid(book.get("cardUid", ""))
+        flags = FLAG_BORROWED if book.get("borrowed") else 0
+        uid_length, uid = packed if packed else (0, b"")
+        if packed is None:
+            flags |= FLAG_UID_TEXT
+        records += BOOK_RECORD.pack(
+            len(text), len(loans) // LOAN_ENTRY.size,
+            parse_iso(book.get("borrowDate")), parse_iso(book.get("returnDate")), len(history),
+            table.intern(book.get("author", "")), table.intern(book.get("shelf", "")),
+            table.intern(book.get("floor", "")), table.intern(book.get("borrowedBy", "")),
+            flags, uid_length, uid.ljust(7, b"\0"), 0)
+        for loan in history:
+            loans += LOAN_ENTRY.pack(parse_iso(loan.get("borrowDate")),
+                                     parse_iso(loan.get("returnDate")),
+                                     table.intern(loan.get("username", "")), 0)
+        for key in ("id", "isbn", "title"):
+            text += encode_string(book.get(key, ""))
+        if packed is None:
+            text += encode_string(book["cardUid"])
+    return assemble(KIND_BOOKS, doc, table, records, BOOK_RECORD.size, LOAN_ENTRY.size, loans, text)
+
+
+def users_to_bin(doc):
+    table = StringTable()
+    records, text = bytearray(), bytearray()
+    for user in doc.get("users", []):
+        packed = pack_uid(user.get("cardUid", ""))
+        uid_length, uid = packed if packed else (0, b"")
+        flags = FLAG_UID_TEXT if packed is None else 0
+        records += USER_RECORD.pack(len(text), table.intern(user.get("type", "")), flags,
+                                    uid_length, uid.ljust(7, b"\0"), 0)
+        for key in ("username", "studentId", "password", "name", "email"):
+            if key == "password":
+                # The firmware hashes a plaintext password when it loads the snapshot
+                text += encode_string(user.get("passwordHash") or user.get("password", ""))
+            else:
+                text += encode_string(user.get(key, ""))
+        if packed is None:
+            text += encode_string(user["cardUid"])
+    return assemble(KIND_USERS, doc, table, records, USER_RECORD.size, 0, b"", text)
+
+
+def assemble(kind, doc, table, records, record_size, loan_size, loans, text):
+    strings = table.encode()
+    strings_offset = HEADER.size
+    records_offset = strings_offset + len(strings)
+    loans_offset = records_offset + len(records)
+    text_offset = loans_offset + len(loans)
+    header = HEADER.pack(MAGIC, VERSION, kind, doc.get("journalSeq", 0),
+                         len(records) // record_size, record_size, loan_size,
+                         len(loans) // LOAN_ENTRY.size, len(table.strings), strings_offset,
+                         records_offset, loans_offset, text_offset, len(text))
+    return header + strings + bytes(records) + bytes(loans) + bytes(text)
+
+
+class Reader:
+    def __init__(self, data, offset):
+        self.data = data
+        self.offset = offset
+
+    def string(self):
+        (length,) = struct.unpack_from("<H", self.data, self.offset)
+        start = self.offset + 2
+        self.offset = start + length
+        return self.data[start:self.offset].decode("utf-8")
+
+
+def bin_to_json(data):
+    (magic, version, kind, journal_seq, record_count, record_size, loan_size, loan_count,
+     string_count, strings_offset, records_offset, loans_offset, text_offset,
+     text_bytes) = HEADER.unpack_from(data)
+    if magic != MAGIC or version != VERSION:
+        raise ValueError("not a version %d catalog snapshot" % VERSION)
+    if len(data) != text_offset + text_bytes:
+        raise ValueError("truncated snapshot")
+
+    reader = Reader(data, strings_offset)
+    strings = [reader.string() for _ in range(string_count)]
+    shared = lambda i: strings[i] if i < len(strings) else ""  # noqa: E731
+    text = Reader(data, text_offset)
+
+    def card(flags, uid_length, uid):
+        return text.string() if flags & FLAG_UID_TEXT else uid[:uid_length].hex().upper()
+
+    if kind == KIND_USERS:
+        users = []
+        for i in range(record_count):
+            _, type_ref, flags, uid_length, uid, _ = USER_RECORD.unpack_from(
+                data, records_offset + i * record_size)
+            user = {"type": shared(type_ref)}
+            for key in ("username", "studentId", "password", "name", "email"):
+                value = text.string()
+                if key == "password" and value.startswith("sha256$"):
+                    key = "passwordHash"  # Salted hash, see src/password.h
+                if value:
+                    user[key] = value
+            user["cardUid"] = card(flags, uid_length, uid)
+            users.append(user)
+        return {"journalSeq": journal_seq, "users": users}
+
+    books = []
+    for i in range(record_count):
+        (_, first_loan, borrow_date, return_date, count, author, shelf, floor, borrowed_by,
+         flags, uid_length, uid, _) = BOOK_RECORD.unpack_from(data, records_offset + i * record_size)
+        book = {key: text.string() for key in ("id", "isbn", "title")}
+        book.update(author=shared(author), shelf=shared(shelf), floor=shared(floor),
+                    borrowed=bool(flags & FLAG_BORROWED), borrowedBy=shared(borrowed_by),
+                    borrowDate=format_iso(borrow_date) if borrow_date else "",
+                    returnDate=format_iso(return_date) if return_date else "",
+                    cardUid=card(flags, uid_length, uid), history=[])
+        for j in range(first_loan, first_loan + count):
+            loan_borrowed, loan_returned, user, _ = LOAN_ENTRY.unpack_from(
+                data, loans_offset + j * loan_size)
+            book["history"].append({
+                "username": shared(user),
+                "borrowDate": format_iso(loan_borrowed) if loan_borrowed else "",
+                "returnDate": format_iso(loan_returned) if loan_returned else None,
+            })
+        books.append(book)
+    return {"journalSeq": journal_seq, "books": books}
+
+
+def to_bin(doc):
+    return users_to_bin(doc) if "users" in doc else books_to_bin(doc)
+
+
+def history_to_json(data):
+    if len(data) % HISTORY_RECORD.size:
+        raise ValueError("not a history segment: %d bytes" % len(data))
+    history = []
+    for seq, borrow, returned, book, user in HISTORY_RECORD.iter_unpack(data):
+        history.append({"seq": seq, "book": book.rstrip(b"\0").decode(),
+                        "username": user.rstrip(b"\0").decode(),
+                        "borrowDate": format_iso(borrow), "returnDate": format_iso(returned)})
+    return {"history": history}
+
+
+def generate(count, seed=1):
+    """A synthetic catalog with realistic field lengths and sharing."""
+    rng = random.Random(seed)
+    words = ("Introduction Advanced Applied Modern Practical Principles Systems Theory "
+             "Networks Databases Algorithms Programming Design Analysis Engineering "
+             "Mathematics Physics Chemistry Biology History Economics Statistics").split()
+    authors = ["%s %s" % (rng.choice(("Jane", "Robert", "Michael", "Sarah", "David", "Lisa",
+                                      "Alan", "Patricia", "Thomas", "Emily")),
+                          rng.choice(("Smith", "Johnson", "Chen", "Williams", "Brown",
+                                      "Garcia", "Lee", "Turner", "Davis", "Wilson")) + str(i))
+               for i in range(count // 8 + 1)]
+    students = ["S%04d" % i for i in range(500)]
+    now = 1760000000
+    books = []
+    for i in range(count):
+        history = []
+        for _ in range(rng.choice((0, 0, 1, 2, 3))):
+            start = now - rng.randint(30, 700) * 86400
+            history.append({"username": rng.choice(students), "borrowDate": format_iso(start),
+                            "returnDate": format_iso(start + rng.randint(3, 14) * 86400)})
+        book = {
+            "id": "B%05d" % i,
+            "isbn": "978%010d" % rng.randrange(10 ** 10),
+            "title": " ".join(rng.choice(words) for _ in range(rng.randint(2, 5))),
+            "author": rng.choice(authors),
+            "shelf": "R%dC%d" % (rng.randint(1, 40), rng.randint(1, 8)),
+            "floor": str(rng.randint(1, 4)),
+            "borrowed": False,
+            "cardUid": "%014X" % rng.getrandbits(56),
+            "history": history,
+        }
+        if rng.random() < 0.1:
+            start = now - rng.randint(0, 13) * 86400
+            borrower = rng.choice(students)
+            book.update(borrowed=True, borrowedBy=borrower, borrowDate=format_iso(start),
+                        returnDate=format_iso(start + 14 * 86400))
+            history.insert(0, {"username": borrower, "borrowDate": format_iso(start),
+                               "returnDate": None})
+        books.append(book)
+    return {"books": books}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    sub = parser.add_subparsers(dest="command", required=True)
+    for name in ("to-bin", "to-json"):
+        cmd = sub.add_parser(name)
+        cmd.add_argument("source")
+        cmd.add_argument("target")
+    cmd = sub.add_parser("generate")
+    cmd.add_argument("count", type=int)
+    cmd.add_argument("target")
+    cmd = sub.add_parser("size")
+    cmd.add_argument("source")
+    cmd = sub.add_parser("history")
+    cmd.add_argument("segments", nargs="+")
+    cmd.add_argument("target")
+    args = parser.parse_args()
+
+    if args.command == "to-bin":
+        with open(args.source) as f:
+            data = to_bin(json.load(f))
+        with open(args.target, "wb") as f:
+            f.write(data)
+    elif args.command == "to-json":
+        with open(args.source, "rb") as f:
+            doc = bin_to_json(f.read())
+        with open(args.target, "w") as f:
+            json.dump(doc, f, separators=(",", ":"))
+    elif args.command == "generate":
+        with open(args.target, "w") as f:
+            json.dump(generate(args.count), f, separators=(",", ":"))
+    elif args.command == "history":
+        history = []
+        for path in args.segments:
+            with open(path, "rb") as f:
+                history += history_to_json(f.read())["history"]
+        with open(args.target, "w") as f:
+            json.dump({"history": history}, f, separators=(",", ":"))
+    elif args.command == "size":
+        with open(args.source, "rb") as f:
+            raw = f.read()
+        doc = bin_to_json(raw) if raw.startswith(MAGIC) else json.loads(raw)
+        as_json = len(json.dumps(doc, separators=(",", ":")))
+        as_bin = len(to_bin(doc))
+        records = len(doc.get("books", doc.get("users", []))) or 1
+        print("%d records: JSON %d bytes (%.0f/record), binary %d bytes (%.0f/record)"
+              % (records, as_json, as_json / records, as_bin, as_bin / records))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
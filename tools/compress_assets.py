@@ -0,0 +1,39 @@
+"""Write gzip copies of the web assets next to the originals in data/.
+
+Runs as a PlatformIO pre-script (see platformio.ini), so `pio run -t
+uploadfs` always ships up-to-date .gz files; it can also be run by hand:
+
+    python3 tools/compress_assets.py
+
+Output is deterministic (no timestamp in the gzip header), so an unchanged
+file keeps the same ETag on the kiosk across uploads.
+"""
+
+import gzip
+import os
+
+EXTENSIONS = (".html", ".css", ".js")
+
+
+def compress_assets(data_dir):
+    for name in sorted(os.listdir(data_dir)):
+        if not name.endswith(EXTENSIONS):
+            continue
+        source = os.path.join(data_dir, name)
+        target = source + ".gz"
+        if os.path.exists(target) and os.path.getmtime(target) >= os.path.getmtime(source):
+            continue
+        with open(source, "rb") as f:
+            raw = f.read()
+        with open(target, "wb") as f:
+            with gzip.GzipFile(filename="", mode="wb", fileobj=f, compresslevel=9, mtime=0) as gz:
+                gz.write(raw)
+        print("Compressed %s: %d -> %d bytes" % (name, len(raw), os.path.getsize(target)))
+
+
+try:
+    Import("env")  # noqa: F821 - provided by PlatformIO
+    compress_assets(env.subst("$PROJECT_DATA_DIR"))  # noqa: F821
+except NameError:
+    if __name__ == "__main__":
+        compress_assets(os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "data"))
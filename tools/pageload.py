@@ -0,0 +1,72 @@
+#!/usr/bin/env python3
+"""Page-load measurement for the kiosk web interface.
+
+Loads a page the way a browser would (the HTML, then its stylesheet and
+script) and reports bytes on the wire and wall time for:
+
+  cold  - empty cache, no compression requested
+  gzip  - empty cache, Accept-Encoding: gzip
+  warm  - revalidating with the ETags from the gzip load (expect 304s)
+
+    python3 tools/pageload.py --host 192.168.4.1 --page /index.html
+
+Run it from a laptop on the soft-AP, or compare with the phone browser's
+network panel. Against older firmware the warm load shows 200s, because
+there were no ETags.
+"""
+
+import argparse
+import http.client
+import time
+
+SUBRESOURCES = ["/styles.css", "/scripts.js"]
+
+
+def load(host, paths, headers_for):
+    total_bytes = 0
+    statuses = []
+    etags = {}
+    start = time.monotonic()
+    conn = http.client.HTTPConnection(host, timeout=10)
+    for path in paths:
+        conn.request("GET", path, headers=headers_for(path))
+        response = conn.getresponse()
+        body = response.read()
+        total_bytes += len(body)
+        statuses.append(response.status)
+        etags[path] = response.getheader("ETag")
+        if response.getheader("Connection", "").lower() == "close" or response.will_close:
+            conn.close()
+            conn = http.client.HTTPConnection(host, timeout=10)
+    conn.close()
+    return time.monotonic() - start, total_bytes, statuses, etags
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--host", default="192.168.4.1")
+    parser.add_argument("--page", default="/index.html")
+    parser.add_argument("--runs", type=int, default=5)
+    args = parser.parse_args()
+
+    paths = [args.page] + SUBRESOURCES
+    etags = {}
+
+    def report(label, headers_for):
+        times = []
+        for _ in range(args.runs):
+            elapsed, size, statuses, seen = load(args.host, paths, headers_for)
+            times.append(elapsed)
+            etags.update({k: v for k, v in seen.items() if v})
+        times.sort()
+        print("%-5s %7d bytes  median %6.1f ms  statuses %s" % (
+            label, size, times[len(times) // 2] * 1000, statuses))
+
+    report("cold", lambda path: {})
+    report("gzip", lambda path: {"Accept-Encoding": "gzip"})
+    report("warm", lambda path: dict({"Accept-Encoding": "gzip"},
+                                     **({"If-None-Match": etags[path]} if path in etags else {})))
+
+
+if __name__ == "__main__":
+    main()